@@ -65,6 +65,7 @@ struct bgchmm_struct {
   int informative_only; // this option implies do nothing except determine which sites are informative for gBGC
   int random_path;
   int get_likelihoods;
+  int nthreads;   // number of threads used when fitting the state models
   FILE *post_probs_f;
   ListOfLists *results;
 };
@@ -78,6 +79,7 @@ struct bgchmm_data_struct {
   int estimate_cons_transitions;
   int estimate_bgc_target_coverage, estimate_bgc_expected_length;
   double bgc_target_coverage, bgc_expected_length;
+  int nthreads;
   HMM *hmm;
 };
 
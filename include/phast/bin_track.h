@@ -0,0 +1,176 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file bin_track.h
+    Compact binary alternative to fixedStep wig output for per-base
+    scores (e.g., phastCons posterior probabilities or phyloP scores).
+
+    A binary track consists of a header, a series of data blocks, and
+    an index.  Each block corresponds to a "fixedStep chrom=... start=...
+    step=1" section of a wig file and holds one value per base,
+    encoded either as a 32-bit float or as an 8- or 16-bit unsigned
+    integer obtained by linearly quantising a fixed range [min, max]
+    (values outside the range are clamped).  The index, written when
+    the track is closed, lists the chromosome, start coordinate, length
+    and file offset of every block, so readers can go directly to any
+    block.  The file format uses native byte order.
+
+    Layout:
+    <pre>
+    header:  "PHASTBTK" (8 bytes), version (int), encoding (int),
+             min (double), max (double)
+    blocks:  raw values
+    index:   for each block: chrom length (int), chrom (chars),
+             start (long long), nvalues (long long), offset (long long)
+    trailer: index offset (long long), number of blocks (int),
+             "PHASTBTK" (8 bytes)
+    </pre>
+
+    Values are written through a large internal buffer, so writing a
+    track costs little more than copying the values.
+    @ingroup feature
+*/
+
+#ifndef BIN_TRACK_H
+#define BIN_TRACK_H
+
+#include <stdio.h>
+#include <phast/lists.h>
+
+/** Magic string at the start and end of every binary track */
+#define BTK_MAGIC "PHASTBTK"
+
+/** Version of the binary track format */
+#define BTK_VERSION 1
+
+/** Size of the write buffer, in bytes */
+#define BTK_BUFSIZE (1 << 22)
+
+/** Largest quantised value for 8-bit encoding (255 means missing) */
+#define BTK_UINT8_MAX 254
+
+/** Largest quantised value for 16-bit encoding (65535 means missing) */
+#define BTK_UINT16_MAX 65534
+
+/** Encoding of values in a binary track */
+typedef enum {
+  BTK_FLOAT32,                  /**< 32-bit IEEE float */
+  BTK_UINT16,                   /**< 16-bit quantised */
+  BTK_UINT8                     /**< 8-bit quantised */
+} btk_encoding;
+
+/** One fixed-step block of a binary track */
+typedef struct {
+  char *chrom;                  /**< Chromosome name */
+  long long start;              /**< Coordinate of first value (1-based) */
+  long long nvalues;            /**< Number of values */
+  long long offset;             /**< File offset of first value */
+} BinTrackBlock;
+
+/** Binary track writer */
+typedef struct {
+  FILE *F;                      /**< Output stream */
+  btk_encoding encoding;        /**< Encoding of values */
+  double min,                   /**< Lower end of quantisation range */
+    max;                        /**< Upper end of quantisation range */
+  unsigned char *buf;           /**< Write buffer */
+  size_t buflen;                /**< Number of bytes in buffer */
+  long long offset;             /**< Number of bytes written so far
+                                   (including buffered bytes) */
+  List *blocks;                 /**< List of BinTrackBlock*, in order */
+} BinTrackWriter;
+
+/** Binary track opened for reading */
+typedef struct {
+  FILE *F;                      /**< Input stream */
+  btk_encoding encoding;        /**< Encoding of values */
+  double min,                   /**< Lower end of quantisation range */
+    max;                        /**< Upper end of quantisation range */
+  List *blocks;                 /**< List of BinTrackBlock*, in order */
+} BinTrack;
+
+/** \name Binary track writing functions
+ \{ */
+
+/** Parse a format specification of the form
+    <tt>float32</tt>, <tt>uint16[:min,max]</tt>, or
+    <tt>uint8[:min,max]</tt>.
+    @param[in] spec Format specification
+    @param[out] encoding Encoding
+    @param[in,out] min Lower end of quantisation range (left
+    unchanged if not given in spec)
+    @param[in,out] max Upper end of quantisation range (left
+    unchanged if not given in spec)
+    @result 0 on success, 1 if spec is not valid
+ */
+int btk_parse_format(const char *spec, btk_encoding *encoding, double *min,
+                     double *max);
+
+/** Start writing a binary track.  The header is written immediately.
+    @param F Output stream (need not be seekable)
+    @param encoding Encoding of values
+    @param min Lower end of quantisation range (ignored for BTK_FLOAT32)
+    @param max Upper end of quantisation range (ignored for BTK_FLOAT32)
+    @result New writer
+ */
+BinTrackWriter *btk_writer_new(FILE *F, btk_encoding encoding, double min,
+                               double max);
+
+/** Start a new block, ending the current one (if any).
+    @param w Writer
+    @param chrom Chromosome name
+    @param start Coordinate of the next value written (1-based)
+ */
+void btk_start_block(BinTrackWriter *w, const char *chrom, long long start);
+
+/** Append a value to the current block.
+    @param w Writer
+    @param val Value; NaN denotes a missing value
+ */
+void btk_put(BinTrackWriter *w, double val);
+
+/** Write the index, flush all buffered data, and free the writer.
+    The output stream is not closed.
+    @param w Writer
+ */
+void btk_writer_close(BinTrackWriter *w);
+
+/** \} \name Binary track reading functions
+ \{ */
+
+/** Open a binary track for reading and load its index.
+    @param F Input stream (must be seekable)
+    @result Newly allocated BinTrack object
+ */
+BinTrack *btk_open(FILE *F);
+
+/** Read all values of a block.
+    @param[in] t Binary track
+    @param[in] block Block to read (one of t->blocks)
+    @param[out] vals Array of at least block->nvalues elements; missing
+    values are returned as NaN
+ */
+void btk_read_block(BinTrack *t, BinTrackBlock *block, double *vals);
+
+/** Free a BinTrack object (does not close its stream).
+    @param t Binary track to free
+ */
+void btk_free(BinTrack *t);
+
+/** Convert a binary track to fixedStep wig format.  Missing values
+    are omitted (a new fixedStep header follows each gap).
+    @param t Binary track
+    @param outf Output stream
+    @param precision Number of digits after the decimal point
+ */
+void btk_print_wig(BinTrack *t, FILE *outf, int precision);
+
+/** \} */
+
+#endif
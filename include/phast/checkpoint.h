@@ -0,0 +1,172 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file checkpoint.h
+    Periodic checkpointing of the state of long-running optimisations,
+    so that an interrupted run can be resumed.
+
+    A checkpoint file is a plain-text list of named items, one per
+    line, of the form "NAME: values".  Integers and strings are
+    written as they are, vectors as their size followed by their
+    elements, and matrices as their dimensions followed by their
+    elements in row-major order.  Doubles are written with 17
+    significant digits, so a resumed run starts from exactly the
+    state that was saved.  A checkpoint is first written to a
+    temporary file, which is then renamed, so the file on disk is
+    always complete even if the program is killed while writing.
+
+    The optimisers and fitting routines that support checkpointing
+    take a Checkpoint object; they save their state with the
+    ckpt_put_ functions whenever ckpt_due reports that the interval
+    has elapsed, and on entry restore any state that was loaded by
+    ckpt_load.
+
+    A checkpoint can be tied to the inputs that produced it by giving
+    it a fingerprint (e.g., a hash of the alignment, model and
+    options) with ckpt_set_fingerprint.  The fingerprint is then
+    written with every checkpoint, and ckpt_load refuses to load a
+    file whose fingerprint differs, so that a run is never resumed
+    from the state of a different analysis.
+    @ingroup base
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <time.h>
+#include <phast/vector.h>
+#include <phast/matrix.h>
+#include <phast/hashtable.h>
+
+/** Default number of seconds between checkpoints */
+#define CKPT_DEFAULT_INTERVAL 300
+
+/** Checkpoint object */
+typedef struct {
+  char *fname;                  /**< Name of checkpoint file */
+  int interval;                 /**< Minimum number of seconds between
+                                   checkpoints */
+  time_t last_save;             /**< Time of last checkpoint (or of
+                                   creation of the object) */
+  Hashtable *items;             /**< Items loaded from file, by name
+                                   (values are unparsed strings) */
+  FILE *F;                      /**< Temporary file while a checkpoint
+                                   is being written, otherwise NULL */
+  char *fprint;                 /**< Fingerprint of the inputs of the
+                                   run, or NULL if none */
+} Checkpoint;
+
+/** \name Checkpoint allocation functions
+ \{ */
+
+/** Create a new Checkpoint object.  Nothing is read or written.
+    @param fname Name of checkpoint file
+    @param interval Minimum number of seconds between checkpoints
+    (0 means save at every opportunity)
+    @result Newly allocated Checkpoint object
+ */
+Checkpoint *ckpt_new(const char *fname, int interval);
+
+/** Free a Checkpoint object (the file is left in place).
+    @param ck Checkpoint object to free
+ */
+void ckpt_free(Checkpoint *ck);
+
+/** Tie a checkpoint to the inputs of a run.  Must be called before
+    ckpt_load and ckpt_begin.
+    @param ck Checkpoint object
+    @param fprint Fingerprint of the inputs (copied; must not contain
+    newlines)
+ */
+void ckpt_set_fingerprint(Checkpoint *ck, const char *fprint);
+
+/** \} \name Checkpoint reading functions
+ \{ */
+
+/** Load the items in the checkpoint file, for use in resuming a run.
+    Dies if a fingerprint has been set with ckpt_set_fingerprint and
+    the file does not carry the same fingerprint.
+    @param ck Checkpoint object
+    @result 1 if the file exists and was loaded, 0 if it does not exist
+ */
+int ckpt_load(Checkpoint *ck);
+
+/** Test whether an item was loaded.
+    @param ck Checkpoint object (may be NULL)
+    @param name Name of item
+    @result 1 if the item is available, 0 otherwise
+ */
+int ckpt_has(Checkpoint *ck, const char *name);
+
+/** Retrieve an integer item; dies if not available. */
+int ckpt_get_int(Checkpoint *ck, const char *name);
+
+/** Retrieve a double item; dies if not available. */
+double ckpt_get_dbl(Checkpoint *ck, const char *name);
+
+/** Retrieve a string item; dies if not available.
+    @result Pointer to the stored string (valid until ckpt_clear or
+    ckpt_free is called) */
+char *ckpt_get_str(Checkpoint *ck, const char *name);
+
+/** Retrieve a vector item; dies if not available.
+    @result Newly allocated Vector */
+Vector *ckpt_get_vector(Checkpoint *ck, const char *name);
+
+/** Retrieve a matrix item; dies if not available.
+    @result Newly allocated Matrix */
+Matrix *ckpt_get_matrix(Checkpoint *ck, const char *name);
+
+/** Discard all loaded items.  Called once a run has restored its
+    state, so that nested or later fits start afresh.
+    @param ck Checkpoint object (may be NULL)
+ */
+void ckpt_clear(Checkpoint *ck);
+
+/** \} \name Checkpoint writing functions
+ \{ */
+
+/** Test whether it is time to write a new checkpoint.
+    @param ck Checkpoint object (may be NULL)
+    @result 1 if ck is non-NULL and at least ck->interval seconds
+    have passed since the last checkpoint, 0 otherwise
+ */
+int ckpt_due(Checkpoint *ck);
+
+/** Start writing a checkpoint.  Must be followed by calls to
+    ckpt_put_ functions and then by ckpt_commit. */
+void ckpt_begin(Checkpoint *ck);
+
+/** Finish writing a checkpoint, replacing the previous one. */
+void ckpt_commit(Checkpoint *ck);
+
+/** Save an integer item. */
+void ckpt_put_int(Checkpoint *ck, const char *name, int val);
+
+/** Save a double item. */
+void ckpt_put_dbl(Checkpoint *ck, const char *name, double val);
+
+/** Save a string item (must not contain newlines). */
+void ckpt_put_str(Checkpoint *ck, const char *name, const char *val);
+
+/** Save a vector item. */
+void ckpt_put_vector(Checkpoint *ck, const char *name, Vector *v);
+
+/** Save a matrix item. */
+void ckpt_put_matrix(Checkpoint *ck, const char *name, Matrix *m);
+
+/** Delete the checkpoint file (e.g., once a run has completed).
+    @param ck Checkpoint object (may be NULL)
+ */
+void ckpt_remove(Checkpoint *ck);
+
+/** \} */
+
+#endif
@@ -176,6 +176,14 @@ void zmat_minus_eq(Zmatrix *thism, Zmatrix *subm);
 void zmat_mult_real_diag(Matrix *A, Zmatrix *B, Zvector *C, Zmatrix *D,
                          Zmatrix *scratch);
 
+/** Two-dimensional discrete Fourier transform, in place.  Applies
+    zvec_fft to every row and then to every column.
+    @param[in,out] m Matrix to transform; both dimensions must be
+    powers of 2
+    @param[in] inverse If TRUE, compute the inverse transform
+ */
+void zmat_fft(Zmatrix *m, int inverse);
+
 /** \name Complex Matrix copy functions 
  \{ */
 
@@ -133,6 +133,16 @@ void zvec_scale(Zvector *v, double scale_factor);
 void zvec_had_prod(Zvector *dest, Zvector *src1, Zvector *src2);
 
 
+/** Discrete Fourier transform, in place.  Computes
+    v[k] = sum_j v[j] exp(-2 pi i j k / n) (or, if inverse == TRUE,
+    (1/n) sum_j v[j] exp(2 pi i j k / n)), where n = v->size, using
+    the iterative radix-2 Cooley-Tukey algorithm, in O(n log n) time.
+    @param[in,out] v Vector to transform; size must be a power of 2
+    @param[in] inverse If TRUE, compute the inverse transform
+ */
+void zvec_fft(Zvector *v, int inverse);
+
+
 /** \name Complex Vector data copy functions
  \{ */
 
@@ -58,7 +58,12 @@ struct phastCons_struct {
   int nrates,		/**< Number of rates for first tree model */
     nrates2,		/**< Number of rates for second tree model */
     refidx,		/**< Index of reference sequence */
-    max_micro_indel;	/**< Maximum length of an alignment gap, any gap longer is treated as missing data*/
+    max_micro_indel,	/**< Maximum length of an alignment gap, any gap longer is treated as missing data*/
+    em_window,		/**< If > 0, size of windows (in alignment columns) for estimation of tree models or rho; parameters are estimated separately in each window unless em_pooled */
+    em_pooled,		/**< Whether to estimate a single set of parameters from expected counts pooled across windows */
+    nthreads,		/**< Number of threads to use with em_window (values less than 1 mean one per processor) */
+    checkpoint_interval, /**< Minimum number of seconds between checkpoints */
+    resume;		/**< Whether to resume from checkpoint_fname, if it exists */
   double lambda,	/**< Lambda parameter value */ 
     mu,			/**< Transitions mu value */
     nu,			/**< Transitions nu value */
@@ -88,7 +93,10 @@ struct phastCons_struct {
     *idpref,		/**< Prefix for assigned ids */
     *estim_trees_fname_root,	/**< Root part of filename for tree models i.e. %s.cons.mod or %s.noncons.mod */
     *extrapolate_tree_fname,	/**< Filepath to tree file used to extrapolate a larger set of species*/
-    *bgc_branch;        /**< If not NULL, assume a two-state HMM with and without bgc on the named branch*/
+    *bgc_branch,        /**< If not NULL, assume a two-state HMM with and without bgc on the named branch*/
+    *lik_cache_fname,   /**< If not NULL, name of file used to store column likelihoods across runs (see tuple_lik_cache.h) */
+    *binary_track,      /**< If not NULL, format in which to write posterior probabilities as a binary track rather than wig (see bin_track.h) */
+    *checkpoint_fname;  /**< If not NULL, file to which the state of parameter estimation is saved periodically (see checkpoint.h) */
   HMM *hmm;		       /**< Hidden Markov Model */
   Hashtable *alias_hash;       /**< Sequence name aliases e.g., "hg17=human; mm5=mouse; rn3=rat" */
   TreeNode *extrapolate_tree;	/**< Root of tree used for extrapolation of larget set of species */
@@ -151,6 +159,70 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
                      double *alpha_1, double *beta_1, double *tau_1, 
                      double *rho, double gamma, FILE *logf);
 
+/** Estimate parameters for the two-state model by EM, treating
+   the alignment as a series of windows that share all parameters.
+   Arguments are as for fit_two_state, and the two functions return
+   identical results when there is only one window.  The HMM is run
+   separately in each window, the E step is done in parallel over
+   windows, and a single M step is applied to the expected counts
+   pooled over all windows.
+   @param phmm Allocated phylo-HMM
+   @param msa Sequence Alignment data (must have ordered sufficient statistics)
+   @param window_size Size of windows, in alignment columns (the last window may be shorter)
+   @param nthreads Number of threads (values less than 1 mean one per processor)
+   @result Log likelihood, summed over windows
+   @see fit_two_state */
+double fit_two_state_pooled(PhyloHmm *phmm, MSA *msa, int window_size,
+                            int nthreads, int estim_func, int estim_indels,
+                            int estim_trees, int estim_rho,
+                            double *mu, double *nu,
+                            double *alpha_0, double *beta_0, double *tau_0,
+                            double *alpha_1, double *beta_1, double *tau_1,
+                            double *rho, double gamma, FILE *logf);
+
+/** Parameters estimated for one window by fit_two_state_windows */
+typedef struct {
+  int start,			/**< First column of window (0-based) */
+    end;			/**< Last column of window plus one */
+  double lnl,			/**< Log likelihood of window */
+    mu,				/**< Estimated transition parameter mu */
+    nu,				/**< Estimated transition parameter nu */
+    rho;			/**< Estimated scale parameter rho */
+  TreeModel *cons_mod,		/**< Estimated conserved model */
+    *noncons_mod;		/**< Estimated nonconserved model */
+} TwoStateWindowFit;
+
+/** Estimate parameters for the two-state model separately in each
+   window of an alignment, fitting windows concurrently.  Each window
+   is fitted by fit_two_state using an independent copy of the
+   phylo-HMM; the models in phmm serve as starting values and are not
+   changed.  Indel models are not supported.
+   @param phmm Phylo-HMM for the whole alignment, set up as for fit_two_state
+   @param msa Sequence Alignment data (must have ordered sufficient statistics)
+   @param window_size Size of windows, in alignment columns (the last window may be shorter)
+   @param nthreads Number of threads (values less than 1 mean one per processor)
+   @param estim_func Whether to estimate mu and nu
+   @param estim_trees Whether to estimate trees
+   @param estim_rho Whether to estimate rho
+   @param mu Starting value of mu
+   @param nu Starting value of nu
+   @param rho Starting value of rho
+   @param gamma Gamma parameter (target coverage), or -1
+   @result List of TwoStateWindowFit objects, one per window, in
+   order along the alignment (free with free_two_state_window_fits)
+   @note No logging is done, because windows are fitted concurrently
+ */
+List *fit_two_state_windows(PhyloHmm *phmm, MSA *msa, int window_size,
+                            int nthreads, int estim_func, int estim_trees,
+                            int estim_rho, double mu, double nu, double rho,
+                            double gamma);
+
+/** Free a list returned by fit_two_state_windows, including the
+    estimated models.
+    @param fits List to free
+ */
+void free_two_state_window_fits(List *fits);
+
 /** Re-estimate phylogenetic model based on expected counts (M step of EM) 
    @param models NOT USED
    @param nmodels NOT USED 
@@ -52,4 +52,55 @@ double hmm_train_by_em(HMM *hmm, void *models, void *data, int nsamples,
                        void (*log_function)(FILE*, double, HMM*, void*, int),
                        double **emissions_alloc, FILE *logf);
 
+/** Train a Hidden Markov Model by EM, pooling expected counts over a
+    set of windows of a single sequence.  The HMM is run independently
+    in each window (i.e., the state path restarts at every window
+    boundary), but all windows share the same parameters and the same
+    observation indices.  On each iteration, emissions are computed
+    once for the whole sequence, the E step (forward/backward and
+    expected counts) runs in parallel over windows, and a single M step
+    is applied to the expected counts summed over all windows.
+    Results do not depend on the number of threads.
+    @param hmm Hidden Markov Model to train
+    @param models Models to pass to compute_emissions and
+    estimate_state_models
+    @param data Training data
+    @param nwindows Number of windows
+    @param window_starts Start of each window (0-based); windows must
+    be in increasing order and must not overlap
+    @param window_lens Length of each window
+    @param nthreads Number of threads to use for the E step
+    @param compute_emissions (Optional) Function to compute emissions
+    for the whole sequence; called with sample 0 and a length of
+    window_starts[nwindows-1] + window_lens[nwindows-1].  May be NULL
+    if estimate_state_models is NULL and emissions are precomputed
+    @param estimate_state_models (Optional) Function to estimate state
+    models (see hmm_train_by_em)
+    @param estimate_transitions (Optional) Function to estimate
+    transition probabilities (see hmm_train_by_em)
+    @param get_observation_index Function to get observation index;
+    called with sample 0 and a position in the whole sequence.  Must
+    be thread safe
+    @param log_function Function to use for logging statistics
+    @param emissions_alloc (Optional) Used for emission probabilities
+    (must be large enough for the whole sequence)
+    @param logf Log to save statistics to
+    @result Log likelihood of optimized model (summed over windows)
+    @see hmm_train_by_em
+*/
+double hmm_train_by_em_pooled(HMM *hmm, void *models, void *data,
+                              int nwindows, int *window_starts,
+                              int *window_lens, int nthreads,
+                              void (*compute_emissions)(double**, void**, int,
+                                                        void*, int, int),
+                              void (*estimate_state_models)(TreeModel**, int,
+                                                            void*, double**,
+                                                            int, FILE*),
+                              void (*estimate_transitions)(HMM*, void*,
+                                                           double**),
+                              int (*get_observation_index)(void*, int, int),
+                              void (*log_function)(FILE*, double, HMM*, void*,
+                                                   int),
+                              double **emissions_alloc, FILE *logf);
+
 #endif
@@ -26,6 +26,19 @@
 #define PHAST_INLINE inline
 #endif
 
+/* POSIX threads are used for coarse-grained parallelism (see
+   thread_pool.h).  They are not used in RPHAST, whose memory handler
+   is not thread safe, or on Windows; define SKIP_THREADS to disable
+   them elsewhere.  PHAST_TLS marks static workspace variables that
+   must be private to each thread. */
+#if !defined(RPHAST) && !defined(USE_PHAST_MEMORY_HANDLER) && \
+  !defined(SKIP_THREADS) && !defined(_WIN32)
+#define PHAST_THREADS
+#define PHAST_TLS __thread
+#else
+#define PHAST_TLS
+#endif
+
 #ifdef R_LAPACK
 #include <R_ext/Lapack.h>
 #define LAPACK_INT int
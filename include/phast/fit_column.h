@@ -23,6 +23,7 @@
 #include <phast/vector.h>
 #include <phast/matrix.h>
 #include <phast/complex_matrix.h>
+#include <phast/tuple_lik_cache.h>
 
 /** Portions of tree that can be used. */
 typedef enum {ALL, /**< Use entire tree. */
@@ -66,6 +67,18 @@ typedef struct {
   Zvector *vec_scratch1_z, *vec_scratch2_z; /**< Scratch memory for complex number vector manipulation. */
   Vector *vec_scratch1_r, *vec_scratch2_r; /**< Scratch memory for real number vector manipulation. */
   double deriv2;                /**< second derivative for 1d case. */
+  double *evec_outer;           /**< Products of eigenvectors of the
+                                   rate matrix, S[i][k] * Sinv[k][j]
+                                   at index (i*size + j)*size + k, so
+                                   that an element of any matrix
+                                   S diag(w) Sinv is a dot product with
+                                   w.  Cached for real eigensystems
+                                   only (NULL otherwise) */
+  double **branch_evals;        /**< Eigenvalues of the rate matrix
+                                   times branch length, by node id
+                                   (cached along with evec_outer) */
+  double *weight_scratch;       /**< Scratch memory for the diagonal
+                                   weights of up to six matrices */
 } ColFitData;
 
 /* data for grid of pre-computed Fisher Information Matrices */
@@ -73,6 +86,12 @@ typedef struct {
 #define GRIDSIZE2 0.05
 #define GRIDMAXLOG 3
 
+/** Magic string at the start of every FIM grid cache file */
+#define FIM_GRID_MAGIC "PHASTFIM"
+
+/** Version of the FIM grid cache file format */
+#define FIM_GRID_VERSION 2
+
 /** Grid of Fisher Information Matrices. */
 typedef struct {
   double *scales;               /**< Scale factors in grid */
@@ -81,7 +100,13 @@ typedef struct {
   int ngrid2;                   /**< Number of grid points above 1 (log
                                    linear) */
   int ngrid;                    /**< Total number of grid points */
+  double gridsize1;             /**< Spacing of grid points below 1 */
+  double gridsize2;             /**< Spacing of log scales of grid
+                                   points above 1 */
   Matrix **fim;                 /**< Pre-computed FIMs */
+  tlc_fprint fprint;            /**< Fingerprint of the model and
+                                   settings the grid was estimated for
+                                   (see col_fim_grid_fingerprint) */
 } FimGrid;
 
 /** \name Column Fit Data allocation function
@@ -180,11 +205,16 @@ double col_compute_likelihood(TreeModel *mod, MSA *msa, int tupleidx,
    @param[out] tuple_scales (Optional) Computed individual scale factors
    @param[out] tuple_llrs (Optional) raw likelihood ratios
    @param logf Location to save output
+   @param nthreads Number of threads (values less than 1 mean one per
+   processor); a single thread is used if logf is non-NULL
    @note Must define mode as CON (for 0 <= scale <= 1), ACC
-   (for 1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale) */
+   (for 1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale)
+   @note Tuples are processed in parallel, each thread using its own
+   copy of mod; results do not depend on the number of threads */
 
 void col_lrts(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_pvals,
-              double *tuple_scales, double *tuple_llrs, FILE *logf);
+              double *tuple_scales, double *tuple_llrs, FILE *logf,
+              int nthreads);
 
 /** Perform a likelihood ratio test for each column tuple in a subtree of an alignment.
     @param[in] mod Tree Model to perform likelihood test on
@@ -195,12 +225,13 @@ void col_lrts(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_pvals,
     @param[out] tuple_sub_scales (Optional) Scales for sub optimal alternative hypothesis
     @param[out] tuple_llrs (Optional) Log Likelihood RS ratio
     @param[in] logf output file to write to
+    @param[in] nthreads Number of threads (see col_lrts)
     @see col_grad_wrapper
 */
 void col_lrts_sub(TreeModel *mod, MSA *msa, mode_type mode,
                   double *tuple_pvals, double *tuple_null_scales,
                   double *tuple_scales, double *tuple_sub_scales,
-                  double *tuple_llrs, FILE *logf);
+                  double *tuple_llrs, FILE *logf, int nthreads);
 
 
 /** \name Column Fit Data derivative calculation functions
@@ -240,6 +271,17 @@ double col_scale_derivs(ColFitData *d, double *first_deriv,
 double col_scale_derivs_subtree(ColFitData *d, Vector *gradient,
                                 Matrix *hessian, double ***scratch);
 
+/** Set the substitution matrices of d->mod for its current scale
+   parameters, together with their derivatives with respect to the
+   scale parameters.  Equivalent to tm_set_subst_matrices followed by
+   the computation of derivatives done by col_scale_derivs, but when
+   the rate matrix has a real eigensystem, all matrices for a branch
+   are obtained in a single pass over eigenvector products cached in d.
+   @param[in,out] d Column Data (d->mod->scale and d->mod->scale_sub
+   must be set)
+*/
+void col_set_subst_derivs(ColFitData *d);
+
 /** \name Column Fit Data gradient calculation functions
  \{ */
 
@@ -266,11 +308,23 @@ void col_grad_wrapper(Vector *grad, Vector *params, void *data,
   @param[out] tuple_pvals (Optional) Computed p-values
   @param[out] tuple_derivs (Optional) Computed first derivatives by tuple column
   @param[out] tuple_teststats (Optional) Statistics for each test  (first_derivative^2 / fim)
+  @param[in] nthreads Number of threads (see col_lrts)
   @see col_score_tests_sub
 */
 void col_score_tests(TreeModel *mod, MSA *msa, mode_type mode,
                      double *tuple_pvals, double *tuple_derivs,
-                     double *tuple_teststats);
+                     double *tuple_teststats, int nthreads);
+
+/** Version of col_score_tests that uses a precomputed Fisher
+  information rather than estimating it by sampling.  Useful when
+  scoring an alignment in pieces.
+  @param[in] fim Fisher information, as returned by col_estimate_fim
+  @see col_score_tests
+*/
+void col_score_tests_fim(TreeModel *mod, MSA *msa, mode_type mode,
+                         double fim, double *tuple_pvals,
+                         double *tuple_derivs, double *tuple_teststats,
+                         int nthreads);
 
 
 /** Calculate scores of subtree using column fit data.
@@ -282,11 +336,30 @@ void col_score_tests(TreeModel *mod, MSA *msa, mode_type mode,
   @param[out] tuple_derivs (Optional) first derivatives by tuple column
   @param[out] tuple_sub_derivs (Optional) derivatives for sub optimal
   @param[out] tuple_teststats (Optional) statistics or each test (first_derivative^2 / fim)
+  @param[in] logf output file to write to
+  @param[in] fim_grid_fname (Optional) cache file for the grid of
+  Fisher Information Matrices (see col_fim_grid_sub_cached)
+  @param[in] nthreads Number of threads (see col_lrts)
 */
 void col_score_tests_sub(TreeModel *mod, MSA *msa, mode_type mode,
                          double *tuple_pvals, double *tuple_null_scales,
                          double *tuple_derivs, double *tuple_sub_derivs,
-                         double *tuple_teststats, FILE *logf);
+                         double *tuple_teststats, FILE *logf,
+                         const char *fim_grid_fname, int nthreads);
+
+/** Version of col_score_tests_sub that uses a precomputed grid of
+  Fisher Information Matrices.  Useful when scoring an alignment in
+  pieces.
+  @param[in] grid Grid for mod, as returned by col_fim_grid_sub or
+  col_fim_grid_sub_cached (not freed)
+  @see col_score_tests_sub
+*/
+void col_score_tests_sub_grid(TreeModel *mod, MSA *msa, mode_type mode,
+                              FimGrid *grid, double *tuple_pvals,
+                              double *tuple_null_scales,
+                              double *tuple_derivs, double *tuple_sub_derivs,
+                              double *tuple_teststats, FILE *logf,
+                              int nthreads);
 
 
 
@@ -299,11 +372,13 @@ void col_score_tests_sub(TreeModel *mod, MSA *msa, mode_type mode,
    @param[out] tuple_nobs (Optional) expected number of substitutions after re-scaling
    @param[out] tuple_nrejected (Optional) expected number of rejected substitutions
    @param[out] tuple_nspecies (Optional) number of species with data
+   @param[in] logf output file to write to
+   @param[in] nthreads Number of threads (see col_lrts)
    @note Gaps and missing data are handled by working with the induced subtree.
  */
 void col_gerp(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_nneut,
               double *tuple_nobs, double *tuple_nrejected,
-              double *tuple_nspecies, FILE *logf);
+              double *tuple_nspecies, FILE *logf, int nthreads);
 
 
 /** \} \name Column Fit Data fisher information matrix functions
@@ -323,6 +398,53 @@ FimGrid *col_fim_grid_sub(TreeModel *mod);
 /** Free FimGrid object  */
 void col_free_fim_grid(FimGrid *g);
 
+/** Compute a fingerprint identifying the FIM grid of a model.  Covers
+   the tree (topology, names and branch lengths), the rate matrix,
+   equilibrium frequencies, rate-variation and selection parameters
+   and any alternative substitution models, the branches in the
+   subtree, and the sample size and grid spacing used for estimation.
+   The model is not modified.
+   @param mod Tree model, with subtree_root or in_subtree defined
+   @result 64-bit fingerprint
+*/
+tlc_fprint col_fim_grid_fingerprint(TreeModel *mod);
+
+/** Read all FIM grids from a cache file written by
+   col_write_fim_grids.
+   @param F File to read from
+   @result List of FimGrid*, each with its fingerprint set, or NULL if
+   the file is not a FIM grid cache of the current version or is
+   truncated or corrupt
+*/
+List *col_read_fim_grids(FILE *F);
+
+/** Write FIM grids to a cache file in binary form (native byte
+   order).
+   @param F File to write to
+   @param grids List of FimGrid*
+   @result 0 on success, 1 if a write failed
+*/
+int col_write_fim_grids(FILE *F, List *grids);
+
+/** Obtain a FIM grid for a model (subtree case), using a cache file
+   to avoid re-estimating it.  If the named file contains a grid whose
+   fingerprint matches the model, that grid is returned; otherwise a
+   new grid is estimated with col_fim_grid_sub and added to the file
+   (which is created if necessary).  A file that cannot be read as a
+   cache is ignored, with a warning.  The file is updated by writing a
+   temporary file and renaming it, so concurrent runs sharing a cache
+   never see a partially written file; a grid added by one run may be
+   lost if another run updates the file at the same moment, in which
+   case it is simply estimated again later.  Because grids are
+   estimated by sampling, a cached grid reflects the random seed of
+   the run that created it.
+   @param mod Tree model (as for col_fim_grid_sub)
+   @param fname Name of cache file, or NULL to estimate a grid without
+   caching
+   @result Newly allocated FimGrid
+*/
+FimGrid *col_fim_grid_sub_cached(TreeModel *mod, const char *fname);
+
 /** Estimate Fisher Information Matrix for the non-subtree case.
    This version does not depend on any free parameters, so no grid is
    required.  Estimation is done by sampling */
@@ -31,9 +31,12 @@
    @param logf output file to write to
    @param error_file If non-NULL, write estimate, variance, and 95% 
    confidence interval for each parameter to this file.
+   @param nthreads Number of threads for the E step and the exact
+   gradient (values less than 1 mean one per processor).  Results do
+   not depend on the number of threads.
 */
 int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat, 
               opt_precision_type precision, int max_its, FILE *logf,
-	      FILE *error_file);
+	      FILE *error_file, int nthreads);
 
 #endif
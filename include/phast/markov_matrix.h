@@ -20,6 +20,7 @@
 #include <phast/complex_matrix.h>
 #include <phast/complex_vector.h>
 #include <phast/external_libs.h>
+#include <phast/rng.h>
 
 /** Size of invariant states char array. */
 #define NCHARS 256
@@ -114,6 +115,9 @@ void mm_free_eigen(MarkovMatrix *M);
 */
 int mm_sample_state(MarkovMatrix *M, int state);
 
+/** As mm_sample_state, but drawing from rng (see rng.h). */
+int mm_sample_state_rng(RngContext *rng, MarkovMatrix *M, int state);
+
 /** Given a character label, draw the next state (as a character label).
     @param M Markov Matrix containing next state
     @param c Character Label used to determine next state
@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <phast/external_libs.h>
+#include <phast/rng.h>
 struct hash_table;
 
 #define TRUE 1
@@ -202,6 +203,25 @@ void srandom(int seed);
  */
 void set_seed(int seed);
 
+/** Direct all random draws made by the calling thread to an
+    independent stream of random numbers, determined by a seed and a
+    stream number.  Draws from a stream do not depend on, or affect,
+    the global generator seeded by set_seed or on draws made by other
+    threads, so work divided into streams (e.g., one per bootstrap
+    replicate) gives the same results regardless of the number of
+    threads.  The stream is a Philox RngContext (see rng.h) held in
+    thread-local storage; it is used by every sampling function
+    called with a NULL context.  Ignored in RPHAST, where R's
+    generator is always used.
+    @param seed Base seed
+    @param stream Stream number
+ */
+void set_rand_stream(int seed, int stream);
+
+/** Return the calling thread to the global random number generator
+    (see set_rand_stream). */
+void unset_rand_stream();
+
 /** \name Combination & Permutation functions
 \{ */
 
@@ -230,6 +250,10 @@ int combinations(int n, int k) {
  */
 void choose(int *selections, int N, int k);
 
+/** As choose, but drawing from rng (see rng.h), and without
+    reseeding the global generator. */
+void choose_rng(RngContext *rng, int *selections, int N, int k);
+
 /** Next combination (used for enumerating combinations).
     Call repeatedly to enumerate combinations.
     @param n Number of elements
@@ -245,6 +269,10 @@ int next_comb(int n, int k, int *index);
 */
 void permute(int *permutation, int N);
 
+/** As permute, but drawing from rng (see rng.h), and without
+    reseeding the global generator. */
+void permute_rng(RngContext *rng, int *permutation, int N);
+
 /** \} */
 
 /** Create map from Codons to Amino Acids.
@@ -366,7 +394,11 @@ void phast_warning(const char *warnfmt, ...);
 void die(const char *warnfmt, ...);
 #define checkInterrupt()
 #define checkInterruptN(i,n)
-#define unif_rand(void) (1.0*random()/RAND_MAX)
+
+/** Draw a number uniformly from [0, 1], from the calling thread's
+    stream if one has been selected by set_rand_stream, otherwise from
+    the global generator.  Equivalent to rng_unif(NULL). */
+double unif_rand();
 #endif
 
 /** \name Program argument handling functions
@@ -574,6 +606,9 @@ double bvn_p(double x, double y, double mu_x, double mu_y, double sigma_x,
 */
 double beta_draw(double a, double b);
 
+/** As beta_draw, but drawing from rng (see rng.h). */
+double beta_draw_rng(RngContext *rng, double a, double b);
+
 /** Make a draw from a k-dimensional Dirichlet distribution.
    @param k Dimensionality of distribution
    @param theta Scale of distribution
@@ -585,6 +620,10 @@ double beta_draw(double a, double b);
  */
 void dirichlet_draw(int k, double *alpha, double *theta);
 
+/** As dirichlet_draw, but drawing from rng (see rng.h). */
+void dirichlet_draw_rng(RngContext *rng, int k, double *alpha,
+                        double *theta);
+
 
 /** Make 'n' draws from a uniform distribution on the interval [min,
    max], optionally with antithetics.
@@ -598,6 +637,10 @@ void dirichlet_draw(int k, double *alpha, double *theta);
  */
 void unif_draw(int n, double min, double max, double *draws, int antithetics);
 
+/** As unif_draw, but drawing from rng (see rng.h). */
+void unif_draw_rng(RngContext *rng, int n, double min, double max,
+                   double *draws, int antithetics);
+
 /** Make a draw from a binomial distribution with parameters 'N' and
    'p'.
    @pre Call srandom
@@ -607,6 +650,9 @@ void unif_draw(int n, double min, double max, double *draws, int antithetics);
    @note Computational complexity is O(N) */
 int bn_draw(int N, double p);
 
+/** As bn_draw, but drawing from rng (see rng.h). */
+int bn_draw_rng(RngContext *rng, int N, double p);
+
 /** Make a draw from a binomial distribution with parameters 'n' and
    'pp'.
    @pre Call srandom
@@ -618,6 +664,9 @@ int bn_draw(int N, double p);
    1/25.   */
 int bn_draw_fast(int n, double pp);
 
+/** As bn_draw_fast, but drawing from rng (see rng.h). */
+int bn_draw_fast_rng(RngContext *rng, int n, double pp);
+
 /** Make 'n' draws from a multinomial distribution defined by
    probability vector 'p' with dimension 'd'.
    @pre Call srandom
@@ -630,6 +679,9 @@ int bn_draw_fast(int n, double pp);
  */
 void mn_draw(int n, double *p, int d, int *counts);
 
+/** As mn_draw, but drawing from rng (see rng.h). */
+void mn_draw_rng(RngContext *rng, int n, double *p, int d, int *counts);
+
 /** Make a draw from an exponential distribution with parameter
    (expected value) 'b'
    @param b Defines exponential distribution
@@ -637,6 +689,9 @@ void mn_draw(int n, double *p, int d, int *counts);
 */
 double exp_draw(double b);
 
+/** As exp_draw, but drawing from rng (see rng.h). */
+double exp_draw_rng(RngContext *rng, double b);
+
 
 /** Make a draw from a gamma distribution with parameters 'a' and 'b'.
    @pre Call srandom
@@ -652,6 +707,9 @@ double exp_draw(double b);
 */
 double gamma_draw(double a, double b);
 
+/** As gamma_draw, but drawing from rng (see rng.h). */
+double gamma_draw_rng(RngContext *rng, double a, double b);
+
 /** Given a probability vector, draw an index.
    @pre Call srandom externally
    @param p Probability vector
@@ -660,6 +718,9 @@ double gamma_draw(double a, double b);
 */
 int draw_index(double *p, int size);
 
+/** As draw_index, but drawing from rng (see rng.h). */
+int draw_index_rng(RngContext *rng, double *p, int size);
+
 
 /** \} */
 
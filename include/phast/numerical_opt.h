@@ -14,6 +14,7 @@
 
 #include <phast/matrix.h>
 #include <phast/vector.h>
+#include <phast/checkpoint.h>
 #include <math.h>
 
 typedef enum {
@@ -40,6 +41,31 @@ typedef enum {
 
 opt_precision_type get_precision(const char *prec);
 
+/* multidimensional optimization algorithm */
+typedef enum {
+  OPT_BFGS,                     /* BFGS with dense inverse Hessian
+                                   (opt_bfgs) */
+  OPT_LBFGS,                    /* limited-memory BFGS (opt_lbfgs) */
+  OPT_UNKNOWN_METHOD
+} opt_method_type;
+
+/* default number of correction pairs kept by opt_lbfgs */
+#define OPT_LBFGS_M 20
+
+/* recent parameter and gradient differences kept by opt_lbfgs, which
+   together stand in for the inverse Hessian */
+typedef struct {
+  int n,                        /* number of parameters */
+    m,                          /* maximum number of pairs */
+    oldest,                     /* index of oldest pair in s and y */
+    npairs;                     /* current number of pairs */
+  Vector **s,                   /* circular buffers of parameter */
+    **y;                        /* and gradient differences */
+  double *rho, *alpha;          /* workspace */
+} LbfgsHistory;
+
+opt_method_type get_opt_method(const char *method);
+
 void opt_gradient(Vector *grad, double (*f)(Vector*, void*), 
                   Vector *params, void* data, opt_deriv_method method,
                   double reference_val, Vector *lower_bounds, 
@@ -51,7 +77,31 @@ int opt_bfgs(double (*f)(Vector*, void*), Vector *params,
              void (*compute_grad)(Vector *grad, Vector *params,
                                   void *data, Vector *lb, Vector *ub),
              opt_precision_type precision, Matrix *inv_Hessian,
-	     int *num_evals);
+             Checkpoint *ckpt, int *num_evals);
+
+int opt_lbfgs(double (*f)(Vector*, void*), Vector *params, 
+              void *data, double *retval, Vector *lower_bounds, 
+              Vector *upper_bounds, FILE *logf,
+              void (*compute_grad)(Vector *grad, Vector *params,
+                                   void *data, Vector *lb, Vector *ub),
+              opt_precision_type precision, LbfgsHistory *history,
+              Checkpoint *ckpt, int *num_evals);
+
+/* create an empty history of at most m correction pairs (if m <= 0,
+   OPT_LBFGS_M) for n parameters */
+LbfgsHistory *opt_lbfgs_history_new(int n, int m);
+
+void opt_lbfgs_history_free(LbfgsHistory *h);
+
+/* save the correction pairs of a history to a checkpoint, as items
+   whose names begin with the given prefix */
+void opt_lbfgs_history_save(LbfgsHistory *h, Checkpoint *ckpt, 
+                            const char *prefix);
+
+/* restore correction pairs saved by opt_lbfgs_history_save,
+   replacing the current contents of the history */
+void opt_lbfgs_history_restore(LbfgsHistory *h, Checkpoint *ckpt, 
+                               const char *prefix);
 
 void opt_lnsrch(Vector *xold, double fold, Vector *g, Vector *p, 
                 Vector *x, double *f, double stpmax, 
@@ -88,6 +138,17 @@ void opt_lnsrch_1d(double direction, double xold, double fold, double *x,
                    double *fx, double deriv, double (*func)(double, void*), 
                    void *data, int *nevals, double *final_lambda, FILE *logf);
 
+/* function for use with opt_newton_1d_batch: for each k in [0, n),
+   evaluate problem prob[k] at abscissa x[k], storing the function
+   value and its first and second derivatives in fx[k], d[k], and
+   d2[k] */
+typedef void (*opt_batch_func_1d)(int n, int *prob, double *x, double *fx,
+                                  double *d, double *d2, void *data);
+
+int opt_newton_1d_batch(opt_batch_func_1d f, int nprobs, double *x,
+                        double *fx, void *data, int sigfigs, double lb,
+                        double ub, FILE *logf);
+
 int opt_min_sigfig(Vector *p1, Vector *p2);
 
 int opt_sigfig(double val1, double val2);
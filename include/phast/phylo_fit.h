@@ -47,7 +47,20 @@ struct phyloFit_struct {
     no_freqs, no_rates, assume_clock, 
     init_parsimony, parsimony_only, no_branchlens,
     label_categories, symfreq, init_backgd_from_data,
-    use_selection, max_em_its;
+    use_selection, max_em_its,
+    nrestarts,                  /* no. of independent fits per model;
+                                   all but the first start from
+                                   random values */
+    nthreads;                   /* no. of threads for fitting windows,
+                                   categories and restarts (0 means
+                                   one per processor) */
+  opt_method_type opt_method;   /* OPT_BFGS or OPT_LBFGS */
+  char *checkpoint_fname;       /* file to which the state of the fit
+                                   is saved periodically (NULL for
+                                   none) */
+  int checkpoint_interval,      /* seconds between checkpoints */
+    resume;                     /* resume from checkpoint_fname, if it
+                                   exists */
   unsigned int nsites_threshold;
   TreeNode *tree;
   CategoryMap *cm;
@@ -42,6 +42,14 @@ typedef struct {
   double gamma;			/**< Target coverage for two-state
                                    rate-variation phylo-HMM */
   Matrix *H;                    /**< Inverse Hessian for BFGS  */
+  double *rho_tuple_scores;     /**< Per-tuple log likelihoods (base 2)
+                                   under the conserved model at scale
+                                   rho_tuple_scores_scale, saved during
+                                   estimation of rho so that conserved
+                                   emissions need not be recomputed
+                                   (NULL if not in use) */
+  double rho_tuple_scores_scale; /**< Scale at which rho_tuple_scores
+                                   were computed */
 } EmData;
 
 /** Phylo HMM object */
@@ -102,6 +110,10 @@ typedef struct {
   **t;        		        /**< Branch-length factor used in
                                    Parametric indel model */
   EmData *em_data;              /**< Used in parameter estimation by EM  */
+  Checkpoint *ckpt;             /**< (Optional) checkpoint to which
+                                   fit_two_state periodically saves
+                                   the state of EM, and from which it
+                                   resumes; not owned by the object */
 } PhyloHmm;
 
 /** Package of data used in estimation of indel parameters */
@@ -31,6 +31,11 @@ typedef enum{SPH, LRT, SCORE, GERP} method_type;
    together */
 #define MAX_CONVOLVE_SIZE 22500
 
+/* maximum number of distinct alignment columns whose scores are
+   remembered across chunks with --chunk-size; when exceeded, the
+   scores are forgotten, to keep memory bounded */
+#define STREAM_MAX_TUPLES 4000000
+
 
 struct phyloP_struct {
   MSA *msa;
@@ -38,7 +43,7 @@ struct phyloP_struct {
   int output_wig, output_gff;
   int nsites, fit_model, base_by_base, default_epsilon, refidx, refidx_feat;
   double ci, epsilon;
-  char *subtree_name, *chrom;
+  char *subtree_name, *chrom, *binary_track;
   List *branch_name;
   GFF_Set *feats;
   method_type method;
@@ -50,9 +55,14 @@ struct phyloP_struct {
   char *help, *mod_fname, *msa_fname;
   ListOfLists *results;
   int no_prune;
+  int nthreads;
+  char *fim_grid_fname;
+  int chunk_size;
+  FILE *msa_stream;
 };
 
 struct phyloP_struct *phyloP_struct_new(int rphast);
 void phyloP(struct phyloP_struct *p);
+void phyloP_stream(struct phyloP_struct *p);
 
 #endif
@@ -15,6 +15,7 @@
 #define PHYLO_P_PRINT_H
 
 #include <phast/list_of_lists.h>
+#include <phast/bin_track.h>
 
 void print_prior_only(FILE *outfile, int nsites, char *mod_fname, 
 		      Vector *prior_distrib, ListOfLists *result);
@@ -48,8 +49,12 @@ void print_feats_sph_subtree(FILE *outfile, p_value_joint_stats *stats,
 			     GFF_Set *gff, mode_type mode, double epsilon, 
 			     int output_gff, ListOfLists *result);
 void print_quantiles(FILE *outfile, Vector *distrib, ListOfLists *result);
-void print_wig(FILE *outfile, MSA *msa, double *tuple_pvals, char *chrom, 
-	       int refidx, int log_trans, ListOfLists *result);
+void print_wig(FILE *outfile, BinTrackWriter *btk, MSA *msa,
+               double *tuple_pvals, char *chrom, int refidx, int log_trans,
+               ListOfLists *result);
+void print_wig_piece(FILE *outfile, BinTrackWriter *btk, MSA *msa,
+                     double *vals, char *chrom, int start, int end,
+                     long long refstart, int log_trans, long long *last);
 void print_base_by_base(FILE *outfile, char *header, char *chrom, MSA *msa, 
                         char **formatstr, int refidx, ListOfLists *result,
 			int log_trans_outfile, int log_trans_results, int ncols, ...);
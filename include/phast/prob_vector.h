@@ -20,6 +20,7 @@
 #define PROB_VECTOR
 
 #include <phast/vector.h>
+#include <phast/rng.h>
 
 /** Type of p-value calculated */
 typedef enum {LOWER, /**< Lower tail p-value */
@@ -136,6 +137,9 @@ Vector *pv_cdf(Vector *pdf, p_val_type side);
  */
 int pv_draw_idx_arr(double *arr, int n);
 
+/** As pv_draw_idx_arr, but drawing from rng (see rng.h). */
+int pv_draw_idx_arr_rng(RngContext *rng, double *arr, int n);
+
 /** Given a probability vector, draw an index. 
    @pre Call srandom externally
    @param pdf Probability to draw from
@@ -143,4 +147,7 @@ int pv_draw_idx_arr(double *arr, int n);
 */
 int pv_draw_idx(Vector *pdf);
 
+/** As pv_draw_idx, but drawing from rng (see rng.h). */
+int pv_draw_idx_rng(RngContext *rng, Vector *pdf);
+
 #endif
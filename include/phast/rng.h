@@ -0,0 +1,102 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file rng.h
+    Counter-based random number generation.  An RngContext produces
+    the output of the Philox4x32-10 function (Salmon et al., SC 2011)
+    applied to a sequence of counters, under a key derived from a
+    seed.  The counter holds the stream number and the number of
+    blocks drawn so far, so each (seed, stream) pair defines an
+    independent sequence of random numbers, and the n-th number of a
+    stream does not depend on anything drawn from any other stream.
+    Work that is divided into streams (e.g., one per simulated
+    replicate) therefore gives bit-identical results regardless of how
+    it is scheduled across threads.
+
+    Every sampling function that takes an RngContext (e.g.,
+    mn_draw_rng, gamma_draw_rng, pv_draw_idx_rng) also accepts NULL,
+    meaning the calling thread's current stream if one has been
+    selected with set_rand_stream, and otherwise the global generator
+    seeded by set_seed.  The older functions without an RngContext
+    argument (mn_draw, gamma_draw, unif_rand, ...) are wrappers that
+    pass NULL.
+
+    An RngContext must not be shared between threads.
+    @ingroup base
+*/
+
+#ifndef RNG_H
+#define RNG_H
+
+/** Random number generator context */
+typedef struct {
+  unsigned int key[2];          /**< Key (from seed) */
+  unsigned int ctr[4];          /**< Counter: block number (ctr[0],
+                                   ctr[1]) and stream (ctr[2],
+                                   ctr[3]) */
+  unsigned int block[4];        /**< Output for current block */
+  int nused;                    /**< Number of words of block used */
+} RngContext;
+
+/** \name RngContext allocation functions
+ \{ */
+
+/** Create a new random number generator context.
+    @param seed Seed
+    @param stream Stream number
+    @result Newly allocated context, positioned at the start of the
+    stream
+ */
+RngContext *rng_new(unsigned long long seed, unsigned long long stream);
+
+/** Initialise a context that has already been allocated (e.g., on the
+    stack or in thread-local storage).  Parameters as for rng_new. */
+void rng_init(RngContext *rng, unsigned long long seed,
+              unsigned long long stream);
+
+/** Free a context.
+    @param rng Context to free
+ */
+void rng_free(RngContext *rng);
+
+/** \} \name RngContext drawing functions
+ \{ */
+
+/** Draw a random 32-bit unsigned integer.
+    @param rng Context (must not be NULL)
+    @result Next word of the stream
+ */
+unsigned int rng_u32(RngContext *rng);
+
+/** Draw a number uniformly from (0, 1).  With a context, the result
+    has 53 random bits and is never exactly 0 or 1.
+    @param rng Context, or NULL for the calling thread's current
+    stream or, if none, the global generator
+    @result Uniform draw
+ */
+double rng_unif(RngContext *rng);
+
+/** \} \name Thread stream functions
+ \{ */
+
+/** Make a context the calling thread's current stream, which is used
+    by all sampling functions called with a NULL context (see
+    set_rand_stream in misc.h).
+    @param rng Context, or NULL to return to the global generator
+ */
+void rng_set_thread(RngContext *rng);
+
+/** Return the calling thread's current stream.
+    @result Context, or NULL if none is selected
+ */
+RngContext *rng_get_thread();
+
+/** \} */
+
+#endif
@@ -15,6 +15,7 @@
 #include <phast/tree_model.h>
 #include <phast/prob_vector.h>
 #include <phast/fit_column.h>
+#include <phast/hashtable.h>
 
 typedef struct {
   int njumps_max;
@@ -26,6 +27,25 @@ typedef struct {
   Matrix *M;
   Matrix ***branch_distrib;
   double epsilon;
+  int *maxsubst;                /* max. no. of substitutions beneath each
+                                   node considered by
+                                   sub_posterior_distrib_site */
+  Matrix **post_L;              /* per-node distributions for the
+                                   current tuple; each points either
+                                   into post_work or into post_cache */
+  Matrix **post_work;           /* per-node workspace for
+                                   sub_posterior_distrib_site */
+  Matrix *post_left, *post_right;
+                                /* per-child workspace for same */
+  int *post_pattern;            /* id of the leaf pattern beneath each
+                                   node for the current tuple, or -1
+                                   if not cached */
+  Hashtable **post_pattern_ids; /* per node, maps the pattern ids of
+                                   the two children to the pattern id
+                                   of the node */
+  List **post_cache;            /* per node, distributions indexed by
+                                   pattern id */
+  long post_cache_size;         /* no. of doubles held in post_cache */
 } JumpProcess;
 /* note: a jump process is defined wrt a whole tree model, not just a
    rate matrix */
@@ -58,7 +78,7 @@ Vector *sub_posterior_distrib_alignment(JumpProcess *jp, MSA *msa);
 void sub_pval_per_site(JumpProcess *jp, MSA *msa, mode_type side,
                        int fit_model, double *prior_mean, double *prior_var, 
                        double *pvals, double *post_mean, double *post_var,
-                       FILE *logf);
+                       FILE *logf, int nthreads);
 void sub_pval_per_site_subtree(JumpProcess *jp, MSA *msa, mode_type mode, 
                                int fit_model, 
                                double *prior_mean_sub, double *prior_var_sub, 
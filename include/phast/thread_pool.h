@@ -0,0 +1,92 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file thread_pool.h
+    Simple pool of worker threads for running independent jobs in
+    parallel.  A pool is created once, used for any number of calls to
+    thr_foreach, and then freed.  Each call to thr_foreach runs a
+    function on every job index in [0, njobs), handing out jobs
+    dynamically to whichever thread is free, and returns when all jobs
+    are finished.  The calling thread takes part in the work as thread
+    0.
+
+    When PHAST is built without thread support (see PHAST_THREADS in
+    external_libs.h), or when a pool has only one thread, all jobs are
+    run in order in the calling thread, so code written against this
+    interface behaves identically in either case.
+
+    Functions passed to thr_foreach must be thread safe: they may read
+    shared data, but must write only to data private to their job or
+    their thread.  Library routines that keep static workspace
+    (e.g., mm_exp) declare it PHAST_TLS; objects that cache state
+    lazily, such as tree traversals and tree models, should be copied
+    for each thread.
+    @ingroup base
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <phast/external_libs.h>
+
+/** Pool of worker threads (opaque) */
+typedef struct thr_pool_struct ThreadPool;
+
+/** Function run for each job.  Arguments are the shared data passed
+    to thr_foreach, the job index, and the index of the thread running
+    the job (in [0, thr_pool_size(pool))), which can be used to select
+    per-thread workspace. */
+typedef void (*thr_job_func)(void *data, int job, int thread);
+
+/** \name Thread pool allocation functions
+ \{ */
+
+/** Create a new thread pool.
+    @param nthreads Number of threads, including the calling thread.
+    Values less than 1 are taken to mean the number of available
+    processors.  Silently reduced to 1 if PHAST is built without
+    thread support.
+    @result Newly allocated pool
+ */
+ThreadPool *thr_pool_new(int nthreads);
+
+/** Stop all worker threads and free a thread pool.
+    @param pool Pool to free
+ */
+void thr_pool_free(ThreadPool *pool);
+
+/** \} \name Thread pool functions
+ \{ */
+
+/** Number of threads in a pool (including the calling thread).
+    @param pool Thread pool, or NULL
+    @result Number of threads (1 if pool is NULL)
+ */
+int thr_pool_size(ThreadPool *pool);
+
+/** Run a function on every job in [0, njobs), in parallel.  Returns
+    when all jobs have completed.  If called from within a job (i.e.,
+    nested), or if pool is NULL, the jobs are run serially in the
+    calling thread.
+    @param pool Thread pool, or NULL
+    @param njobs Number of jobs
+    @param func Function to run for each job
+    @param data Shared data passed to each call of func
+ */
+void thr_foreach(ThreadPool *pool, int njobs, thr_job_func func, void *data);
+
+/** Number of processors available.
+    @result Number of online processors, or 1 if it cannot be
+    determined
+ */
+int thr_ncpus();
+
+/** \} */
+
+#endif
@@ -20,6 +20,7 @@
 #include <phast/msa.h>
 #include <math.h>
 #include <phast/misc.h>
+#include <phast/thread_pool.h>
 
 /** Structure for information related to posterior probability of tree
    model wrt an alignment.  
@@ -128,6 +129,51 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
 				 int cat,
                                  TreePosteriors *post);
 
+/** Compute the log likelihood of a tree model, together with
+   posterior quantities, by dividing the column tuples into blocks of
+   consecutive tuples that are processed concurrently.  Expected
+   numbers of substitutions (expected_nsubst_tot) and of sites per
+   rate category (rcat_expected_nsites) are accumulated separately
+   for each block and then summed in block order, so results depend
+   on the number of blocks but not on the number of threads.
+   @param[in] mod Tree Model to compute likelihood for
+   @param[in] msa Multiple Alignment (sufficient statistics required)
+   @param[in] cat Category to use (-1 for all columns)
+   @param[in,out] posts Array of nblocks TreePosteriors objects.  The
+   first receives all results, as with tl_compute_log_likelihood.  Of
+   the others, only expected_nsubst_tot and rcat_expected_nsites are
+   used, as workspace; they must be allocated if those of the first
+   are.
+   @param[in] nblocks Number of blocks (with 1, equivalent to
+   tl_compute_log_likelihood)
+   @param[in] pool Thread pool (may be NULL)
+   @result Log (base 2) likelihood
+*/
+double tl_compute_log_likelihood_blocks(TreeModel *mod, MSA *msa, int cat,
+                                        TreePosteriors **posts, int nblocks,
+                                        ThreadPool *pool);
+
+/** Compute column-by-column log likelihoods under two tree models
+   that share a topology and differ only in their branch lengths or
+   substitution parameters (e.g., the conserved and nonconserved
+   models of the two-state phastCons HMM).  The leaf partial
+   likelihoods and gap/informativeness checks are computed once per
+   column tuple and shared by both models, and for leaves with an
+   unambiguous base the sum over child states is replaced by a lookup
+   in the substitution matrix.  Results are identical to two calls to
+   tl_compute_log_likelihood.  If the models are not compatible
+   (different topologies or alphabets, order > 0, or a likelihood
+   cache in use), falls back on tl_compute_log_likelihood.
+   @param[in] mod0 First tree model
+   @param[in] mod1 Second tree model
+   @param[in] msa Multiple alignment
+   @param[out] col_scores0 Log likelihood (base 2) of each column under mod0
+   @param[out] col_scores1 Log likelihood (base 2) of each column under mod1
+*/
+void tl_compute_log_likelihood_pair(TreeModel *mod0, TreeModel *mod1,
+                                    MSA *msa, double *col_scores0,
+                                    double *col_scores1);
+
 /** Create a new TreePosteriors object.
     @param mod Tree Model of which the posterior probabilities are calculated
     @param msa Multiple Alignment
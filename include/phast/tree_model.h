@@ -84,6 +84,7 @@ typedef enum {
 } scale_bound_type; 
 
 struct tp_struct;
+struct tlc_struct;
 
 
 /** Defines alternative substitution model for a particular branch */
@@ -218,7 +219,21 @@ struct tm_struct {
   int scale_during_opt;       /**< Whether to scale rate matrix during optimization.
 				 Normally 0, but 1 if TM_BRANCHLENS_NONE, or
 				 if TM_SCALE and alt_subst_mods!=NULL */
+  opt_method_type opt_method;   /**< Optimization algorithm used by
+                                   tm_fit, tm_fit_multi, and tm_fit_em
+                                   (OPT_BFGS or OPT_LBFGS) */
   int **iupac_inv_map;          /**< Inverse map for IUPAC ambiguity characters */
+  struct tlc_struct *lik_cache; /**< (Optional) cache of column
+                                   likelihoods consulted by
+                                   tl_compute_log_likelihood; not
+                                   owned by the model (see
+                                   tuple_lik_cache.h) */
+  Checkpoint *ckpt;             /**< (Optional) checkpoint to which
+                                   tm_fit and tm_fit_em periodically
+                                   save their state, and from which
+                                   they resume; not owned by the
+                                   model, and not copied by
+                                   tm_create_copy */
 };
 
 typedef struct tm_struct TreeModel;
@@ -434,11 +449,14 @@ int tm_fit(TreeModel *mod, MSA *msa, Vector *params, int cat,
     @param precision Precision describing BFGS convergence criteria
     @param logf log file
     @param quiet Whether to report progress to stderr
+    @param nthreads Number of threads used to compute the likelihoods
+    of the models concurrently (0 means one per available processor).
+    Results do not depend on the number of threads.
     @returns 0 on success, 1 on failure
  */
 int tm_fit_multi(TreeModel **mod, int nmod, MSA **msa, int nmsa,
 		 opt_precision_type precision,
-		 FILE *logf, int quiet);
+		 FILE *logf, int quiet, int nthreads);
 
 /** Set specified TreeModel according to specified parameter vector.
    Exact behavior depends on substitution model.
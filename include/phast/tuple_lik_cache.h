@@ -0,0 +1,202 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/** @file tuple_lik_cache.h
+    Persistent cache of per-rate-category column likelihoods, keyed by
+    a fingerprint of the tree model and the column tuple.
+    When a cache is attached to a tree model (mod->lik_cache),
+    tl_compute_log_likelihood consults it before running the pruning
+    algorithm on a column tuple, and records any newly computed
+    values.  Because alignment columns are highly repetitive, a cache
+    saved by one run (e.g., phastCons with one --target-coverage) makes
+    most emission computations in later runs against the same models
+    simple lookups.
+    @ingroup phylo
+ */
+
+#ifndef TUPLE_LIK_CACHE_H
+#define TUPLE_LIK_CACHE_H
+
+#include <stdio.h>
+#include <phast/hashtable.h>
+#include <phast/tree_model.h>
+#include <phast/msa.h>
+
+/** Magic string at the start of every cache file */
+#define TLC_MAGIC "PHASTTLC"
+
+/** Version of the cache file format */
+#define TLC_VERSION 1
+
+/** Number of hex characters used to encode a model fingerprint in a
+    cache key */
+#define TLC_FPRINT_LEN 16
+
+/** Model fingerprint (64-bit FNV-1a hash of model parameters) */
+typedef unsigned long long tlc_fprint;
+
+/** Cache of column likelihoods. */
+struct tlc_struct {
+  Hashtable *entries;           /**< Maps key (fingerprint + tuple
+                                   characters, in leaf order) to a
+                                   TupleLikEntry */
+  List *keys;                   /**< Copies of all keys, in order of
+                                   insertion (used when writing the
+                                   cache) */
+  int nhits,                    /**< Number of successful lookups */
+    nmisses;                    /**< Number of failed lookups */
+};
+typedef struct tlc_struct TupleLikCache;
+                                /* see incomplete type in tree_model.h */
+
+/** Cached likelihoods for one (model, tuple) pair */
+typedef struct {
+  int nratecats;                /**< Number of rate categories */
+  double *lik;                  /**< Likelihood of the tuple for each
+                                   rate category, weighted by the
+                                   category frequency, exactly as
+                                   accumulated by
+                                   tl_compute_log_likelihood */
+} TupleLikEntry;
+
+/** \name Cache allocation/cleanup functions
+ \{ */
+
+/** Create a new, empty cache.
+    @param est_capacity Estimated number of entries
+    @result Newly allocated cache
+ */
+TupleLikCache *tlc_new(int est_capacity);
+
+/** Read a cache from a file previously written by tlc_write.
+    @param F File to read from
+    @param est_capacity Estimated number of entries (in addition to
+    those stored in the file)
+    @result Newly allocated cache containing all stored entries, or
+    NULL if the file is not a valid cache or is truncated or corrupt
+ */
+TupleLikCache *tlc_new_from_file(FILE *F, int est_capacity);
+
+/** Read a cache from the named file if it exists, or create an empty
+    one otherwise.  An invalid file is reported with a warning and
+    treated like a missing one.
+    @param fname Name of cache file
+    @param est_capacity Estimated number of entries
+    @result Newly allocated cache
+ */
+TupleLikCache *tlc_new_from_fname(const char *fname, int est_capacity);
+
+/** Free a cache and all of its entries.
+    @param cache Cache to free
+ */
+void tlc_free(TupleLikCache *cache);
+
+/** \} \name Cache read/write functions
+ \{ */
+
+/** Write a cache in binary form.
+    @param F File to write to
+    @param cache Cache to write
+    @result 0 on success, 1 on a write error
+    @note The file format uses native byte order and is not portable
+    across architectures.
+ */
+int tlc_write(FILE *F, TupleLikCache *cache);
+
+/** Write a cache to the named file, replacing it atomically: the
+    cache is written to a temporary file which is then renamed, so
+    that readers never see a partially written file.  A failure is
+    reported with a warning.
+    @param fname Name of cache file
+    @param cache Cache to write
+    @result 0 on success, 1 on error
+    @note The file is rewritten in full with every entry in the
+    cache; it is never pruned.
+ */
+int tlc_write_fname(const char *fname, TupleLikCache *cache);
+
+/** \} \name Cache lookup functions
+ \{ */
+
+/** Compute a fingerprint for a tree model.
+    The fingerprint covers everything the pruning algorithm depends on:
+    the tree topology and leaf names, the substitution probability
+    matrices for every branch and rate category, the equilibrium
+    frequencies, the rate-category weights, the model order and the
+    alphabet.  It does not cover settings that determine whether a
+    column is scored at all (e.g., mod->inform_reqd).
+    @param mod Tree model, with substitution matrices already set
+    @result 64-bit fingerprint
+ */
+tlc_fprint tlc_fingerprint(TreeModel *mod);
+
+/** Extend a fingerprint with arbitrary data, e.g., to key derived
+    quantities that depend on settings beyond the model itself.
+    @param fprint Fingerprint to extend
+    @param data Data to add
+    @param len Length of data, in bytes
+    @result Extended fingerprint
+ */
+tlc_fprint tlc_hash(tlc_fprint fprint, const void *data, size_t len);
+
+/** Extend a fingerprint with the contents of an alignment: its
+    sequence names and alphabet, and either its sequences or its
+    sufficient statistics (whichever are present), plus any category
+    labels.
+    @param fprint Fingerprint to extend
+    @param msa Alignment
+    @result Extended fingerprint
+ */
+tlc_fprint tlc_hash_msa(tlc_fprint fprint, MSA *msa);
+
+/** Extend a fingerprint with the free parameters of a tree model: the
+    substitution model, order, tree (with branch lengths), rate matrix,
+    equilibrium frequencies and rate-variation settings.  Unlike
+    tlc_fingerprint, this does not require substitution matrices to
+    have been computed.
+    @param fprint Fingerprint to extend
+    @param mod Tree model
+    @result Extended fingerprint
+ */
+tlc_fprint tlc_hash_model(tlc_fprint fprint, TreeModel *mod);
+
+/** Build a cache key for a column tuple.  Characters are listed in
+    order of leaf node ids, so the key does not depend on the order of
+    sequences in the alignment.
+    @param[out] key Must have room for TLC_FPRINT_LEN + (number of
+    leaves) * (mod->order + 1) + 1 characters
+    @param[in] fprint Model fingerprint
+    @param[in] mod Tree model (mod->msa_seq_idx must be defined)
+    @param[in] msa Alignment, with sufficient statistics
+    @param[in] tupleidx Index of column tuple
+ */
+void tlc_make_key(char *key, tlc_fprint fprint, TreeModel *mod, MSA *msa,
+                  int tupleidx);
+
+/** Look up a key.
+    @param cache Cache to search
+    @param key Key built by tlc_make_key
+    @param nratecats Expected number of rate categories
+    @result Array of per-rate-category likelihoods, or NULL if the key
+    is not present
+ */
+double *tlc_get(TupleLikCache *cache, const char *key, int nratecats);
+
+/** Add an entry to the cache.
+    @param cache Cache to add to
+    @param key Key built by tlc_make_key
+    @param lik Per-rate-category likelihoods (copied)
+    @param nratecats Number of rate categories
+ */
+void tlc_put(TupleLikCache *cache, const char *key, double *lik,
+             int nratecats);
+
+/** \} */
+
+#endif
@@ -0,0 +1,202 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Checkpointing of long-running optimisations.  See checkpoint.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <phast/checkpoint.h>
+#include <phast/stringsplus.h>
+#include <phast/misc.h>
+
+Checkpoint *ckpt_new(const char *fname, int interval) {
+  Checkpoint *ck = smalloc(sizeof(Checkpoint));
+  ck->fname = copy_charstr(fname);
+  ck->interval = interval;
+  ck->last_save = time(NULL);
+  ck->items = hsh_new(50);
+  ck->F = NULL;
+  ck->fprint = NULL;
+  return ck;
+}
+
+void ckpt_free(Checkpoint *ck) {
+  if (ck->F != NULL) phast_fclose(ck->F);
+  hsh_free_with_vals(ck->items);
+  if (ck->fprint != NULL) sfree(ck->fprint);
+  sfree(ck->fname);
+  sfree(ck);
+}
+
+void ckpt_set_fingerprint(Checkpoint *ck, const char *fprint) {
+  if (ck->fprint != NULL) sfree(ck->fprint);
+  ck->fprint = copy_charstr(fprint);
+}
+
+int ckpt_load(Checkpoint *ck) {
+  FILE *F = phast_fopen_no_exit(ck->fname, "r");
+  String *line;
+  int lineno = 0;
+  if (F == NULL) return 0;
+
+  ckpt_clear(ck);
+  line = str_new(STR_LONG_LEN);
+  while (str_readline(line, F) != EOF) {
+    char *colon;
+    lineno++;
+    str_trim(line);
+    if (line->length == 0 || line->chars[0] == '#') continue;
+    colon = strchr(line->chars, ':');
+    if (colon == NULL)
+      die("ERROR: bad line %i in checkpoint file %s.\n", lineno, ck->fname);
+    *colon = '\0';
+    colon++;
+    while (*colon == ' ') colon++;
+    hsh_put(ck->items, line->chars, copy_charstr(colon));
+  }
+  str_free(line);
+  phast_fclose(F);
+
+  if (ck->fprint != NULL) {
+    char *saved = hsh_get(ck->items, "FINGERPRINT");
+    if (saved == (void*)-1 || strcmp(saved, ck->fprint) != 0)
+      die("ERROR: checkpoint file %s was written for a different alignment, model, or\noptions; refusing to resume from it.\n", ck->fname);
+  }
+  return 1;
+}
+
+int ckpt_has(Checkpoint *ck, const char *name) {
+  return ck != NULL && hsh_get(ck->items, name) != (void*)-1;
+}
+
+static char *get_item(Checkpoint *ck, const char *name) {
+  char *val = hsh_get(ck->items, name);
+  if (val == (void*)-1)
+    die("ERROR: item %s missing from checkpoint file %s.\n", name,
+        ck->fname);
+  return val;
+}
+
+/* parse the next number in an item, advancing *pos; dies if there is
+   none */
+static double next_dbl(Checkpoint *ck, const char *name, char **pos) {
+  char *end;
+  double val = strtod(*pos, &end);
+  if (end == *pos)
+    die("ERROR: bad value for %s in checkpoint file %s.\n", name, ck->fname);
+  *pos = end;
+  return val;
+}
+
+int ckpt_get_int(Checkpoint *ck, const char *name) {
+  char *pos = get_item(ck, name);
+  return (int)next_dbl(ck, name, &pos);
+}
+
+double ckpt_get_dbl(Checkpoint *ck, const char *name) {
+  char *pos = get_item(ck, name);
+  return next_dbl(ck, name, &pos);
+}
+
+char *ckpt_get_str(Checkpoint *ck, const char *name) {
+  return get_item(ck, name);
+}
+
+Vector *ckpt_get_vector(Checkpoint *ck, const char *name) {
+  char *pos = get_item(ck, name);
+  int i, size = (int)next_dbl(ck, name, &pos);
+  Vector *v;
+  if (size <= 0)
+    die("ERROR: bad value for %s in checkpoint file %s.\n", name, ck->fname);
+  v = vec_new(size);
+  for (i = 0; i < size; i++)
+    vec_set(v, i, next_dbl(ck, name, &pos));
+  return v;
+}
+
+Matrix *ckpt_get_matrix(Checkpoint *ck, const char *name) {
+  char *pos = get_item(ck, name);
+  int i, j, nrows = (int)next_dbl(ck, name, &pos),
+    ncols = (int)next_dbl(ck, name, &pos);
+  Matrix *m;
+  if (nrows <= 0 || ncols <= 0)
+    die("ERROR: bad value for %s in checkpoint file %s.\n", name, ck->fname);
+  m = mat_new(nrows, ncols);
+  for (i = 0; i < nrows; i++)
+    for (j = 0; j < ncols; j++)
+      mat_set(m, i, j, next_dbl(ck, name, &pos));
+  return m;
+}
+
+void ckpt_clear(Checkpoint *ck) {
+  if (ck != NULL) hsh_clear_with_vals(ck->items);
+}
+
+int ckpt_due(Checkpoint *ck) {
+  return ck != NULL && time(NULL) - ck->last_save >= ck->interval;
+}
+
+void ckpt_begin(Checkpoint *ck) {
+  char *tmpname = smalloc((strlen(ck->fname) + 5) * sizeof(char));
+  sprintf(tmpname, "%s.tmp", ck->fname);
+  ck->F = phast_fopen(tmpname, "w");
+  sfree(tmpname);
+  fprintf(ck->F, "# PHAST checkpoint\n");
+  if (ck->fprint != NULL)
+    ckpt_put_str(ck, "FINGERPRINT", ck->fprint);
+}
+
+void ckpt_commit(Checkpoint *ck) {
+  char *tmpname = smalloc((strlen(ck->fname) + 5) * sizeof(char));
+  int err;
+  sprintf(tmpname, "%s.tmp", ck->fname);
+  err = fflush(ck->F) != 0 || ferror(ck->F);
+  phast_fclose(ck->F);
+  ck->F = NULL;
+  if (err || rename(tmpname, ck->fname) != 0)
+    die("ERROR: unable to write checkpoint file %s (%s).\n", ck->fname,
+        strerror(errno));
+  sfree(tmpname);
+  ck->last_save = time(NULL);
+}
+
+void ckpt_put_int(Checkpoint *ck, const char *name, int val) {
+  fprintf(ck->F, "%s: %i\n", name, val);
+}
+
+void ckpt_put_dbl(Checkpoint *ck, const char *name, double val) {
+  fprintf(ck->F, "%s: %.17g\n", name, val);
+}
+
+void ckpt_put_str(Checkpoint *ck, const char *name, const char *val) {
+  fprintf(ck->F, "%s: %s\n", name, val);
+}
+
+void ckpt_put_vector(Checkpoint *ck, const char *name, Vector *v) {
+  int i;
+  fprintf(ck->F, "%s: %i", name, v->size);
+  for (i = 0; i < v->size; i++)
+    fprintf(ck->F, " %.17g", vec_get(v, i));
+  fprintf(ck->F, "\n");
+}
+
+void ckpt_put_matrix(Checkpoint *ck, const char *name, Matrix *m) {
+  int i, j;
+  fprintf(ck->F, "%s: %i %i", name, m->nrows, m->ncols);
+  for (i = 0; i < m->nrows; i++)
+    for (j = 0; j < m->ncols; j++)
+      fprintf(ck->F, " %.17g", mat_get(m, i, j));
+  fprintf(ck->F, "\n");
+}
+
+void ckpt_remove(Checkpoint *ck) {
+  if (ck != NULL) remove(ck->fname);
+}
@@ -225,6 +225,25 @@ void zmat_mult_real_diag(Matrix *A, Zmatrix *B, Zvector *C, Zmatrix *D,
     zmat_free(tmp);
 }
 
+/* two-dimensional FFT, computed as one-dimensional transforms of the
+   rows followed by one-dimensional transforms of the columns */
+void zmat_fft(Zmatrix *m, int inverse) {
+  int i, j;
+  Zvector row, *col = zvec_new(m->nrows);
+
+  row.size = m->ncols;
+  for (i = 0; i < m->nrows; i++) {
+    row.data = m->data[i];      /* transform rows in place */
+    zvec_fft(&row, inverse);
+  }
+  for (j = 0; j < m->ncols; j++) {
+    for (i = 0; i < m->nrows; i++) col->data[i] = m->data[i][j];
+    zvec_fft(col, inverse);
+    for (i = 0; i < m->nrows; i++) m->data[i][j] = col->data[i];
+  }
+  zvec_free(col);
+}
+
 /* "cast" complex matrix as real, by extracting real component of each
    element.  If strict == TRUE ensure imaginary components are zero
    (or very close)  */
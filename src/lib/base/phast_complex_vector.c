@@ -105,6 +105,55 @@ void zvec_had_prod(Zvector *dest, Zvector *src1, Zvector *src2) {
     dest->data[i] = z_mul(src1->data[i], src2->data[i]);
 }
 
+/* in-place radix-2 FFT; see complex_vector.h */
+void zvec_fft(Zvector *v, int inverse) {
+  int n = v->size, i, j, k, bit, len, half, step;
+  Complex *a = v->data, *w, t, u;
+  double ang;
+
+  if (n < 1 || (n & (n - 1)) != 0)
+    die("ERROR zvec_fft: size (%i) must be a power of 2\n", n);
+  if (n == 1) return;
+
+  /* bit-reversal permutation */
+  for (i = 1, j = 0; i < n; i++) {
+    for (bit = n >> 1; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+  }
+
+  /* twiddle factors, computed directly rather than by recurrence to
+     avoid accumulating rounding error */
+  w = smalloc(n/2 * sizeof(Complex));
+  for (k = 0; k < n/2; k++) {
+    ang = (inverse ? 2 : -2) * M_PI * k / n;
+    w[k] = z_set(cos(ang), sin(ang));
+  }
+
+  /* butterflies */
+  for (len = 2; len <= n; len <<= 1) {
+    half = len >> 1;
+    step = n / len;
+    for (i = 0; i < n; i += len) {
+      for (k = 0; k < half; k++) {
+        u = a[i+k];
+        t = z_mul(w[k*step], a[i+k+half]);
+        a[i+k] = z_add(u, t);
+        a[i+k+half] = z_sub(u, t);
+      }
+    }
+  }
+  sfree(w);
+
+  if (inverse)
+    for (i = 0; i < n; i++)
+      a[i] = z_mul_real(a[i], 1.0/n);
+}
+
 /* "cast" complex vector as real, by extracting real component of each
    element.  If strict == TRUE ensure imaginary components are zero
    (or very close)  */
@@ -464,9 +464,9 @@ void mm_exp_higham(MarkovMatrix *P, MarkovMatrix *Q, double t, int do_mu) {
 /* general version allowing for complex eigenvalues/eigenvectors */
 void mm_exp_complex(MarkovMatrix *P, MarkovMatrix *Q, double t) {
 
-  static Zmatrix *Eexp = NULL; /* reuse these if possible */
-  static Zmatrix *tmp = NULL;
-  static int last_size = 0;
+  static PHAST_TLS Zmatrix *Eexp = NULL; /* reuse these if possible */
+  static PHAST_TLS Zmatrix *tmp = NULL;
+  static PHAST_TLS int last_size = 0;
   int n = Q->size;
   int i, j;
 
@@ -520,8 +520,8 @@ void mm_exp_complex(MarkovMatrix *P, MarkovMatrix *Q, double t) {
 
 /* version that assumes real eigenvalues/eigenvectors */
 void mm_exp_real(MarkovMatrix *P, MarkovMatrix *Q, double t) {
-  static Vector *exp_evals = NULL; /* reuse if possible */
-  static int last_size = -1;
+  static PHAST_TLS Vector *exp_evals = NULL; /* reuse if possible */
+  static PHAST_TLS int last_size = -1;
   int n = Q->size;
   int i;
 
@@ -574,10 +574,12 @@ void mm_exp(MarkovMatrix *dest, MarkovMatrix *src, double t) {
 /* given a state, draw the next state from the multinomial
  * distribution defined by the corresponding row in the matrix */
 int mm_sample_state(MarkovMatrix *M, int state) {
-  Vector *v = mat_get_row(M->matrix, state);
-  int retval = pv_draw_idx(v);
-  vec_free(v);
-  return retval;
+  return mm_sample_state_rng(NULL, M, state);
+}
+
+int mm_sample_state_rng(RngContext *rng, MarkovMatrix *M, int state) {
+  /* draw directly from the row; no need to copy it */
+  return pv_draw_idx_arr_rng(rng, M->matrix->data[state], M->size);
 }
 
 /* as above but by character */
@@ -663,10 +665,10 @@ void mm_diagonalize_real(MarkovMatrix *M) {
 
   /* keep temp storage around -- this function will be called many
      times repeatedly */
-  static Zmatrix *evecs_z = NULL;
-  static Zmatrix *evecs_inv_z = NULL;
-  static Zvector *evals_z = NULL;
-  static int size = -1;
+  static PHAST_TLS Zmatrix *evecs_z = NULL;
+  static PHAST_TLS Zmatrix *evecs_inv_z = NULL;
+  static PHAST_TLS Zvector *evals_z = NULL;
+  static PHAST_TLS int size = -1;
 
   if (evecs_z == NULL || size != M->size) {
     if (evecs_z != NULL) {
@@ -37,6 +37,14 @@ FILE *rphast_stderr=(FILE*)1;
    k >= N (or, more precisely, the number of eligible elements in N),
    then all (eligible) items will be marked as selected.  */
 void choose(int *selections, int N, int k) {
+  /* if RPHAST RNG is seeded externally */
+#ifndef RPHAST
+  srandom((unsigned int)time(NULL));
+#endif
+  choose_rng(NULL, selections, N, k);
+}
+
+void choose_rng(RngContext *rng, int *selections, int N, int k) {
   int i;
   List *eligible = lst_new_int(N);
   for (i = 0; i < N; i++) {
@@ -48,12 +56,8 @@ void choose(int *selections, int N, int k) {
     }
   }
 
-  /* if RPHAST RNG is seeded externally */
-#ifndef RPHAST
-  srandom((unsigned int)time(NULL));
-#endif
   for (i = 0; i < k && lst_size(eligible) > 0; i++) {
-    int randidx = (int)rint(1.0 * (lst_size(eligible)-1) * unif_rand());
+    int randidx = (int)rint(1.0 * (lst_size(eligible)-1) * rng_unif(rng));
     int item = lst_get_int(eligible, randidx);
     selections[item] = 1;
     
@@ -85,17 +89,20 @@ void srandom(int seed)
 /* produce a random permutation of the designated size; 'permutation'
    must be allocated externally  */
 void permute(int *permutation, int N) {
-  int i, element, randidx;
-  List *eligible = lst_new_int(N);
-  for (i = 0; i < N; i++) lst_push_int(eligible, i);
-
   /* if RPHAST RNG is seeded externally */
 #ifndef RPHAST
   srandom((unsigned int)time(NULL));
 #endif
+  permute_rng(NULL, permutation, N);
+}
+
+void permute_rng(RngContext *rng, int *permutation, int N) {
+  int i, element, randidx;
+  List *eligible = lst_new_int(N);
+  for (i = 0; i < N; i++) lst_push_int(eligible, i);
 
   for (i = 0; i < N; i++) {
-    randidx = (int)rint(1.0 * (lst_size(eligible)-1) * unif_rand());
+    randidx = (int)rint(1.0 * (lst_size(eligible)-1) * rng_unif(rng));
     if (!(randidx >= 0 && randidx < lst_size(eligible)))
       die("ERROR permute: randidx=%i, should be in [0, %i)\n",
 	  randidx, lst_size(eligible));
@@ -331,6 +338,23 @@ void set_seed(int seed) {
   } else srandom(seed);
 }
 
+/* storage for the calling thread's random number stream (see
+   set_rand_stream) */
+static PHAST_TLS RngContext rand_stream;
+
+void set_rand_stream(int seed, int stream) {
+  rng_init(&rand_stream, (unsigned int)seed, (unsigned int)stream);
+  rng_set_thread(&rand_stream);
+}
+
+void unset_rand_stream() {
+  rng_set_thread(NULL);
+}
+
+double unif_rand() {
+  return rng_unif(NULL);
+}
+
 #endif
 
 #ifdef RPHAST
@@ -340,6 +364,13 @@ void set_seed(int seed) {
   GetRNGstate();
 }
 
+//streams are not supported in RPHAST mode; R's generator is used
+void set_rand_stream(int seed, int stream) {
+}
+
+void unset_rand_stream() {
+}
+
 
 int rphast_fprintf(FILE *f, const char *format, ...) {
   va_list args;
@@ -504,10 +535,15 @@ double normalize_probs(double *p, int size) {
    max], optionally with antithetics.  Store in 'draws'.  Designed for use with
    real (floating-point) numbers.  Be sure to call srandom externally. */ 
 void unif_draw(int n, double min, double max, double *draws, int antithetics) {
+  unif_draw_rng(NULL, n, min, max, draws, antithetics);
+}
+
+void unif_draw_rng(RngContext *rng, int n, double min, double max,
+                   double *draws, int antithetics) {
   int i;
   double range = max - min;
   for (i = 0; i < n; i++) {
-    draws[i] = min + range * unif_rand();
+    draws[i] = min + range * rng_unif(rng);
     if (antithetics) {
       draws[i+1] = min + (max - draws[i]);
       i++;
@@ -520,12 +556,16 @@ void unif_draw(int n, double min, double max, double *draws, int antithetics) {
    complexity is O(N) -- see Numerical Recipes for a better way
    (rejection sampling) */
 int bn_draw(int N, double p) {
+  return bn_draw_rng(NULL, N, p);
+}
+
+int bn_draw_rng(RngContext *rng, int N, double p) {
   int j, retval = 0;
   double *unif_draws;
   if (N < 1)
     die("ERROR bn_draw: got N=%i\n", N);
   unif_draws = smalloc(N * sizeof(double));
-  unif_draw(N, 0, 1, unif_draws, FALSE);
+  unif_draw_rng(rng, N, 0, 1, unif_draws, FALSE);
                                 /* antithetics can have undesirable
                                    effect; e.g., if p = 0.5, it will
                                    always be true that retval =
@@ -542,12 +582,16 @@ int bn_draw(int N, double p) {
    1/25.  It takes constant expected time.  Be sure to call srandom
    externally. */
 int bn_draw_fast(int n, double pp) {
+  return bn_draw_fast_rng(NULL, n, pp);
+}
+
+int bn_draw_fast_rng(RngContext *rng, int n, double pp) {
   int j;
-  static int nold = -1;
+  static PHAST_TLS int nold = -1;
   double am, em, g, angle, p, bn1, sq, t, y;
-  static double pold = -1, pc, plog, pclog, en, oldg;
+  static PHAST_TLS double pold = -1, pc, plog, pclog, en, oldg;
 
-  if (n < 25) return bn_draw(n, pp);
+  if (n < 25) return bn_draw_rng(rng, n, pp);
 
   p = (pp <= 0.5 ? pp : 1.0 - pp); /* can assume p less than 0.5, and
                                       adjust return value as
@@ -562,7 +606,7 @@ int bn_draw_fast(int n, double pp) {
     g = exp(-am);
     t = 1.0;
     for (j = 0; j <= n; j++) {
-      t *= unif_rand();
+      t *= rng_unif(rng);
       if (t < g) break;
     }
     bn1 = min(j, n);
@@ -583,7 +627,7 @@ int bn_draw_fast(int n, double pp) {
                                    comparison function */
     do {
       do {
-        angle = M_PI * unif_rand();
+        angle = M_PI * rng_unif(rng);
         y = tan(angle);
         em = sq * y + am;
       } 
@@ -593,7 +637,7 @@ int bn_draw_fast(int n, double pp) {
         exp(oldg - lgamma(em+1) - lgamma(en-em+1) + 
             em*plog + (en-em)*pclog);
     } 
-    while (unif_rand() > t);
+    while (rng_unif(rng) > t);
     bn1 = em;
   }
 
@@ -621,6 +665,10 @@ int mn_compare(const void* ptr1, const void* ptr2) {
    'n'.  Probability vector is assumed to be normalized.  Be sure
    to call srandom externally. */
 void mn_draw(int n, double *p, int d, int *counts) {
+  mn_draw_rng(NULL, n, p, d, counts);
+}
+
+void mn_draw_rng(RngContext *rng, int n, double *p, int d, int *counts) {
   int i, nremaining = n;
   double rem_p = 1;
 
@@ -637,7 +685,7 @@ void mn_draw(int n, double *p, int d, int *counts) {
   for (i = 0; i < d-1; i++) {
     if (data[i].p == 0 || nremaining == 0) 
       break;
-    data[i].count = bn_draw_fast(nremaining, data[i].p / rem_p);
+    data[i].count = bn_draw_fast_rng(rng, nremaining, data[i].p / rem_p);
     nremaining -= data[i].count;
     rem_p -= data[i].p;
   }
@@ -653,8 +701,12 @@ void mn_draw(int n, double *p, int d, int *counts) {
 
 /** Given a probability vector, draw an index.  Call srandom externally */
 int draw_index(double *p, int size) {
+  return draw_index_rng(NULL, p, size);
+}
+
+int draw_index_rng(RngContext *rng, double *p, int size) {
   int i;
-  double sum = 0, r = unif_rand();
+  double sum = 0, r = rng_unif(rng);
   
   for (i = 0; i < size; i++) {
     sum += p[i];
@@ -738,7 +790,11 @@ double half_chisq_cdf(double x, double dof, int lower_tail) {
 /* make a draw from an exponential distribution with parameter
    (expected value) 'b' */
 double exp_draw(double b) {
-  return -log(unif_rand()) * b; /* inversion method */
+  return exp_draw_rng(NULL, b);
+}
+
+double exp_draw_rng(RngContext *rng, double b) {
+  return -log(rng_unif(rng)) * b; /* inversion method */
 }
 
 /* make a draw from a gamma distribution with parameters 'a' and
@@ -749,20 +805,24 @@ double exp_draw(double b) {
    Generation" by Luc Devroye, available online at
    http://cgm.cs.mcgill.ca/~luc/rnbookindex.html */
 double gamma_draw(double a, double b) {
+  return gamma_draw_rng(NULL, a, b);
+}
+
+double gamma_draw_rng(RngContext *rng, double a, double b) {
   double retval = -1;
 
   if (a <= 0)
     die("ERROR gamma_draw got a=%f\n", a);
 
-  if (a == 1) return exp_draw(b);
+  if (a == 1) return exp_draw_rng(rng, b);
 
   else if (a > 1) {
     while (retval == -1) {
       double U, V, W, X, Y, Z;
       double d = a - 1, c = 3 * a - 0.75;
 
-      U = unif_rand();  	/* uniform on [0, 1]; used for draw */
-      V = unif_rand();	        /* also uniform on [0, 1]; used for
+      U = rng_unif(rng);  	/* uniform on [0, 1]; used for draw */
+      V = rng_unif(rng);	        /* also uniform on [0, 1]; used for
                                        rejection/acceptance */
       W = U * (1 - U);
       Y = sqrt(c / W) * (U - 0.5); 
@@ -790,8 +850,8 @@ double gamma_draw(double a, double b) {
     double c = 1/a, d = pow(a, a/(1-a)) * (1-a);
     while (retval == -1) {
       double E, Z, X;
-      E = exp_draw(1);
-      Z = exp_draw(1);
+      E = exp_draw_rng(rng, 1);
+      Z = exp_draw_rng(rng, 1);
       X = pow(Z, c);		/* X is Weibull(a) */
       if (Z + E >= d + X)	/* note: wrong in book, correct
                                formula in errata */
@@ -815,8 +875,12 @@ double d_beta(double x, double a, double b) {
 
 /* make a draw from a beta distribution with parameters 'a' and 'b'.  */
 double beta_draw(double a, double b) {
-  double x = gamma_draw(a, 1);
-  double y = gamma_draw(b, 1);
+  return beta_draw_rng(NULL, a, b);
+}
+
+double beta_draw_rng(RngContext *rng, double a, double b) {
+  double x = gamma_draw_rng(rng, a, 1);
+  double y = gamma_draw_rng(rng, b, 1);
   return x / (x + y);
 }
 
@@ -825,9 +889,14 @@ double beta_draw(double a, double b) {
    accomplished by sampling from gamma distributions with parameters
    alpha[0], ..., alpha[k-1] and renormalizing */
 void dirichlet_draw(int k, double *alpha, double *theta) {
+  dirichlet_draw_rng(NULL, k, alpha, theta);
+}
+
+void dirichlet_draw_rng(RngContext *rng, int k, double *alpha,
+                        double *theta) {
   int i;
   for (i = 0; i < k; i++) 
-    theta[i] = gamma_draw(alpha[i], 1);
+    theta[i] = gamma_draw_rng(rng, alpha[i], 1);
   normalize_probs(theta, k);
 }
 
@@ -1134,7 +1203,7 @@ static char **build_iupac_map() {
 
 /* accessor for static mapping */
 char **get_iupac_map() {
-  static char **iupac_map = NULL;
+  static PHAST_TLS char **iupac_map = NULL;
   if (iupac_map == NULL) {
     iupac_map = build_iupac_map();
     set_static_var((void**)(&iupac_map));
@@ -18,6 +18,7 @@
 #include <sys/time.h>
 #include <phast/vector.h>
 #include <phast/external_libs.h>
+#include <phast/stringsplus.h>
 
 /* Numerical optimization of one-dimensional and multi-dimensional functions */
 
@@ -93,6 +94,14 @@
 FILE *debugf = NULL;
 #endif
 
+opt_method_type get_opt_method(const char *method) {
+  if (strcmp(method, "BFGS")==0)
+    return OPT_BFGS;
+  if (strcmp(method, "LBFGS")==0)
+    return OPT_LBFGS;
+  return OPT_UNKNOWN_METHOD;
+}
+
 opt_precision_type get_precision(const char *prec) {
    if (strcmp(prec, "LOW")==0)
      return OPT_LOW_PREC;
@@ -360,6 +369,421 @@ void check_H(Matrix *H, Vector *at_bounds){
 #endif
 
 
+/* State shared by the quasi-Newton optimizers (opt_bfgs and
+   opt_lbfgs), which differ only in how they maintain their
+   approximation of the inverse Hessian and derive a search direction
+   from it.  The line search, the handling of bounds, the gradient
+   computations, and the convergence tests are common to both, and are
+   implemented by the qn_ functions below. */
+typedef struct {
+  double (*f)(Vector*, void*);
+  void *data;
+  void (*compute_grad)(Vector *grad, Vector *params, void *data,
+                       Vector *lb, Vector *ub);
+  Vector *lower_bounds, *upper_bounds;
+  opt_precision_type precision;
+  FILE *logf;
+  Vector *params;               /* current parameters */
+  Vector *params_new;           /* updated params vector */
+  Vector *g;                    /* gradient */
+  Vector *dg;                   /* difference between old and new
+                                   gradients */
+  Vector *xi;                   /* current direction along which to
+                                   minimize; after a line search, the
+                                   difference between the new and old
+                                   parameters */
+  Vector *at_bounds;            /* record of whether each param is at
+                                   a boundary */
+  int params_at_bounds;         /* number of params at a boundary */
+  int nevals;                   /* number of function evaluations */
+  int trunc;                    /* return value of scale_for_bounds */
+  double fval;                  /* current function value */
+  double lambda;                /* step length of last line search */
+  double stpmax;                /* maximum step length */
+  opt_deriv_method deriv_method;
+  struct timeval start_time;
+} QuasiNewton;
+
+/* Allocate the vectors of a QuasiNewton object and initialize its
+   settings */
+static void qn_init(QuasiNewton *qn, double (*f)(Vector*, void*),
+                    Vector *params, void *data, Vector *lower_bounds,
+                    Vector *upper_bounds, FILE *logf,
+                    void (*compute_grad)(Vector *grad, Vector *params,
+                                         void *data, Vector *lb,
+                                         Vector *ub),
+                    opt_precision_type precision) {
+  int n = params->size;
+  qn->f = f;
+  qn->data = data;
+  qn->compute_grad = compute_grad;
+  qn->lower_bounds = lower_bounds;
+  qn->upper_bounds = upper_bounds;
+  qn->precision = precision;
+  qn->logf = logf;
+  qn->params = params;
+  qn->params_new = vec_new(n);
+  qn->g = vec_new(n);
+  qn->dg = vec_new(n);
+  qn->xi = vec_new(n);
+  qn->at_bounds = vec_new(n);
+  qn->params_at_bounds = 0;
+  qn->nevals = 0;
+  qn->trunc = -1;
+  qn->lambda = -1;
+  qn->deriv_method = OPT_DERIV_FORWARD;
+  if (logf != NULL)
+    gettimeofday(&qn->start_time, NULL);
+}
+
+/* Save the state of a BFGS or L-BFGS optimisation at the start of
+   iteration "its" to a checkpoint: the parameters, the search
+   direction and the other state of the QuasiNewton object, and either
+   the inverse Hessian or the L-BFGS history.  For use in opt_bfgs and
+   opt_lbfgs. */
+static void save_checkpoint(Checkpoint *ckpt, int its, QuasiNewton *qn,
+                            int already_failed, Matrix *H, 
+                            LbfgsHistory *h) {
+  ckpt_begin(ckpt);
+  ckpt_put_int(ckpt, "OPT_ITERATION", its);
+  ckpt_put_vector(ckpt, "OPT_PARAMS", qn->params);
+  ckpt_put_vector(ckpt, "OPT_DIRECTION", qn->xi);
+  ckpt_put_vector(ckpt, "OPT_AT_BOUNDS", qn->at_bounds);
+  ckpt_put_int(ckpt, "OPT_DERIV_METHOD", qn->deriv_method);
+  ckpt_put_int(ckpt, "OPT_TRUNC", qn->trunc);
+  ckpt_put_dbl(ckpt, "OPT_LAMBDA", qn->lambda);
+  ckpt_put_dbl(ckpt, "OPT_STPMAX", qn->stpmax);
+  ckpt_put_int(ckpt, "OPT_ALREADY_FAILED", already_failed);
+  if (H != NULL) ckpt_put_matrix(ckpt, "OPT_INV_HESSIAN", H);
+  if (h != NULL) opt_lbfgs_history_save(h, ckpt, "OPT_");
+  ckpt_commit(ckpt);
+}
+
+/* Retrieve a vector of the same size as "dest" from a checkpoint */
+static void restore_vector(Checkpoint *ckpt, const char *name, 
+                           Vector *dest) {
+  Vector *saved = ckpt_get_vector(ckpt, name);
+  if (saved->size != dest->size)
+    die("ERROR: checkpoint item %s has %i elements, expected %i.\n", 
+        name, saved->size, dest->size);
+  vec_copy(dest, saved);
+  vec_free(saved);
+}
+
+/* Restore the state saved by save_checkpoint, if any, and discard the
+   loaded items.  Must be called before qn_start.  Returns the
+   iteration at which to resume (0 if there is nothing to restore).
+   For use in opt_bfgs and opt_lbfgs. */
+static int restore_checkpoint(Checkpoint *ckpt, QuasiNewton *qn,
+                              int *already_failed, Matrix *H, 
+                              LbfgsHistory *h) {
+  int i, its;
+  if (!ckpt_has(ckpt, "OPT_PARAMS")) return 0;
+  restore_vector(ckpt, "OPT_PARAMS", qn->params);
+  restore_vector(ckpt, "OPT_DIRECTION", qn->xi);
+  restore_vector(ckpt, "OPT_AT_BOUNDS", qn->at_bounds);
+  for (i = 0, qn->params_at_bounds = 0; i < qn->at_bounds->size; i++)
+    if (vec_get(qn->at_bounds, i) != OPT_NO_BOUND) qn->params_at_bounds++;
+  qn->deriv_method = ckpt_get_int(ckpt, "OPT_DERIV_METHOD");
+  qn->trunc = ckpt_get_int(ckpt, "OPT_TRUNC");
+  qn->lambda = ckpt_get_dbl(ckpt, "OPT_LAMBDA");
+  qn->stpmax = ckpt_get_dbl(ckpt, "OPT_STPMAX");
+  *already_failed = ckpt_get_int(ckpt, "OPT_ALREADY_FAILED");
+  if (H != NULL) {
+    Matrix *savedH = ckpt_get_matrix(ckpt, "OPT_INV_HESSIAN");
+    if (savedH->nrows != H->nrows || savedH->ncols != H->ncols)
+      die("ERROR: checkpoint has inverse Hessian of wrong dimension.\n");
+    mat_copy(H, savedH);
+    mat_free(savedH);
+  }
+  if (h != NULL) opt_lbfgs_history_restore(h, ckpt, "OPT_");
+  its = ckpt_get_int(ckpt, "OPT_ITERATION");
+  ckpt_clear(ckpt);
+  return its;
+}
+
+/* Compute the gradient at the current parameters, using compute_grad
+   if available and numerical derivatives otherwise */
+static void qn_gradient(QuasiNewton *qn) {
+  if (qn->compute_grad != NULL) {
+    qn->compute_grad(qn->g, qn->params, qn->data, qn->lower_bounds,
+                     qn->upper_bounds);
+    qn->nevals++;               /* here assume equiv of one function
+                                   eval -- not necessarily accurate,
+                                   but prob. okay approx. */
+  }
+  else {
+    opt_gradient(qn->g, qn->f, qn->params, qn->data, qn->deriv_method,
+                 qn->fval, qn->lower_bounds, qn->upper_bounds,
+                 DERIV_EPSILON);
+    qn->nevals += (qn->deriv_method == OPT_DERIV_CENTRAL ? 2 : 1) *
+      qn->params->size;
+  }
+}
+
+/* Calculate the starting function value and gradient, record which
+   parameters are at a boundary, and write the header of the log.  If
+   "resumed" is TRUE, the record of bounds and the maximum step length
+   have been restored from a checkpoint and are left as they are */
+static void qn_start(QuasiNewton *qn, int resumed) {
+  qn->fval = qn->f(qn->params, qn->data);
+  qn->nevals++;
+  qn_gradient(qn);
+
+  /* test bounds of each parameter and set "at_bounds" appropriately */
+  if (!resumed)
+    qn->params_at_bounds = test_bounds(qn->params, NULL, qn->lower_bounds,
+                                       qn->upper_bounds, qn->at_bounds, 0);
+
+  /* TODO: report an error if starting parameter actually *out* of bounds */
+
+  if (qn->logf != NULL) {
+    opt_log(qn->logf, 1, 0, qn->params, qn->g, -1, -1);
+    opt_log(qn->logf, 0, qn->fval, qn->params, qn->g, -1, -1);
+  }
+
+  if (!resumed)
+    qn->stpmax = STEP_SCALE * max(vec_norm(qn->params), qn->params->size);
+}
+
+/* Minimize along the current direction xi, moving the parameters to
+   the new point.  On return, xi holds the difference between the new
+   and old parameters.  Returns TRUE if convergence is detected on
+   the basis of the step or the change in the function value */
+static int qn_line_search(QuasiNewton *qn, double *retval) {
+  int i, check, minsf, n = qn->params->size;
+  double test, temp, fval_old;
+
+  /* see if any parameters are (newly) at a boundary, and update
+     total number at boundary */
+  /* FIXME: should this be here? */
+  vec_scale(qn->xi, -1);   /* temporary hack: test_bounds expects a
+                              gradient-like vector */
+  if ((i = test_bounds(qn->params, qn->xi, qn->lower_bounds,
+                       qn->upper_bounds, qn->at_bounds, 1)) > 0) {
+    qn->params_at_bounds += i;
+    project_vector(qn->xi, qn->at_bounds);
+  }
+  vec_scale(qn->xi, -1);
+
+#ifdef DEBUG
+  fprintf(debugf, "Parameters at a boundary (prior to linesearch): ");
+  if (qn->params_at_bounds == 0) fprintf(debugf, "None\n\n");
+  else {
+    for (i = 0; i < n; i++)
+      if (vec_get(qn->at_bounds, i) != OPT_NO_BOUND)
+        fprintf(debugf, "%d ", i);
+    fprintf(debugf, "\n\n");
+  }
+#endif
+
+  /* scale the direction vector such that the update will send no
+     parameter out of bounds */
+  qn->trunc = scale_for_bounds(qn->xi, qn->params, qn->lower_bounds,
+                               qn->upper_bounds);
+
+  /* minimize along xi */
+  opt_lnsrch(qn->params, qn->fval, qn->g, qn->xi, qn->params_new, retval,
+             qn->stpmax, &check, qn->f, qn->data, &qn->nevals,
+             &qn->lambda, qn->logf);
+  /* function is evaluated in opt_lnsrch, value is returned in
+     retval.  We'll ignore the value of "check" here (see Press, et
+     al.) */
+  fval_old = qn->fval;
+  qn->fval = *retval;
+
+  /* update line direction and current version of params */
+  vec_copy(qn->xi, qn->params_new);
+  vec_minus_eq(qn->xi, qn->params);
+  minsf = opt_min_sigfig(qn->params, qn->params_new);  
+                                /* first grab min stable sig figs */
+  vec_copy(qn->params, qn->params_new);
+
+#ifdef DEBUG
+  /* verify xi has correct dimensionality */
+  for (i = 0; i < n; i++)
+    if (!(vec_get(qn->at_bounds, i) == OPT_NO_BOUND ||
+          vec_get(qn->xi, i) == 0))
+      die("ERROR: qn_line_search: DEBUG error\n");
+#endif
+
+  /* test for convergence. "test" will be set to max_i
+     abs(xi_i/max(abs(params_i, 1))) -- an adjusted version of the
+     largest absolute value in xi (adjusted for large vals in
+     params).  Convergence is taken to have occurred if "test" is
+     smaller than the threshold TOLX */
+  /* NOTE: here "xi" is the difference between the old and new
+     parameter vectors */
+  test = 0;                   
+  for (i = 0; i < n; i++) {
+    temp = fabs(vec_get(qn->xi, i))/
+      max(fabs(vec_get(qn->params, i)), 1.0);
+    if (temp > test) test = temp;
+  }
+  if (test <= TOLX(qn->precision)) {
+    if (qn->logf != NULL) 
+      fprintf(qn->logf, "Convergence via TOLX (%e <= %e)\n",
+              test, TOLX(qn->precision));
+    return TRUE;
+  }
+
+  /* alternative tests for convergence */
+  /* FIXME: also test for radical truncation due to bounds? */
+  if (qn->lambda > LAMBDA_THRESHOLD && 
+      minsf >= SIGFIG(qn->precision)) {
+    if (qn->logf != NULL) 
+      fprintf(qn->logf, "Convergence via sigfigs (%d)\n", minsf);
+    return TRUE;
+  }
+
+  if (qn->lambda > LAMBDA_THRESHOLD && 
+      fabs((fval_old - qn->fval) / qn->fval) <= DELTA_FUNC(qn->precision)) {
+    if (qn->logf != NULL) fprintf(qn->logf, "Convergence via delta func\n");
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Obtain the gradient at the new parameters, saving the difference
+   from the old gradient in dg.  Returns TRUE if convergence is
+   detected because the gradient is (nearly) zero */
+static int qn_new_gradient(QuasiNewton *qn, double *retval) {
+  int i, n = qn->params->size;
+  double test, temp, den;
+
+  /* first update the method for derivatives, if necessary */
+  if (qn->deriv_method == OPT_DERIV_FORWARD && qn->trunc == -1 && 
+      qn->lambda == 1)
+    qn->deriv_method = OPT_DERIV_CENTRAL; 
+                                /* this heuristic seems pretty good:
+                                   if we're taking complete Newton
+                                   steps, then we're getting close to
+                                   the minimum, so we'll start to
+                                   obtain more precise (but expensive)
+                                   gradient estimates */
+  else if (qn->deriv_method == OPT_DERIV_CENTRAL && 
+           (qn->trunc != -1 || qn->lambda < 1))
+    qn->deriv_method = OPT_DERIV_FORWARD;
+                                /* we also need to be able to switch
+                                   back, in case we have a lucky
+                                   step early in the search */
+  vec_copy(qn->dg, qn->g);
+  qn_gradient(qn);
+
+  if (qn->logf != NULL) 
+    opt_log(qn->logf, 0, qn->fval, qn->params, qn->g, qn->trunc, 
+            qn->lambda);
+
+#ifdef DEBUG
+  opt_log(debugf, 1, 0, qn->params, qn->g, -1, -1);
+  opt_log(debugf, 0, qn->fval, qn->params, qn->g, qn->trunc, qn->lambda);
+#endif
+
+  /* test for convergence via zero gradient.  here "test" is an
+     adjusted version of the largest absolute value in g (the
+     gradient) */
+  test = 0;                 
+  den = max(*retval, 1.0);
+  for (i = 0; i < n; i++) {
+    temp = fabs(vec_get(qn->g, i)) * 
+      max(fabs(vec_get(qn->params, i)), 1.0) / den;
+    if (temp > test) test = temp;
+  }
+  if (test <= GTOL(qn->precision)) {
+    if (qn->logf != NULL) 
+      fprintf(qn->logf, "Convergence via gradiant tolerance (%e < %e)\n", 
+              test, GTOL(qn->precision));
+    return TRUE;
+  }
+
+  /* compute difference of gradients */
+  vec_scale(qn->dg, -1);
+  vec_plus_eq(qn->dg, qn->g);    
+  return FALSE;
+}
+
+/* Update the record of parameters at a boundary given the new
+   gradient, and release the parameter at a boundary whose gradient
+   most strongly suggests a move into the permitted region, if any.
+   If "proj" is non-NULL, it is projected according to any newly
+   bounded parameters.  Returns the index of the released parameter,
+   or -1 if none */
+static int qn_update_bounds(QuasiNewton *qn, Vector *proj) {
+  int i, new_at_bounds;
+  if ((new_at_bounds = test_bounds(qn->params, qn->g, qn->lower_bounds, 
+                                   qn->upper_bounds, qn->at_bounds, 1)) > 0) {
+    qn->params_at_bounds += new_at_bounds;
+    if (proj != NULL) project_vector(proj, qn->at_bounds); 
+  }
+
+  /* see about relaxing some constraints */
+  if (qn->params_at_bounds > 0) {
+    double max_grad = 0;        /* maximum gradient component in the
+                                   "right" direction, for parameters
+                                   at the boundary (i.e., suggesting a
+                                   move into the permitted region of
+                                   the parameter space) */
+    int max_idx = 0;            /* corresponding index */
+    for (i = 0; i < qn->at_bounds->size; i++) {
+      if (vec_get(qn->at_bounds, i) == OPT_LOWER_BOUND && 
+          -1 * vec_get(qn->g, i) > max_grad) {
+        max_idx = i; 
+        max_grad = -1 * vec_get(qn->g, i);
+      }
+      else if (vec_get(qn->at_bounds, i) == OPT_UPPER_BOUND && 
+               vec_get(qn->g, i) > max_grad) {
+        max_idx = i; 
+        max_grad = vec_get(qn->g, i);
+      }            
+    }
+    /* enlarge in the dimension of max_grad, if its value is
+       sufficiently large */
+    if (max_grad > 0) {         /* FIXME: zero? */
+#ifdef DEBUG
+      fprintf(debugf, "\nParameter %d now free; will be included in update.\n", max_idx);
+#endif
+      vec_set(qn->at_bounds, max_idx, OPT_NO_BOUND); 
+      qn->params_at_bounds--;
+      return max_idx;
+    }
+  }
+  return -1;
+}
+
+/* Write the summary of the optimization to the log, free the vectors
+   of a QuasiNewton object, and report the number of function
+   evaluations.  Returns the value to be returned by the optimizer */
+static int qn_finish(QuasiNewton *qn, int its, int success, 
+                     const char *name, int *num_evals) {
+  if (qn->logf != NULL) {
+    struct timeval end_time;
+    opt_log(qn->logf, 0, qn->fval, qn->params, qn->g, qn->trunc, 
+            qn->lambda);        /* final versions */
+    gettimeofday(&end_time, NULL);
+    fprintf(qn->logf, "\nNumber of iterations: %d\nNumber of function evaluations: %d\nTotal time: %.4f sec.\n", 
+            its, qn->nevals, end_time.tv_sec - qn->start_time.tv_sec + 
+            (end_time.tv_usec - qn->start_time.tv_usec)/1.0e6);
+  }
+
+  vec_free(qn->params_new);
+  vec_free(qn->g);
+  vec_free(qn->dg);
+  vec_free(qn->xi);
+  vec_free(qn->at_bounds);
+  if (num_evals != NULL)
+    *num_evals = qn->nevals;
+
+  if (success == 0) {
+    if (qn->logf != NULL)
+      fprintf(qn->logf, 
+              "WARNING: exceeded maximum number of iterations in %s.\n", 
+              name);
+    return 1;
+  }
+  return 0;
+}
+
 /* Find a minimum of the specified function with the "quasi-Newton"
    Broyden-Fletcher-Goldfarb-Shanno (BFGS) algorithm starting at the
    specified parameter values.  The implementation here is loosely
@@ -381,7 +805,14 @@ void check_H(Matrix *H, Vector *at_bounds){
    parameters at the boundary are fixed, the reduction in dimension is
    simulated by zeroing out certain rows and columns of matrices and
    elements of vectors.  This strategy avoids some complexity in
-   coding.  */
+   coding.  
+
+   If "ckpt" is non-NULL, the parameters, search direction, inverse
+   Hessian, and iteration count (with the rest of the optimizer's
+   state) are saved to it at the start of an iteration whenever a
+   checkpoint is due, and any such state loaded from a checkpoint file
+   is restored on entry, so that an interrupted optimisation resumes
+   exactly where it left off.  */
 
 /* NOTE: added optional gradient function, to be used instead of
    opt_gradient if non-NULL */
@@ -391,287 +822,85 @@ int opt_bfgs(double (*f)(Vector*, void*), Vector *params,
              void (*compute_grad)(Vector *grad, Vector *params,
                                   void *data, Vector *lb, Vector *ub),
              opt_precision_type precision, Matrix *inv_Hessian,
-	     int *num_evals) {
+             Checkpoint *ckpt, int *num_evals) {
   
-  int check, i, its, n = params->size, success = 0, nevals = 0, 
-    params_at_bounds = 0, new_at_bounds, //changed_dimension = 0,
-    trunc, already_failed = 0, minsf;
-  double den, fac, fae, fval, stpmax, temp, test, lambda, fval_old,
-    deriv_epsilon = DERIV_EPSILON;
-  Vector *dg, *g, *hdg, *params_new, *xi, *at_bounds;
+  int its, n = params->size, success = 0, already_failed = 0, 
+    start_its, released;
+  double fac, fae;
+  Vector *hdg, *xi, *dg;
   Matrix *H, *first_frac, *sec_frac, *bfgs_term;
-  opt_deriv_method deriv_method = OPT_DERIV_FORWARD;
-  struct timeval start_time, end_time;
+  QuasiNewton qn;
 
   if (precision == OPT_UNKNOWN_PREC)
     die("unknown precision in opt_bfgs");
 
-  if (logf != NULL)
-    gettimeofday(&start_time, NULL);
-
-  g = vec_new(n);      /* gradient */
-  xi = vec_new(n);     /* current direction along which to minimize */
+  qn_init(&qn, f, params, data, lower_bounds, upper_bounds, logf, 
+          compute_grad, precision);
+  xi = qn.xi;
+  dg = qn.dg;
   H = inv_Hessian != NULL ? inv_Hessian : mat_new(n, n);   
                                 /* inverse Hessian */
-  dg = vec_new(n);     /* difference between old and new gradients */
   hdg = vec_new(n);    /* H * dg */
-  params_new = vec_new(n); /* updated params vector */
-  at_bounds = vec_new(n); /* record of whether each param is
-                                      at a boundary */
   /* remainder are auxiliary matrices used in update of inverse
      Hessian */  
   first_frac = mat_new(n, n);
   sec_frac = mat_new(n, n);
   bfgs_term = mat_new(n, n);
 
+  /* resume from a checkpoint, if available */
+  start_its = restore_checkpoint(ckpt, &qn, &already_failed, H, NULL);
+
 #ifdef DEBUG
   debugf = fopen_name("opt.debug", "w+");
 #endif
 
-  fval = f(params, data);       /* Calculate starting function value
-                                   and gradient, */
-
-  nevals++;
-
-  if (compute_grad != NULL) {
-    compute_grad(g, params, data, lower_bounds, upper_bounds);
-    nevals++;                   /* here assume equiv of one function
-                                   eval -- not necessarily accurate,
-                                   but prob. okay approx. */
-  }
-  else {
-    opt_gradient(g, f, params, data, deriv_method, fval, lower_bounds, 
-                 upper_bounds, deriv_epsilon);
-    nevals += (deriv_method == OPT_DERIV_CENTRAL ? 2 : 1)*params->size;
-  }
-
-  /* test bounds of each parameter and set "at_bounds" appropriately */
-  params_at_bounds = 
-    test_bounds(params, NULL, lower_bounds, upper_bounds, at_bounds, 0);
-
-  /* TODO: report an error if starting parameter actually *out* of bounds */
-
-  /* if appropriate, print header and initial line to log file */
-  if (logf != NULL) {
-    opt_log(logf, 1, 0, params, g, -1, -1);
-    opt_log(logf, 0, fval, params, g, -1, -1);
-  }
+  qn_start(&qn, start_its > 0);
 
   /* initialize inv Hessian and direction */
-  if (inv_Hessian == NULL) mat_set_identity(H);
-  vec_copy(xi, g);
-  vec_scale(xi, -1);
+  if (start_its == 0) {
+    if (inv_Hessian == NULL) mat_set_identity(H);
+    vec_copy(xi, qn.g);
+    vec_scale(xi, -1);
 
-  /* if there are parameters at boundaries, reduce the dimensionality
-     of xi accordingly */
-  if (params_at_bounds) {
-    project_vector(xi, at_bounds);
-    //    changed_dimension = 1;
+    /* if there are parameters at boundaries, reduce the dimensionality
+       of xi accordingly */
+    if (qn.params_at_bounds) 
+      project_vector(xi, qn.at_bounds);
   }
-/*   for (i = 0; i < at_bounds->size; i++)  */
-/*     vec_set(at_bounds, i, OPT_NO_BOUND); */
-
-  stpmax = STEP_SCALE * max(vec_norm(params), n);
 
-  for (its = 0; its < ITMAX; its++) { /* main loop */
+  for (its = start_its; its < ITMAX; its++) { /* main loop */
     checkInterrupt();
 
-    /* see if any parameters are (newly) at a boundary, and update
-       total number at boundary */
-    /* FIXME: should this be here? */
-    vec_scale(xi, -1);   /* temporary hack */
-    if ((new_at_bounds = test_bounds(params, xi, lower_bounds, upper_bounds, 
-                                     at_bounds, 1)) > 0) {
-      params_at_bounds += new_at_bounds;
-      project_vector(xi, at_bounds); 
-      //      changed_dimension = 1;
-    }
-    vec_scale(xi, -1);
-
-#ifdef DEBUG
-    fprintf(debugf, "BFGS, iteration %d\nParameters at a boundary (prior to linesearch): ", its) ;
-    if (params_at_bounds == 0) fprintf(debugf, "None\n\n");
-    else {
-      for (i = 0; i < at_bounds->size; i++)
-        if (vec_get(at_bounds, i) != OPT_NO_BOUND)
-          fprintf(debugf, "%d ", i);
-      fprintf(debugf, "\n\n");
-    }
-#endif
-
-    /* scale the direction vector such that the update will send no
-       parameter out of bounds */
-    trunc = scale_for_bounds(xi, params, lower_bounds, upper_bounds); 
-
-    /* minimize along xi */
-    opt_lnsrch(params, fval, g, xi, params_new, retval, stpmax, &check, 
-               f, data, &nevals, &lambda, logf); 
-    /* function is evaluated in opt_lnsrch, value is returned in
-       retval.  We'll ignore the value of "check" here (see Press, et
-       al.) */
-    fval_old = fval;
-    fval = *retval;
-
-    /* update line direction and current version of params */
-    vec_copy(xi, params_new);
-    vec_minus_eq(xi, params);
-    minsf = opt_min_sigfig(params, params_new);  /* first grab min
-                                                    stable sig figs */
-    vec_copy(params, params_new);
+    if (ckpt_due(ckpt))
+      save_checkpoint(ckpt, its, &qn, already_failed, H, NULL);
 
 #ifdef DEBUG
-    /* verify xi has correct dimensionality */
-    for (i = 0; i < params->size; i++)
-      if (!(vec_get(at_bounds, i) == OPT_NO_BOUND ||
-	    vec_get(xi, i) == 0))
-	die("ERROR: opt_bfgs: DEBUG error\n");
+    fprintf(debugf, "BFGS, iteration %d\n", its);
 #endif
 
-    /* test for convergence. "test" will be set to max_i
-       abs(xi_i/max(abs(params_i, 1))) -- an adjusted version of the
-       largest absolute value in xi (adjusted for large vals in
-       params).  Convergence is taken to have occurred if "test" is
-       smaller than the threshold TOLX */
-    /* NOTE: here "xi" is the difference between the old and new
-       parameter vectors */
-    test = 0;                   
-    for (i = 0; i < n; i++) {
-      temp = fabs(vec_get(xi, i))/
-        max(fabs(vec_get(params, i)), 1.0);
-      if (temp > test) test = temp;
-    }
-    if (test <= TOLX(precision)) {
-      if (logf != NULL) fprintf(logf, "Convergence via TOLX (%e <= %e)\n",
-				test, TOLX(precision));
-      success = 1;
-      break;
-    }
-
-    /* alternative tests for convergence */
-    /* FIXME: also test for radical truncation due to bounds? */
-    if (lambda > LAMBDA_THRESHOLD && 
-        minsf >= SIGFIG(precision)) {
-      if (logf != NULL) fprintf(logf, "Convergence via sigfigs (%d)\n", minsf);
-      success = 1;
-      break;
-    }
-
-    if (lambda > LAMBDA_THRESHOLD && 
-        fabs((fval_old - fval) / fval) <= DELTA_FUNC(precision)) {
-      if (logf != NULL) fprintf(logf, "Convergence via delta func\n");
+    /* minimize along xi and test for convergence */
+    if (qn_line_search(&qn, retval)) {
       success = 1;
       break;
     }
 
     /* save the old gradient and obtain the new gradient */
-    /* first update the method for derivatives, if necessary */
-    if (deriv_method == OPT_DERIV_FORWARD && trunc == -1 && lambda == 1)
-      deriv_method = OPT_DERIV_CENTRAL; 
-                                /* this heuristic seems pretty good:
-                                   if we're taking complete Newton
-                                   steps, then we're getting close to
-                                   the minimum, so we'll start to
-                                   obtain more precise (but expensive)
-                                   gradient estimates */
-    else if (deriv_method == OPT_DERIV_CENTRAL && (trunc != -1 || 
-                                                   lambda < 1))
-      deriv_method = OPT_DERIV_FORWARD;
-                                /* we also need to be able to switch
-                                   back, in case we have a lucky
-                                   step early in the search */
-    vec_copy(dg, g);
-    if (compute_grad != NULL) {
-      compute_grad(g, params, data, lower_bounds, upper_bounds);
-      nevals++;
-    }
-    else {
-      opt_gradient(g, f, params, data, deriv_method, fval, lower_bounds, 
-                   upper_bounds, deriv_epsilon);
-      nevals += (deriv_method == OPT_DERIV_CENTRAL ? 2 : 1)*params->size;
-    }
-
-    if (logf != NULL) 
-      opt_log(logf, 0, fval, params, g, trunc, lambda);
-
-#ifdef DEBUG
-    opt_log(debugf, 1, 0, params, g, -1, -1);
-    opt_log(debugf, 0, fval, params, g, trunc, lambda);
-#endif
-
-    /* test for convergence via zero gradient.  here "test" is an
-       adjusted version of the largest absolute value in g (the
-       gradient) */
-    test = 0;                 
-    den = max(*retval, 1.0);
-    for (i = 0; i < n; i++) {
-      temp = fabs(vec_get(g, i)) * 
-        max(fabs(vec_get(params, i)), 1.0) / den;
-      if (temp > test) test = temp;
-    }
-    if (test <= GTOL(precision)) {
-      if (logf != NULL) fprintf(logf, "Convergence via gradiant tolerance (%e < %e)\n", test, GTOL(precision));
+    if (qn_new_gradient(&qn, retval)) {
       success = 1;
       break;
     }
 
-    /* compute difference of gradients */
-    vec_scale(dg, -1);
-    vec_plus_eq(dg, g);    
-
-    /* see if any parameters are (newly) at a boundary, and update
-       total number at boundary */
-    if ((new_at_bounds = test_bounds(params, g, lower_bounds, upper_bounds, 
-                                     at_bounds, 1)) > 0) {
-      params_at_bounds += new_at_bounds;
-      project_vector(xi, at_bounds); 
-      //      changed_dimension = 1;
-    }
+    /* see if any parameters are (newly) at a boundary, and see about
+       relaxing some constraints (enlarging H) */
+    if ((released = qn_update_bounds(&qn, xi)) >= 0)
+      mat_set(H, released, released, 1);
 
-    /* see about relaxing some constraints (enlarging H) */
-    if (params_at_bounds > 0) {
-      double max_grad = 0;      /* maximum gradient component in the
-                                   "right" direction, for parameters
-                                   at the boundary (i.e., suggesting a
-                                   move into the permitted region of
-                                   the parameter space) */
-      int max_idx=0;              /* corresponding index */
-      for (i = 0; i < at_bounds->size; i++) {
-        if (vec_get(at_bounds, i) == OPT_LOWER_BOUND && 
-            -1 * vec_get(g, i) > max_grad) {
-          /*             vec_get(xi, i) > max_grad) { */
-          max_idx = i; 
-          max_grad = -1 * vec_get(g, i);
-          /*           max_grad = vec_get(xi, i); */
-        }
-        else if (vec_get(at_bounds, i) == OPT_UPPER_BOUND && 
-                 vec_get(g, i) > max_grad) {
-          /*                  -1 * vec_get(xi, i) > max_grad) { */
-          max_idx = i; 
-          max_grad = vec_get(g, i);
-          /*           max_grad = -1 * vec_get(xi, i); */
-        }            
-      }
-      /* enlarge in the dimension of max_grad, if its value is
-         sufficiently large */
-      if (max_grad > 0) {       /* FIXME: zero? */
-#ifdef DEBUG
-        fprintf(debugf, "\nParameter %d now free; will be included in update.\n", max_idx);
-#endif
-        mat_set(H, max_idx, max_idx, 1);
-        vec_set(at_bounds, max_idx, OPT_NO_BOUND); 
-        params_at_bounds--;
-	//        changed_dimension = 1;
-      }
-    }
-
-    /* FIXME: make this more efficient, once working! */
-    /*     if (changed_dimension) { */
-    if (params_at_bounds > 0) {
+    if (qn.params_at_bounds > 0) {
       /* project H, dg, and xi, according to new representation of
          bounds */
-      project_matrix(H, at_bounds);
-      project_vector(dg, at_bounds);
-      project_vector(xi, at_bounds); /* necessary? */
+      project_matrix(H, qn.at_bounds);
+      project_vector(dg, qn.at_bounds);
+      project_vector(xi, qn.at_bounds); /* necessary? */
 #ifdef DEBUG
       fprintf(debugf, "Dimensionality changed and params at bounds; re-projecting H, dg, and xi.\n");
 #endif
@@ -680,8 +909,6 @@ int opt_bfgs(double (*f)(Vector*, void*), Vector *params,
        are no params currently at the bounds, then we need not do
        anything (H already taken care of, dg and xi can remain as
        they are).  */
-    //    changed_dimension = 0;
-    /*     } */
 
     /* compute product of current inv Hessian and difference in
        gradients.  NOTE: if one or more parameters are at a boundary,
@@ -694,7 +921,7 @@ int opt_bfgs(double (*f)(Vector*, void*), Vector *params,
     fprintf(debugf, "H:\n");
     mat_print(debugf, H);
     fprintf(debugf, "g:\n");
-    vec_fprintf(debugf, g, "%f");
+    vec_fprintf(debugf, qn.g, "%f");
     fprintf(debugf, "xi:\n");
     vec_fprintf(debugf, xi, "%f");
     fprintf(debugf, "dg:\n");
@@ -744,28 +971,22 @@ int opt_bfgs(double (*f)(Vector*, void*), Vector *params,
       mat_plus_eq(H, first_frac);
       mat_plus_eq(H, sec_frac);
       mat_plus_eq(H, bfgs_term);
-
-#ifdef DEBUG
-/*       check_H(H, at_bounds); */
-#endif
     }
     else {
       if (logf != NULL) fprintf(logf, "WARNING: resetting H!\n");
       mat_set_identity(H);
-      project_matrix(H, at_bounds);
+      project_matrix(H, qn.at_bounds);
     }
 
-
     /* finally, update the direction vector */
-    mat_vec_mult(xi, H, g);
+    mat_vec_mult(xi, H, qn.g);
     vec_scale(xi, -1);
 
-
     /* make sure direction of xi is okay; if not, reset H to identity;
        on second failure of this type, assume convergence */
-    if (vec_inner_prod(g, xi) >= 0) {
+    if (vec_inner_prod(qn.g, xi) >= 0) {
       if (already_failed) {
-	if (logf != NULL) fprintf(logf, "Convergence via inner product (%e) >= 0\n", vec_inner_prod(g, xi));
+	if (logf != NULL) fprintf(logf, "Convergence via inner product (%e) >= 0\n", vec_inner_prod(qn.g, xi));
         success = 1; 
         break;
       }
@@ -773,43 +994,285 @@ int opt_bfgs(double (*f)(Vector*, void*), Vector *params,
         if (logf != NULL) fprintf(logf, "WARNING: resetting H! (%s time)\n", 
                 already_failed ? "2nd" : "1st");
         mat_set_identity(H);
-        project_matrix(H, at_bounds);
-        mat_vec_mult(xi, H, g);
+        project_matrix(H, qn.at_bounds);
+        mat_vec_mult(xi, H, qn.g);
         vec_scale(xi, -1);
         already_failed = 1;
       }
     }
   }
 
-  if (logf != NULL) {
-    opt_log(logf, 0, fval, params, g, trunc, lambda); /* final versions */
-    gettimeofday(&end_time, NULL);
-    fprintf(logf, "\nNumber of iterations: %d\nNumber of function evaluations: %d\nTotal time: %.4f sec.\n", 
-            its, nevals, end_time.tv_sec - start_time.tv_sec + 
-            (end_time.tv_usec - start_time.tv_usec)/1.0e6);
-  }
-
-  vec_free(dg);
-  vec_free(g);
   vec_free(hdg);
-  vec_free(params_new);
-  vec_free(xi);
-  vec_free(at_bounds);
   if (inv_Hessian == NULL) mat_free(H);
   mat_free(first_frac);
   mat_free(sec_frac);
   mat_free(bfgs_term);
-  if (num_evals != NULL)
-    *num_evals = nevals;
+  return qn_finish(&qn, its, success, "opt_bfgs", num_evals);
+}
 
-  if (success == 0) {
-    if (logf != NULL)
-      fprintf(logf, 
-              "WARNING: exceeded maximum number of iterations in opt_bfgs.\n");
-    return 1;
+/* Inner product of two vectors restricted to the parameters not at a
+   boundary.  For use in opt_lbfgs. */
+static PHAST_INLINE
+double free_inner_prod(Vector *a, Vector *b, Vector *at_bounds) {
+  int i;
+  double retval = 0;
+  for (i = 0; i < a->size; i++)
+    if (vec_get(at_bounds, i) == OPT_NO_BOUND)
+      retval += vec_get(a, i) * vec_get(b, i);
+  return retval;
+}
+
+LbfgsHistory *opt_lbfgs_history_new(int n, int m) {
+  LbfgsHistory *h = smalloc(sizeof(LbfgsHistory));
+  int i;
+  if (m <= 0) m = OPT_LBFGS_M;
+  if (m > n) m = n;
+  h->n = n;
+  h->m = m;
+  h->oldest = h->npairs = 0;
+  h->s = smalloc(m * sizeof(Vector*));
+  h->y = smalloc(m * sizeof(Vector*));
+  for (i = 0; i < m; i++) {
+    h->s[i] = vec_new(n);
+    h->y[i] = vec_new(n);
   }
-  
-  return 0;    
+  h->rho = smalloc(m * sizeof(double));
+  h->alpha = smalloc(m * sizeof(double));
+  return h;
+}
+
+void opt_lbfgs_history_free(LbfgsHistory *h) {
+  int i;
+  for (i = 0; i < h->m; i++) {
+    vec_free(h->s[i]);
+    vec_free(h->y[i]);
+  }
+  sfree(h->s);
+  sfree(h->y);
+  sfree(h->rho);
+  sfree(h->alpha);
+  sfree(h);
+}
+
+/* Add a correction pair to the history, overwriting the oldest one if
+   the history is full */
+static void lbfgs_push(LbfgsHistory *h, Vector *s, Vector *y) {
+  int newest;
+  if (h->npairs < h->m) newest = (h->oldest + h->npairs++) % h->m;
+  else {
+    newest = h->oldest;
+    h->oldest = (h->oldest + 1) % h->m;
+  }
+  vec_copy(h->s[newest], s);
+  vec_copy(h->y[newest], y);
+}
+
+void opt_lbfgs_history_save(LbfgsHistory *h, Checkpoint *ckpt, 
+                            const char *prefix) {
+  char name[STR_MED_LEN];
+  int j;
+  sprintf(name, "%sLBFGS_NPAIRS", prefix);
+  ckpt_put_int(ckpt, name, h->npairs);
+  for (j = 0; j < h->npairs; j++) {   /* oldest first */
+    int k = (h->oldest + j) % h->m;
+    sprintf(name, "%sLBFGS_S%d", prefix, j);
+    ckpt_put_vector(ckpt, name, h->s[k]);
+    sprintf(name, "%sLBFGS_Y%d", prefix, j);
+    ckpt_put_vector(ckpt, name, h->y[k]);
+  }
+}
+
+void opt_lbfgs_history_restore(LbfgsHistory *h, Checkpoint *ckpt, 
+                               const char *prefix) {
+  char name[STR_MED_LEN];
+  int j, npairs;
+  sprintf(name, "%sLBFGS_NPAIRS", prefix);
+  if (!ckpt_has(ckpt, name)) return;
+  npairs = ckpt_get_int(ckpt, name);
+  h->npairs = h->oldest = 0;
+  for (j = 0; j < npairs; j++) {
+    Vector *s, *y;
+    sprintf(name, "%sLBFGS_S%d", prefix, j);
+    s = ckpt_get_vector(ckpt, name);
+    sprintf(name, "%sLBFGS_Y%d", prefix, j);
+    y = ckpt_get_vector(ckpt, name);
+    if (s->size != h->n || y->size != h->n)
+      die("ERROR: checkpoint has L-BFGS history of wrong dimension.\n");
+    lbfgs_push(h, s, y);      /* keeps the most recent h->m pairs */
+    vec_free(s);
+    vec_free(y);
+  }
+}
+
+/* Compute the L-BFGS search direction xi = -H * g by the two-loop
+   recursion (Nocedal & Wright, Numerical Optimization, algorithm
+   7.4), in the space of the parameters not at a boundary.  Pairs that
+   do not have a sufficiently positive curvature in that space are
+   skipped.  With an empty history, the direction is steepest descent,
+   scaled to at most unit length.  For use in opt_lbfgs. */
+static void lbfgs_direction(Vector *xi, Vector *g, LbfgsHistory *h, 
+                            Vector *at_bounds) {
+  int i, j, k, n = g->size, scaled = FALSE;
+  double gamma = 1, sy, yy, beta;
+
+  vec_copy(xi, g);
+  project_vector(xi, at_bounds);
+
+  for (j = h->npairs - 1; j >= 0; j--) {
+    k = (h->oldest + j) % h->m;
+    sy = free_inner_prod(h->s[k], h->y[k], at_bounds);
+    yy = free_inner_prod(h->y[k], h->y[k], at_bounds);
+    if (sy <= sqrt(EPS * yy * free_inner_prod(h->s[k], h->s[k], at_bounds))) {
+      h->rho[k] = 0;
+      continue;
+    }
+    h->rho[k] = 1 / sy;
+    if (!scaled) {              /* initial H is scaled by the most
+                                   recent usable pair */
+      gamma = sy / yy;
+      scaled = TRUE;
+    }
+    h->alpha[k] = h->rho[k] * free_inner_prod(h->s[k], xi, at_bounds);
+    for (i = 0; i < n; i++)
+      if (vec_get(at_bounds, i) == OPT_NO_BOUND)
+        vec_set(xi, i, vec_get(xi, i) - h->alpha[k] * vec_get(h->y[k], i));
+  }
+
+  if (!scaled) {
+    double norm = vec_norm(xi);
+    if (norm > 1) gamma = 1 / norm;
+  }
+  vec_scale(xi, gamma);
+
+  for (j = 0; j < h->npairs; j++) {
+    k = (h->oldest + j) % h->m;
+    if (h->rho[k] == 0) continue;
+    beta = h->rho[k] * free_inner_prod(h->y[k], xi, at_bounds);
+    for (i = 0; i < n; i++)
+      if (vec_get(at_bounds, i) == OPT_NO_BOUND)
+        vec_set(xi, i, vec_get(xi, i) + 
+                (h->alpha[k] - beta) * vec_get(h->s[k], i));
+  }
+
+  vec_scale(xi, -1);
+}
+
+/* Find a minimum of the specified function using the limited-memory
+   BFGS algorithm (L-BFGS).  Instead of the dense n x n inverse
+   Hessian maintained by opt_bfgs, only the most recent pairs of
+   parameter and gradient differences are kept, and the search
+   direction is computed from them directly, so that each iteration
+   requires O(mn) time and memory (for m pairs) rather than O(n^2).
+   This makes a large difference for models with many parameters.
+
+   The arguments and return value are as for opt_bfgs, except that
+   the inverse Hessian is replaced by a history of correction pairs
+   (see opt_lbfgs_history_new).  As with the inverse Hessian in
+   opt_bfgs, a history passed in is used as a starting point and is
+   updated on return, which is useful when a series of related
+   problems is solved (as in EM); if "history" is NULL, a new history
+   with OPT_LBFGS_M pairs is used.  Bounds are handled as in opt_bfgs:
+   parameters found at a boundary (with the gradient pushing them out
+   of bounds) are held fixed, by computing the direction only in the
+   space of the remaining parameters, and are released one at a time
+   when the gradient points back into the permitted region.  The line
+   search, convergence criteria, and checkpointing are shared with
+   opt_bfgs (see QuasiNewton). */
+int opt_lbfgs(double (*f)(Vector*, void*), Vector *params, 
+              void *data, double *retval, Vector *lower_bounds, 
+              Vector *upper_bounds, FILE *logf,
+              void (*compute_grad)(Vector *grad, Vector *params,
+                                   void *data, Vector *lb, Vector *ub),
+              opt_precision_type precision, LbfgsHistory *history,
+              Checkpoint *ckpt, int *num_evals) {
+
+  int its, n = params->size, success = 0, already_failed = 0, start_its;
+  Vector *xi, *dg;
+  LbfgsHistory *h;
+  QuasiNewton qn;
+
+  if (precision == OPT_UNKNOWN_PREC)
+    die("unknown precision in opt_lbfgs");
+  if (history != NULL && history->n != n)
+    die("ERROR opt_lbfgs: history has wrong dimension (%i, expected %i)\n",
+        history->n, n);
+
+  qn_init(&qn, f, params, data, lower_bounds, upper_bounds, logf, 
+          compute_grad, precision);
+  xi = qn.xi;
+  dg = qn.dg;
+  h = history != NULL ? history : opt_lbfgs_history_new(n, OPT_LBFGS_M);
+                                /* correction pairs */
+
+  /* resume from a checkpoint, if available */
+  start_its = restore_checkpoint(ckpt, &qn, &already_failed, NULL, h);
+
+  qn_start(&qn, start_its > 0);
+
+  /* initial direction */
+  if (start_its == 0) {
+    lbfgs_direction(xi, qn.g, h, qn.at_bounds);
+    if (vec_inner_prod(qn.g, xi) >= 0) {
+      h->npairs = h->oldest = 0;
+      lbfgs_direction(xi, qn.g, h, qn.at_bounds);
+    }
+  }
+
+  for (its = start_its; its < ITMAX; its++) { /* main loop */
+    checkInterrupt();
+
+    if (ckpt_due(ckpt))
+      save_checkpoint(ckpt, its, &qn, already_failed, NULL, h);
+
+    /* minimize along xi and test for convergence */
+    if (qn_line_search(&qn, retval)) {
+      success = 1;
+      break;
+    }
+
+    /* save the old gradient and obtain the new gradient */
+    if (qn_new_gradient(&qn, retval)) {
+      success = 1;
+      break;
+    }
+
+    /* update parameters at bounds (xi is left as it is, since it is
+       the step to be stored in the history) */
+    qn_update_bounds(&qn, NULL);
+
+    /* store the new correction pair; if the curvature condition
+       fails, discard the history instead (analogous to resetting H in
+       opt_bfgs) */
+    if (vec_inner_prod(dg, xi) > 
+        sqrt(EPS * vec_inner_prod(dg, dg) * vec_inner_prod(xi, xi)))
+      lbfgs_push(h, xi, dg);
+    else {
+      if (logf != NULL) fprintf(logf, "WARNING: resetting H!\n");
+      h->npairs = h->oldest = 0;
+    }
+
+    /* finally, update the direction vector */
+    lbfgs_direction(xi, qn.g, h, qn.at_bounds);
+
+    /* make sure direction of xi is okay; if not, discard the
+       history; on second failure of this type, assume convergence */
+    if (vec_inner_prod(qn.g, xi) >= 0) {
+      if (already_failed) {
+	if (logf != NULL) fprintf(logf, "Convergence via inner product (%e) >= 0\n", vec_inner_prod(qn.g, xi));
+        success = 1; 
+        break;
+      }
+      else {
+        if (logf != NULL) fprintf(logf, "WARNING: resetting H! (1st time)\n");
+        h->npairs = h->oldest = 0;
+        lbfgs_direction(xi, qn.g, h, qn.at_bounds);
+        already_failed = 1;
+      }
+    }
+  }
+
+  if (history == NULL) opt_lbfgs_history_free(h);
+  return qn_finish(&qn, its, success, "opt_lbfgs", num_evals);
 }
 
 /* Given a point "xold", the value of the function "f" and its gradient
@@ -1316,6 +1779,169 @@ void opt_lnsrch_1d(double direction, double xold, double fxold, double *x,
   *final_lambda = lambda;
 }
 
+/* state of one problem in opt_newton_1d_batch */
+typedef struct {
+  double x, fx, d, d2;          /* current abscissa, value, derivs */
+  double xold, fxold;           /* values at start of iteration */
+  double direction, slope, lambda, lambda_min;
+  int its;
+  int flat;                     /* whether the step was taken on a flat
+                                   stretch (see newton_batch_step) */
+} NewtonState1d;
+
+/* begin a Newton iteration for one problem of opt_newton_1d_batch:
+   choose the direction and set up the line search.  Returns the
+   first abscissa to evaluate */
+static double newton_batch_step(NewtonState1d *s, double lb, double ub) {
+  double maxstep = max(fabs(s->x), 1);
+  s->xold = s->x;
+  s->fxold = s->fx;
+  s->flat = (s->d2 > 0 && s->d2 < 1e-4);
+  if (s->flat) {
+    /* opt_newton_1d takes a gradient step here, because numerical
+       second derivatives this small are unreliable.  With exact
+       derivatives the Newton step is safe, and a gradient step is
+       not: on a flat stretch (e.g., a likelihood still rising slowly
+       towards an unbounded scale) it is so short that it passes the
+       convergence test on x long before f(x) has converged.  The
+       step is limited to doubling x */
+    s->direction = -s->d / s->d2;
+    if (fabs(s->direction) > maxstep)
+      s->direction = s->direction > 0 ? maxstep : -maxstep;
+  }
+  else                          /* as in opt_newton_1d */
+    s->direction = -s->d / (s->d2 < 1e-4 ? 1 : s->d2);
+  if (s->x + s->direction - lb < BOUNDARY_EPS2)
+    s->direction = lb + BOUNDARY_EPS2 - s->x;
+  else if (ub - (s->x + s->direction) < BOUNDARY_EPS2)
+    s->direction = ub - BOUNDARY_EPS2 - s->x;
+  s->slope = s->d * s->direction;
+  s->lambda = 1;
+  s->lambda_min = TOLX(OPT_HIGH_PREC) / (fabs(s->x) / max(fabs(s->x), 1.0));
+  s->its++;
+  return s->xold + s->direction;
+}
+
+/* Batched version of opt_newton_1d for many independent
+   one-dimensional problems sharing the same bounds, using exact first
+   and second derivatives.  All problems that are still active advance
+   together, so that each round requires a single call to f for the
+   whole batch; this allows f to share work across problems (e.g.,
+   when several are evaluated at the same abscissa, as in the first
+   round).  Each problem follows the same iteration as opt_newton_1d
+   (Newton step, truncation at bounds, backtracking line search), and
+   is retired as soon as it converges.  The exception is where the
+   second derivative is positive but small: a bounded Newton step is
+   taken, and convergence requires one more significant figure in f(x)
+   in place of a stable x (see newton_batch_step).  Because
+   derivatives are computed along with each function value, an
+   accepted line-search point needs no further evaluations.  On entry x[i] must hold the
+   starting point of problem i; on exit x[i] and fx[i] hold the
+   minimiser and minimum.  Returns the number of problems that reached
+   the maximum number of iterations without converging */
+int opt_newton_1d_batch(opt_batch_func_1d f, int nprobs, double *x,
+                        double *fx, void *data, int sigfigs, double lb,
+                        double ub, FILE *logf) {
+  NewtonState1d *state = smalloc(nprobs * sizeof(NewtonState1d));
+  int *active = smalloc(nprobs * sizeof(int));
+  double *bx = smalloc(nprobs * sizeof(double)),
+    *bfx = smalloc(nprobs * sizeof(double)),
+    *bd = smalloc(nprobs * sizeof(double)),
+    *bd2 = smalloc(nprobs * sizeof(double));
+  int i, k, nactive = 0, nfailed = 0;
+
+  if (nprobs == 0) {
+    sfree(state); sfree(active); sfree(bx); sfree(bfx); sfree(bd);
+    sfree(bd2);
+    return 0;
+  }
+
+  if (logf != NULL)
+    fprintf(logf, "%8s %15s %15s %15s %15s %15s\n", "problem", "f(x)", "x",
+            "f'(x)", "f''(x)", "lambda");
+
+  /* initial function evaluation */
+  for (i = 0; i < nprobs; i++) {
+    if (!(x[i] > lb && x[i] < ub && ub > lb))
+      die("ERROR opt_newton_1d_batch: x=%e, lb=%e, ub=%e\n", x[i], lb, ub);
+    active[i] = i;
+    bx[i] = x[i];
+  }
+  f(nprobs, active, bx, bfx, bd, bd2, data);
+  for (i = 0; i < nprobs; i++) {
+    NewtonState1d *s = &state[i];
+    s->x = x[i];
+    s->fx = bfx[i];
+    s->d = bd[i];
+    s->d2 = bd2[i];
+    s->its = 0;
+    if (logf != NULL)
+      fprintf(logf, "%8d %15.6f %15.6f %15.6f %15.6f %15s\n", i, s->fx, s->x,
+              s->d, s->d2, "-");
+    bx[nactive] = newton_batch_step(s, lb, ub);
+    active[nactive++] = i;
+  }
+
+  while (nactive > 0) {
+    int nnext = 0;
+    checkInterrupt();
+    f(nactive, active, bx, bfx, bd, bd2, data);
+
+    for (k = 0; k < nactive; k++) {
+      NewtonState1d *s = &state[active[k]];
+      i = active[k];
+
+      if (s->lambda < s->lambda_min)  /* line search failed; stay put */
+        s->x = s->xold;
+      else if (bfx[k] <= s->fxold + ALPHA * s->lambda * s->slope) {
+        s->x = bx[k];           /* sufficient decrease; accept */
+        s->fx = bfx[k];
+        s->d = bd[k];
+        s->d2 = bd2[k];
+      }
+      else {                    /* backtrack */
+        s->lambda *= RHO;
+        bx[nnext] = s->xold + s->lambda * s->direction;
+        active[nnext++] = i;
+        continue;
+      }
+
+      if (logf != NULL)
+        fprintf(logf, "%8d %15.6f %15.6f %15.6f %15.6f %15.6f\n", i, s->fx,
+                s->x, s->d, s->d2, s->lambda);
+
+      /* test for convergence; after a step on a flat stretch x can
+         still change by a large fraction, so rely on f(x) alone */
+      if (opt_sigfig(s->fx, s->fxold) >= sigfigs &&
+          (opt_sigfig(s->x, s->xold) >= sigfigs ||
+           (s->flat && opt_sigfig(s->fx, s->fxold) > sigfigs)))
+        continue;
+      if (s->its >= ITMAX) {
+        nfailed++;
+        if (logf != NULL)
+          fprintf(logf, "WARNING: exceeded maximum number of iterations (problem %d).\n", i);
+        continue;
+      }
+      bx[nnext] = newton_batch_step(s, lb, ub);
+      active[nnext++] = i;
+    }
+    nactive = nnext;
+  }
+
+  for (i = 0; i < nprobs; i++) {
+    x[i] = state[i].x;
+    fx[i] = state[i].fx;
+  }
+
+  sfree(state);
+  sfree(active);
+  sfree(bx);
+  sfree(bfx);
+  sfree(bd);
+  sfree(bd2);
+  return nfailed;
+}
+
 /* given two vectors of consecutive parameter estimates, return the
    minimum number of shared significant figures */
 int opt_min_sigfig(Vector *p1, Vector *p2) {
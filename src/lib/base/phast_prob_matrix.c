@@ -18,6 +18,7 @@
 
 #include <phast/prob_matrix.h>
 #include <phast/prob_vector.h>
+#include <phast/complex_matrix.h>
 #include <phast/misc.h>
 
 void pm_mean(Matrix *p, double *mean_x, double *mean_y) {
@@ -112,12 +113,174 @@ void pm_normalize(Matrix *p) {
   mat_scale(p, 1/sum);
 }
 
-/* convolve distribution n times */
+/* Direct convolution of an ar x ac matrix with a br x bc matrix costs
+   about ar*ac*br*bc multiply-adds, while a two-dimensional FFT over N
+   elements costs about N log2 N complex operations per transform.
+   Convolution by FFT (which takes two transforms, see below) is used
+   when the direct cost exceeds this factor times N log2 N */
+#define PM_FFT_COST_FACTOR 6
+
+/* compute the first out->nrows x out->ncols elements of the
+   convolution of the leading ar x ac block of a with the leading br x
+   bc block of b, storing them in out; elements beyond the end of the
+   full convolution are set to zero.  The direct method is used for
+   small inputs and the two-dimensional FFT for large ones.  Rounding
+   error in the FFT can produce tiny negative values, which are set to
+   zero.  The matrices a and b may be the same (in which case a single
+   forward transform suffices, and ar == br, ac == bc are assumed) but
+   must not be out. */
+static void conv_matrices(Matrix *a, int ar, int ac, Matrix *b, int br,
+                          int bc, Matrix *out) {
+  int x, y, j, k, lenr, lenc, N1, N2;
+  double s;
+
+  ar = min(ar, out->nrows); ac = min(ac, out->ncols);
+  br = min(br, out->nrows); bc = min(bc, out->ncols);
+  lenr = min(out->nrows, ar + br - 1);
+  lenc = min(out->ncols, ac + bc - 1);
+  for (N1 = 1; N1 < ar + br - 1; N1 <<= 1);
+  for (N2 = 1; N2 < ac + bc - 1; N2 <<= 1);
+
+  if ((double)ar * ac * br * bc <=
+      PM_FFT_COST_FACTOR * (double)N1 * N2 * log2_int(N1 * N2)) {
+    /* direct method; order of summation matches the original
+       recursive convolutions */
+    for (x = 0; x < lenr; x++) {
+      for (y = 0; y < lenc; y++) {
+        s = 0;
+        for (j = max(0, x - br + 1); j <= x && j < ar; j++)
+          for (k = max(0, y - bc + 1); k <= y && k < ac; k++)
+            s += a->data[j][k] * b->data[x - j][y - k];
+        out->data[x][y] = s;
+      }
+    }
+  }
+  else {
+    Zmatrix *z = zmat_new(N1, N2);
+    Complex zk, zn, prod;       /* zn holds conj(Z[-k]) */
+    int m1, m2;
+
+    /* as in the one-dimensional case (see prob_vector.c), pack both
+       real inputs into a single complex grid a + ib and separate their
+       transforms by conjugate symmetry: with -k = (N1-k1, N2-k2) mod
+       (N1, N2), A[k]B[k] = (Z[k]^2 - conj(Z[-k])^2) / 4i */
+    for (j = 0; j < N1; j++)
+      for (k = 0; k < N2; k++)
+        z->data[j][k] = z_set(j < ar && k < ac ? a->data[j][k] : 0,
+                              a != b && j < br && k < bc ?
+                              b->data[j][k] : 0);
+    zmat_fft(z, FALSE);
+
+    if (a == b) {               /* squaring: product is just A[k]^2 */
+      for (j = 0; j < N1; j++)
+        for (k = 0; k < N2; k++)
+          z->data[j][k] = z_mul(z->data[j][k], z->data[j][k]);
+    }
+    else {
+      for (j = 0; j < N1; j++) {
+        m1 = (N1 - j) % N1;
+        for (k = 0; k < N2; k++) {
+          m2 = (N2 - k) % N2;
+          if (m1 * N2 + m2 < j * N2 + k) continue;
+                                /* handled with its partner */
+          zk = z->data[j][k];
+          zn = z->data[m1][m2];
+          zn.y = -zn.y;
+          prod = z_sub(z_mul(zk, zk), z_mul(zn, zn));
+          z->data[j][k] = z_set(prod.y / 4, -prod.x / 4);
+          /* the product at -k is the conjugate of that at k */
+          z->data[m1][m2] = z_set(z->data[j][k].x, -z->data[j][k].y);
+        }
+      }
+    }
+    zmat_fft(z, TRUE);
+
+    for (x = 0; x < lenr; x++)
+      for (y = 0; y < lenc; y++)
+        out->data[x][y] = z->data[x][y].x > 0 ? z->data[x][y].x : 0;
+    zmat_free(z);
+  }
+
+  for (x = 0; x < out->nrows; x++)
+    for (y = (x < lenr ? lenc : 0); y < out->ncols; y++)
+      out->data[x][y] = 0;
+}
+
+/* compute the first out->nrows x out->ncols elements of the n-fold
+   convolution of the matrix p with itself, storing them in out (n >=
+   1).  Uses exponentiation by squaring, so requires O(log n)
+   convolutions.  On return, *outr and *outc give the dimensions of
+   the part of out that may be nonzero */
+static void conv_matrix_power(Matrix *p, int n, Matrix *out, int *outr,
+                              int *outc) {
+  Matrix *sq = mat_new(out->nrows, out->ncols),
+    *tmp = mat_new(out->nrows, out->ncols), *swap;
+  int sqr = min(p->nrows, out->nrows), sqc = min(p->ncols, out->ncols),
+    x, y;
+
+  for (x = 0; x < sqr; x++)
+    for (y = 0; y < sqc; y++)
+      sq->data[x][y] = p->data[x][y];
+  *outr = *outc = 0;
+
+  /* at each step, the desired result is out o sq^n (taking out to be
+     the identity while *outr == 0) */
+  while (1) {
+    if (n & 1) {
+      if (*outr == 0) {
+        for (x = 0; x < sqr; x++)
+          for (y = 0; y < sqc; y++)
+            out->data[x][y] = sq->data[x][y];
+        *outr = sqr;
+        *outc = sqc;
+      }
+      else {
+        conv_matrices(out, *outr, *outc, sq, sqr, sqc, tmp);
+        *outr = min(out->nrows, *outr + sqr - 1);
+        *outc = min(out->ncols, *outc + sqc - 1);
+        for (x = 0; x < *outr; x++)
+          for (y = 0; y < *outc; y++)
+            out->data[x][y] = tmp->data[x][y];
+      }
+    }
+    n >>= 1;
+    if (n == 0) break;
+    conv_matrices(sq, sqr, sqc, sq, sqr, sqc, tmp);
+    sqr = min(out->nrows, 2 * sqr - 1);
+    sqc = min(out->ncols, 2 * sqc - 1);
+    swap = sq; sq = tmp; tmp = swap;
+  }
+
+  for (x = 0; x < out->nrows; x++)
+    for (y = (x < *outr ? *outc : 0); y < out->ncols; y++)
+      out->data[x][y] = 0;
+  mat_free(sq);
+  mat_free(tmp);
+}
+
+/* trim rows and columns whose elements are all at most epsilon off
+   the ends of q */
+static void trim_dims(Matrix *q, double epsilon) {
+  int x, y, max_nrows = -1, max_ncols = -1;
+  for (x = q->nrows - 1; max_nrows == -1 && x >= 0; x--) 
+    for (y = 0; max_nrows == -1 && y < q->ncols; y++) 
+      if (q->data[x][y] > epsilon) 
+        max_nrows = x+1;      
+  if (max_nrows == -1) max_nrows = q->nrows;
+  for (y = q->ncols - 1; max_ncols == -1 && y >= 0; y--) 
+    for (x = 0; max_ncols == -1 && x < q->nrows; x++) 
+      if (q->data[x][y] > epsilon) 
+        max_ncols = y+1;
+  if (max_ncols == -1) max_ncols = q->ncols;
+  mat_resize(q, max_nrows, max_ncols);
+}
+
+/* convolve distribution n times.  Uses repeated squaring, so requires
+   O(log n) convolutions, each computed by FFT when large */
 Matrix *pm_convolve(Matrix *p, int n, double epsilon) {
-  int i, j, k, x, y;
-  Matrix *q_i, *q_i_1;
+  Matrix *q;
   double mean, var, max_nsd;
-  int max_nrows = p->nrows * n, max_ncols = p->ncols * n;
+  int max_nrows = p->nrows * n, max_ncols = p->ncols * n, qr, qc;
 
   if (n <= 0)
     die("ERROR pm_convlve: n=%i\n", n);
@@ -139,49 +302,20 @@ Matrix *pm_convolve(Matrix *p, int n, double epsilon) {
     vec_free(marg_y);
   }
 
-  q_i = mat_new(max_nrows, max_ncols);
-  q_i_1 = mat_new(max_nrows, max_ncols);
-
-  /* compute convolution recursively */
-  mat_zero(q_i_1);
-  for (x = 0; x < p->nrows; x++)
-    for (y = 0; y < p->ncols; y++)
-      q_i_1->data[x][y] = p->data[x][y];
-
-  for (i = 1; i < n; i++) {
-    mat_zero(q_i);
-    for (x = 0; x < q_i->nrows; x++) {
-      for (y = 0; y < q_i->ncols; y++) 
-        for (j = max(0, x - p->nrows + 1); j <= x; j++) 
-          for (k = max(0, y - p->ncols + 1); k <= y; k++) 
-            q_i->data[x][y] += q_i_1->data[j][k] * p->data[x - j][y - k];
-    }
-    mat_copy(q_i_1, q_i);
-  }
-
-  mat_free(q_i_1);
+  q = mat_new(max_nrows, max_ncols);
+  conv_matrix_power(p, n, q, &qr, &qc);
 
   /* trim dimension before returning */
-  max_nrows = max_ncols = -1;
-  for (x = q_i->nrows - 1; max_nrows == -1 && x >= 0; x--) 
-    for (y = 0; max_nrows == -1 && y < q_i->ncols; y++) 
-      if (q_i->data[x][y] > epsilon) 
-        max_nrows = x+1;      
-  for (y = q_i->ncols - 1; max_ncols == -1 && y >= 0; y--) 
-    for (x = 0; max_ncols == -1 && x < q_i->nrows; x++) 
-      if (q_i->data[x][y] > epsilon) 
-        max_ncols = y+1;
-  mat_resize(q_i, max_nrows, max_ncols);
-
-  pm_normalize(q_i);
-  return q_i;
+  trim_dims(q, epsilon);
+  pm_normalize(q);
+  return q;
 }
 
 /* convolve distribution n times and keep all intermediate
    distributions.  Return value is an array q such that q[i] (1 <= i
    <= n) is the ith convolution of p (q[0] will be NULL) */
 Matrix **pm_convolve_save(Matrix *p, int n, double epsilon) {
-  int i, j, k, x, y;
+  int i, x, y;
   double mean, var, max_nsd;
   int max_nrows = p->nrows * n, max_ncols = p->ncols * n;
   Matrix **q = smalloc((n+1) * sizeof(void*));
@@ -213,32 +347,19 @@ Matrix **pm_convolve_save(Matrix *p, int n, double epsilon) {
   /* compute convolution recursively */
   q[1] = mat_new(max_nrows, max_ncols);
   mat_zero(q[1]);
-  for (x = 0; x < p->nrows; x++)
-    for (y = 0; y < p->ncols; y++)
+  for (x = 0; x < p->nrows && x < max_nrows; x++)
+    for (y = 0; y < p->ncols && y < max_ncols; y++)
       q[1]->data[x][y] = p->data[x][y];
 
   for (i = 2; i <= n; i++) {
     q[i] = mat_new(max_nrows, max_ncols);
-    mat_zero(q[i]);
-    for (x = 0; x < q[i]->nrows; x++) 
-      for (y = 0; y < q[i]->ncols; y++) 
-        for (j = max(0, x - p->nrows + 1); j <= x; j++) 
-          for (k = max(0, y - p->ncols + 1); k <= y; k++) 
-            q[i]->data[x][y] += q[i-1]->data[j][k] * p->data[x - j][y - k];
+    conv_matrices(q[i-1], (i-1) * p->nrows, (i-1) * p->ncols, p,
+                  p->nrows, p->ncols, q[i]);
   }
 
   /* trim dimension before returning */
   for (i = 1; i <= n; i++) {
-    max_nrows = max_ncols = -1;
-    for (x = q[i]->nrows - 1; max_nrows == -1 && x >= 0; x--) 
-      for (y = 0; max_nrows == -1 && y < q[i]->ncols; y++) 
-        if (q[i]->data[x][y] > epsilon) 
-          max_nrows = x+1;      
-    for (y = q[i]->ncols - 1; max_ncols == -1 && y >= 0; y--) 
-      for (x = 0; max_ncols == -1 && x < q[i]->nrows; x++) 
-        if (q[i]->data[x][y] > epsilon) 
-          max_ncols = y+1;
-    mat_resize(q[i], max_nrows, max_ncols);
+    trim_dims(q[i], epsilon);
     pm_normalize(q[i]);
   }
 
@@ -246,19 +367,22 @@ Matrix **pm_convolve_save(Matrix *p, int n, double epsilon) {
 }
 
 /* take convolution of a set of probability matrices.  If counts is
-   NULL, then each distrib is assumed to have multiplicity 1 */
+   NULL, then each distrib is assumed to have multiplicity 1.  Each
+   distrib is first raised to its multiplicity by repeated squaring,
+   then the results are convolved together */
 Matrix *pm_convolve_many(Matrix **p, int *counts, int n, double epsilon) {
-  int i, j, k, l, x, y, max_nrows, max_ncols, count, tot_count = 0,
-    this_max_nrows, this_max_ncols;
-  Matrix *q_i, *q_i_1;
+  int i, x, y, max_nrows, max_ncols, count, tot_count = 0, qr, qc, powr,
+    powc;
+  Matrix *q, *pow, *tmp;
   double max_nsd;
 
-  max_nrows = max_ncols = 0; 
+  max_nrows = max_ncols = 1; 
   for (i = 0; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
+    if (i == 0) count = max(1, count);
     tot_count += count;
-    max_nrows += p[i]->nrows;
-    max_ncols += p[i]->ncols;
+    max_nrows += count * (p[i]->nrows - 1);
+    max_ncols += count * (p[i]->ncols - 1);
   }
 
   if (n == 1 && (counts == NULL || counts[0] == 1))
@@ -288,54 +412,33 @@ Matrix *pm_convolve_many(Matrix **p, int *counts, int n, double epsilon) {
     max_ncols = (int)ceil(tot_mean_y + max_nsd * sqrt(tot_var_y)) + 1;
   }
 
-  q_i = mat_new(max_nrows, max_ncols);
-  q_i_1 = mat_new(max_nrows, max_ncols);
+  q = mat_new(max_nrows, max_ncols);
+  pow = mat_new(max_nrows, max_ncols);
+  tmp = mat_new(max_nrows, max_ncols);
 
-  /* compute convolution recursively */
-  mat_zero(q_i_1);
-  this_max_nrows = min(p[0]->nrows, max_nrows);
-  this_max_ncols = min(p[0]->ncols, max_ncols);
-  for (x = 0; x < this_max_nrows; x++)
-    for (y = 0; y < this_max_ncols; y++)
-      q_i_1->data[x][y] = p[0]->data[x][y];
- 
-  this_max_nrows = p[0]->nrows;
-  this_max_ncols = p[0]->ncols;
-  for (i = 0; i < n; i++) {
+  /* the first distrib is always included at least once */
+  count = (counts == NULL ? 1 : max(1, counts[0]));
+  conv_matrix_power(p[0], count, q, &qr, &qc);
+
+  for (i = 1; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
-    if (i == 0) count--; /* initialization takes care of first one */
-    this_max_nrows = min(max_nrows, this_max_nrows + p[i]->nrows);
-    this_max_ncols = min(max_ncols, this_max_ncols + p[i]->ncols);
-    for (l = 0; l < count; l++) {
-      mat_zero(q_i);
-      for (x = 0; x < this_max_nrows; x++) {
-        for (y = 0; y < this_max_ncols; y++) 
-          for (j = max(0, x - p[i]->nrows + 1); j <= x; j++) 
-            for (k = max(0, y - p[i]->ncols + 1); k <= y; k++) 
-              q_i->data[x][y] += q_i_1->data[j][k] * p[i]->data[x - j][y - k];
-      }
-      mat_copy(q_i_1, q_i);
-    }
+    if (count <= 0) continue;
+    conv_matrix_power(p[i], count, pow, &powr, &powc);
+    conv_matrices(q, qr, qc, pow, powr, powc, tmp);
+    qr = min(max_nrows, qr + powr - 1);
+    qc = min(max_ncols, qc + powc - 1);
+    for (x = 0; x < qr; x++)
+      for (y = 0; y < qc; y++)
+        q->data[x][y] = tmp->data[x][y];
   }
 
-  mat_free(q_i_1);
+  mat_free(pow);
+  mat_free(tmp);
 
   /* trim dimension before returning */
-  max_nrows = max_ncols = -1;
-  for (x = q_i->nrows - 1; max_nrows == -1 && x >= 0; x--) 
-    for (y = 0; max_nrows == -1 && y < q_i->ncols; y++) 
-      if (q_i->data[x][y] > epsilon) 
-        max_nrows = x+1;      
-  if (max_nrows == -1) max_nrows = q_i->nrows;
-  for (y = q_i->ncols - 1; max_ncols == -1 && y >= 0; y--) 
-    for (x = 0; max_ncols == -1 && x < q_i->nrows; x++) 
-      if (q_i->data[x][y] > epsilon) 
-        max_ncols = y+1;
-  if (max_ncols == -1) max_ncols = q_i->ncols;
-  mat_resize(q_i, max_nrows, max_ncols);
-
-  pm_normalize(q_i);
-  return q_i;
+  trim_dims(q, epsilon);
+  pm_normalize(q);
+  return q;
 }
 
 /* take convolution of a set of probability matrices, avoiding some
@@ -343,7 +446,7 @@ Matrix *pm_convolve_many(Matrix **p, int *counts, int n, double epsilon) {
    normalize, does not trim dimension, allows max size to be
    specified */
 Matrix *pm_convolve_many_fast(Matrix **p, int n, int max_nrows, int max_ncols) {
-  int i, j, k, x, y, this_max_nrows, this_max_ncols;
+  int i, x, y, this_max_nrows, this_max_ncols;
   Matrix *q_i, *q_i_1;
 
   if (n == 1)
@@ -361,34 +464,25 @@ Matrix *pm_convolve_many_fast(Matrix **p, int n, int max_nrows, int max_ncols) {
     for (y = 0; y < this_max_ncols; y++)
       q_i_1->data[x][y] = p[0]->data[x][y];
  
-  this_max_nrows = p[0]->nrows;
-  this_max_ncols = p[0]->ncols;
   for (i = 1; i < n; i++) {
-    this_max_nrows = min(max_nrows, this_max_nrows + p[i]->nrows);
-    this_max_ncols = min(max_ncols, this_max_ncols + p[i]->ncols);
-    mat_zero(q_i);
-    for (x = 0; x < this_max_nrows; x++) {
-      for (y = 0; y < this_max_ncols; y++) 
-        for (j = max(0, x - p[i]->nrows + 1); j <= x; j++) 
-          for (k = max(0, y - p[i]->ncols + 1); k <= y; k++) 
-            q_i->data[x][y] += q_i_1->data[j][k] * p[i]->data[x - j][y - k];
-    }
-    mat_copy(q_i_1, q_i);
+    conv_matrices(q_i_1, this_max_nrows, this_max_ncols, p[i], p[i]->nrows,
+                  p[i]->ncols, q_i);
+    this_max_nrows = min(max_nrows, this_max_nrows + p[i]->nrows - 1);
+    this_max_ncols = min(max_ncols, this_max_ncols + p[i]->ncols - 1);
+    if (i < n - 1) mat_copy(q_i_1, q_i);
   }
 
   mat_free(q_i_1);
   return q_i;
 }
 
-/* convolve distribution n times, using a faster algorithm than the
-   ones above; time is proportional to log(n) rather than n */
+/* convolve distribution n times, without normalizing or trimming the
+   result.  Uses repeated squaring, so time is proportional to log(n)
+   rather than n */
 Matrix *pm_convolve_fast(Matrix *p, int n, double epsilon) {
-  int i, j, checksum;
-  int logn = log2_int(n);
-  Matrix *pow_p[64], *pows[64];
   Matrix *retval;
   double mean, var, max_nsd;
-  int max_nrows = p->nrows * n, max_ncols = p->ncols * n;
+  int max_nrows = p->nrows * n, max_ncols = p->ncols * n, qr, qc;
 
   if (n == 1)
     return mat_create_copy(p);
@@ -407,33 +501,8 @@ Matrix *pm_convolve_fast(Matrix *p, int n, double epsilon) {
     vec_free(marg_y);
   }
 
-  /* Let p^i be the ith convolution of p (i.e., p o p o ... o p, i
-     times, where 'o' is the convolution operator).  We use the fact
-     that p^i o p^j = p^(i+j) to compose p^n from p^1, p^2, p^4, p^8,
-     ... in log2(k) steps */
-
-  /* compute "powers" of p */
-  pow_p[0] = p;
-  for (i = 1; i <= logn; i++) 
-    pow_p[i] = pm_convolve(pow_p[i-1], 2, epsilon);
-
-  /* now combine powers to get desired convolution */
-  j = checksum = 0;
-  for (i = 0; i <= logn; i++) {
-    unsigned bit_i = (n >> i) & 1;
-    if (bit_i) {
-      pows[j++] = pow_p[i];
-      checksum += int_pow(2, i);
-    }
-  }
-  if (n != checksum)
-    die("ERROR pm_convolve_fast: n (%i) != checksum (%i)\n", n, checksum);
-
-  retval = pm_convolve_many_fast(pows, j, max_nrows, max_ncols);
-
-  for (i = 1; i <= logn; i++) 
-    mat_free(pow_p[i]);
-
+  retval = mat_new(max_nrows, max_ncols);
+  conv_matrix_power(p, n, retval, &qr, &qc);
   return retval;
 }
 
@@ -16,6 +16,7 @@
    epsilon for y >= x_max, where epsilon is an input parameter. */
 
 #include <phast/prob_vector.h>
+#include <phast/complex_vector.h>
 #include <phast/misc.h>
 
 /* compute mean and variance */
@@ -102,6 +103,14 @@ double pv_p_value(Vector *distrib, double x_0, p_val_type side) {
   return 2 * (min(lretval, hretval));
 }
 
+/* look up element x of a CDF computed by pv_cdf, allowing for values
+   of x off either end of the distribution */
+static double cdf_lookup(Vector *cdf, double x, p_val_type side) {
+  if (x < 0) return side == LOWER ? 0 : 1;
+  if (x >= cdf->size) return side == LOWER ? 1 : 0;
+  return cdf->data[(int)x];
+}
+
 /* compute one-sided p-values for array of values.  Like pv_p_value, but
    saves time by computing CDF and using for all pvals */
 void pv_p_values(Vector *distrib, double *x_0, int n, double *pvals,
@@ -117,12 +126,12 @@ void pv_p_values(Vector *distrib, double *x_0, int n, double *pvals,
   /* look up tail probabilities from CDF */
   for (i = 0; i < n; i++) {
     if (side == LOWER)
-      pvals[i] = lcdf->data[(int)floor(x_0[i])];
+      pvals[i] = cdf_lookup(lcdf, floor(x_0[i]), LOWER);
     else if (side == UPPER)
-      pvals[i] = hcdf->data[(int)ceil(x_0[i])];
+      pvals[i] = cdf_lookup(hcdf, ceil(x_0[i]), UPPER);
     else                        /* side == TWOTAIL */
-      pvals[i] = 2*(min(lcdf->data[(int)floor(x_0[i])], 
-                        hcdf->data[(int)ceil(x_0[i])]));
+      pvals[i] = 2*(min(cdf_lookup(lcdf, floor(x_0[i]), LOWER), 
+                        cdf_lookup(hcdf, ceil(x_0[i]), UPPER)));
   }
 
   if (lcdf != NULL) vec_free(lcdf);
@@ -141,10 +150,132 @@ void pv_normalize(Vector *p) {
   vec_scale(p, 1/sum);
 }
 
-/* convolve distribution n times */
+/* Direct convolution costs about na*nb multiply-adds, while an FFT of
+   size N costs about N log2 N complex operations per transform.
+   Convolution by FFT (which takes two transforms, see below) is used
+   when na*nb exceeds this factor times N log2 N */
+#define PV_FFT_COST_FACTOR 6
+
+/* compute the first nout elements of the convolution of the arrays a
+   (length na) and b (length nb), storing them in out; elements beyond
+   the end of the full convolution are set to zero.  The direct method
+   is used for small inputs and the FFT for large ones.  Rounding
+   error in the FFT can produce tiny negative values, which are set to
+   zero.  The arrays a and b may be the same array (in which case a
+   single forward transform suffices) but must not overlap out. */
+static void conv_arrays(double *a, int na, double *b, int nb, double *out,
+                        int nout) {
+  int x, j, k, len, N;
+  double s;
+
+  na = min(na, nout);
+  nb = min(nb, nout);
+  len = min(nout, na + nb - 1);
+  for (N = 1; N < na + nb - 1; N <<= 1);
+
+  if ((double)na * nb <= PV_FFT_COST_FACTOR * (double)N * log2_int(N)) {
+    /* direct method; order of summation matches the original
+       recursive convolutions */
+    for (x = 0; x < len; x++) {
+      s = 0;
+      for (j = max(0, x - nb + 1); j <= x && j < na; j++)
+        s += a[j] * b[x - j];
+      out[x] = s;
+    }
+  }
+  else {
+    Zvector *z = zvec_new(N);
+    Complex zk, zn, prod;     /* zn holds conj(Z[N-k]) */
+
+    /* pack both real inputs into a single complex sequence a + ib,
+       transform, and separate their transforms by conjugate symmetry:
+       A[k] = (Z[k] + conj(Z[N-k]))/2, B[k] = (Z[k] - conj(Z[N-k]))/2i,
+       so that A[k]B[k] = (Z[k]^2 - conj(Z[N-k])^2) / 4i */
+    for (k = 0; k < N; k++)
+      z->data[k] = z_set(k < na ? a[k] : 0, a != b && k < nb ? b[k] : 0);
+    zvec_fft(z, FALSE);
+
+    if (a == b)                 /* squaring: product is just A[k]^2 */
+      for (k = 0; k < N; k++)
+        z->data[k] = z_mul(z->data[k], z->data[k]);
+    else {
+      for (k = 0; k <= N/2; k++) {
+        zk = z->data[k];
+        zn = z->data[(N - k) % N];
+        zn.y = -zn.y;
+        prod = z_sub(z_mul(zk, zk), z_mul(zn, zn));
+        z->data[k] = z_set(prod.y / 4, -prod.x / 4);
+        if (k > 0 && k < N - k) {
+          /* the product at N-k is the conjugate of that at k */
+          z->data[N - k] = z_set(z->data[k].x, -z->data[k].y);
+        }
+      }
+    }
+    zvec_fft(z, TRUE);
+
+    for (x = 0; x < len; x++)
+      out[x] = z->data[x].x > 0 ? z->data[x].x : 0;
+    zvec_free(z);
+  }
+
+  for (x = len; x < nout; x++)
+    out[x] = 0;
+}
+
+/* compute the first nout elements of the n-fold convolution of the
+   array p (length np) with itself, storing them in out (n >= 1).
+   Uses exponentiation by squaring, so requires O(log n)
+   convolutions.  Returns the number of elements of out that may be
+   nonzero */
+static int conv_power(double *p, int np, int n, double *out, int nout) {
+  double *sq = smalloc(nout * sizeof(double)),
+    *tmp = smalloc(nout * sizeof(double)), *swap;
+  int sqlen = min(np, nout), outlen = 0, x;
+
+  for (x = 0; x < sqlen; x++) sq[x] = p[x];
+
+  /* at each step, the desired result is out o sq^n (taking out to be
+     the identity while outlen == 0) */
+  while (1) {
+    if (n & 1) {
+      if (outlen == 0) {
+        for (x = 0; x < sqlen; x++) out[x] = sq[x];
+        outlen = sqlen;
+      }
+      else {
+        conv_arrays(out, outlen, sq, sqlen, tmp, nout);
+        outlen = min(nout, outlen + sqlen - 1);
+        for (x = 0; x < outlen; x++) out[x] = tmp[x];
+      }
+    }
+    n >>= 1;
+    if (n == 0) break;
+    conv_arrays(sq, sqlen, sq, sqlen, tmp, nout);
+    sqlen = min(nout, 2 * sqlen - 1);
+    swap = sq; sq = tmp; tmp = swap;
+  }
+
+  for (x = outlen; x < nout; x++) out[x] = 0;
+  sfree(sq);
+  sfree(tmp);
+  return outlen;
+}
+
+/* trim very small values off tail of q */
+static void trim_tail(Vector *q, double epsilon) {
+  int x;
+  for (x = q->size - 1; x >= 0; x--) {
+    if (q->data[x] > epsilon) {
+      q->size = x+1;
+      break;
+    }
+  }
+}
+
+/* convolve distribution n times.  Uses repeated squaring, so requires
+   O(log n) convolutions, each computed by FFT when large */
 Vector *pv_convolve(Vector *p, int n, double epsilon) {
-  int i, j, x;
-  Vector *q_i, *q_i_1;
+  Vector *q;
   double mean, var, max_nsd;
   int max_x = p->size * n;
 
@@ -162,42 +293,19 @@ Vector *pv_convolve(Vector *p, int n, double epsilon) {
     max_x = max((int)ceil(n * mean + max_nsd * sqrt(n * var)), p->size);
   }
 
-  q_i = vec_new(max_x);
-  q_i_1 = vec_new(max_x);
-
-  /* compute convolution recursively */
-  vec_zero(q_i_1);
-  for (x = 0; x < p->size; x++)
-    q_i_1->data[x] = p->data[x];
-
-  for (i = 1; i < n; i++) {
-    vec_zero(q_i);
-    for (x = 0; x < q_i->size; x++) {
-      for (j = max(0, x - p->size + 1); j <= x; j++) 
-        q_i->data[x] += q_i_1->data[j] * p->data[x - j];
-    }
-    if (i < n - 1) vec_copy(q_i_1, q_i);
-  }
-
-  vec_free(q_i_1);
-
-  /* trim very small values off tail before returning */
-  for (x = q_i->size - 1; x >= 0; x--) {
-    if (q_i->data[x] > epsilon) {
-      q_i->size = x+1;
-      break;
-    }
-  }
+  q = vec_new(max_x);
+  conv_power(p->data, p->size, n, q->data, max_x);
 
-  pv_normalize(q_i);
-  return q_i;
+  trim_tail(q, epsilon);
+  pv_normalize(q);
+  return q;
 }
 
 /* convolve distribution n times and keep all intermediate
    distributions.  Return value is an array q such that q[i] (1 <= i <=
    n) is the ith convolution of p (q[0] will be NULL) */
 Vector **pv_convolve_save(Vector *p, int n, double epsilon) {
-  int i, j, x;
+  int i, x;
   double mean, var, max_nsd;
   int max_x = p->size * n, newsize;
   Vector **q = smalloc((n+1) * sizeof(void*));
@@ -225,15 +333,13 @@ Vector **pv_convolve_save(Vector *p, int n, double epsilon) {
   /* compute convolution recursively */
   q[1] = vec_new(max_x);
   vec_zero(q[1]);
-  for (x = 0; x < p->size; x++)
+  for (x = 0; x < p->size && x < max_x; x++)
     q[1]->data[x] = p->data[x];
 
   for (i = 2; i <= n; i++) {
     q[i] = vec_new(max_x);
-    vec_zero(q[i]);
-    for (x = 0; x < q[i]->size; x++) 
-      for (j = max(0, x - p->size + 1); j <= x; j++) 
-        q[i]->data[x] += q[i-1]->data[j] * p->data[x - j];
+    conv_arrays(q[i-1]->data, min(max_x, (i-1) * p->size), p->data,
+                p->size, q[i]->data, max_x);
   }
 
   /* trim very small values off tail before returning */
@@ -250,11 +356,13 @@ Vector **pv_convolve_save(Vector *p, int n, double epsilon) {
 }
 
 /* take convolution of a set of probability vectors.  If counts is
-   NULL, then each distrib is assumed to have multiplicity 1 */
+   NULL, then each distrib is assumed to have multiplicity 1.  Each
+   distrib is first raised to its multiplicity by repeated squaring,
+   then the results are convolved together */
 Vector *pv_convolve_many(Vector **p, int *counts, int n, double epsilon) {
-  int i, j, k, x, max_x = 0, tot_count = 0, count, thismax;
-  Vector *q_i, *q_i_1;
-  double mean, var, max_nsd;
+  int i, x, max_x = 0, tot_count = 0, count, len, powlen;
+  Vector *q;
+  double *pow, *tmp, mean, var, max_nsd;
 
   for (i = 0; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
@@ -284,41 +392,29 @@ Vector *pv_convolve_many(Vector **p, int *counts, int n, double epsilon) {
     max_x = (int)ceil(tot_mean + max_nsd * sqrt(tot_var));
   }
 
-  q_i = vec_new(max_x);
-  q_i_1 = vec_new(max_x);
+  q = vec_new(max_x);
+  pow = smalloc(max_x * sizeof(double));
+  tmp = smalloc(max_x * sizeof(double));
 
-  /* compute convolution recursively */
-  vec_zero(q_i_1);
-  thismax = min(p[0]->size, max_x);
-  for (x = 0; x < thismax; x++)
-    q_i_1->data[x] = p[0]->data[x];
+  /* the first distrib is always included at least once */
+  count = (counts == NULL ? 1 : max(1, counts[0]));
+  len = conv_power(p[0]->data, p[0]->size, count, q->data, max_x);
 
-  for (i = 0; i < n; i++) {
+  for (i = 1; i < n; i++) {
     count = (counts == NULL ? 1 : counts[i]);
-    if (i == 0) count--; /* initialization takes care of first one */
-    thismax = min(max_x, thismax + p[i]->size);
-    for (k = 0; k < count; k++) {
-      vec_zero(q_i);
-      for (x = 0; x < thismax; x++) {
-        for (j = max(0, x - p[i]->size + 1); j <= x; j++) 
-          q_i->data[x] += q_i_1->data[j] * p[i]->data[x - j];
-      }
-      vec_copy(q_i_1, q_i);
-    }
+    if (count <= 0) continue;
+    powlen = conv_power(p[i]->data, p[i]->size, count, pow, max_x);
+    conv_arrays(q->data, len, pow, powlen, tmp, max_x);
+    len = min(max_x, len + powlen - 1);
+    for (x = 0; x < len; x++) q->data[x] = tmp[x];
   }
 
-  vec_free(q_i_1);
+  sfree(pow);
+  sfree(tmp);
 
-  /* trim very small values off tail before returning */
-  for (x = q_i->size - 1; x >= 0; x--) {
-    if (q_i->data[x] > epsilon) {
-      q_i->size = x+1;
-      break;
-    }
-  }
-
-  pv_normalize(q_i);
-  return q_i;
+  trim_tail(q, epsilon);
+  pv_normalize(q);
+  return q;
 }
 
 /* compute and return a probability vector giving Pois(x | lambda) up to
@@ -400,10 +496,14 @@ Vector *pv_cdf(Vector *pdf, p_val_type side) {
 /** Given a probability vector, draw an index.  Call srandom externally */
 
 int pv_draw_idx_arr(double *arr, int n) {
+  return pv_draw_idx_arr_rng(NULL, arr, n);
+}
+
+int pv_draw_idx_arr_rng(RngContext *rng, double *arr, int n) {
   int i;
   double sum, r;
   sum = 0;
-  r = unif_rand();
+  r = rng_unif(rng);
   for (i = 0; i < n; i++) {
     sum += arr[i];
     if (r < sum) break;
@@ -415,7 +515,11 @@ int pv_draw_idx_arr(double *arr, int n) {
 
 /** Given a probability vector, draw an index.  Call srandom externally */
 int pv_draw_idx(Vector *pv) {
-  return pv_draw_idx_arr(pv->data, pv->size);
+  return pv_draw_idx_arr_rng(NULL, pv->data, pv->size);
+}
+
+int pv_draw_idx_rng(RngContext *rng, Vector *pv) {
+  return pv_draw_idx_arr_rng(rng, pv->data, pv->size);
 }
 
 
@@ -0,0 +1,98 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Counter-based random number generation (Philox4x32-10).  See rng.h */
+
+#include <stdlib.h>
+#include <phast/rng.h>
+#include <phast/misc.h>
+#include <phast/external_libs.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+#define PHILOX_ROUNDS 10
+
+/* the calling thread's current stream (see rng_set_thread) */
+static PHAST_TLS RngContext *thread_rng = NULL;
+
+/* apply the Philox4x32 bijection to ctr under key, storing the
+   result in out */
+static void philox4x32(const unsigned int ctr[4], const unsigned int key[2],
+                       unsigned int out[4]) {
+  unsigned int c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3],
+    k0 = key[0], k1 = key[1];
+  int r;
+  for (r = 0; r < PHILOX_ROUNDS; r++) {
+    unsigned long long p0 = (unsigned long long)PHILOX_M0 * c0,
+      p1 = (unsigned long long)PHILOX_M1 * c2;
+    unsigned int hi0 = (unsigned int)(p0 >> 32), lo0 = (unsigned int)p0,
+      hi1 = (unsigned int)(p1 >> 32), lo1 = (unsigned int)p1;
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+RngContext *rng_new(unsigned long long seed, unsigned long long stream) {
+  RngContext *rng = smalloc(sizeof(RngContext));
+  rng_init(rng, seed, stream);
+  return rng;
+}
+
+void rng_init(RngContext *rng, unsigned long long seed,
+              unsigned long long stream) {
+  rng->key[0] = (unsigned int)seed;
+  rng->key[1] = (unsigned int)(seed >> 32);
+  rng->ctr[0] = rng->ctr[1] = 0;
+  rng->ctr[2] = (unsigned int)stream;
+  rng->ctr[3] = (unsigned int)(stream >> 32);
+  rng->nused = 4;               /* no block computed yet */
+}
+
+void rng_free(RngContext *rng) {
+  sfree(rng);
+}
+
+unsigned int rng_u32(RngContext *rng) {
+  if (rng->nused == 4) {
+    philox4x32(rng->ctr, rng->key, rng->block);
+    if (++rng->ctr[0] == 0) rng->ctr[1]++;
+    rng->nused = 0;
+  }
+  return rng->block[rng->nused++];
+}
+
+double rng_unif(RngContext *rng) {
+  unsigned long long hi, lo;
+  if (rng == NULL) rng = thread_rng;
+  if (rng == NULL) {
+#ifdef RPHAST
+    return unif_rand();
+#else
+    return 1.0*random()/RAND_MAX;
+#endif
+  }
+  hi = rng_u32(rng) >> 5;       /* 27 bits */
+  lo = rng_u32(rng) >> 6;       /* 26 bits */
+  return ((hi << 26 | lo) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+void rng_set_thread(RngContext *rng) {
+  thread_rng = rng;
+}
+
+RngContext *rng_get_thread() {
+  return thread_rng;
+}
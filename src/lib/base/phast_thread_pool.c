@@ -0,0 +1,184 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Simple pool of worker threads with dynamic job scheduling.  See
+   thread_pool.h */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <phast/thread_pool.h>
+#include <phast/misc.h>
+
+#ifdef PHAST_THREADS
+#include <pthread.h>
+#endif
+
+struct thr_pool_struct {
+  int nthreads;
+#ifdef PHAST_THREADS
+  pthread_t *workers;           /* nthreads-1 worker threads */
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;    /* signalled when a new batch starts */
+  pthread_cond_t work_done;     /* signalled when last worker finishes */
+  int batch;                    /* incremented for each call to
+                                   thr_foreach */
+  int shutdown;
+  int njobs, next_job;          /* jobs in current batch, next to hand
+                                   out */
+  int nbusy;                    /* workers still working on current
+                                   batch */
+  thr_job_func func;
+  void *data;
+#endif
+};
+
+/* TRUE while the current thread is running a job; used to run nested
+   calls to thr_foreach serially rather than deadlocking */
+static PHAST_TLS int in_job = 0;
+
+static void run_serial(int njobs, thr_job_func func, void *data) {
+  int job, was_in_job = in_job;
+  in_job = 1;
+  for (job = 0; job < njobs; job++)
+    func(data, job, 0);
+  in_job = was_in_job;
+}
+
+#ifdef PHAST_THREADS
+
+/* hand out jobs from the current batch until none are left */
+static void run_jobs(ThreadPool *pool, int thread) {
+  int job;
+  in_job = 1;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    job = pool->next_job++;
+    pthread_mutex_unlock(&pool->lock);
+    if (job >= pool->njobs) break;
+    pool->func(pool->data, job, thread);
+  }
+  in_job = 0;
+}
+
+typedef struct {
+  ThreadPool *pool;
+  int thread;
+} WorkerArg;
+
+static void *worker_main(void *arg) {
+  ThreadPool *pool = ((WorkerArg*)arg)->pool;
+  int thread = ((WorkerArg*)arg)->thread, batch = 0;
+  free(arg);
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->shutdown && pool->batch == batch)
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    if (pool->shutdown) break;
+    batch = pool->batch;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_jobs(pool, thread);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->nbusy == 0)
+      pthread_cond_signal(&pool->work_done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+#endif
+
+ThreadPool *thr_pool_new(int nthreads) {
+  ThreadPool *pool = smalloc(sizeof(ThreadPool));
+  if (nthreads < 1) nthreads = thr_ncpus();
+#ifdef PHAST_THREADS
+  {
+    int i;
+    pool->nthreads = nthreads;
+    pool->batch = 0;
+    pool->shutdown = FALSE;
+    pool->njobs = pool->next_job = pool->nbusy = 0;
+    pool->func = NULL;
+    pool->data = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->workers = smalloc(nthreads * sizeof(pthread_t));
+    for (i = 1; i < nthreads; i++) {
+      /* allocated with malloc rather than smalloc because freed by
+         the worker */
+      WorkerArg *arg = malloc(sizeof(WorkerArg));
+      if (arg == NULL) die("ERROR: thr_pool_new: out of memory.\n");
+      arg->pool = pool;
+      arg->thread = i;
+      if (pthread_create(&pool->workers[i], NULL, worker_main, arg) != 0)
+        die("ERROR: thr_pool_new: unable to create thread %d.\n", i);
+    }
+  }
+#else
+  pool->nthreads = 1;
+#endif
+  return pool;
+}
+
+void thr_pool_free(ThreadPool *pool) {
+#ifdef PHAST_THREADS
+  int i;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = TRUE;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 1; i < pool->nthreads; i++)
+    pthread_join(pool->workers[i], NULL);
+  sfree(pool->workers);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->work_done);
+#endif
+  sfree(pool);
+}
+
+int thr_pool_size(ThreadPool *pool) {
+  return pool == NULL ? 1 : pool->nthreads;
+}
+
+void thr_foreach(ThreadPool *pool, int njobs, thr_job_func func, void *data) {
+  if (pool == NULL || pool->nthreads == 1 || njobs <= 1 || in_job) {
+    run_serial(njobs, func, data);
+    return;
+  }
+#ifdef PHAST_THREADS
+  pthread_mutex_lock(&pool->lock);
+  pool->func = func;
+  pool->data = data;
+  pool->njobs = njobs;
+  pool->next_job = 0;
+  pool->nbusy = pool->nthreads - 1;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_jobs(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->nbusy > 0)
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+int thr_ncpus() {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n >= 1) return (int)n;
+#endif
+  return 1;
+}
@@ -0,0 +1,276 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Compact binary per-base score tracks.  See bin_track.h */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <phast/bin_track.h>
+#include <phast/misc.h>
+
+static int value_size(btk_encoding encoding) {
+  if (encoding == BTK_FLOAT32) return sizeof(float);
+  if (encoding == BTK_UINT16) return sizeof(unsigned short);
+  return sizeof(unsigned char);
+}
+
+static int quant_max(btk_encoding encoding) {
+  return encoding == BTK_UINT16 ? BTK_UINT16_MAX : BTK_UINT8_MAX;
+}
+
+static void flush_buffer(BinTrackWriter *w) {
+  if (w->buflen > 0 && fwrite(w->buf, 1, w->buflen, w->F) != w->buflen)
+    die("ERROR: unable to write binary track.\n");
+  w->buflen = 0;
+}
+
+/* append raw bytes to the buffer, flushing as needed */
+static void write_bytes(BinTrackWriter *w, const void *data, size_t len) {
+  if (w->buflen + len > BTK_BUFSIZE) flush_buffer(w);
+  if (len > BTK_BUFSIZE) {      /* never happens for values */
+    if (fwrite(data, 1, len, w->F) != len)
+      die("ERROR: unable to write binary track.\n");
+  }
+  else {
+    memcpy(w->buf + w->buflen, data, len);
+    w->buflen += len;
+  }
+  w->offset += len;
+}
+
+int btk_parse_format(const char *spec, btk_encoding *encoding, double *min,
+                     double *max) {
+  const char *colon = strchr(spec, ':');
+  size_t len = colon == NULL ? strlen(spec) : (size_t)(colon - spec);
+
+  if (len == 7 && strncmp(spec, "float32", len) == 0)
+    *encoding = BTK_FLOAT32;
+  else if (len == 6 && strncmp(spec, "uint16", len) == 0)
+    *encoding = BTK_UINT16;
+  else if (len == 5 && strncmp(spec, "uint8", len) == 0)
+    *encoding = BTK_UINT8;
+  else return 1;
+
+  if (colon != NULL) {
+    double lo, hi;
+    char extra;
+    if (*encoding == BTK_FLOAT32 ||
+        sscanf(colon+1, "%lf,%lf%c", &lo, &hi, &extra) != 2 || lo >= hi)
+      return 1;
+    *min = lo;
+    *max = hi;
+  }
+  return 0;
+}
+
+BinTrackWriter *btk_writer_new(FILE *F, btk_encoding encoding, double min,
+                               double max) {
+  BinTrackWriter *w = smalloc(sizeof(BinTrackWriter));
+  int version = BTK_VERSION, enc = encoding;
+  if (encoding != BTK_FLOAT32 && min >= max)
+    die("ERROR: btk_writer_new: empty quantisation range [%f, %f].\n",
+        min, max);
+  w->F = F;
+  w->encoding = encoding;
+  w->min = min;
+  w->max = max;
+  w->buf = smalloc(BTK_BUFSIZE);
+  w->buflen = 0;
+  w->offset = 0;
+  w->blocks = lst_new_ptr(10);
+  write_bytes(w, BTK_MAGIC, strlen(BTK_MAGIC));
+  write_bytes(w, &version, sizeof(int));
+  write_bytes(w, &enc, sizeof(int));
+  write_bytes(w, &w->min, sizeof(double));
+  write_bytes(w, &w->max, sizeof(double));
+  return w;
+}
+
+void btk_start_block(BinTrackWriter *w, const char *chrom, long long start) {
+  BinTrackBlock *b = smalloc(sizeof(BinTrackBlock));
+  b->chrom = copy_charstr(chrom);
+  b->start = start;
+  b->nvalues = 0;
+  b->offset = w->offset;
+  lst_push_ptr(w->blocks, b);
+}
+
+void btk_put(BinTrackWriter *w, double val) {
+  BinTrackBlock *b;
+  if (lst_size(w->blocks) == 0)
+    die("ERROR: btk_put: no block started.\n");
+  b = lst_get_ptr(w->blocks, lst_size(w->blocks)-1);
+  b->nvalues++;
+
+  if (w->encoding == BTK_FLOAT32) {
+    float f = (float)val;
+    write_bytes(w, &f, sizeof(float));
+  }
+  else {
+    int qmax = quant_max(w->encoding), q;
+    if (isnan(val)) q = qmax + 1;
+    else if (val <= w->min) q = 0;
+    else if (val >= w->max) q = qmax;
+    else q = (int)floor((val - w->min) / (w->max - w->min) * qmax + 0.5);
+
+    if (w->encoding == BTK_UINT16) {
+      unsigned short s = (unsigned short)q;
+      write_bytes(w, &s, sizeof(unsigned short));
+    }
+    else {
+      unsigned char c = (unsigned char)q;
+      write_bytes(w, &c, sizeof(unsigned char));
+    }
+  }
+}
+
+void btk_writer_close(BinTrackWriter *w) {
+  long long index_offset = w->offset;
+  int i, nblocks = lst_size(w->blocks);
+  for (i = 0; i < nblocks; i++) {
+    BinTrackBlock *b = lst_get_ptr(w->blocks, i);
+    int len = (int)strlen(b->chrom);
+    write_bytes(w, &len, sizeof(int));
+    write_bytes(w, b->chrom, len);
+    write_bytes(w, &b->start, sizeof(long long));
+    write_bytes(w, &b->nvalues, sizeof(long long));
+    write_bytes(w, &b->offset, sizeof(long long));
+    sfree(b->chrom);
+    sfree(b);
+  }
+  write_bytes(w, &index_offset, sizeof(long long));
+  write_bytes(w, &nblocks, sizeof(int));
+  write_bytes(w, BTK_MAGIC, strlen(BTK_MAGIC));
+  flush_buffer(w);
+  fflush(w->F);
+  lst_free(w->blocks);
+  sfree(w->buf);
+  sfree(w);
+}
+
+static void read_or_die(void *data, size_t size, size_t n, FILE *F) {
+  if (fread(data, size, n, F) != n)
+    die("ERROR: binary track is truncated or corrupt.\n");
+}
+
+BinTrack *btk_open(FILE *F) {
+  BinTrack *t;
+  char magic[sizeof(BTK_MAGIC)];
+  size_t mlen = strlen(BTK_MAGIC);
+  int version, enc, nblocks, i;
+  long long index_offset;
+
+  read_or_die(magic, sizeof(char), mlen, F);
+  if (strncmp(magic, BTK_MAGIC, mlen) != 0)
+    die("ERROR: btk_open: not a binary track.\n");
+  read_or_die(&version, sizeof(int), 1, F);
+  if (version != BTK_VERSION)
+    die("ERROR: btk_open: unsupported binary track version %d.\n", version);
+  read_or_die(&enc, sizeof(int), 1, F);
+  if (enc != BTK_FLOAT32 && enc != BTK_UINT16 && enc != BTK_UINT8)
+    die("ERROR: btk_open: unknown encoding %d.\n", enc);
+
+  t = smalloc(sizeof(BinTrack));
+  t->F = F;
+  t->encoding = enc;
+  read_or_die(&t->min, sizeof(double), 1, F);
+  read_or_die(&t->max, sizeof(double), 1, F);
+
+  /* trailer */
+  if (fseek(F, -(long)(sizeof(long long) + sizeof(int) + mlen), SEEK_END) != 0)
+    die("ERROR: btk_open: binary track must be seekable.\n");
+  read_or_die(&index_offset, sizeof(long long), 1, F);
+  read_or_die(&nblocks, sizeof(int), 1, F);
+  read_or_die(magic, sizeof(char), mlen, F);
+  if (strncmp(magic, BTK_MAGIC, mlen) != 0 || nblocks < 0)
+    die("ERROR: btk_open: binary track is truncated or corrupt.\n");
+
+  /* index */
+  t->blocks = lst_new_ptr(nblocks > 0 ? nblocks : 1);
+  if (fseek(F, (long)index_offset, SEEK_SET) != 0)
+    die("ERROR: btk_open: binary track is truncated or corrupt.\n");
+  for (i = 0; i < nblocks; i++) {
+    BinTrackBlock *b = smalloc(sizeof(BinTrackBlock));
+    int len;
+    read_or_die(&len, sizeof(int), 1, F);
+    if (len < 0)
+      die("ERROR: btk_open: binary track is truncated or corrupt.\n");
+    b->chrom = smalloc((len+1) * sizeof(char));
+    read_or_die(b->chrom, sizeof(char), len, F);
+    b->chrom[len] = '\0';
+    read_or_die(&b->start, sizeof(long long), 1, F);
+    read_or_die(&b->nvalues, sizeof(long long), 1, F);
+    read_or_die(&b->offset, sizeof(long long), 1, F);
+    lst_push_ptr(t->blocks, b);
+  }
+  return t;
+}
+
+void btk_read_block(BinTrack *t, BinTrackBlock *block, double *vals) {
+  long long i;
+  int size = value_size(t->encoding), qmax = quant_max(t->encoding);
+  void *raw = smalloc(block->nvalues * size + 1);
+
+  if (fseek(t->F, (long)block->offset, SEEK_SET) != 0)
+    die("ERROR: btk_read_block: binary track is truncated or corrupt.\n");
+  read_or_die(raw, size, block->nvalues, t->F);
+
+  for (i = 0; i < block->nvalues; i++) {
+    if (t->encoding == BTK_FLOAT32)
+      vals[i] = ((float*)raw)[i];
+    else {
+      int q = t->encoding == BTK_UINT16 ? ((unsigned short*)raw)[i] :
+        ((unsigned char*)raw)[i];
+      if (q > qmax) vals[i] = NAN;
+      else vals[i] = t->min + (t->max - t->min) * q / qmax;
+    }
+  }
+  sfree(raw);
+}
+
+void btk_free(BinTrack *t) {
+  int i;
+  for (i = 0; i < lst_size(t->blocks); i++) {
+    BinTrackBlock *b = lst_get_ptr(t->blocks, i);
+    sfree(b->chrom);
+    sfree(b);
+  }
+  lst_free(t->blocks);
+  sfree(t);
+}
+
+void btk_print_wig(BinTrack *t, FILE *outf, int precision) {
+  int i;
+  long long j, maxlen = 0;
+  double *vals;
+  for (i = 0; i < lst_size(t->blocks); i++) {
+    BinTrackBlock *b = lst_get_ptr(t->blocks, i);
+    if (b->nvalues > maxlen) maxlen = b->nvalues;
+  }
+  vals = smalloc((maxlen + 1) * sizeof(double));
+  for (i = 0; i < lst_size(t->blocks); i++) {
+    BinTrackBlock *b = lst_get_ptr(t->blocks, i);
+    int need_header = TRUE;
+    btk_read_block(t, b, vals);
+    for (j = 0; j < b->nvalues; j++) {
+      if (isnan(vals[j])) {
+        need_header = TRUE;
+        continue;
+      }
+      if (need_header) {
+        fprintf(outf, "fixedStep chrom=%s start=%lld step=1\n", b->chrom,
+                b->start + j);
+        need_header = FALSE;
+      }
+      fprintf(outf, "%.*f\n", precision, vals[j]);
+    }
+  }
+  sfree(vals);
+}
@@ -16,6 +16,7 @@
 #include <phast/misc.h>
 #include <phast/sufficient_stats.h>
 #include <phast/fit_em.h>
+#include <phast/thread_pool.h>
 #include <sys/time.h>
 
 /* generic log function: show log likelihood and all HMM transitions
@@ -284,3 +285,320 @@ double hmm_train_by_em(HMM *hmm, void *models, void *data, int nsamples,
   return total_logl;
 }
 
+
+/* Data shared by the per-window E-step jobs of
+   hmm_train_by_em_pooled */
+typedef struct {
+  HMM *hmm;
+  void *data;
+  double **emissions;           /* emissions for whole sequence */
+  int *window_starts, *window_lens;
+  int (*get_observation_index)(void*, int, int);
+  double ***forward_scores,     /* per-thread workspace */
+    ***backward_scores,
+    ***window_emissions;        /* per-thread pointers into emissions */
+  double **post;                /* posterior probs for whole sequence;
+                                   NULL if state models not estimated */
+  double *window_logl;          /* per-window log likelihood */
+  double **window_A,            /* per-window expected transition
+                                   counts (nstates x nstates) */
+    **window_totalA;            /* per-window row sums of window_A */
+  FILE *logf;
+} PooledEStepData;
+
+/* E step for a single window: forward/backward, then expected
+   transition counts for the window and posterior probabilities for
+   each of its columns.  Expected emission counts are accumulated
+   afterward, in a fixed order, by the caller */
+static void pooled_estep_window(void *data, int w, int thread) {
+  PooledEStepData *d = data;
+  HMM *hmm = d->hmm;
+  int nstates = hmm->nstates, start = d->window_starts[w],
+    len = d->window_lens[w], i, k, l;
+  double **emissions = d->window_emissions[thread],
+    **forward_scores = d->forward_scores[thread],
+    **backward_scores = d->backward_scores[thread],
+    *A = d->window_A[w], *totalA = d->window_totalA[w];
+  double *tempA, logp_fw, logp_bw, sum, val, this_logp;
+  List *val_list = NULL;
+
+  for (k = 0; k < nstates; k++)
+    emissions[k] = &d->emissions[k][start];
+
+  logp_fw = hmm_forward(hmm, emissions, len, forward_scores);
+  logp_bw = hmm_backward(hmm, emissions, len, backward_scores);
+
+  if (fabs(logp_fw - logp_bw) > 1.0)
+    if (d->logf != NULL)
+      fprintf(d->logf, "WARNING: forward and backward algorithms returned different total log\nprobabilities in window %d (%f and %f, respectively).\n", w, logp_fw, logp_bw);
+
+  d->window_logl[w] = logp_fw;
+
+  tempA = smalloc(nstates * nstates * sizeof(double));
+  for (k = 0; k < nstates; k++) {
+    for (l = 0; l < nstates; l++)
+      A[k*nstates + l] = 0;
+    totalA[k] = 0;
+  }
+  if (d->post != NULL)
+    val_list = lst_new_dbl(nstates);
+
+  for (i = 0; i < len; i++) {
+    if (d->post != NULL) {
+      lst_clear(val_list);
+      for (l = 0; l < nstates; l++)
+        lst_push_dbl(val_list, (forward_scores[l][i] +
+                                backward_scores[l][i]));
+      this_logp = log_sum(val_list);
+      /* (transitions are skipped here too, as in hmm_train_by_em) */
+      if (d->get_observation_index(d->data, 0, start + i) == -1) continue;
+      for (k = 0; k < nstates; k++)
+        d->post[k][start + i] = exp2(forward_scores[k][i] +
+                                     backward_scores[k][i] - this_logp);
+    }
+
+    if (i != len-1) {
+      sum = 0.0;
+      for (k = 0; k < nstates; k++) {
+        for (l = 0; l < nstates; l++) {
+          val = exp2(forward_scores[k][i] +
+                     hmm_get_transition_score(hmm, k, l) +
+                     emissions[l][i+1] + backward_scores[l][i+1] -
+                     logp_fw);
+          sum += (tempA[k*nstates + l] = val);
+        }
+      }
+      for (k = 0; k < nstates; k++) {
+        for (l = 0; l < nstates; l++) {
+          A[k*nstates + l] += tempA[k*nstates + l]/sum;
+          totalA[k] += tempA[k*nstates + l]/sum;
+        }
+      }
+    }
+  }
+
+  sfree(tempA);
+  if (val_list != NULL) lst_free(val_list);
+}
+
+/* Like hmm_train_by_em, but for a single sequence divided into
+   windows, with the HMM run separately in each window.  The E step is
+   done in parallel over windows, with expected counts summed across
+   windows (in window order, so that results do not depend on the
+   number of threads) before a single M step.  See em.h */
+double hmm_train_by_em_pooled(HMM *hmm, void *models, void *data,
+                              int nwindows, int *window_starts,
+                              int *window_lens, int nthreads,
+                              void (*compute_emissions)(double**, void**, int,
+                                                        void*, int, int),
+                              void (*estimate_state_models)(TreeModel**, int,
+                                                            void*, double**,
+                                                            int, FILE*),
+                              void (*estimate_transitions)(HMM*, void*,
+                                                           double**),
+                              int (*get_observation_index)(void*, int, int),
+                              void (*log_function)(FILE*, double, HMM*, void*,
+                                                   int),
+                              double **emissions_alloc, FILE *logf) {
+  int i, k, l, w, t, obsidx, nobs = 0, maxlen = 0, seqlen, done, it, nthr;
+  double **emissions, **E = NULL, **A, *totalA;
+  double total_logl, prev_total_logl;
+  ThreadPool *pool;
+  PooledEStepData d;
+  struct timeval start_time, end_time;
+
+  if (estimate_state_models != NULL &&
+      (get_observation_index == NULL || compute_emissions == NULL))
+    die("ERROR: (hmm_train_by_em_pooled) If estimating state models, must pass in non-NULL functions get_observation_index and compute_emissions.\n");
+
+  if (compute_emissions == NULL && emissions_alloc == NULL)
+    die("ERROR: (hmm_train_by_em_pooled) compute_emissions function required.\n");
+
+  if (nwindows < 1)
+    die("ERROR: (hmm_train_by_em_pooled) no windows given.\n");
+
+  for (w = 0; w < nwindows; w++) {
+    if (window_lens[w] <= 0 || window_starts[w] < 0 ||
+        (w > 0 && window_starts[w] < window_starts[w-1] + window_lens[w-1]))
+      die("ERROR: (hmm_train_by_em_pooled) windows must be nonempty, in order, and nonoverlapping.\n");
+    if (window_lens[w] > maxlen) maxlen = window_lens[w];
+  }
+  seqlen = window_starts[nwindows-1] + window_lens[nwindows-1];
+
+  if (logf != NULL)
+    gettimeofday(&start_time, NULL);
+
+  pool = thr_pool_new(nthreads);
+  nthr = thr_pool_size(pool);
+
+  d.hmm = hmm;
+  d.data = data;
+  d.window_starts = window_starts;
+  d.window_lens = window_lens;
+  d.get_observation_index = get_observation_index;
+  d.logf = logf;
+
+  d.forward_scores = smalloc(nthr * sizeof(double**));
+  d.backward_scores = smalloc(nthr * sizeof(double**));
+  d.window_emissions = smalloc(nthr * sizeof(double**));
+  for (t = 0; t < nthr; t++) {
+    d.forward_scores[t] = smalloc(hmm->nstates * sizeof(double*));
+    d.backward_scores[t] = smalloc(hmm->nstates * sizeof(double*));
+    d.window_emissions[t] = smalloc(hmm->nstates * sizeof(double*));
+    for (k = 0; k < hmm->nstates; k++) {
+      d.forward_scores[t][k] = smalloc(maxlen * sizeof(double));
+      d.backward_scores[t][k] = smalloc(maxlen * sizeof(double));
+    }
+  }
+
+  if (emissions_alloc != NULL)
+    emissions = emissions_alloc;
+  else {
+    emissions = smalloc(hmm->nstates * sizeof(double*));
+    for (k = 0; k < hmm->nstates; k++)
+      emissions[k] = smalloc(seqlen * sizeof(double));
+  }
+  d.emissions = emissions;
+
+  d.window_logl = smalloc(nwindows * sizeof(double));
+  d.window_A = smalloc(nwindows * sizeof(double*));
+  d.window_totalA = smalloc(nwindows * sizeof(double*));
+  for (w = 0; w < nwindows; w++) {
+    d.window_A[w] = smalloc(hmm->nstates * hmm->nstates * sizeof(double));
+    d.window_totalA[w] = smalloc(hmm->nstates * sizeof(double));
+  }
+
+  A = smalloc(hmm->nstates * sizeof(double*));
+  for (k = 0; k < hmm->nstates; k++)
+    A[k] = smalloc(hmm->nstates * sizeof(double));
+  totalA = smalloc(hmm->nstates * sizeof(double));
+
+  d.post = NULL;
+  if (estimate_state_models != NULL) {
+    nobs = get_observation_index(data, -1, -1);
+    E = smalloc(hmm->nstates * sizeof(double*));
+    d.post = smalloc(hmm->nstates * sizeof(double*));
+    for (k = 0; k < hmm->nstates; k++) {
+      E[k] = smalloc(nobs * sizeof(double));
+      d.post[k] = smalloc(seqlen * sizeof(double));
+    }
+  }
+
+  prev_total_logl = NEGINFTY;
+  done = FALSE;
+
+  for (it = 1; !done; it++) {
+    checkInterrupt();
+
+    if (compute_emissions != NULL &&
+        (estimate_state_models != NULL || it == 1))
+      compute_emissions(emissions, models, hmm->nstates, data, 0, seqlen);
+
+    /* E step, in parallel over windows */
+    thr_foreach(pool, nwindows, pooled_estep_window, &d);
+
+    /* pool expected counts in window order */
+    total_logl = 0;
+    for (k = 0; k < hmm->nstates; k++) {
+      for (l = 0; l < hmm->nstates; l++)
+        A[k][l] = 0;
+      totalA[k] = 0;
+    }
+    if (estimate_state_models != NULL)
+      for (k = 0; k < hmm->nstates; k++)
+        for (obsidx = 0; obsidx < nobs; obsidx++)
+          E[k][obsidx] = 0;
+
+    for (w = 0; w < nwindows; w++) {
+      total_logl += d.window_logl[w];
+      for (k = 0; k < hmm->nstates; k++) {
+        for (l = 0; l < hmm->nstates; l++)
+          A[k][l] += d.window_A[w][k*hmm->nstates + l];
+        totalA[k] += d.window_totalA[w][k];
+      }
+      if (estimate_state_models != NULL) {
+        for (i = window_starts[w]; i < window_starts[w] + window_lens[w]; i++) {
+          obsidx = get_observation_index(data, 0, i);
+          if (obsidx == -1) continue;
+          for (k = 0; k < hmm->nstates; k++)
+            E[k][obsidx] += d.post[k][i];
+        }
+      }
+    }
+
+    if (logf != NULL) {
+      if (log_function != NULL)
+        log_function(logf, total_logl, hmm, data, it == 1);
+      else
+        default_log_function(logf, total_logl, hmm, NULL, it == 1);
+    }
+
+    if (total_logl < prev_total_logl)
+      phast_warning("WARNING: likelihood decreased during EM: it %i total_logl=%.10g, prev_total_logl=%.10g\n", it, total_logl, prev_total_logl);
+
+    /* check convergence */
+    if (fabs(total_logl - prev_total_logl) <= EM_CONVERGENCE_THRESHOLD)
+      done = TRUE;
+
+    else {                      /* M step */
+      prev_total_logl = total_logl;
+
+      if (estimate_transitions != NULL)
+        estimate_transitions(hmm, data, A);
+      else
+        for (k = 0; k < hmm->nstates; k++)
+          for (l = 0; l < hmm->nstates; l++)
+            mm_set(hmm->transition_matrix, k, l, A[k][l] / totalA[k]);
+
+      hmm_reset(hmm);
+
+      if (estimate_state_models != NULL)
+        estimate_state_models(models, hmm->nstates, data, E, nobs, logf);
+    }
+  }
+
+  if (logf != NULL) {
+    gettimeofday(&end_time, NULL);
+    fprintf(logf, "\nNumber of iterations: %d\nNumber of windows: %d\nTotal time: %.4f sec.\n",
+            it, nwindows, end_time.tv_sec - start_time.tv_sec +
+            (end_time.tv_usec - start_time.tv_usec)/1.0e6);
+  }
+
+  thr_pool_free(pool);
+  for (t = 0; t < nthr; t++) {
+    for (k = 0; k < hmm->nstates; k++) {
+      sfree(d.forward_scores[t][k]);
+      sfree(d.backward_scores[t][k]);
+    }
+    sfree(d.forward_scores[t]);
+    sfree(d.backward_scores[t]);
+    sfree(d.window_emissions[t]);
+  }
+  sfree(d.forward_scores);
+  sfree(d.backward_scores);
+  sfree(d.window_emissions);
+  for (w = 0; w < nwindows; w++) {
+    sfree(d.window_A[w]);
+    sfree(d.window_totalA[w]);
+  }
+  sfree(d.window_A);
+  sfree(d.window_totalA);
+  sfree(d.window_logl);
+  for (k = 0; k < hmm->nstates; k++) {
+    sfree(A[k]);
+    if (emissions_alloc == NULL) sfree(emissions[k]);
+    if (estimate_state_models != NULL) {
+      sfree(E[k]);
+      sfree(d.post[k]);
+    }
+  }
+  sfree(A);
+  sfree(totalA);
+  if (emissions_alloc == NULL) sfree(emissions);
+  if (estimate_state_models != NULL) {
+    sfree(E);
+    sfree(d.post);
+  }
+
+  return total_logl;
+}
@@ -266,6 +266,73 @@ double hmm_get_transition_score(HMM *hmm, int from_state, int to_state) {
   return (mat_get(hmm->transition_score_matrix, from_state, to_state));
 }
 
+/* Special case of DP routines for two-state HMMs with all four
+   transitions allowed (e.g., the default phastCons model).  The
+   transition scores are looked up once and the max or log-sum over
+   the two predecessors/successors is computed inline, avoiding the
+   list manipulation and sorting in hmm_max_or_sum.  Results are
+   identical to those of the general routines. */
+static int is_full_two_state(HMM *hmm) {
+  return (hmm->nstates == 2 &&
+          mm_get(hmm->transition_matrix, 0, 0) > 0 &&
+          mm_get(hmm->transition_matrix, 0, 1) > 0 &&
+          mm_get(hmm->transition_matrix, 1, 0) > 0 &&
+          mm_get(hmm->transition_matrix, 1, 1) > 0);
+}
+
+/* log2(2^a + 2^b); same as log_sum for a list of two elements */
+static PHAST_INLINE double log_sum2(double a, double b) {
+  double hi = (a > b ? a : b), d = (a > b ? b : a) - hi;
+  return (d > SUM_LOG_THRESHOLD ? hi + log2(1 + exp2(d)) : hi);
+}
+
+static void dp_forward_two_state(HMM *hmm, double **emission_scores, 
+                                 int seqlen, hmm_mode mode, 
+                                 double **full_scores, int **backptr) {
+  double t00 = hmm_get_transition_score(hmm, 0, 0),
+    t01 = hmm_get_transition_score(hmm, 0, 1),
+    t10 = hmm_get_transition_score(hmm, 1, 0),
+    t11 = hmm_get_transition_score(hmm, 1, 1);
+  double *f0 = full_scores[0], *f1 = full_scores[1], 
+    *e0 = emission_scores[0], *e1 = emission_scores[1];
+  int j;
+
+  if (mode == VITERBI) {
+    for (j = 1; j < seqlen; j++) {
+      double c00 = f0[j-1] + t00, c10 = f1[j-1] + t10,
+        c01 = f0[j-1] + t01, c11 = f1[j-1] + t11;
+      backptr[0][j] = (c10 > c00);
+      backptr[1][j] = (c11 > c01);
+      f0[j] = e0[j] + (c10 > c00 ? c10 : c00);
+      f1[j] = e1[j] + (c11 > c01 ? c11 : c01);
+    }
+  }
+  else {
+    for (j = 1; j < seqlen; j++) {
+      f0[j] = e0[j] + log_sum2(f0[j-1] + t00, f1[j-1] + t10);
+      f1[j] = e1[j] + log_sum2(f0[j-1] + t01, f1[j-1] + t11);
+    }
+  }
+}
+
+static void dp_backward_two_state(HMM *hmm, double **emission_scores, 
+                                  int seqlen, double **full_scores) {
+  double t00 = hmm_get_transition_score(hmm, 0, 0),
+    t01 = hmm_get_transition_score(hmm, 0, 1),
+    t10 = hmm_get_transition_score(hmm, 1, 0),
+    t11 = hmm_get_transition_score(hmm, 1, 1);
+  double *b0 = full_scores[0], *b1 = full_scores[1], 
+    *e0 = emission_scores[0], *e1 = emission_scores[1];
+  int j;
+
+  for (j = seqlen - 2; j >= 0; j--) {
+    double s0 = e0[j+1] + b0[j+1], s1 = e1[j+1] + b1[j+1];
+    checkInterruptN(j, 1000);
+    b0[j] = log_sum2(s0 + t00, s1 + t01);
+    b1[j] = log_sum2(s0 + t10, s1 + t11);
+  }
+}
+
 /* Finds most probable path, according to the Viterbi algorithm.
    Emission scores must be passed in as a two dimensional matrix, with
    hmm->nstates rows and seqlen columns.  The array "path" must be
@@ -393,22 +460,35 @@ double hmm_posterior_probs(HMM *hmm, double **emission_scores, int seqlen,
 
   /* compute posterior probs */
   val_list = lst_new_dbl(hmm->nstates);
-  for (j = 0; j < len; j++) {
-    double this_logp;
-    checkInterruptN(i, 1000);
-
-    /* to avoid rounding errors, estimate total log prob
-       separately for each column */
-    lst_clear(val_list);
-    for (i = 0; i < hmm->nstates; i++) 
-      lst_push_dbl(val_list, (forward_scores[i][j] + backward_scores[i][j]));
-    this_logp = log_sum(val_list);
-
-    for (i = 0; i < hmm->nstates; i++) 
-      if (posterior_probs[i] != NULL) /* indicates probs for this
-                                         state are not desired */
-        posterior_probs[i][j] = exp2(forward_scores[i][j] + 
-                                     backward_scores[i][j] - this_logp);
+  if (hmm->nstates == 2) {       /* special case, for efficiency */
+    for (j = 0; j < len; j++) {
+      double s0 = forward_scores[0][j] + backward_scores[0][j],
+        s1 = forward_scores[1][j] + backward_scores[1][j],
+        this_logp = log_sum2(s0, s1);
+      if (posterior_probs[0] != NULL) 
+        posterior_probs[0][j] = exp2(s0 - this_logp);
+      if (posterior_probs[1] != NULL) 
+        posterior_probs[1][j] = exp2(s1 - this_logp);
+    }
+  }
+  else {
+    for (j = 0; j < len; j++) {
+      double this_logp;
+      checkInterruptN(i, 1000);
+
+      /* to avoid rounding errors, estimate total log prob
+         separately for each column */
+      lst_clear(val_list);
+      for (i = 0; i < hmm->nstates; i++) 
+        lst_push_dbl(val_list, (forward_scores[i][j] + backward_scores[i][j]));
+      this_logp = log_sum(val_list);
+
+      for (i = 0; i < hmm->nstates; i++) 
+        if (posterior_probs[i] != NULL) /* indicates probs for this
+                                           state are not desired */
+          posterior_probs[i][j] = exp2(forward_scores[i][j] + 
+                                       backward_scores[i][j] - this_logp);
+    }
   }
 
   for (i = 0; i < hmm->nstates; i++) {
@@ -442,11 +522,16 @@ void hmm_do_dp_forward(HMM *hmm, double **emission_scores, int seqlen,
   }
 
   /* recursion */
-  for (j = 1; j < seqlen; j++) {
-    for (i = 0; i < hmm->nstates; i++) {
-      full_scores[i][j] = emission_scores[i][j] + 
-        hmm_max_or_sum(hmm, full_scores, emission_scores, backptr, 
-                       i, j, mode);
+  if (is_full_two_state(hmm))
+    dp_forward_two_state(hmm, emission_scores, seqlen, mode, full_scores,
+                         backptr);
+  else {
+    for (j = 1; j < seqlen; j++) {
+      for (i = 0; i < hmm->nstates; i++) {
+        full_scores[i][j] = emission_scores[i][j] + 
+          hmm_max_or_sum(hmm, full_scores, emission_scores, backptr, 
+                         i, j, mode);
+      }
     }
   }
 
@@ -472,6 +557,10 @@ void hmm_do_dp_backward(HMM *hmm, double **emission_scores,  int seqlen,
                                 /*  will be 0 when no end state */
 
   /* recursion */
+  if (is_full_two_state(hmm)) {
+    dp_backward_two_state(hmm, emission_scores, seqlen, full_scores);
+    return;
+  }
   for (j = seqlen - 2; j >= 0; j--) {
     checkInterruptN(j, 1000);
     for (i = 0; i < hmm->nstates; i++) {
@@ -493,7 +582,7 @@ double hmm_max_or_sum(HMM *hmm, double **full_scores, double **emission_scores,
   int k;
   double retval = NEGINFTY;
   
-  static List *l = NULL;
+  static PHAST_TLS List *l = NULL;
 
   if (l == NULL) {
     l = lst_new_dbl(hmm->nstates);
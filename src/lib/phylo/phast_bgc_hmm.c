@@ -201,6 +201,7 @@ struct bgchmm_struct *bgchmm_struct_new(int rphast) {
   rv->post_probs_f = rphast ? NULL : stdout;
   rv->random_path = 0;
   rv->get_likelihoods = FALSE;
+  rv->nthreads = 1;
   rv->informative_only = FALSE;
   rv->informative_fn = NULL;
   rv->mods_fn = NULL;
@@ -273,6 +274,7 @@ int bgcHmm(struct bgchmm_struct *b) {
   data->bgc_expected_length = b->bgc_expected_length;
   data->estimate_bgc_target_coverage = b->estimate_bgc_target_coverage;
   data->estimate_bgc_expected_length = b->estimate_bgc_expected_length;
+  data->nthreads = b->nthreads;
 
   if (do_bgc)
     numstate = 4;
@@ -725,7 +727,8 @@ void bgchmm_estimate_states(TreeModel **mods, int nmod, void *data0, double **E,
   use_nmod = nmod;
   for (i=0; i < nmod; i++) usemods[i] = mods[i];
   
-  tm_fit_multi(usemods, use_nmod, &msa, 1, OPT_VERY_HIGH_PREC, NULL, 1);
+  tm_fit_multi(usemods, use_nmod, &msa, 1, OPT_VERY_HIGH_PREC, NULL, 1,
+               data->nthreads);
   sfree(usemods);
 }
 
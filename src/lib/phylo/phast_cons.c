@@ -18,8 +18,17 @@
 #include <phast/dgamma.h>
 #include <phast/tree_likelihoods.h>
 #include <phast/maf.h>
+#include <phast/tuple_lik_cache.h>
+#include <phast/thread_pool.h>
+#include <phast/bin_track.h>
+#include <phast/checkpoint.h>
 #include "phast/cons.h"
 
+static void checkpoint_two_state(PhyloHmm *phmm, Vector *tree_params);
+static double restore_two_state(PhyloHmm *phmm, int estim_trees);
+static void checkpoint_fingerprint(char *fprint, struct phastCons_struct *p,
+                                   PhyloHmm *phmm);
+
 
 struct phastCons_struct *phastCons_struct_new(int rphast) {
   struct phastCons_struct *p = smalloc(sizeof(struct phastCons_struct));
@@ -68,6 +77,14 @@ struct phastCons_struct *phastCons_struct_new(int rphast) {
   p->idpref = NULL;
   p->estim_trees_fname_root = NULL;
   p->extrapolate_tree_fname = NULL;
+  p->lik_cache_fname = NULL;
+  p->binary_track = NULL;
+  p->checkpoint_fname = NULL;
+  p->checkpoint_interval = CKPT_DEFAULT_INTERVAL;
+  p->resume = FALSE;
+  p->em_window = 0;
+  p->em_pooled = FALSE;
+  p->nthreads = 1;
   p->hmm = NULL;
   p->alias_hash = NULL;
   p->extrapolate_tree = NULL;
@@ -86,7 +103,8 @@ int phastCons(struct phastCons_struct *p) {
     estim_transitions, two_state, indels,
     indels_only, estim_indels,
     estim_trees, ignore_missing, estim_rho, set_transitions,
-    nummod, viterbi, compute_likelihood;
+    nummod, viterbi, compute_likelihood, em_window, em_pooled, nthreads,
+    window_fits;
   int nrates, nrates2, refidx, max_micro_indel, free_cm=0;
   double lambda, mu, nu, alpha_0, beta_0, tau_0, alpha_1, beta_1, tau_1,
     gc, gamma, rho, omega;
@@ -94,7 +112,7 @@ int phastCons(struct phastCons_struct *p) {
   List *states, *pivot_states, *inform_reqd,
     *not_informative;
   char *seqname, *idpref, *estim_trees_fname_root,
-    *extrapolate_tree_fname;
+    *extrapolate_tree_fname, *lik_cache_fname, *binary_track;
   HMM *hmm;
   Hashtable *alias_hash;
   TreeNode *extrapolate_tree;
@@ -107,6 +125,8 @@ int phastCons(struct phastCons_struct *p) {
   int i, j, last;
   double lnl = INFTY;
   PhyloHmm *phmm;
+  TupleLikCache *lik_cache = NULL;
+  Checkpoint *ckpt = NULL;
   char *newname;
   indel_mode_type indel_mode;
 
@@ -129,6 +149,9 @@ int phastCons(struct phastCons_struct *p) {
   nrates2 = p->nrates2;
   refidx = p->refidx;
   max_micro_indel = p->max_micro_indel;
+  em_window = p->em_window;
+  em_pooled = p->em_pooled;
+  nthreads = p->nthreads;
   lambda = p->lambda;
   mu = p->mu;
   nu = p->nu;
@@ -155,6 +178,8 @@ int phastCons(struct phastCons_struct *p) {
   idpref = p->idpref;
   estim_trees_fname_root = p->estim_trees_fname_root;
   extrapolate_tree_fname = p->extrapolate_tree_fname;
+  lik_cache_fname = p->lik_cache_fname;
+  binary_track = p->binary_track;
   hmm = p->hmm;
   alias_hash = p->alias_hash;
   extrapolate_tree = p->extrapolate_tree;
@@ -168,6 +193,7 @@ int phastCons(struct phastCons_struct *p) {
   else compute_likelihood = p->compute_likelihood;
   if (viterbi_f != NULL) viterbi=TRUE;
   quiet = (results_f == NULL);
+  window_fits = (em_window > 0 && !em_pooled);
 
   /* enforce usage rules */
   if ((hmm != NULL && FC))
@@ -180,6 +206,24 @@ int phastCons(struct phastCons_struct *p) {
        omega != -1 || set_transitions) && !two_state)
     die("ERROR: --estimate-trees, --target-coverage, --expected-length, --transitions,\nand --estimate-rho can only be used with default two-state HMM.\n");
 
+  if (em_window > 0 && !(two_state && (estim_trees || estim_rho)))
+    die("ERROR: --em-window requires --estimate-trees or --estimate-rho.\n");
+
+  if (em_pooled && em_window <= 0)
+    die("ERROR: --em-pooled requires --em-window.\n");
+
+  if (window_fits && (indels || viterbi || score || compute_likelihood))
+    die("ERROR: --em-window without --em-pooled cannot be used with --indels,\n--most-conserved, --score, or --lnl.\n");
+
+  if (binary_track != NULL && (!post_probs || post_probs_f == NULL ||
+                               window_fits))
+    die("ERROR: --binary-track requires posterior probabilities to be output.\n");
+
+  if (p->checkpoint_fname != NULL &&
+      (!two_state || window_fits ||
+       !(estim_transitions || estim_indels || estim_trees || estim_rho)))
+    die("ERROR: --checkpoint requires estimation of parameters of the two-state HMM,\nand cannot be used with --em-window unless --em-pooled is given.\n");
+
   if (set_transitions && (gamma != -1 || omega != -1))
     die("ERROR: --transitions and --target-coverage/--expected-length cannot be used together.\n");
 
@@ -317,7 +361,7 @@ int phastCons(struct phastCons_struct *p) {
     if (nrates == -1) nrates = mod[0]->nratecats;
   }
 
-  if (viterbi && seqname==NULL)
+  if ((viterbi || binary_track != NULL) && seqname==NULL)
     seqname = "refseq";
 
   /* set up states */
@@ -356,6 +400,24 @@ int phastCons(struct phastCons_struct *p) {
 
   phmm = phmm_new(hmm, mod, cm, pivot_states, indel_mode);
 
+  if (p->checkpoint_fname != NULL) {
+    char fprint[TLC_FPRINT_LEN + 1];
+    ckpt = ckpt_new(p->checkpoint_fname, p->checkpoint_interval);
+    checkpoint_fingerprint(fprint, p, phmm);
+    ckpt_set_fingerprint(ckpt, fprint);
+    if (p->resume) {
+      if (ckpt_load(ckpt)) {
+        if (!quiet)
+          fprintf(results_f, "Resuming from checkpoint %s...\n",
+                  p->checkpoint_fname);
+      }
+      else if (!quiet)
+        fprintf(results_f, "No checkpoint found in %s; starting from scratch.\n",
+                p->checkpoint_fname);
+    }
+    phmm->ckpt = ckpt;
+  }
+
   if (FC) {
     if (!quiet)
       fprintf(results_f, "Creating %d scaled versions of tree model...\n", nrates);
@@ -376,8 +438,22 @@ int phastCons(struct phastCons_struct *p) {
   }
   if (free_cm) cm_free(cm);
 
-  /* compute emissions */
-  phmm_compute_emissions(phmm, msa, quiet);
+  /* attach likelihood cache, if necessary.  Models whose parameters
+     are re-estimated change at every EM iteration, so caching their
+     likelihoods would only fill the cache with stale entries; with
+     --estimate-rho the nonconserved model is fixed, however */
+  if (lik_cache_fname != NULL && !estim_trees) {
+    if (!quiet)
+      fprintf(results_f, "Reading likelihood cache from %s...\n", lik_cache_fname);
+    lik_cache = tlc_new_from_fname(lik_cache_fname,
+                                   msa->ss->ntuples * phmm->nmods);
+    for (i = (estim_rho ? 1 : 0); i < phmm->nmods; i++)
+      phmm->mods[i]->lik_cache = lik_cache;
+  }
+
+  /* compute emissions (windows fitted separately compute their own) */
+  if (!window_fits)
+    phmm_compute_emissions(phmm, msa, quiet);
 
   /* estimate lambda, if necessary */
   if (FC && estim_lambda) {
@@ -388,6 +464,76 @@ int phastCons(struct phastCons_struct *p) {
     phmm_update_cross_prod(phmm, lambda);
   }
 
+  /* estimate parameters separately in each window, if necessary */
+  else if (window_fits) {
+    List *fits;
+    char cons_fname[STR_MED_LEN], noncons_fname[STR_MED_LEN];
+    int nwindows, *wstart = NULL, *wend = NULL;
+    double *wlnl = NULL, *wmu = NULL, *wnu = NULL, *wrho = NULL;
+
+    if (!quiet)
+      fprintf(results_f, "Finding MLE for (%s%s) in windows of %d sites...\n",
+              estim_transitions ? "mu, nu, " : "",
+              estim_trees ? "[tree models]" : "rho", em_window);
+    fits = fit_two_state_windows(phmm, msa, em_window, nthreads,
+                                 estim_transitions, estim_trees, estim_rho,
+                                 mu, nu, rho, gamma);
+    nwindows = lst_size(fits);
+    if (results != NULL) {
+      wstart = smalloc(nwindows * sizeof(int));
+      wend = smalloc(nwindows * sizeof(int));
+      wlnl = smalloc(nwindows * sizeof(double));
+      wmu = smalloc(nwindows * sizeof(double));
+      wnu = smalloc(nwindows * sizeof(double));
+      wrho = smalloc(nwindows * sizeof(double));
+    }
+    if (post_probs_f != NULL)
+      fprintf(post_probs_f, "#start\tend\tlnL\tmu\tnu\trho\n");
+    for (i = 0; i < nwindows; i++) {
+      TwoStateWindowFit *fit = lst_get_ptr(fits, i);
+      int start = fit->start + msa->idx_offset + 1,
+        end = fit->end + msa->idx_offset;
+      if (post_probs_f != NULL)
+        fprintf(post_probs_f, "%d\t%d\t%.4f\t%g\t%g\t%g\n", start, end,
+                fit->lnl, fit->mu, fit->nu, fit->rho);
+      if (estim_trees_fname_root != NULL) {
+        FILE *F;
+        sprintf(cons_fname, "%s.%d-%d.cons.mod", estim_trees_fname_root,
+                start, end);
+        sprintf(noncons_fname, "%s.%d-%d.noncons.mod", estim_trees_fname_root,
+                start, end);
+        F = phast_fopen(cons_fname, "w+");
+        tm_print(F, fit->cons_mod);
+        phast_fclose(F);
+        F = phast_fopen(noncons_fname, "w+");
+        tm_print(F, fit->noncons_mod);
+        phast_fclose(F);
+      }
+      if (results != NULL) {
+        wstart[i] = start; wend[i] = end; wlnl[i] = fit->lnl;
+        wmu[i] = fit->mu; wnu[i] = fit->nu; wrho[i] = fit->rho;
+      }
+    }
+    if (!quiet && estim_trees_fname_root != NULL)
+      fprintf(results_f, "Wrote re-estimated tree models to %s.<start>-<end>.cons.mod and\n%s.<start>-<end>.noncons.mod...\n",
+              estim_trees_fname_root, estim_trees_fname_root);
+    if (results != NULL) {
+      ListOfLists *winList = lol_new(6);
+      lol_push_int(winList, wstart, nwindows, "start");
+      lol_push_int(winList, wend, nwindows, "end");
+      lol_push_dbl(winList, wlnl, nwindows, "lnl");
+      lol_push_dbl(winList, wmu, nwindows, "mu");
+      lol_push_dbl(winList, wnu, nwindows, "nu");
+      lol_push_dbl(winList, wrho, nwindows, "rho");
+      lol_set_class(winList, "data.frame");
+      lol_push_lol(results, winList, "windows");
+      sfree(wstart); sfree(wend); sfree(wlnl);
+      sfree(wmu); sfree(wnu); sfree(wrho);
+    }
+    free_two_state_window_fits(fits);
+    post_probs = FALSE;
+  }
+
   /* estimate mu and nu and indel params, if necessary */
   else if (two_state &&
 	   (estim_transitions || estim_indels || estim_trees || estim_rho)) {
@@ -406,11 +552,24 @@ int phastCons(struct phastCons_struct *p) {
         fprintf(results_f, "rho");
       fprintf(results_f, ")...\n");
     }
-    lnl = fit_two_state(phmm, msa, estim_transitions, estim_indels,
-			estim_trees, estim_rho,
-                        &mu, &nu, &alpha_0, &beta_0, &tau_0,
-                        &alpha_1, &beta_1, &tau_1, &rho,
-                        gamma, log_f);
+    if (em_pooled)
+      lnl = fit_two_state_pooled(phmm, msa, em_window, nthreads,
+                                 estim_transitions, estim_indels,
+                                 estim_trees, estim_rho,
+                                 &mu, &nu, &alpha_0, &beta_0, &tau_0,
+                                 &alpha_1, &beta_1, &tau_1, &rho,
+                                 gamma, log_f);
+    else
+      lnl = fit_two_state(phmm, msa, estim_transitions, estim_indels,
+                          estim_trees, estim_rho,
+                          &mu, &nu, &alpha_0, &beta_0, &tau_0,
+                          &alpha_1, &beta_1, &tau_1, &rho,
+                          gamma, log_f);
+    if (ckpt != NULL) {         /* estimation is complete */
+      ckpt_remove(ckpt);
+      ckpt_free(ckpt);
+      phmm->ckpt = NULL;
+    }
     if (estim_transitions || estim_indels || estim_rho) {
       if (!quiet) {
 	fprintf(results_f, "(");
@@ -537,6 +696,8 @@ int phastCons(struct phastCons_struct *p) {
 
     if (states == NULL) {  //this only happens if two_state==FALSE
                            //return posterior probabilites for every state
+      if (binary_track != NULL)
+        die("ERROR: --binary-track requires a single set of states.\n");
       double **postprobs = phmm_new_postprobs(phmm), **postprobsNoMissing=NULL;
       int idx=0, j, k, l;
       if (results != NULL) {
@@ -598,7 +759,15 @@ int phastCons(struct phastCons_struct *p) {
     } else {
       double *postprobs, *postprobsNoMissing=NULL;
       int idx=0, j, k;
+      BinTrackWriter *btk = NULL;
       postprobs = phmm_postprobs_cats(phmm, states, &lnl);
+      if (binary_track != NULL && post_probs_f != NULL) {
+        btk_encoding enc;
+        double min = 0, max = 1;
+        if (btk_parse_format(binary_track, &enc, &min, &max) != 0)
+          die("ERROR: bad argument to --binary-track (\"%s\").\n", binary_track);
+        btk = btk_writer_new(post_probs_f, enc, min, max);
+      }
       if (results != NULL) {
 	postprobsNoMissing = smalloc(msa->length*sizeof(double));
 	coord = smalloc(msa->length*sizeof(int));
@@ -610,7 +779,12 @@ int phastCons(struct phastCons_struct *p) {
 	checkInterruptN(j, 1000);
 	if (refidx == 0 || msa_get_char(msa, refidx-1, j) != GAP_CHAR) {
 	  if (!msa_missing_col(msa, refidx, j)) {
-	    if (post_probs_f != NULL) {
+	    if (btk != NULL) {
+	      if (k > last + 1)
+		btk_start_block(btk, seqname, k + msa->idx_offset + 1);
+	      btk_put(btk, postprobs[j]);
+	    }
+	    else if (post_probs_f != NULL) {
 	      if (k > last + 1)
 		fprintf(post_probs_f, "fixedStep chrom=%s start=%d step=1\n", seqname,
 			k + msa->idx_offset + 1);
@@ -625,6 +799,7 @@ int phastCons(struct phastCons_struct *p) {
 	  k++;
 	}
       }
+      if (btk != NULL) btk_writer_close(btk);
       if (results != NULL) {
         ListOfLists *wigList = lol_new(2);
         lol_push_int(wigList, coord, idx, "coord");
@@ -659,6 +834,17 @@ int phastCons(struct phastCons_struct *p) {
     }
   }
 
+  if (lik_cache != NULL) {
+    if (!quiet)
+      fprintf(results_f, "Writing likelihood cache to %s (%d hits, %d misses)...\n",
+              lik_cache_fname, lik_cache->nhits, lik_cache->nmisses);
+    for (i = 0; i < phmm->nmods; i++)
+      phmm->mods[i]->lik_cache = NULL;
+    if (lik_cache->nmisses > 0)
+      tlc_write_fname(lik_cache_fname, lik_cache);
+    tlc_free(lik_cache);
+  }
+
   if (!quiet)
     fprintf(results_f, "Done.\n");
 
@@ -689,16 +875,86 @@ void setup_two_state(HMM **hmm, CategoryMap **cm, double mu, double nu) {
 
 /* Version of compute_emissions for use when estimating rho only (see
    fit_two_state, below); makes use of fact that emissions for
-   nonconserved state need not be recomputed */
+   nonconserved state need not be recomputed.  Emissions for the
+   conserved state are also not recomputed if the tuple scores saved
+   by the last call to likelihood_wrapper_rho apply to the current
+   model */
 void compute_emissions_estim_rho(double **emissions, void **models,
 				 int nmodels, void *data, int sample,
 				 int length) {
   PhyloHmm *phmm = (PhyloHmm*)data;
-  tl_compute_log_likelihood(phmm->mods[0], phmm->em_data->msa,
-			    phmm->emissions[0], NULL,  -1, NULL);
+  MSA *msa = phmm->em_data->msa;
+  int i;
+  if (phmm->em_data->rho_tuple_scores != NULL &&
+      phmm->em_data->rho_tuple_scores_scale == phmm->mods[0]->scale) {
+    for (i = 0; i < msa->length; i++)
+      phmm->emissions[0][i] =
+        phmm->em_data->rho_tuple_scores[msa->ss->tuple_idx[i]];
+  }
+  else
+    tl_compute_log_likelihood(phmm->mods[0], msa, phmm->emissions[0], NULL,
+                              -1, NULL);
 }
 
 
+/* Transition estimation function for train_two_state when the tree
+   models are fixed; also checkpoints the state of EM (which otherwise
+   is done when the tree models are re-estimated) */
+static void estim_trans_checkpoint(HMM *hmm, void *data, double **A) {
+  PhyloHmm *phmm = (PhyloHmm*)data;
+  if (phmm->em_data->gamma > 0)
+    phmm_estim_trans_em_coverage(hmm, data, A);
+  else
+    phmm_estim_trans_em(hmm, data, A);
+  checkpoint_two_state(phmm, NULL);
+}
+
+/* Run the EM algorithm for fit_two_state, either on the whole
+   alignment (window_size <= 0) or pooling expected counts over windows
+   of the specified size */
+static double train_two_state(PhyloHmm *phmm, int window_size, int nthreads,
+                              void (*compute_emissions_func)(double **, void **,
+                                                             int, void*, int,
+                                                             int),
+                              void (*estimate_state_models)(TreeModel**, int,
+                                                            void*, double**,
+                                                            int, FILE*),
+                              FILE *logf) {
+  void (*estim_trans_func)(HMM*, void*, double**) =
+    phmm->em_data->gamma > 0 ?
+    phmm_estim_trans_em_coverage : phmm_estim_trans_em;
+  int (*get_obs_idx_func)(void*, int, int) =
+    estimate_state_models != NULL ? phmm_get_obs_idx_em : NULL;
+  int nwindows, w, *starts, *lens, len = phmm->em_data->msa->length;
+  double retval;
+
+  if (estimate_state_models == NULL && phmm->ckpt != NULL)
+    estim_trans_func = estim_trans_checkpoint;
+
+  if (window_size <= 0)
+    return hmm_train_by_em(phmm->hmm, phmm->mods, phmm, 1, &phmm->alloc_len,
+                           NULL, compute_emissions_func, estimate_state_models,
+                           estim_trans_func, get_obs_idx_func,
+                           phmm_log_em, phmm->emissions, logf);
+
+  nwindows = (len + window_size - 1) / window_size;
+  starts = smalloc(nwindows * sizeof(int));
+  lens = smalloc(nwindows * sizeof(int));
+  for (w = 0; w < nwindows; w++) {
+    starts[w] = w * window_size;
+    lens[w] = min(window_size, len - starts[w]);
+  }
+  retval = hmm_train_by_em_pooled(phmm->hmm, phmm->mods, phmm, nwindows,
+                                  starts, lens, nthreads,
+                                  compute_emissions_func,
+                                  estimate_state_models, estim_trans_func,
+                                  get_obs_idx_func, phmm_log_em,
+                                  phmm->emissions, logf);
+  sfree(starts);
+  sfree(lens);
+  return retval;
+}
+
 /* Estimate parameters for the two-state model using an EM algorithm.
    Any or all of the parameters 'mu' and 'nu', the indel parameters, and
    the tree models themselves may be estimated.  Returns ln
@@ -708,7 +964,22 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
                      double *alpha_0, double *beta_0, double *tau_0,
                      double *alpha_1, double *beta_1, double *tau_1,
                      double *rho, double gamma, FILE *logf) {
-  double retval;
+  return fit_two_state_pooled(phmm, msa, -1, 1, estim_func, estim_indels,
+                              estim_trees, estim_rho, mu, nu, alpha_0, beta_0,
+                              tau_0, alpha_1, beta_1, tau_1, rho, gamma, logf);
+}
+
+/* Version of fit_two_state in which the alignment is divided into
+   windows that share all parameters; the E step is done in parallel
+   over windows.  With window_size <= 0, identical to fit_two_state */
+double fit_two_state_pooled(PhyloHmm *phmm, MSA *msa, int window_size,
+                            int nthreads, int estim_func, int estim_indels,
+                            int estim_trees, int estim_rho,
+                            double *mu, double *nu,
+                            double *alpha_0, double *beta_0, double *tau_0,
+                            double *alpha_1, double *beta_1, double *tau_1,
+                            double *rho, double gamma, FILE *logf) {
+  double retval, scale = *rho;
   void (*compute_emissions_func)(double **, void **, int, void*, int, int);
 
   mm_set(phmm->functional_hmm->transition_matrix, 0, 0, 1-*mu);
@@ -725,6 +996,7 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
   phmm->em_data->rho = *rho;
   phmm->em_data->gamma = gamma;
   phmm->em_data->H = NULL;      /* will be defined as needed */
+  phmm->em_data->rho_tuple_scores = NULL;
 
   if (phmm->indel_mode == PARAMETERIC) {
     phmm->alpha[0] = *alpha_0;
@@ -735,8 +1007,15 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
     phmm->tau[1] = *tau_1;
   }
 
+  /* resume from a checkpoint, if available */
+  if (ckpt_has(phmm->ckpt, "CONS_MU"))
+    scale = restore_two_state(phmm, estim_trees);
+
   phmm_reset(phmm);
 
+  if (window_size > 0 && (msa->ss == NULL || msa->ss->tuple_idx == NULL))
+    die("ERROR: fit_two_state_pooled: ordered sufficient statistics required.\n");
+
   if (estim_trees || estim_rho) {
     msa->ncats = phmm->nmods - 1;   /* ?? */
     if (msa->ss == NULL)
@@ -753,13 +1032,9 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
   else compute_emissions_func = NULL;
 
   if (estim_trees) {
-    retval = hmm_train_by_em(phmm->hmm, phmm->mods, phmm, 1, &phmm->alloc_len, NULL,
+    retval = train_two_state(phmm, window_size, nthreads,
                              compute_emissions_func, reestimate_trees,
-                             gamma > 0 ?
-                             phmm_estim_trans_em_coverage : phmm_estim_trans_em,
-                             phmm_get_obs_idx_em,
-                             phmm_log_em, phmm->emissions, logf) * log(2);
-
+                             logf) * log(2);
 
     /* have to do final rescaling of tree models to get units of subst/site */
     if (phmm->mods[0]->subst_mod != JC69 && phmm->mods[0]->subst_mod != F81) {
@@ -773,15 +1048,12 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
 
   else if (estim_rho) {
     phmm->mods[0]->estimate_branchlens = TM_SCALE_ONLY;
-    phmm->mods[0]->scale = phmm->em_data->rho;
+    phmm->mods[0]->scale = scale;
     tm_set_subst_matrices(phmm->mods[0]);
 
-    retval = hmm_train_by_em(phmm->hmm, phmm->mods, phmm, 1, &phmm->alloc_len, NULL,
+    retval = train_two_state(phmm, window_size, nthreads,
                              compute_emissions_func, reestimate_rho,
-                             gamma > 0 ?
-                             phmm_estim_trans_em_coverage : phmm_estim_trans_em,
-                             phmm_get_obs_idx_em,
-                             phmm_log_em, phmm->emissions, logf) * log(2);
+                             logf) * log(2);
 
     /* do final rescaling of conserved tree */
     tm_scale_branchlens(phmm->mods[0], phmm->em_data->rho, FALSE);
@@ -790,13 +1062,9 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
     phmm->mods[0]->lnL = phmm->mods[1]->lnL = retval;
   }
 
-  else {                        /* not estimating tree models */
-    retval = hmm_train_by_em(phmm->hmm, phmm->mods, phmm, 1,
-                             &phmm->alloc_len, NULL, NULL, NULL,
-                             gamma > 0 ?
-                             phmm_estim_trans_em_coverage : phmm_estim_trans_em,
-                             NULL, phmm_log_em, phmm->emissions, logf) * log(2);
-  }
+  else                          /* not estimating tree models */
+    retval = train_two_state(phmm, window_size, nthreads, NULL, NULL,
+                             logf) * log(2);
 
   *mu = mm_get(phmm->functional_hmm->transition_matrix, 0, 1);
   *nu = mm_get(phmm->functional_hmm->transition_matrix, 1, 0);
@@ -814,6 +1082,120 @@ double fit_two_state(PhyloHmm *phmm, MSA *msa, int estim_func, int estim_indels,
   return retval;
 }
 
+/* Data shared by the per-window jobs of fit_two_state_windows */
+typedef struct {
+  List *fits;
+  MSA **msas;                   /* sub-alignment for each window */
+  PhyloHmm **phmms;             /* independent phylo-HMM for each window */
+  int estim_func, estim_trees, estim_rho;
+  double mu, nu, rho, gamma;
+} WindowFitData;
+
+/* fit the two-state model to a single window */
+static void fit_window(void *data, int w, int thread) {
+  WindowFitData *d = data;
+  TwoStateWindowFit *fit = lst_get_ptr(d->fits, w);
+  PhyloHmm *phmm = d->phmms[w];
+  double mu = d->mu, nu = d->nu, rho = d->rho;
+
+  phmm_compute_emissions(phmm, d->msas[w], TRUE);
+  fit->lnl = fit_two_state(phmm, d->msas[w], d->estim_func, FALSE,
+                           d->estim_trees, d->estim_rho, &mu, &nu,
+                           NULL, NULL, NULL, NULL, NULL, NULL, &rho,
+                           d->gamma, NULL);
+  fit->mu = mu;
+  fit->nu = nu;
+  fit->rho = rho;
+  fit->cons_mod = phmm->mods[0];
+  fit->noncons_mod = phmm->mods[1];
+
+  /* keep the models but free everything else */
+  phmm->mods[0] = tm_create_copy(fit->cons_mod);
+  phmm->mods[1] = tm_create_copy(fit->noncons_mod);
+  phmm_free(phmm);
+  msa_free(d->msas[w]);
+  d->phmms[w] = NULL;
+  d->msas[w] = NULL;
+}
+
+/* Estimate parameters separately in each window of an alignment,
+   fitting windows concurrently */
+List *fit_two_state_windows(PhyloHmm *phmm, MSA *msa, int window_size,
+                            int nthreads, int estim_func, int estim_trees,
+                            int estim_rho, double mu, double nu, double rho,
+                            double gamma) {
+  int nwindows, w, i;
+  List *seqs;
+  ThreadPool *pool;
+  WindowFitData d;
+
+  if (window_size <= 0)
+    die("ERROR: fit_two_state_windows: window size must be positive.\n");
+  if (phmm->indel_mode != MISSING_DATA || phmm->nmods != 2)
+    die("ERROR: fit_two_state_windows: only the two-state model without indels is supported.\n");
+  if (msa->ss == NULL || msa->ss->tuple_idx == NULL)
+    die("ERROR: fit_two_state_windows: ordered sufficient statistics required.\n");
+
+  nwindows = (msa->length + window_size - 1) / window_size;
+  d.fits = lst_new_ptr(nwindows);
+  d.msas = smalloc(nwindows * sizeof(MSA*));
+  d.phmms = smalloc(nwindows * sizeof(PhyloHmm*));
+  d.estim_func = estim_func;
+  d.estim_trees = estim_trees;
+  d.estim_rho = estim_rho;
+  d.mu = mu;
+  d.nu = nu;
+  d.rho = rho;
+  d.gamma = gamma;
+
+  seqs = lst_new_int(msa->nseqs);
+  for (i = 0; i < msa->nseqs; i++) lst_push_int(seqs, i);
+
+  /* set up windows serially; copying tree models is not thread safe,
+     because traversals are cached lazily */
+  for (w = 0; w < nwindows; w++) {
+    TwoStateWindowFit *fit = smalloc(sizeof(TwoStateWindowFit));
+    TreeModel **mods = smalloc(2 * sizeof(TreeModel*));
+    char **names = smalloc(msa->nseqs * sizeof(char*));
+
+    fit->start = w * window_size;
+    fit->end = min(fit->start + window_size, msa->length);
+    fit->cons_mod = fit->noncons_mod = NULL;
+    lst_push_ptr(d.fits, fit);
+
+    for (i = 0; i < msa->nseqs; i++) names[i] = copy_charstr(msa->names[i]);
+    d.msas[w] = ss_sub_alignment(msa, names, seqs, fit->start, fit->end);
+    d.msas[w]->idx_offset = msa->idx_offset + fit->start;
+
+    for (i = 0; i < 2; i++) {
+      mods[i] = tm_create_copy(phmm->mods[i]);
+      mods[i]->lik_cache = NULL; /* caches are not thread safe */
+    }
+    d.phmms[w] = phmm_new(hmm_create_copy(phmm->functional_hmm), mods,
+                          phmm->cm, NULL, MISSING_DATA);
+  }
+  lst_free(seqs);
+
+  pool = thr_pool_new(nthreads);
+  thr_foreach(pool, nwindows, fit_window, &d);
+  thr_pool_free(pool);
+
+  sfree(d.msas);
+  sfree(d.phmms);
+  return d.fits;
+}
+
+void free_two_state_window_fits(List *fits) {
+  int w;
+  for (w = 0; w < lst_size(fits); w++) {
+    TwoStateWindowFit *fit = lst_get_ptr(fits, w);
+    if (fit->cons_mod != NULL) tm_free(fit->cons_mod);
+    if (fit->noncons_mod != NULL) tm_free(fit->noncons_mod);
+    sfree(fit);
+  }
+  lst_free(fits);
+}
+
 /* Special-purpose unpack function, adapted from tm_unpack_params */
 void unpack_params_mod(TreeModel *mod, Vector *params_in) {
   TreeNode *n;
@@ -903,25 +1285,15 @@ double likelihood_wrapper(Vector *params, void *data) {
                                    one cats and mods? */
 }
 
-/* Re-estimate phylogenetic model based on expected counts (M step of EM) */
-void reestimate_trees(TreeModel **models, int nmodels, void *data,
-                      double **E, int nobs, FILE *logf) {
-
-  PhyloHmm *phmm = (PhyloHmm*)data;
-  int k, obsidx, i, npar;
-  Vector *params, *lower_bounds, *upper_bounds, *opt_params;
-  double ll;
+/* Set up the parameters of the two tree models for re-estimation
+   (see reestimate_trees).  Returns a newly allocated vector of the
+   free parameters, initialised from the current models, with rho as
+   the last element */
+static Vector *setup_tree_params(PhyloHmm *phmm) {
+  int i, npar;
+  Vector *params, *opt_params;
   int haveratevar, orig_nratecats[2];
 
-  /* FIXME: what about when multiple states per model?  Need to
-     collapse sufficient stats.  Could probably be done generally...
-     need to use state_to_cat, etc. in deciding which categories to
-     use */
-
-  for (k = 0; k < phmm->nmods; k++)
-    for (obsidx = 0; obsidx < nobs; obsidx++)
-      phmm->em_data->msa->ss->cat_counts[k][obsidx] = E[k][obsidx];
-
   /* This will set up params in phmm->mods[0] and phmm->mods[1].  The
      tree models should be the same at this point, since only one model
      is allowed for --estimate-trees.  Therefore the parameter setup
@@ -978,6 +1350,142 @@ void reestimate_trees(TreeModel **models, int nmodels, void *data,
   }
   vec_set(opt_params, npar - 1, phmm->em_data->rho);
 
+  vec_copy(phmm->mods[0]->all_params, params);
+  vec_copy(phmm->mods[1]->all_params, params);
+  vec_free(params);
+  return opt_params;
+}
+
+/* Compute a fingerprint of the inputs of parameter estimation, to be
+   stored in the checkpoint: the alignment, the initial tree models
+   and HMM, and the options that affect the course of estimation.
+   fprint must have room for TLC_FPRINT_LEN + 1 characters */
+static void checkpoint_fingerprint(char *fprint, struct phastCons_struct *p,
+                                   PhyloHmm *phmm) {
+  int i, j, settings[] = {p->FC, p->estim_lambda, p->estim_transitions,
+                          p->two_state, p->indels, p->indels_only,
+                          p->estim_indels, p->estim_trees, p->ignore_missing,
+                          p->estim_rho, p->set_transitions, p->nrates,
+                          p->nrates2, p->refidx, p->max_micro_indel,
+                          p->em_window, p->em_pooled};
+  double vals[] = {p->lambda, p->mu, p->nu, p->alpha_0, p->beta_0, p->tau_0,
+                   p->alpha_1, p->beta_1, p->tau_1, p->gc, p->gamma, p->rho,
+                   p->omega};
+  tlc_fprint h = tlc_hash_msa(0, p->msa);
+
+  h = tlc_hash(h, settings, sizeof(settings));
+  h = tlc_hash(h, vals, sizeof(vals));
+  for (i = 0; i < phmm->nmods; i++)
+    h = tlc_hash_model(h, phmm->mods[i]);
+  for (i = 0; i < phmm->hmm->nstates; i++)
+    for (j = 0; j < phmm->hmm->nstates; j++) {
+      double a = mm_get(phmm->hmm->transition_matrix, i, j);
+      h = tlc_hash(h, &a, sizeof(double));
+    }
+  sprintf(fprint, "%016llx", h);
+}
+
+/* Save the state of the EM algorithm for the two-state model to
+   phmm->ckpt, if a checkpoint is due.  Called at the end of each M
+   step.  The tree parameters (as set up by setup_tree_params) are
+   saved only if they are being estimated */
+static void checkpoint_two_state(PhyloHmm *phmm, Vector *tree_params) {
+  if (!ckpt_due(phmm->ckpt)) return;
+  ckpt_begin(phmm->ckpt);
+  ckpt_put_dbl(phmm->ckpt, "CONS_MU",
+               mm_get(phmm->functional_hmm->transition_matrix, 0, 1));
+  ckpt_put_dbl(phmm->ckpt, "CONS_NU",
+               mm_get(phmm->functional_hmm->transition_matrix, 1, 0));
+  ckpt_put_dbl(phmm->ckpt, "CONS_RHO", phmm->em_data->rho);
+  ckpt_put_dbl(phmm->ckpt, "CONS_SCALE", phmm->mods[0]->scale);
+  if (phmm->indel_mode == PARAMETERIC) {
+    Vector *indel_params = vec_new(6);
+    vec_set(indel_params, 0, phmm->alpha[0]);
+    vec_set(indel_params, 1, phmm->beta[0]);
+    vec_set(indel_params, 2, phmm->tau[0]);
+    vec_set(indel_params, 3, phmm->alpha[1]);
+    vec_set(indel_params, 4, phmm->beta[1]);
+    vec_set(indel_params, 5, phmm->tau[1]);
+    ckpt_put_vector(phmm->ckpt, "CONS_INDEL_PARAMS", indel_params);
+    vec_free(indel_params);
+  }
+  if (tree_params != NULL) {
+    ckpt_put_vector(phmm->ckpt, "CONS_TREE_PARAMS", tree_params);
+    ckpt_put_matrix(phmm->ckpt, "CONS_INV_HESSIAN", phmm->em_data->H);
+  }
+  ckpt_commit(phmm->ckpt);
+}
+
+/* Restore the state saved by checkpoint_two_state and discard the
+   loaded items.  For use in fit_two_state_pooled, after phmm->em_data
+   has been set up.  Returns the saved scale of the conserved model
+   (which, when rho is estimated, is the last value tried in the M
+   step rather than the new estimate of rho) */
+static double restore_two_state(PhyloHmm *phmm, int estim_trees) {
+  Checkpoint *ck = phmm->ckpt;
+  double mu = ckpt_get_dbl(ck, "CONS_MU"), nu = ckpt_get_dbl(ck, "CONS_NU"),
+    scale = ckpt_get_dbl(ck, "CONS_SCALE");
+
+  mm_set(phmm->functional_hmm->transition_matrix, 0, 0, 1-mu);
+  mm_set(phmm->functional_hmm->transition_matrix, 0, 1, mu);
+  mm_set(phmm->functional_hmm->transition_matrix, 1, 0, nu);
+  mm_set(phmm->functional_hmm->transition_matrix, 1, 1, 1-nu);
+  phmm->em_data->rho = ckpt_get_dbl(ck, "CONS_RHO");
+
+  if (phmm->indel_mode == PARAMETERIC && ckpt_has(ck, "CONS_INDEL_PARAMS")) {
+    Vector *indel_params = ckpt_get_vector(ck, "CONS_INDEL_PARAMS");
+    if (indel_params->size != 6)
+      die("ERROR: bad indel parameters in checkpoint.\n");
+    phmm->alpha[0] = vec_get(indel_params, 0);
+    phmm->beta[0] = vec_get(indel_params, 1);
+    phmm->tau[0] = vec_get(indel_params, 2);
+    phmm->alpha[1] = vec_get(indel_params, 3);
+    phmm->beta[1] = vec_get(indel_params, 4);
+    phmm->tau[1] = vec_get(indel_params, 5);
+    vec_free(indel_params);
+  }
+
+  if (estim_trees && ckpt_has(ck, "CONS_TREE_PARAMS")) {
+    Vector *opt_params = setup_tree_params(phmm),
+      *saved = ckpt_get_vector(ck, "CONS_TREE_PARAMS");
+    if (saved->size != opt_params->size)
+      die("ERROR: checkpoint has %i tree parameters, expected %i.\n",
+          saved->size, opt_params->size);
+    phmm->em_data->H = ckpt_get_matrix(ck, "CONS_INV_HESSIAN");
+    if (phmm->em_data->H->nrows != saved->size || 
+        phmm->em_data->H->ncols != saved->size)
+      die("ERROR: checkpoint has inverse Hessian of wrong dimension.\n");
+    unpack_params_phmm(phmm, saved);
+    if (phmm->indel_mode == PARAMETERIC)
+      phmm_set_branch_len_factors(phmm);
+    vec_free(saved);
+    vec_free(opt_params);
+  }
+  ckpt_clear(ck);
+  return scale;
+}
+
+/* Re-estimate phylogenetic model based on expected counts (M step of EM) */
+void reestimate_trees(TreeModel **models, int nmodels, void *data,
+                      double **E, int nobs, FILE *logf) {
+
+  PhyloHmm *phmm = (PhyloHmm*)data;
+  int k, obsidx, npar;
+  Vector *lower_bounds, *upper_bounds, *opt_params;
+  double ll;
+
+  /* FIXME: what about when multiple states per model?  Need to
+     collapse sufficient stats.  Could probably be done generally...
+     need to use state_to_cat, etc. in deciding which categories to
+     use */
+
+  for (k = 0; k < phmm->nmods; k++)
+    for (obsidx = 0; obsidx < nobs; obsidx++)
+      phmm->em_data->msa->ss->cat_counts[k][obsidx] = E[k][obsidx];
+
+  opt_params = setup_tree_params(phmm);
+  npar = opt_params->size;
+
   lower_bounds = vec_new(npar);
   vec_zero(lower_bounds);
   upper_bounds = vec_new(npar);
@@ -994,11 +1502,9 @@ void reestimate_trees(TreeModel **models, int nmodels, void *data,
     mat_set_identity(phmm->em_data->H);
   }
 
-  vec_copy(phmm->mods[0]->all_params, params);
-  vec_copy(phmm->mods[1]->all_params, params);
-
   if (opt_bfgs(likelihood_wrapper, opt_params, phmm, &ll, lower_bounds,
-               NULL, logf, NULL, OPT_MED_PREC, phmm->em_data->H, NULL) != 0)
+               NULL, logf, NULL, OPT_MED_PREC, phmm->em_data->H, NULL,
+               NULL) != 0)
     die("ERROR returned by opt_bfgs.\n");
 
   if (logf != NULL)
@@ -1009,20 +1515,39 @@ void reestimate_trees(TreeModel **models, int nmodels, void *data,
   if (phmm->indel_mode == PARAMETERIC)
     phmm_set_branch_len_factors(phmm);
 
-  vec_free(params);
+  checkpoint_two_state(phmm, opt_params);
+
   vec_free(opt_params);
   vec_free(lower_bounds);
   vec_free(upper_bounds);
 }
 
 
-/* Wrapper for computation of likelihood, for use by reestimate_rho (below) */
+/* Wrapper for computation of likelihood, for use by reestimate_rho
+   (below).  Equivalent to tl_compute_log_likelihood for category 0
+   (weighting tuples by their expected counts for the conserved state),
+   but keeps the score of every tuple so that compute_emissions_estim_rho
+   can reuse them */
 double likelihood_wrapper_rho(double rho, void *data) {
   PhyloHmm *phmm = (PhyloHmm*)data;
+  MSA *msa = phmm->em_data->msa;
+  double retval = 0;
+  int tupleidx;
+
   phmm->mods[0]->scale = rho;
   tm_set_subst_matrices(phmm->mods[0]);
-  return -tl_compute_log_likelihood(phmm->mods[0], phmm->em_data->msa,
-				    NULL, NULL, 0, NULL);
+  if (phmm->em_data->rho_tuple_scores == NULL)
+    phmm->em_data->rho_tuple_scores =
+      smalloc(msa->ss->ntuples * sizeof(double));
+  tl_compute_log_likelihood(phmm->mods[0], msa, NULL,
+                            phmm->em_data->rho_tuple_scores, -1, NULL);
+  phmm->em_data->rho_tuple_scores_scale = rho;
+
+  for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++)
+    if (msa->ss->cat_counts[0][tupleidx] != 0)
+      retval += phmm->em_data->rho_tuple_scores[tupleidx] *
+        msa->ss->cat_counts[0][tupleidx];
+  return -retval;
 }
 
 /* Similar to reestimate_trees, but re-estimate only scale parameter
@@ -1055,6 +1580,8 @@ void reestimate_rho(TreeModel **models, int nmodels, void *data,
     die("ERROR reestimate:rho: phmm->indel_mode is PARAMETERIC\n");
   /* FIXME: to make work with parameteric indel model, will have to
      propagate scale parameter through phmm_set_branch_len_factors */
+
+  checkpoint_two_state(phmm, NULL);
 }
 
 /* Maximize HMM transition parameters subject to constrain implied by
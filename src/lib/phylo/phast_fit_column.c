@@ -14,10 +14,14 @@
    perform single-base LRTs, score tests, phyloP, etc. */
 
 #include <stdlib.h>
+#include <string.h>
 #include <phast/fit_column.h>
 #include <phast/sufficient_stats.h>
 #include <phast/tree_likelihoods.h>
+#include <phast/dgamma.h>
+#include <phast/thread_pool.h>
 #include <time.h>
+#include <unistd.h>
 
 #define DERIV_EPSILON 1e-6
 /* for numerical computation of derivatives */
@@ -141,22 +145,23 @@ void col_scale_derivs_subst_complex(ColFitData *d) {
     die("ERROR col_scale_derivs_subst_complex cannot handle lineage-specific models");
 
   for (rcat = 0; rcat < d->mod->nratecats; rcat++) {
+    if (d->mod->freqK[rcat] == 0) continue; /* contributes nothing */
     for (nid = 1; nid < d->mod->tree->nnodes; nid++) { /* skip root */
 
       double t = ((TreeNode*)lst_get_ptr(d->mod->tree->nodes, nid))->dparent;
       double l1 = d->mod->scale;
       double l2 = (d->stype == SUBTREE && d->mod->in_subtree[nid] ?
                    d->mod->scale_sub : 1);
+      double r = d->mod->rK[rcat];
 
       /* set up exponentiated diagonal matrix */
-      for (i = 0; i < size; i++) {
-        double r = t * l1 * l2 * d->mod->rK[rcat];
-        zvec_set(d->expdiag_z, i, z_exp(z_mul_real(zvec_get(Q->evals_z, i), r)));
-      }
+      for (i = 0; i < size; i++)
+        zvec_set(d->expdiag_z, i, z_exp(z_mul_real(zvec_get(Q->evals_z, i),
+                                                   t * l1 * l2 * r)));
 
       /* PP */
       zvec_copy(d->vec_scratch1_z, Q->evals_z);
-      zvec_scale(d->vec_scratch1_z, t * l2);
+      zvec_scale(d->vec_scratch1_z, t * l2 * r);
       zvec_had_prod(d->vec_scratch2_z, d->vec_scratch1_z, d->expdiag_z);
       zmat_mult_real_diag(d->PP[nid][rcat], S, d->vec_scratch2_z, Sinv,
                           d->mat_scratch_z);
@@ -175,7 +180,7 @@ void col_scale_derivs_subst_complex(ColFitData *d) {
 
         /* QQ */
         zvec_copy(d->vec_scratch1_z, Q->evals_z);
-        zvec_scale(d->vec_scratch1_z, t * l1);
+        zvec_scale(d->vec_scratch1_z, t * l1 * r);
         zvec_had_prod(d->vec_scratch2_z, d->vec_scratch1_z, d->expdiag_z);
         zmat_mult_real_diag(d->QQ[nid][rcat], S, d->vec_scratch2_z, Sinv,
                             d->mat_scratch_z);
@@ -189,9 +194,9 @@ void col_scale_derivs_subst_complex(ColFitData *d) {
 
           /* RRR */
           zvec_copy(d->vec_scratch1_z, Q->evals_z);
-          zvec_scale(d->vec_scratch1_z, t);
+          zvec_scale(d->vec_scratch1_z, t * r);
           zvec_had_prod(d->vec_scratch2_z, Q->evals_z, Q->evals_z);
-          zvec_scale(d->vec_scratch2_z, t * t * l1 * l2);
+          zvec_scale(d->vec_scratch2_z, t * t * l1 * l2 * r * r);
           zvec_plus_eq(d->vec_scratch2_z, d->vec_scratch1_z);
           zvec_had_prod(d->vec_scratch1_z, d->vec_scratch2_z, d->expdiag_z);
           zmat_mult_real_diag(d->RRR[nid][rcat], S, d->vec_scratch1_z, Sinv,
@@ -202,88 +207,101 @@ void col_scale_derivs_subst_complex(ColFitData *d) {
   }
 }
 
-/* version of col_scale_derivs_subst that is optimized for the case in
-   which eigenvalues and eigenvectors can be assumed to be real */
-void col_scale_derivs_subst_real(ColFitData *d) {
-  Matrix *S = d->mod->rate_matrix->evec_matrix_r,
-    *Sinv = d->mod->rate_matrix->evec_matrix_inv_r;
-  MarkovMatrix *Q = d->mod->rate_matrix;
-  int size = Q->size;
-  int rcat, nid, i;
-
-  if (S==NULL)
-    die("ERROR col_scale_derivs_subst_real: got S==NULL\n");
-  if (Sinv==NULL)
-    die("ERROR col_scale_derivs_subst_real: got Sinv==NULL\n");
-  if (d->mod->alt_subst_mods != NULL)
+/* Set derivatives of the substitution matrices wrt the scale
+   parameters for every branch and rate category, and optionally (if
+   set_P is TRUE) the substitution matrices themselves, in the case of
+   a real eigensystem.  Every one of these matrices has the form
+   S diag(w) Sinv, for a vector of weights w that depends on the
+   eigenvalues, branch length, rate, and scales.  The weights of all
+   matrices for a branch are computed first, and then each element of
+   all matrices is obtained in a single pass over the cached
+   eigenvector products (d->evec_outer), rather than by a separate
+   matrix product for each matrix */
+static void subst_derivs_real(ColFitData *d, int set_P) {
+  TreeModel *mod = d->mod;
+  int size = mod->rate_matrix->size;
+  int rcat, nid, i, j, k, m, nmats;
+  double *w = d->weight_scratch;
+  Matrix *mats[6];
+
+  if (mod->alt_subst_mods != NULL)
     die("ERROR col_scale_derivs_subst_real: cannot handle lineage-specific models");
 
-  for (rcat = 0; rcat < d->mod->nratecats; rcat++) {
-    for (nid = 1; nid < d->mod->tree->nnodes; nid++) { /* skip root */
-
-      double t = ((TreeNode*)lst_get_ptr(d->mod->tree->nodes, nid))->dparent;
-      double l1 = d->mod->scale;
-      double l2 = (d->stype == SUBTREE && d->mod->in_subtree[nid] ?
-                   d->mod->scale_sub : 1);
-
-      /* set up exponentiated diagonal matrix */
-      for (i = 0; i < size; i++)
-        d->expdiag_r->data[i] = exp(Q->evals_r->data[i] * t *
-                                    l1 * l2 * d->mod->rK[rcat]);
-
-      /* PP */
-      for (i = 0; i < size; i++) {
-        d->vec_scratch1_r->data[i] = Q->evals_r->data[i] * t * l2;
-        d->vec_scratch2_r->data[i] = d->vec_scratch1_r->data[i] *
-          d->expdiag_r->data[i];
+  for (rcat = 0; rcat < mod->nratecats; rcat++) {
+    double r = mod->rK[rcat];
+    if (mod->freqK[rcat] == 0) continue; /* contributes nothing */
+    for (nid = 1; nid < mod->tree->nnodes; nid++) { /* skip root */
+      double *lt = d->branch_evals[nid]; /* eigenvalues * branch length */
+      double l1 = mod->scale;
+      int sub = (d->stype == SUBTREE && mod->in_subtree[nid]);
+      double l2 = (sub ? mod->scale_sub : 1);
+      double t = ((TreeNode*)lst_get_ptr(mod->tree->nodes, nid))->dparent;
+      double *ww = w;
+      int do_P = set_P;
+
+      if (do_P && t * l1 * l2 * r == 0) {
+        mat_set_identity(mod->P[nid][rcat]->matrix); /* as mm_exp */
+        do_P = FALSE;
       }
-      mat_mult_diag(d->PP[nid][rcat], S, d->vec_scratch2_r, Sinv);
 
-      if (d->second_derivs) {
-        /* PPP */
-        for (i = 0; i < size; i++) {
-          d->vec_scratch2_r->data[i] = d->vec_scratch1_r->data[i] *
-            d->vec_scratch1_r->data[i];
-          d->vec_scratch1_r->data[i] = d->vec_scratch2_r->data[i] *
-            d->expdiag_r->data[i];
+      /* weights for each matrix, size apiece */
+      nmats = 0;
+      if (do_P) {
+        for (k = 0; k < size; k++)
+          ww[k] = exp(lt[k] * l1 * l2 * r);
+        mats[nmats++] = mod->P[nid][rcat]->matrix;
+        ww += size;
+      }
+      for (k = 0; k < size; k++) { /* PP: deriv wrt l1 */
+        double e = exp(lt[k] * l1 * l2 * r), a = lt[k] * l2 * r;
+        ww[k] = a * e;
+        if (d->second_derivs)    /* PPP */
+          ww[size + k] = a * a * e;
+        if (sub) {               /* QQ, QQQ, RRR */
+          double b = lt[k] * l1 * r;
+          ww[(d->second_derivs ? 2 : 1) * size + k] = b * e;
+          if (d->second_derivs) {
+            ww[3*size + k] = b * b * e;
+            ww[4*size + k] = e * (a * b + lt[k] * r);
+          }
         }
-        mat_mult_diag(d->PPP[nid][rcat], S, d->vec_scratch1_r, Sinv);
       }
-
-      if (d->stype == SUBTREE && d->mod->in_subtree[nid]) {
-        /* if not in subtree, leave all of these equal to 0 (as
+      mats[nmats++] = d->PP[nid][rcat];
+      if (d->second_derivs) mats[nmats++] = d->PPP[nid][rcat];
+      if (sub) {
+        /* if not in subtree, leave these equal to 0 (as
            initialized) */
-
-        /* QQ */
-        for (i = 0; i < size; i++) {
-          d->vec_scratch1_r->data[i] = Q->evals_r->data[i] * t * l1;
-          d->vec_scratch2_r->data[i] = d->vec_scratch1_r->data[i] *
-            d->expdiag_r->data[i];
+        mats[nmats++] = d->QQ[nid][rcat];
+        if (d->second_derivs) {
+          mats[nmats++] = d->QQQ[nid][rcat];
+          mats[nmats++] = d->RRR[nid][rcat];
         }
-        mat_mult_diag(d->QQ[nid][rcat], S, d->vec_scratch2_r, Sinv);
+      }
 
-        if (d->second_derivs) {
-          /* QQQ */
-          for (i = 0; i < size; i++) {
-            d->vec_scratch2_r->data[i] = d->vec_scratch1_r->data[i] *
-              d->vec_scratch1_r->data[i];
-            d->vec_scratch1_r->data[i] = d->vec_scratch2_r->data[i] *
-              d->expdiag_r->data[i];
+      /* single pass over eigenvector products for all matrices */
+      for (i = 0; i < size; i++) {
+        for (j = 0; j < size; j++) {
+          double *c = &d->evec_outer[(i*size + j) * size];
+          for (m = 0; m < nmats; m++) {
+            double tot = 0, *wm = &w[m * size];
+            for (k = 0; k < size; k++)
+              tot += c[k] * wm[k];
+            mats[m]->data[i][j] = tot;
           }
-          mat_mult_diag(d->QQQ[nid][rcat], S, d->vec_scratch1_r, Sinv);
-
-          /* RRR */
-          for (i = 0; i < size; i++)
-            d->vec_scratch1_r->data[i] = d->expdiag_r->data[i] *
-              (Q->evals_r->data[i] * Q->evals_r->data[i] * t * t * l1 * l2 +
-               Q->evals_r->data[i] * t);
-          mat_mult_diag(d->RRR[nid][rcat], S, d->vec_scratch1_r, Sinv);
         }
       }
     }
   }
 }
 
+/* version of col_scale_derivs_subst that is optimized for the case in
+   which eigenvalues and eigenvectors can be assumed to be real */
+void col_scale_derivs_subst_real(ColFitData *d) {
+  if (d->evec_outer == NULL)
+    die("ERROR col_scale_derivs_subst_real: eigenvectors not available\n");
+  subst_derivs_real(d, FALSE);
+}
+
 /* Compute 1st and 2nd derivs wrt scale params of substitution
    matrices for each branch of the tree (and each rate category).
    These are used in the recursive computation of derivatives of the
@@ -296,6 +314,22 @@ void col_scale_derivs_subst(ColFitData *d) {
     col_scale_derivs_subst_complex(d);
 }
 
+/* Set the substitution matrices of d->mod for its current scale
+   parameters, together with their derivatives (see
+   col_scale_derivs_subst).  When the rate matrix has a real
+   eigensystem, both are obtained in a single pass per branch */
+void col_set_subst_derivs(ColFitData *d) {
+  if (d->evec_outer != NULL && d->mod->ignore_branch == NULL)
+    subst_derivs_real(d, TRUE);
+  else {
+    tm_set_subst_matrices(d->mod);
+    col_scale_derivs_subst(d);
+  }
+}
+
+static double scale_derivs_prune(ColFitData *d, double *first_deriv,
+                                 double *second_deriv, double ***scratch);
+
 /* Compute the first and (optionally) second derivatives with respect
    to the scale parameter for the single-column log likelihood
    function (col_compute_log_likelihood).  This version assumes a
@@ -305,6 +339,15 @@ void col_scale_derivs_subst(ColFitData *d) {
    == NULL, it will not be computed (saves some time).  */
 double col_scale_derivs(ColFitData *d, double *first_deriv,
                         double *second_deriv, double ***scratch) {
+  col_scale_derivs_subst(d);
+  return scale_derivs_prune(d, first_deriv, second_deriv, scratch);
+}
+
+/* pruning pass of col_scale_derivs, for tuple d->tupleidx; assumes
+   substitution matrices and their derivatives are already set for
+   the current scale */
+static double scale_derivs_prune(ColFitData *d, double *first_deriv,
+                                 double *second_deriv, double ***scratch) {
 
   int i, j, k, nodeidx, rcat;
   int nstates = d->mod->rate_matrix->size;
@@ -347,9 +390,8 @@ double col_scale_derivs(ColFitData *d, double *first_deriv,
     LLL = scratch[2];
   }
 
-  col_scale_derivs_subst(d);
-
   for (rcat = 0; rcat < d->mod->nratecats; rcat++) {
+    if (d->mod->freqK[rcat] == 0) continue; /* contributes nothing */
     for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
       n = lst_get_ptr(traversal, nodeidx);
       if (n->lchild == NULL) {
@@ -736,6 +778,243 @@ double col_deriv2_wrapper_1d(double x, void *data, double lb, double ub) {
   return d->deriv2;
 }
 
+/* number of consecutive tuples handed to a thread at a time by the
+   per-tuple tests below; tuples are otherwise scheduled dynamically,
+   because their cost varies greatly with the amount of missing
+   data */
+#define TUPLES_PER_JOB 16
+
+/* shared data for running per-tuple tests in parallel.  Arrays
+   indexed by thread hold data private to each thread; everything else
+   is read-only, except that each tuple writes only to its own
+   elements of the output arrays */
+typedef struct ColTestData ColTestData;
+struct ColTestData {
+  MSA *msa;
+  mode_type mode;
+  FILE *logf;
+  ColFitData **d, **d2;         /* per thread; null and alt models */
+  Vector **grad;                /* per thread */
+  int **has_data;               /* per thread */
+  List *inside, *outside;
+  double fim;
+  FimGrid *grid;
+  double *out[5];               /* per-tuple outputs (any may be NULL) */
+  void (*tuple_func)(ColTestData *td, int tup, int thread);
+};
+
+static void tuple_job(void *data, int job, int thread) {
+  ColTestData *td = data;
+  int i, end = min(td->msa->ss->ntuples, (job+1) * TUPLES_PER_JOB);
+  for (i = job * TUPLES_PER_JOB; i < end; i++) {
+    checkInterruptN(i, 100);
+    td->tuple_func(td, i, thread);
+  }
+}
+
+/* apply td->tuple_func to every tuple, in parallel */
+static void run_tuple_tests(ThreadPool *pool, ColTestData *td) {
+  thr_foreach(pool, (td->msa->ss->ntuples + TUPLES_PER_JOB - 1) /
+              TUPLES_PER_JOB, tuple_job, td);
+}
+
+/* create a thread pool for the per-tuple tests.  Output to a log file
+   is only meaningful in order, so a single thread is used if logf is
+   non-NULL */
+static ThreadPool *tuple_test_pool(int nthreads, FILE *logf) {
+  return thr_pool_new(logf == NULL ? nthreads : 1);
+}
+
+/* create one ColFitData object per thread.  The first uses mod
+   itself; the others use private copies, because fitting changes the
+   scale and substitution matrices of the model.  The copies are made
+   here, serially, because tree traversals are cached lazily */
+static ColFitData **thread_fit_data(TreeModel *mod, MSA *msa,
+                                    scale_type stype, mode_type mode,
+                                    int second_derivs, int nthreads) {
+  ColFitData **d = smalloc(nthreads * sizeof(ColFitData*));
+  int t;
+  d[0] = col_init_fit_data(mod, msa, stype, mode, second_derivs);
+  for (t = 1; t < nthreads; t++) {
+    TreeModel *cpy = tm_create_copy(mod);
+    cpy->lik_cache = NULL;      /* caches are not thread safe */
+    tr_postorder(cpy->tree);
+    tr_preorder(cpy->tree);
+    d[t] = col_init_fit_data(cpy, msa, stype, mode, second_derivs);
+  }
+  return d;
+}
+
+/* free objects created by thread_fit_data, including model copies */
+static void free_thread_fit_data(ColFitData **d, int nthreads) {
+  int t;
+  for (t = 1; t < nthreads; t++) {
+    TreeModel *cpy = d[t]->mod;
+    col_free_fit_data(d[t]);
+    tm_free(cpy);
+  }
+  col_free_fit_data(d[0]);
+  sfree(d);
+}
+
+/* convert a chi-sq test statistic to a p-value, as appropriate for
+   the mode; acc indicates a departure in the direction of
+   acceleration */
+static double tuple_pval(double teststat, mode_type mode, int acc) {
+  double pval;
+  if (mode == NNEUT || mode == CONACC)
+    pval = chisq_cdf(teststat, 1, FALSE);
+  else
+    pval = half_chisq_cdf(teststat, 1, FALSE);
+  /* assumes 50:50 mix of chisq and point mass at zero, due to
+     bounding of param */
+
+  if (pval < 1e-20)
+    pval = 1e-20;
+  /* approx limit of eval of tail prob; pvals of 0 cause problems */
+
+  if (mode == CONACC && acc)
+    pval *= -1;                 /* mark as acceleration */
+  return pval;
+}
+
+/* store the results of the LRT for tuple i (see col_lrts) */
+static void lrt_store(ColTestData *td, int i, double delta_lnl,
+                      double this_scale) {
+  if (delta_lnl <= -0.01)
+    die("ERROR col_lrts: delta_lnl = %e < -0.01\n", delta_lnl);
+  if (delta_lnl < 0) delta_lnl = 0;
+
+  /* compute p-vals via chi-sq */
+  if (td->out[0] != NULL)
+    td->out[0][i] = tuple_pval(2*delta_lnl, td->mode, this_scale > 1);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL) td->out[1][i] = this_scale;
+  if (td->out[2] != NULL) td->out[2][i] = delta_lnl;
+}
+
+/* LRT for a single tuple (see col_lrts) */
+static void lrt_tuple(ColTestData *td, int i, int thread) {
+  ColFitData *d = td->d[thread];
+  TreeModel *mod = d->mod;
+  double null_lnl, alt_lnl, delta_lnl, this_scale = 1;
+
+  /* first check for actual substitution data in column; if none,
+     don't waste time computing likelihoods */
+  if (!col_has_data(mod, td->msa, i)) {
+    delta_lnl = 0;
+    this_scale = 1;
+  }
+
+  else {                      /* compute null and alt lnl */
+    mod->scale = 1;
+    tm_set_subst_matrices(mod);
+
+    /* compute log likelihoods under null and alt hypotheses */
+    null_lnl = col_compute_log_likelihood(mod, td->msa, i,
+                                          d->fels_scratch[0]);
+
+    vec_set(d->params, 0, d->init_scale);
+    d->tupleidx = i;
+
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &alt_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  td->logf, NULL, NULL);
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+
+    alt_lnl *= -1;
+    this_scale = d->params->data[0];
+
+    delta_lnl = alt_lnl - null_lnl;
+  } /* end estimation of delta_lnl */
+
+  lrt_store(td, i, delta_lnl, this_scale);
+}
+
+/* data for fitting the scale factors of a batch of tuples (see
+   lrt_batch) */
+typedef struct {
+  ColFitData *d;
+  int *tuples;                  /* tuple index of each problem */
+} ColBatchData;
+
+/* function for opt_newton_1d_batch: negative log likelihood of each
+   tuple in the batch and its exact derivatives wrt the scale.
+   Substitution matrices and their derivatives are recomputed only
+   when the scale changes, so consecutive problems at the same scale
+   (in particular, all problems in the first round) share them */
+static void col_batch_derivs(int n, int *prob, double *x, double *fx,
+                             double *d1, double *d2, void *data) {
+  ColBatchData *bd = data;
+  ColFitData *d = bd->d;
+  int k;
+  for (k = 0; k < n; k++) {
+    if (k == 0 || x[k] != x[k-1]) {
+      d->mod->scale = x[k];
+      col_set_subst_derivs(d);
+    }
+    d->tupleidx = bd->tuples[prob[k]];
+    fx[k] = -scale_derivs_prune(d, &d1[k], &d2[k], d->fels_scratch);
+    d1[k] = -d1[k];             /* because working with neg lnl */
+    d2[k] = -d2[k];
+  }
+}
+
+/* returns TRUE if exact scale derivatives (col_scale_derivs) are
+   available for a model, which requires a single diagonalized rate
+   matrix for all branches */
+static int col_has_exact_derivs(TreeModel *mod) {
+  MarkovMatrix *Q = mod->rate_matrix;
+  if (mod->alt_subst_mods != NULL || mod->ignore_branch != NULL)
+    return FALSE;
+  if (Q->eigentype == REAL_NUM)
+    return (Q->evec_matrix_r != NULL && Q->evals_r != NULL &&
+            Q->evec_matrix_inv_r != NULL);
+  return (Q->evec_matrix_z != NULL && Q->evals_z != NULL &&
+          Q->evec_matrix_inv_z != NULL);
+}
+
+/* LRTs for the tuples of one job (see col_lrts).  Equivalent to
+   lrt_tuple for each tuple, except that the null likelihoods share a
+   single set of substitution matrices, and the alternative models of
+   all tuples with data are fitted together, in lockstep, using exact
+   derivatives */
+static void lrt_batch(void *data, int job, int thread) {
+  ColTestData *td = data;
+  ColFitData *d = td->d[thread];
+  int start = job * TUPLES_PER_JOB,
+    end = min(td->msa->ss->ntuples, start + TUPLES_PER_JOB);
+  int i, k, n = 0, tuples[TUPLES_PER_JOB];
+  double null_lnl[TUPLES_PER_JOB], scales[TUPLES_PER_JOB],
+    alt_lnl[TUPLES_PER_JOB];
+  ColBatchData bd;
+
+  d->mod->scale = 1;
+  tm_set_subst_matrices(d->mod);
+  for (i = start; i < end; i++) {
+    checkInterruptN(i, 100);
+    /* don't waste time on columns without substitution data */
+    if (!col_has_data(d->mod, td->msa, i)) {
+      lrt_store(td, i, 0, 1);
+      continue;
+    }
+    tuples[n] = i;
+    null_lnl[n] = col_compute_log_likelihood(d->mod, td->msa, i,
+                                             d->fels_scratch[0]);
+    scales[n++] = d->init_scale;
+  }
+
+  bd.d = d;
+  bd.tuples = tuples;
+  opt_newton_1d_batch(col_batch_derivs, n, scales, alt_lnl, &bd, SIGFIGS,
+                      d->lb->data[0], d->ub->data[0], td->logf);
+
+  for (k = 0; k < n; k++)
+    lrt_store(td, tuples[k], -alt_lnl[k] - null_lnl[k], scales[k]);
+}
+
 /* Perform a likelihood ratio test for each column tuple in an
    alignment, comparing the given null model with an alternative model
    that has a free scaling parameter for all branches.  Assumes a 0th
@@ -745,369 +1024,373 @@ double col_deriv2_wrapper_1d(double x, void *data, double lb, double ub) {
    Will optionally store the individual scale factors in tuple_scales
    and raw log likelihood ratios in tuple_llrs if these variables are
    non-NULL.  Must define mode as CON (for 0 <= scale <= 1), ACC
-   (for 1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale) */
+   (for 1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale).
+   Tuples are processed in parallel using nthreads threads, and
+   whenever possible the scale factors of consecutive tuples are
+   fitted together (see lrt_batch) */
 void col_lrts(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_pvals,
-              double *tuple_scales, double *tuple_llrs, FILE *logf) {
-  int i;
-  ColFitData *d;
-  double null_lnl, alt_lnl, delta_lnl, this_scale = 1;
+              double *tuple_scales, double *tuple_llrs, FILE *logf,
+              int nthreads) {
+  ThreadPool *pool = tuple_test_pool(nthreads, logf);
+  ColTestData td;
+
+  td.msa = msa;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = tuple_pvals;
+  td.out[1] = tuple_scales;
+  td.out[2] = tuple_llrs;
+  td.tuple_func = lrt_tuple;
 
   /* init ColFitData */
-  d = col_init_fit_data(mod, msa, ALL, mode, FALSE);
+  td.d = thread_fit_data(mod, msa, ALL, mode, TRUE,
+                         thr_pool_size(pool));
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 100);
-
-    /* first check for actual substitution data in column; if none,
-       don't waste time computing likelihoods */
-    if (!col_has_data(mod, msa, i)) {
-      delta_lnl = 0;
-      this_scale = 1;
-    }
-
-    else {                      /* compute null and alt lnl */
-      mod->scale = 1;
-      tm_set_subst_matrices(mod);
-
-      /* compute log likelihoods under null and alt hypotheses */
-      null_lnl = col_compute_log_likelihood(mod, msa, i, d->fels_scratch[0]);
-
-      vec_set(d->params, 0, d->init_scale);
-      d->tupleidx = i;
-
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &alt_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-
-      alt_lnl *= -1;
-      this_scale = d->params->data[0];
-
-      delta_lnl = alt_lnl - null_lnl;
-      if (delta_lnl <= -0.01)
-	die("ERROR col_lrts: delta_lnl = %e < -0.01\n", delta_lnl);
-      if (delta_lnl < 0) delta_lnl = 0;
-    } /* end estimation of delta_lnl */
+  if (col_has_exact_derivs(mod))
+    thr_foreach(pool, (msa->ss->ntuples + TUPLES_PER_JOB - 1) /
+                TUPLES_PER_JOB, lrt_batch, &td);
+  else
+    run_tuple_tests(pool, &td);
 
-    /* compute p-vals via chi-sq */
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(2*delta_lnl, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(2*delta_lnl, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero, due to
-           bounding of param */
+  free_thread_fit_data(td.d, thr_pool_size(pool));
+  thr_pool_free(pool);
+}
 
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+/* subtree LRT for a single tuple (see col_lrts_sub) */
+static void lrt_sub_tuple(ColTestData *td, int i, int thread) {
+  ColFitData *d = td->d[thread], *d2 = td->d2[thread];
+  double null_lnl, alt_lnl, delta_lnl;
 
-      if (mode == CONACC && this_scale > 1)
-          tuple_pvals[i] *= -1; /* mark as acceleration */
-    }
+  /* first check for informative substitution data in column; if none,
+     don't waste time computing likeihoods */
+  if (!col_has_data_sub(d2->mod, td->msa, i, td->inside, td->outside)) {
+    delta_lnl = 0;
+    d->params->data[0] = d2->params->data[0] = d2->params->data[1] = 1;
+  }
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_scales != NULL) tuple_scales[i] = this_scale;
-    if (tuple_llrs != NULL) tuple_llrs[i] = delta_lnl;
+  else {
+    /* compute log likelihoods under null and alt hypotheses */
+    d->tupleidx = i;
+    vec_set(d->params, 0, d->init_scale);
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &null_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  td->logf, NULL, NULL);
+
+    //      opt_bfgs(col_likelihood_wrapper, d->params, d, &null_lnl, d->lb,
+    //	       d->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL);
+
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+    null_lnl *= -1;
+
+    d2->tupleidx = i;
+    vec_set(d2->params, 0, max(0.05, d->params->data[0]));
+    /* init to previous estimate to save time, but don't init to
+       value at boundary */
+    vec_set(d2->params, 1, d2->init_scale_sub);
+
+    if (opt_bfgs(col_likelihood_wrapper, d2->params, d2, &alt_lnl, d2->lb,
+                 d2->ub, td->logf, NULL, OPT_HIGH_PREC, NULL, NULL, NULL) != 0)
+      ;                         /* do nothing; nonzero exit typically
+                                   occurs when max iterations is
+                                   reached; a warning is printed to
+                                   the log */
+    alt_lnl *= -1;
+
+    delta_lnl = alt_lnl - null_lnl;
+    if (delta_lnl <= -0.1)
+      die("ERROR col_lrts_sub: delta_lnl = %e <= -0.1\n", delta_lnl);
+    if (delta_lnl < 0) delta_lnl = 0;
   }
 
-  col_free_fit_data(d);
+  /* compute p-vals via chi-sq */
+  if (td->out[0] != NULL)
+    td->out[0][i] = tuple_pval(2*delta_lnl, td->mode,
+                               d2->params->data[1] > 1);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL)
+    td->out[1][i] = d->params->data[0];
+  if (td->out[2] != NULL)
+    td->out[2][i] = d2->params->data[0];
+  if (td->out[3] != NULL)
+    td->out[3][i] = d2->params->data[1];
+  if (td->out[4] != NULL)
+    td->out[4][i] = delta_lnl;
 }
 
 /* Subtree version of LRT */
 void col_lrts_sub(TreeModel *mod, MSA *msa, mode_type mode,
                   double *tuple_pvals, double *tuple_null_scales,
                   double *tuple_scales, double *tuple_sub_scales,
-                  double *tuple_llrs, FILE *logf) {
-  int i;
-  ColFitData *d, *d2;
-  double null_lnl, alt_lnl, delta_lnl;
+                  double *tuple_llrs, FILE *logf, int nthreads) {
+  ThreadPool *pool = tuple_test_pool(nthreads, logf);
+  ColTestData td;
   TreeModel *modcpy;
-  List *inside=NULL, *outside=NULL;
 
   modcpy = tm_create_copy(mod);   /* need separate copy of tree model
                                      with different internal scaling
                                      data for supertree/subtree case */
   modcpy->subtree_root = NULL;
 
+  td.msa = msa;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = tuple_pvals;
+  td.out[1] = tuple_null_scales;
+  td.out[2] = tuple_scales;
+  td.out[3] = tuple_sub_scales;
+  td.out[4] = tuple_llrs;
+  td.tuple_func = lrt_sub_tuple;
+  td.inside = td.outside = NULL;
+
   /* init ColFitData -- one for null model, one for alt */
-  d = col_init_fit_data(modcpy, msa, ALL, NNEUT, FALSE);
-  d2 = col_init_fit_data(mod, msa, SUBTREE, mode, FALSE);
+  td.d = thread_fit_data(modcpy, msa, ALL, NNEUT, FALSE,
+                         thr_pool_size(pool));
+  td.d2 = thread_fit_data(mod, msa, SUBTREE, mode, FALSE,
+                          thr_pool_size(pool));
                                 /* mod has the subtree info, modcpy
                                    does not */
 
   /* prepare lists of leaves inside and outside root, for use in
      checking for informative substitutions */
   if (mod->subtree_root != NULL) {
-    inside = lst_new_ptr(mod->tree->nnodes);
-    outside = lst_new_ptr(mod->tree->nnodes);
-    tr_partition_leaves(mod->tree, mod->subtree_root, inside, outside);
+    td.inside = lst_new_ptr(mod->tree->nnodes);
+    td.outside = lst_new_ptr(mod->tree->nnodes);
+    tr_partition_leaves(mod->tree, mod->subtree_root, td.inside,
+                        td.outside);
   }
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 100);
+  run_tuple_tests(pool, &td);
 
-    /* first check for informative substitution data in column; if none,
-       don't waste time computing likeihoods */
-    if (!col_has_data_sub(mod, msa, i, inside, outside)) {
-      delta_lnl = 0;
-      d->params->data[0] = d2->params->data[0] = d2->params->data[1] = 1;
-    }
+  free_thread_fit_data(td.d, thr_pool_size(pool));
+  free_thread_fit_data(td.d2, thr_pool_size(pool));
+  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
+                                /* have to revert for tm_free to work
+                                   correctly */
+  tm_free(modcpy);
+  if (td.inside != NULL) lst_free(td.inside);
+  if (td.outside != NULL) lst_free(td.outside);
+  thr_pool_free(pool);
+}
 
-    else {
-      /* compute log likelihoods under null and alt hypotheses */
-      d->tupleidx = i;
-      vec_set(d->params, 0, d->init_scale);
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &null_lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-
-      //      opt_bfgs(col_likelihood_wrapper, d->params, d, &null_lnl, d->lb,
-      //	       d->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL);
-
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-      null_lnl *= -1;
-
-      d2->tupleidx = i;
-      vec_set(d2->params, 0, max(0.05, d->params->data[0]));
-      /* init to previous estimate to save time, but don't init to
-         value at boundary */
-      vec_set(d2->params, 1, d2->init_scale_sub);
-
-      if (opt_bfgs(col_likelihood_wrapper, d2->params, d2, &alt_lnl, d2->lb,
-                   d2->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL) != 0)
-        ;                         /* do nothing; nonzero exit typically
-                                     occurs when max iterations is
-                                     reached; a warning is printed to
-                                     the log */
-      alt_lnl *= -1;
-
-      delta_lnl = alt_lnl - null_lnl;
-      if (delta_lnl <= -0.1)
-	die("ERROR col_lrts_sub: delta_lnl = %e <= -0.1\n", delta_lnl);
-      if (delta_lnl < 0) delta_lnl = 0;
-    }
+/* score test for a single tuple (see col_score_tests) */
+static void score_tuple(ColTestData *td, int i, int thread) {
+  ColFitData *d = td->d[thread];
+  double first_deriv, teststat;
 
-    /* compute p-vals via chi-sq */
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(2*delta_lnl, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(2*delta_lnl, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero, due to
-           bounding of param */
+  /* first check for actual substitution data in column; if none,
+     don't waste time computing score */
+  if (!col_has_data(d->mod, td->msa, i)) {
+    first_deriv = 0;
+    teststat = 0;
+  }
+
+  else {
+    d->tupleidx = i;
 
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+    col_scale_derivs(d, &first_deriv, NULL, d->fels_scratch);
 
-      if (mode == CONACC && d2->params->data[1] > 1)
-        tuple_pvals[i] *= -1;    /* mark as acceleration */
-    }
+    teststat = first_deriv*first_deriv / td->fim;
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_null_scales != NULL)
-      tuple_null_scales[i] = d->params->data[0];
-    if (tuple_scales != NULL)
-      tuple_scales[i] = d2->params->data[0];
-    if (tuple_sub_scales != NULL)
-      tuple_sub_scales[i] = d2->params->data[1];
-    if (tuple_llrs != NULL)
-      tuple_llrs[i] = delta_lnl;
+    if ((td->mode == ACC && first_deriv < 0) ||
+        (td->mode == CON && first_deriv > 0))
+      teststat = 0;             /* derivative points toward boundary;
+                                   truncate at 0 */
   }
 
-  col_free_fit_data(d);
-  col_free_fit_data(d2);
-  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
-                                /* have to revert for tm_free to work
-                                   correctly */
-  tm_free(modcpy);
-  if (inside != NULL) lst_free(inside);
-  if (outside != NULL) lst_free(outside);
+  if (td->out[0] != NULL)
+    td->out[0][i] = tuple_pval(teststat, td->mode, first_deriv > 0);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL) td->out[1][i] = first_deriv;
+  if (td->out[2] != NULL) td->out[2][i] = teststat;
 }
 
 /* Score test */
 void col_score_tests(TreeModel *mod, MSA *msa, mode_type mode,
                      double *tuple_pvals, double *tuple_derivs,
-                     double *tuple_teststats) {
-  int i;
-  ColFitData *d;
-  double first_deriv, teststat, fim;
-
-  /* init ColFitData */
-  d = col_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
-
-  /* precompute FIM */
-  fim = col_estimate_fim(mod);
+                     double *tuple_teststats, int nthreads) {
+  /* precompute FIM.  This is done before the model is copied for each
+     thread, because sampling fills out the rate categories of the
+     model */
+  double fim = col_estimate_fim(mod);
 
   if (fim < 0)
     die("ERROR: negative fisher information in col_score_tests\n");
 
-  /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 1000);
-
-    /* first check for actual substitution data in column; if none,
-       don't waste time computing score */
-    if (!col_has_data(mod, msa, i)) {
-      first_deriv = 0;
-      teststat = 0;
-    }
+  col_score_tests_fim(mod, msa, mode, fim, tuple_pvals, tuple_derivs,
+                      tuple_teststats, nthreads);
+}
 
-    else {
-      d->tupleidx = i;
+/* Score tests given a precomputed Fisher information (see
+   col_score_tests) */
+void col_score_tests_fim(TreeModel *mod, MSA *msa, mode_type mode,
+                         double fim, double *tuple_pvals,
+                         double *tuple_derivs, double *tuple_teststats,
+                         int nthreads) {
+  ThreadPool *pool = thr_pool_new(nthreads);
+  ColTestData td;
+
+  td.msa = msa;
+  td.mode = mode;
+  td.logf = NULL;
+  td.out[0] = tuple_pvals;
+  td.out[1] = tuple_derivs;
+  td.out[2] = tuple_teststats;
+  td.tuple_func = score_tuple;
+  td.fim = fim;
 
-      col_scale_derivs(d, &first_deriv, NULL, d->fels_scratch);
+  /* init ColFitData */
+  td.d = thread_fit_data(mod, msa, ALL, NNEUT, FALSE, thr_pool_size(pool));
 
-      teststat = first_deriv*first_deriv / fim;
+  /* iterate through column tuples */
+  run_tuple_tests(pool, &td);
 
-      if ((mode == ACC && first_deriv < 0) ||
-          (mode == CON && first_deriv > 0))
-        teststat = 0;             /* derivative points toward boundary;
-                                     truncate at 0 */
-    }
+  free_thread_fit_data(td.d, thr_pool_size(pool));
+  thr_pool_free(pool);
+}
 
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(teststat, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(teststat, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero */
+/* subtree score test for a single tuple (see col_score_tests_sub) */
+static void score_sub_tuple(ColTestData *td, int i, int thread) {
+  ColFitData *d = td->d[thread], *d2 = td->d2[thread];
+  Vector *grad = td->grad[thread];
+  Matrix *fim;
+  double lnl, teststat;
 
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+  /* first check for informative substitution data in column; if none,
+     don't waste time computing score */
+  if (!col_has_data_sub(d2->mod, td->msa, i, td->inside, td->outside)) {
+    teststat = 0;
+    vec_zero(grad);
+    d->params->data[0] = 1.0;
+  }
 
-      if (mode == CONACC && first_deriv > 0)
-        tuple_pvals[i] *= -1; /* mark as acceleration */
+  else {
+    d->tupleidx = i;
+    vec_set(d->params, 0, d->init_scale);
+
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  td->logf, NULL, NULL);
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+
+    d2->tupleidx = i;
+    d2->mod->scale = d->params->data[0];
+    d2->mod->scale_sub = 1;
+    tm_set_subst_matrices(d2->mod);
+    col_scale_derivs_subtree(d2, grad, NULL, d2->fels_scratch);
+
+    fim = col_get_fim_sub(td->grid, d2->mod->scale);
+
+    teststat = grad->data[1]*grad->data[1] /
+      (fim->data[1][1] - fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
+
+    if (teststat < 0) {
+      fprintf(stderr, "WARNING: teststat < 0 (%f\t%f\t%f\t%f\t%f\t%f)\n",
+              teststat, fim->data[0][0], fim->data[0][1],
+              fim->data[1][0], fim->data[1][1],
+              fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
+      teststat = 0;
     }
+    mat_free(fim);
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_derivs != NULL) tuple_derivs[i] = first_deriv;
-    if (tuple_teststats != NULL) tuple_teststats[i] = teststat;
+    if ((td->mode == ACC && grad->data[1] < 0) ||
+        (td->mode == CON && grad->data[1] > 0))
+      teststat = 0;             /* derivative points toward boundary;
+                                   truncate at 0 */
   }
 
-  col_free_fit_data(d);
+  if (td->out[0] != NULL)
+    td->out[0][i] = tuple_pval(teststat, td->mode, grad->data[1] > 0);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL) td->out[1][i] = d->params->data[0];
+  if (td->out[2] != NULL) td->out[2][i] = grad->data[0];
+  if (td->out[3] != NULL) td->out[3][i] = grad->data[1];
+  if (td->out[4] != NULL) td->out[4][i] = teststat;
 }
 
 /* Subtree version of score test */
 void col_score_tests_sub(TreeModel *mod, MSA *msa, mode_type mode,
                          double *tuple_pvals, double *tuple_null_scales,
                          double *tuple_derivs, double *tuple_sub_derivs,
-                         double *tuple_teststats, FILE *logf) {
-  int i;
-  ColFitData *d, *d2;
-  Vector *grad = vec_new(2);
-  Matrix *fim;
-  double lnl, teststat;
-  FimGrid *grid;
-  List *inside=NULL, *outside=NULL;
+                         double *tuple_teststats, FILE *logf,
+                         const char *fim_grid_fname, int nthreads) {
+  /* precompute Fisher information matrices for a grid of scale
+     values.  This is done before the model is copied for the null
+     hypothesis and for each thread (see col_score_tests) */
+  FimGrid *grid = col_fim_grid_sub_cached(mod, fim_grid_fname);
+
+  col_score_tests_sub_grid(mod, msa, mode, grid, tuple_pvals,
+                           tuple_null_scales, tuple_derivs,
+                           tuple_sub_derivs, tuple_teststats, logf,
+                           nthreads);
+  col_free_fim_grid(grid);
+}
+
+/* Subtree score tests given a precomputed grid of Fisher information
+   matrices (see col_score_tests_sub) */
+void col_score_tests_sub_grid(TreeModel *mod, MSA *msa, mode_type mode,
+                              FimGrid *grid, double *tuple_pvals,
+                              double *tuple_null_scales,
+                              double *tuple_derivs, double *tuple_sub_derivs,
+                              double *tuple_teststats, FILE *logf,
+                              int nthreads) {
+  ThreadPool *pool = tuple_test_pool(nthreads, logf);
+  ColTestData td;
+  int t, nthr = thr_pool_size(pool);
   TreeModel *modcpy = tm_create_copy(mod); /* need separate copy of tree model
                                               with different internal scaling
                                               data for supertree/subtree case */
   modcpy->subtree_root = NULL;
 
+  td.msa = msa;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = tuple_pvals;
+  td.out[1] = tuple_null_scales;
+  td.out[2] = tuple_derivs;
+  td.out[3] = tuple_sub_derivs;
+  td.out[4] = tuple_teststats;
+  td.tuple_func = score_sub_tuple;
+  td.inside = td.outside = NULL;
+  td.grad = smalloc(nthr * sizeof(Vector*));
+  for (t = 0; t < nthr; t++) td.grad[t] = vec_new(2);
+  td.grid = grid;
+
   /* init ColFitData -- one for null model, one for alt */
-  d = col_init_fit_data(modcpy, msa, ALL, NNEUT, FALSE);
-  d2 = col_init_fit_data(mod, msa, SUBTREE, NNEUT, FALSE);
+  td.d = thread_fit_data(modcpy, msa, ALL, NNEUT, FALSE, nthr);
+  td.d2 = thread_fit_data(mod, msa, SUBTREE, NNEUT, FALSE, nthr);
                                 /* mod has the subtree info, modcpy
                                    does not */
 
-  /* precompute Fisher information matrices for a grid of scale values */
-  grid = col_fim_grid_sub(mod);
-
   /* prepare lists of leaves inside and outside root, for use in
      checking for informative substitutions */
   if (mod->subtree_root != NULL) {
-    inside = lst_new_ptr(mod->tree->nnodes);
-    outside = lst_new_ptr(mod->tree->nnodes);
-    tr_partition_leaves(mod->tree, mod->subtree_root, inside, outside);
+    td.inside = lst_new_ptr(mod->tree->nnodes);
+    td.outside = lst_new_ptr(mod->tree->nnodes);
+    tr_partition_leaves(mod->tree, mod->subtree_root, td.inside,
+                        td.outside);
   }
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples; i++) {
-    checkInterruptN(i, 100);
-
-    /* first check for informative substitution data in column; if none,
-       don't waste time computing score */
-    if (!col_has_data_sub(mod, msa, i, inside, outside)) {
-      teststat = 0;
-      vec_zero(grad);
-      d->params->data[0] = 1.0;
-    }
-
-    else {
-      d->tupleidx = i;
-      vec_set(d->params, 0, d->init_scale);
-
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-
-      d2->tupleidx = i;
-      d2->mod->scale = d->params->data[0];
-      d2->mod->scale_sub = 1;
-      tm_set_subst_matrices(d2->mod);
-      col_scale_derivs_subtree(d2, grad, NULL, d2->fels_scratch);
-
-      fim = col_get_fim_sub(grid, d2->mod->scale);
-
-      teststat = grad->data[1]*grad->data[1] /
-        (fim->data[1][1] - fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
-
-      if (teststat < 0) {
-        fprintf(stderr, "WARNING: teststat < 0 (%f\t%f\t%f\t%f\t%f\t%f)\n",
-                teststat, fim->data[0][0], fim->data[0][1],
-                fim->data[1][0], fim->data[1][1],
-                fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
-        teststat = 0;
-      }
-      mat_free(fim);
-
-      if ((mode == ACC && grad->data[1] < 0) ||
-          (mode == CON && grad->data[1] > 0))
-        teststat = 0;             /* derivative points toward boundary;
-                                     truncate at 0 */
-    }
-
-    if (tuple_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        tuple_pvals[i] = chisq_cdf(teststat, 1, FALSE);
-      else
-        tuple_pvals[i] = half_chisq_cdf(teststat, 1, FALSE);
-      /* assumes 50:50 mix of chisq and point mass at zero */
-
-      if (tuple_pvals[i] < 1e-20)
-        tuple_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
-
-      if (mode == CONACC && grad->data[1] > 0)
-        tuple_pvals[i] *= -1; /* mark as acceleration */
-    }
+  run_tuple_tests(pool, &td);
 
-    /* store scales and log likelihood ratios if necessary */
-    if (tuple_null_scales != NULL) tuple_null_scales[i] = d->params->data[0];
-    if (tuple_derivs != NULL) tuple_derivs[i] = grad->data[0];
-    if (tuple_sub_derivs != NULL) tuple_sub_derivs[i] = grad->data[1];
-    if (tuple_teststats != NULL) tuple_teststats[i] = teststat;
-  }
-
-  col_free_fit_data(d);
-  col_free_fit_data(d2);
-  vec_free(grad);
+  free_thread_fit_data(td.d, nthr);
+  free_thread_fit_data(td.d2, nthr);
+  for (t = 0; t < nthr; t++) vec_free(td.grad[t]);
+  sfree(td.grad);
   modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
                                 /* have to revert for tm_free to work
                                    correctly */
   tm_free(modcpy);
-  if (inside != NULL) lst_free(inside);
-  if (outside != NULL) lst_free(outside);
-  col_free_fim_grid(grid);
+  if (td.inside != NULL) lst_free(td.inside);
+  if (td.outside != NULL) lst_free(td.outside);
+  thr_pool_free(pool);
 }
 
 /* Create object with metadata and scratch memory for fitting scale
@@ -1222,6 +1505,35 @@ ColFitData *col_init_fit_data(TreeModel *mod, MSA *msa, scale_type stype,
   d->vec_scratch2_z = zvec_new(size);
   d->vec_scratch1_r = vec_new(size);
   d->vec_scratch2_r = vec_new(size);
+
+  /* cache eigenvector products and scaled eigenvalues for
+     col_scale_derivs_subst_real; the rate matrix has been
+     diagonalized (if possible) by tm_set_subst_matrices above */
+  d->evec_outer = NULL;
+  d->branch_evals = NULL;
+  d->weight_scratch = smalloc(6 * size * sizeof(double));
+  if (mod->rate_matrix->eigentype == REAL_NUM &&
+      mod->rate_matrix->evec_matrix_r != NULL &&
+      mod->rate_matrix->evals_r != NULL &&
+      mod->rate_matrix->evec_matrix_inv_r != NULL) {
+    Matrix *S = mod->rate_matrix->evec_matrix_r,
+      *Sinv = mod->rate_matrix->evec_matrix_inv_r;
+    int k;
+    d->evec_outer = smalloc(size * size * size * sizeof(double));
+    for (i = 0; i < size; i++)
+      for (j = 0; j < size; j++)
+        for (k = 0; k < size; k++)
+          d->evec_outer[(i*size + j)*size + k] = mat_get(S, i, k) *
+            mat_get(Sinv, k, j);
+    d->branch_evals = smalloc(nnodes * sizeof(double*));
+    for (nid = 0; nid < nnodes; nid++) {
+      TreeNode *n = lst_get_ptr(mod->tree->nodes, nid);
+      d->branch_evals[nid] = smalloc(size * sizeof(double));
+      for (k = 0; k < size; k++)
+        d->branch_evals[nid][k] = vec_get(mod->rate_matrix->evals_r, k) *
+          n->dparent;
+    }
+  }
   return d;
 }
 
@@ -1266,62 +1578,91 @@ void col_free_fit_data(ColFitData *d) {
   zvec_free(d->vec_scratch2_z);
   vec_free(d->vec_scratch1_r);
   vec_free(d->vec_scratch2_r);
+  if (d->evec_outer != NULL) {
+    sfree(d->evec_outer);
+    for (nid = 0; nid < d->mod->tree->nnodes; nid++)
+      sfree(d->branch_evals[nid]);
+    sfree(d->branch_evals);
+  }
+  sfree(d->weight_scratch);
 
   sfree(d);
 }
 
+/* GERP-like computation for a single tuple (see col_gerp) */
+static void gerp_tuple(ColTestData *td, int i, int thread) {
+  ColFitData *d = td->d[thread];
+  TreeModel *mod = d->mod;
+  int *has_data = td->has_data[thread];
+  int j, nspec = 0;
+  double nneut, scale, lnl;
+
+  col_find_missing_branches(mod, td->msa, i, has_data, &nspec);
+
+  if (nspec < 3)
+    nneut = scale = 0;
+  else {
+    vec_set(d->params, 0, d->init_scale);
+    d->tupleidx = i;
+
+    opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
+                  &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
+                  td->logf, NULL, NULL);
+    /* turns out to be faster (roughly 15% in limited experiments)
+       to use numerical rather than exact derivatives */
+
+    scale = d->params->data[0];
+    for (j = 1, nneut = 0; j < mod->tree->nnodes; j++)  /* node 0 is root */
+      if (has_data[j])
+        nneut += ((TreeNode*)lst_get_ptr(mod->tree->nodes, j))->dparent;
+  }
+
+  if (td->out[3] != NULL) td->out[3][i] = (double)nspec;
+  if (td->out[0] != NULL) td->out[0][i] = nneut;
+  if (td->out[1] != NULL) td->out[1][i] = scale * nneut;
+  if (td->out[2] != NULL) {
+    td->out[2][i] = nneut * (1 - scale);
+    if (td->mode == ACC) td->out[2][i] *= -1;
+    else if (td->mode == NNEUT) td->out[2][i] = fabs(td->out[2][i]);
+  }
+}
+
 /* Perform a GERP-like computation for each tuple.  Computes expected
    number of subst. under neutrality (tuple_nneut), expected number
    after rescaling by ML (tuple_nobs), expected number of rejected
    substitutions (tuple_nrejected), and number of species with data
-   (tuple_nspecies).  If any arrays are NULL, values will not be
+   (tuple_nspec).  If any arrays are NULL, values will not be
    retained.  Gaps and missing data are handled by working with
    induced subtree.  */
 void col_gerp(TreeModel *mod, MSA *msa, mode_type mode, double *tuple_nneut,
               double *tuple_nobs, double *tuple_nrejected,
-              double *tuple_nspec, FILE *logf) {
-  int i, j, nspec = 0;
-  double nneut, scale, lnl;
-  int *has_data = smalloc(mod->tree->nnodes * sizeof(int));
-  ColFitData *d;
+              double *tuple_nspec, FILE *logf, int nthreads) {
+  ThreadPool *pool = tuple_test_pool(nthreads, logf);
+  ColTestData td;
+  int t, nthr = thr_pool_size(pool);
+
+  td.msa = msa;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = tuple_nneut;
+  td.out[1] = tuple_nobs;
+  td.out[2] = tuple_nrejected;
+  td.out[3] = tuple_nspec;
+  td.tuple_func = gerp_tuple;
+  td.has_data = smalloc(nthr * sizeof(int*));
+  for (t = 0; t < nthr; t++)
+    td.has_data[t] = smalloc(mod->tree->nnodes * sizeof(int));
 
   /* init ColFitData */
-  d = col_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
+  td.d = thread_fit_data(mod, msa, ALL, NNEUT, FALSE, nthr);
 
   /* iterate through column tuples */
-  for (i = 0; i < msa->ss->ntuples;i++) {
-    checkInterruptN(i, 1000);
-    col_find_missing_branches(mod, msa, i, has_data, &nspec);
-
-    if (nspec < 3)
-      nneut = scale = 0;
-    else {
-      vec_set(d->params, 0, d->init_scale);
-      d->tupleidx = i;
-
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d,
-                    &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0],
-                    logf, NULL, NULL);
-      /* turns out to be faster (roughly 15% in limited experiments)
-         to use numerical rather than exact derivatives */
-
-      scale = d->params->data[0];
-      for (j = 1, nneut = 0; j < mod->tree->nnodes; j++)  /* node 0 is root */
-        if (has_data[j])
-          nneut += ((TreeNode*)lst_get_ptr(mod->tree->nodes, j))->dparent;
-    }
+  run_tuple_tests(pool, &td);
 
-    if (tuple_nspec != NULL) tuple_nspec[i] = (double)nspec;
-    if (tuple_nneut != NULL) tuple_nneut[i] = nneut;
-    if (tuple_nobs != NULL) tuple_nobs[i] = scale * nneut;
-    if (tuple_nrejected != NULL) {
-      tuple_nrejected[i] = nneut * (1 - scale);
-      if (mode == ACC) tuple_nrejected[i] *= -1;
-      else if (mode == NNEUT) tuple_nrejected[i] = fabs(tuple_nrejected[i]);
-    }
-  }
-  col_free_fit_data(d);
-  sfree(has_data);
+  free_thread_fit_data(td.d, nthr);
+  for (t = 0; t < nthr; t++) sfree(td.has_data[t]);
+  sfree(td.has_data);
+  thr_pool_free(pool);
 }
 
 /* Identify branches wrt which a given column tuple is uninformative,
@@ -1442,6 +1783,8 @@ void col_scale_derivs_subtree_num(ColFitData *d, Vector *gradient,
 Matrix *col_estimate_fim_sub(TreeModel *mod) {
   Vector *grad = vec_new(2);
   Matrix *hessian = mat_new(2, 2), *fim = mat_new(2, 2);
+  int *seq_idx = mod->msa_seq_idx; /* replaced by tm_generate_msa; must
+                                      be restored for the real data */
   MSA *msa = tm_generate_msa(NSAMPLES_FIM, NULL, &mod, NULL);
   ColFitData *d = col_init_fit_data(mod, msa, SUBTREE, NNEUT, TRUE);
   int i;
@@ -1460,24 +1803,41 @@ Matrix *col_estimate_fim_sub(TreeModel *mod) {
 
   msa_free(msa);
   col_free_fit_data(d);
+  sfree(mod->msa_seq_idx);
+  mod->msa_seq_idx = seq_idx;
   vec_free(grad);
   mat_free(hessian);
   return (fim);
 }
 
-/* Precompute estimates of FIM for a grid of possible scale params
-   (subtree case) */
-FimGrid *col_fim_grid_sub(TreeModel *mod) {
+/* set up a model for estimation of a FIM grid: scale estimation, at
+   scale 1 (as col_init_fit_data does) */
+static void fim_grid_setup(TreeModel *mod) {
+  /* rates for the discrete gamma model are otherwise filled in only
+     as a side effect of sampling (tm_generate_msa), which does not
+     happen if the grid is cached */
+  if (mod->nratecats > 1 && !mod->empirical_rates)
+    DiscreteGamma(mod->freqK, mod->rK, mod->alpha, mod->alpha,
+                  mod->nratecats, 0);
+  mod->estimate_branchlens = TM_SCALE_ONLY;
+  mod->scale = mod->scale_sub = 1;
+  tm_set_subst_matrices(mod);   /* also defines in_subtree */
+}
+
+/* estimate a FIM grid for a model already set up by fim_grid_setup;
+   leaves the model at scale 1 */
+static FimGrid *fim_grid_estimate(TreeModel *mod, tlc_fprint fprint) {
   int i;
   FimGrid *g = smalloc(sizeof(FimGrid));
 
+  g->fprint = fprint;
+  g->gridsize1 = GRIDSIZE1;
+  g->gridsize2 = GRIDSIZE2;
   g->ngrid1 = (int)(1.0/GRIDSIZE1);
   g->ngrid2 = (int)((1.0 * GRIDMAXLOG / GRIDSIZE2) + 1);
   g->ngrid = g->ngrid1 + g->ngrid2;
   g->scales = smalloc(g->ngrid * sizeof(double));
 
-  mod->scale_sub = 1;
-
   for (i = 0; i < g->ngrid1; i++)
     g->scales[i] = i * GRIDSIZE1;
 
@@ -1490,10 +1850,19 @@ FimGrid *col_fim_grid_sub(TreeModel *mod) {
     tm_set_subst_matrices(mod);
     g->fim[i] = col_estimate_fim_sub(mod);
   }
+  mod->scale = 1;
+  tm_set_subst_matrices(mod);
 
   return g;
 }
 
+/* Precompute estimates of FIM for a grid of possible scale params
+   (subtree case) */
+FimGrid *col_fim_grid_sub(TreeModel *mod) {
+  fim_grid_setup(mod);
+  return fim_grid_estimate(mod, col_fim_grid_fingerprint(mod));
+}
+
 /* free FimGrid object */
 void col_free_fim_grid(FimGrid *g) {
   int i;
@@ -1501,6 +1870,265 @@ void col_free_fim_grid(FimGrid *g) {
     mat_free(g->fim[i]);
   sfree(g->fim);
   sfree(g->scales);
+  sfree(g);
+}
+
+/* add the contents of a Markov matrix to a fingerprint */
+static tlc_fprint fim_hash_mm(tlc_fprint h, MarkovMatrix *M) {
+  int i;
+  h = tlc_hash(h, &M->size, sizeof(int));
+  for (i = 0; i < M->size; i++)
+    h = tlc_hash(h, M->matrix->data[i], M->size * sizeof(double));
+  return h;
+}
+
+/* add the contents of a vector to a fingerprint */
+static tlc_fprint fim_hash_vec(tlc_fprint h, Vector *v) {
+  h = tlc_hash(h, &v->size, sizeof(int));
+  return tlc_hash(h, v->data, v->size * sizeof(double));
+}
+
+tlc_fprint col_fim_grid_fingerprint(TreeModel *mod) {
+  tlc_fprint h = tlc_hash(0, FIM_GRID_MAGIC, strlen(FIM_GRID_MAGIC));
+  int settings[6] = {NSAMPLES_FIM, GRIDMAXLOG, 0, 0, 0, 0};
+  double gridsizes[2] = {GRIDSIZE1, GRIDSIZE2};
+  char *topology = tr_to_string(mod->tree, FALSE);
+  int *in_subtree = mod->in_subtree;
+  int i;
+
+  settings[2] = mod->order;
+  settings[3] = mod->nratecats;
+  settings[4] = (int)mod->subst_mod;
+  settings[5] = mod->root_leaf_id;
+  h = tlc_hash(h, settings, sizeof(settings));
+  h = tlc_hash(h, gridsizes, sizeof(gridsizes));
+  h = tlc_hash(h, mod->rate_matrix->states,
+               strlen(mod->rate_matrix->states));
+  h = tlc_hash(h, topology, strlen(topology));
+  sfree(topology);
+
+  /* branch lengths and leaf names, by node id */
+  for (i = 0; i < mod->tree->nnodes; i++) {
+    TreeNode *n = lst_get_ptr(mod->tree->nodes, i);
+    h = tlc_hash(h, &n->id, sizeof(int));
+    h = tlc_hash(h, &n->dparent, sizeof(double));
+    h = tlc_hash(h, n->name, strlen(n->name));
+  }
+
+  /* branches in the subtree; membership is computed here if the model
+     has not defined it yet */
+  if (in_subtree == NULL && mod->subtree_root != NULL)
+    in_subtree = tr_in_subtree(mod->tree, mod->subtree_root);
+  if (in_subtree != NULL)
+    h = tlc_hash(h, in_subtree, mod->tree->nnodes * sizeof(int));
+  if (in_subtree != mod->in_subtree) sfree(in_subtree);
+
+  /* substitution process */
+  h = fim_hash_mm(h, mod->rate_matrix);
+  h = fim_hash_vec(h, mod->backgd_freqs);
+  h = tlc_hash(h, &mod->selection, sizeof(double));
+  h = tlc_hash(h, &mod->alpha, sizeof(double));
+  if (mod->empirical_rates && mod->nratecats > 1) {
+    h = tlc_hash(h, mod->rK, mod->nratecats * sizeof(double));
+    h = tlc_hash(h, mod->freqK, mod->nratecats * sizeof(double));
+  }
+  if (mod->alt_subst_mods != NULL) {
+    for (i = 0; i < lst_size(mod->alt_subst_mods); i++) {
+      AltSubstMod *alt = lst_get_ptr(mod->alt_subst_mods, i);
+      if (alt->defString != NULL)
+        h = tlc_hash(h, alt->defString->chars, alt->defString->length);
+      if (alt->rate_matrix != NULL) h = fim_hash_mm(h, alt->rate_matrix);
+      if (alt->backgd_freqs != NULL) h = fim_hash_vec(h, alt->backgd_freqs);
+      h = tlc_hash(h, &alt->selection, sizeof(double));
+      h = tlc_hash(h, &alt->bgc, sizeof(double));
+    }
+  }
+  return h;
+}
+
+/* upper limit on the number of grid points in a cached grid; larger
+   values indicate a corrupt file */
+#define FIM_GRID_MAX_POINTS 100000
+
+static int fim_read(void *data, size_t size, size_t n, FILE *F) {
+  return fread(data, size, n, F) == n;
+}
+
+static int fim_write(const void *data, size_t size, size_t n, FILE *F) {
+  return fwrite(data, size, n, F) == n;
+}
+
+/* read one grid; returns NULL if the file is truncated or corrupt */
+static FimGrid *fim_read_grid(FILE *F) {
+  FimGrid *g = smalloc(sizeof(FimGrid));
+  int j;
+
+  g->scales = NULL;
+  g->fim = NULL;
+  g->ngrid = 0;
+  if (!fim_read(&g->fprint, sizeof(tlc_fprint), 1, F) ||
+      !fim_read(&g->ngrid1, sizeof(int), 1, F) ||
+      !fim_read(&g->ngrid2, sizeof(int), 1, F) ||
+      !fim_read(&g->gridsize1, sizeof(double), 1, F) ||
+      !fim_read(&g->gridsize2, sizeof(double), 1, F) ||
+      g->ngrid1 < 0 || g->ngrid2 < 0 || g->ngrid1 + g->ngrid2 < 1 ||
+      g->ngrid1 + g->ngrid2 > FIM_GRID_MAX_POINTS) {
+    sfree(g);
+    return NULL;
+  }
+  g->scales = smalloc((g->ngrid1 + g->ngrid2) * sizeof(double));
+  g->fim = smalloc((g->ngrid1 + g->ngrid2) * sizeof(void*));
+  for (j = 0; j < g->ngrid1 + g->ngrid2; j++) {
+    double vals[4];
+    if (!fim_read(&g->scales[j], sizeof(double), 1, F) ||
+        !fim_read(vals, sizeof(double), 4, F)) {
+      col_free_fim_grid(g);
+      return NULL;
+    }
+    g->fim[j] = mat_new(2, 2);
+    g->ngrid = j+1;             /* number allocated so far */
+    mat_set(g->fim[j], 0, 0, vals[0]);
+    mat_set(g->fim[j], 0, 1, vals[1]);
+    mat_set(g->fim[j], 1, 0, vals[2]);
+    mat_set(g->fim[j], 1, 1, vals[3]);
+  }
+  return g;
+}
+
+List *col_read_fim_grids(FILE *F) {
+  char magic[sizeof(FIM_GRID_MAGIC)];
+  size_t mlen = strlen(FIM_GRID_MAGIC);
+  int version, ngrids, i;
+  List *grids;
+
+  if (!fim_read(magic, sizeof(char), mlen, F) ||
+      strncmp(magic, FIM_GRID_MAGIC, mlen) != 0 ||
+      !fim_read(&version, sizeof(int), 1, F) ||
+      version != FIM_GRID_VERSION ||
+      !fim_read(&ngrids, sizeof(int), 1, F) || ngrids < 0)
+    return NULL;
+
+  grids = lst_new_ptr(10);
+  for (i = 0; i < ngrids; i++) {
+    FimGrid *g = fim_read_grid(F);
+    if (g == NULL) {
+      for (i = 0; i < lst_size(grids); i++)
+        col_free_fim_grid(lst_get_ptr(grids, i));
+      lst_free(grids);
+      return NULL;
+    }
+    lst_push_ptr(grids, g);
+  }
+  return grids;
+}
+
+int col_write_fim_grids(FILE *F, List *grids) {
+  int version = FIM_GRID_VERSION, ngrids = lst_size(grids), i, j;
+
+  if (!fim_write(FIM_GRID_MAGIC, sizeof(char), strlen(FIM_GRID_MAGIC), F) ||
+      !fim_write(&version, sizeof(int), 1, F) ||
+      !fim_write(&ngrids, sizeof(int), 1, F))
+    return 1;
+  for (i = 0; i < ngrids; i++) {
+    FimGrid *g = lst_get_ptr(grids, i);
+    if (!fim_write(&g->fprint, sizeof(tlc_fprint), 1, F) ||
+        !fim_write(&g->ngrid1, sizeof(int), 1, F) ||
+        !fim_write(&g->ngrid2, sizeof(int), 1, F) ||
+        !fim_write(&g->gridsize1, sizeof(double), 1, F) ||
+        !fim_write(&g->gridsize2, sizeof(double), 1, F))
+      return 1;
+    for (j = 0; j < g->ngrid; j++) {
+      double vals[4];
+      vals[0] = mat_get(g->fim[j], 0, 0);
+      vals[1] = mat_get(g->fim[j], 0, 1);
+      vals[2] = mat_get(g->fim[j], 1, 0);
+      vals[3] = mat_get(g->fim[j], 1, 1);
+      if (!fim_write(&g->scales[j], sizeof(double), 1, F) ||
+          !fim_write(vals, sizeof(double), 4, F))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/* read the grids in a cache file; returns an empty list if the file
+   does not exist or is not a valid cache (with a warning in the latter
+   case, if warn is TRUE) */
+static List *fim_load_cache(const char *fname, int warn) {
+  List *grids = NULL;
+  FILE *F = phast_fopen_no_exit(fname, "rb");
+  if (F != NULL) {
+    grids = col_read_fim_grids(F);
+    phast_fclose(F);
+    if (grids == NULL && warn)
+      phast_warning("WARNING: ignoring invalid FIM grid cache %s.\n", fname);
+  }
+  return grids != NULL ? grids : lst_new_ptr(10);
+}
+
+/* add a grid to a cache file.  The file is re-read, so that grids
+   added by other runs since it was first read are kept, and the new
+   contents are written to a temporary file that is then renamed, so
+   that readers never see a partially written file */
+static void fim_save_cache(const char *fname, FimGrid *grid) {
+  List *grids = fim_load_cache(fname, FALSE);
+  char *tmpname = smalloc((strlen(fname) + 30) * sizeof(char));
+  FILE *F;
+  int i, err, found = FALSE;
+
+  for (i = 0; i < lst_size(grids) && !found; i++)
+    if (((FimGrid*)lst_get_ptr(grids, i))->fprint == grid->fprint)
+      found = TRUE;
+  if (!found) {
+    lst_push_ptr(grids, grid);
+    sprintf(tmpname, "%s.%ld.tmp", fname, (long)getpid());
+    if ((F = phast_fopen_no_exit(tmpname, "wb")) == NULL)
+      err = 1;
+    else {
+      err = col_write_fim_grids(F, grids);
+      err = (fclose(F) != 0) || err;
+      err = err || rename(tmpname, fname) != 0;
+    }
+    if (err) {
+      phast_warning("WARNING: unable to write FIM grid cache %s.\n", fname);
+      remove(tmpname);
+    }
+  }
+  for (i = 0; i < lst_size(grids); i++) {
+    FimGrid *g = lst_get_ptr(grids, i);
+    if (g != grid) col_free_fim_grid(g);
+  }
+  lst_free(grids);
+  sfree(tmpname);
+}
+
+FimGrid *col_fim_grid_sub_cached(TreeModel *mod, const char *fname) {
+  FimGrid *retval = NULL;
+  List *grids;
+  tlc_fprint fprint;
+  int i;
+
+  if (fname == NULL)
+    return col_fim_grid_sub(mod);
+
+  fim_grid_setup(mod);
+  fprint = col_fim_grid_fingerprint(mod);
+  grids = fim_load_cache(fname, TRUE);
+  for (i = 0; i < lst_size(grids) && retval == NULL; i++) {
+    FimGrid *g = lst_get_ptr(grids, i);
+    if (g->fprint == fprint) retval = g;
+  }
+  for (i = 0; i < lst_size(grids); i++) {
+    FimGrid *g = lst_get_ptr(grids, i);
+    if (g != retval) col_free_fim_grid(g);
+  }
+  lst_free(grids);
+
+  if (retval == NULL) {         /* not cached; estimate and add to file */
+    retval = fim_grid_estimate(mod, fprint);
+    fim_save_cache(fname, retval);
+  }
+  return retval;
 }
 
 /* Estimate scale Fisher Information Matrix for the non-subtree case.
@@ -1508,6 +2136,8 @@ void col_free_fim_grid(FimGrid *g) {
    required.  Estimation is done by sampling, as above */
 double col_estimate_fim(TreeModel *mod) {
   double deriv1, deriv2, retval = 0;
+  int *seq_idx = mod->msa_seq_idx; /* replaced by tm_generate_msa; must
+                                      be restored for the real data */
   MSA *msa = tm_generate_msa(NSAMPLES_FIM, NULL, &mod, NULL);
   ColFitData *d = col_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
   int i;
@@ -1524,6 +2154,8 @@ double col_estimate_fim(TreeModel *mod) {
 
   msa_free(msa);
   col_free_fit_data(d);
+  sfree(mod->msa_seq_idx);
+  mod->msa_seq_idx = seq_idx;
   return (retval);
 }
 
@@ -1538,9 +2170,9 @@ Matrix *col_get_fim_sub(FimGrid *g, double scale) {
     die("ERROR col_get_fix_sub: scale should be >= 0 but is %e\n", scale);
 
   if (scale < 1)
-    idx = (int)floor(scale / GRIDSIZE1);
+    idx = (int)floor(scale / g->gridsize1);
   else
-    idx = g->ngrid1 + (int)floor(log(scale) / GRIDSIZE2);
+    idx = g->ngrid1 + (int)floor(log(scale) / g->gridsize2);
 
   if (idx >= g->ngrid - 1)
     retval = mat_create_copy(g->fim[g->ngrid - 1]);
@@ -29,14 +29,30 @@
 #include <phast/complex.h>
 #include <math.h>
 #include <phast/dgamma.h>
+#include <phast/thread_pool.h>
 
 #define DERIV_EPSILON 1e-5      
                                 /* used for numerical est. of derivatives */
 
+#define EM_BLOCK_MIN_TUPLES 1000
+                                /* minimum no. of tuples per block in
+                                   the E step */
+#define EM_MAX_BLOCKS 64        /* maximum no. of blocks in the E step */
+#define EM_BLOCK_MAX_DOUBLES (1 << 24)
+                                /* limit on the total size of the
+                                   per-block expected counts */
+
+/* data passed to the objective and gradient functions of the M step */
+typedef struct {
+  TreeModel *mod;
+  ThreadPool *pool;
+} EmData;
+
 /* internal functions */
 double tm_partial_ll_wrapper(Vector *params, void *data);
 double tm_partial_ll_wrapper_fast(Vector *params, void *data);
 double tm_likelihood_wrapper(Vector *params, void *data);
+double tm_em_likelihood_wrapper(Vector *params, void *data);
 void tm_log_em(FILE *logf, int header_only, double val, Vector *params);
 void compute_grad_em_approx(Vector *grad, Vector *params, void *data, 
                             Vector *lb, Vector *ub);
@@ -47,13 +63,59 @@ void get_neighbors(int *neighbors, int state, int order, int alph_size);
 
 void remove_ratevar_from_param_map(TreeModel *mod, Vector *params);
 
-/* fit a tree model using EM */
+/* state of the EM algorithm that is not part of the model, saved to
+   and restored from checkpoints */
+typedef struct {
+  int npar;                     /* number of free parameters */
+  Vector *opt_params;           /* free parameters */
+  Vector *lower_bounds, *upper_bounds;
+  Matrix *H;                    /* inverse Hessian (BFGS) */
+  LbfgsHistory *hist;           /* or correction pairs (L-BFGS) */
+} EmOptState;
+
+/* reinstate rate variation, which is ignored in early iterations;
+   the parameters for it are added to the free parameters if
+   necessary, and the inverse Hessian or L-BFGS history is reset */
+static void reintroduce_ratevar(TreeModel *mod, EmOptState *st, 
+                                int nratecats, double alpha, double rK0, 
+                                double freqK0, int opt_ratevar_freqs) {
+  int i, nrateparams = tm_get_nratevarparams(mod), old_npar = st->npar;
+  mod->nratecats = nratecats;
+  mod->alpha  = alpha;
+  mod->rK[0] = rK0;
+  mod->freqK[0] = freqK0;
+  if (opt_ratevar_freqs && !mod->empirical_rates) {
+    st->npar += nrateparams;
+    vec_realloc(st->opt_params, st->npar);
+    for (i=0; i < nrateparams; i++) {
+      mod->param_map[mod->ratevar_idx+i] = i + old_npar;
+      vec_set(st->opt_params, i + old_npar, 
+              vec_get(mod->all_params, mod->ratevar_idx + i));
+    }
+    if (st->lower_bounds != NULL) vec_free(st->lower_bounds);
+    if (st->upper_bounds != NULL) vec_free(st->upper_bounds);
+    tm_new_boundaries(&st->lower_bounds, &st->upper_bounds, st->npar, mod, 0);
+    if (st->H != NULL) {
+      mat_free(st->H);
+      st->H = mat_new(st->npar, st->npar);
+      mat_set_identity(st->H);
+    }
+    else {
+      opt_lbfgs_history_free(st->hist);
+      st->hist = opt_lbfgs_history_new(st->npar, OPT_LBFGS_M);
+    }
+  }
+}
+
+/* fit a tree model using EM.  If mod->ckpt is non-NULL, the state of
+   the algorithm is checkpointed periodically at the start of an
+   iteration, and a run is resumed from any state loaded into
+   mod->ckpt */
 int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat, 
               opt_precision_type precision, int max_its, FILE *logf,
-	      FILE *error_file) {
+	      FILE *error_file, int nthreads) {
   double ll, improvement;
-  Vector *lower_bounds, *upper_bounds, *opt_params;
-  int retval = 0, it, i, home_stretch = 0, nratecats, npar;
+  int retval = 0, it, i, home_stretch = 0, nratecats;
   double lastll = NEGINFTY, alpha=0, rK0=0, freqK0=0, branchlen_scale;
   struct timeval start_time, end_time, post_prob_start, post_prob_end;
   TreeModel *proj_mod = NULL;
@@ -62,10 +124,14 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
   void (*grad_func)(Vector*, Vector*, void*, Vector*, 
                     Vector*);
   double (*likelihood_func)(Vector *, void*);
-  Matrix *H;
-  int opt_ratevar_freqs=0;
+  EmOptState st;
+  int opt_ratevar_freqs=0, start_it = 1;
   opt_precision_type bfgs_prec = OPT_LOW_PREC;
                                 /* will be adjusted as necessary */
+  TreePosteriors **block_post;
+  int nblocks;
+  long block_size;
+  EmData em;
 
   /* obtain sufficient statistics for MSA, if necessary */
   if (msa->ss == NULL) {
@@ -105,6 +171,25 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
                                                 mod->empirical_rates ? 1 : 0);
   mod->category = cat;
 
+  /* the E step is divided into blocks of tuples, which are processed
+     concurrently.  The number of blocks depends only on the data and
+     the model, so that results do not depend on the number of
+     threads */
+  block_size = (long)mod->nratecats * mod->rate_matrix->size *
+    mod->rate_matrix->size * mod->tree->nnodes;
+  nblocks = msa->ss->ntuples / EM_BLOCK_MIN_TUPLES;
+  if (nblocks > EM_MAX_BLOCKS) nblocks = EM_MAX_BLOCKS;
+  if (nblocks > EM_BLOCK_MAX_DOUBLES / block_size)
+    nblocks = (int)(EM_BLOCK_MAX_DOUBLES / block_size);
+  if (nblocks < 1) nblocks = 1;
+  block_post = smalloc(nblocks * sizeof(TreePosteriors*));
+  block_post[0] = mod->tree_posteriors;
+  for (i = 1; i < nblocks; i++)
+    block_post[i] = tl_new_tree_posteriors(mod, msa, 0, 0, 0, 1, 0, 0,
+                                           mod->empirical_rates ? 1 : 0);
+  em.mod = mod;
+  em.pool = thr_pool_new(nthreads);
+
   /* in the case of rate variation, start by ignoring then reinstate
      when close to convergence */
   nratecats = mod->nratecats;
@@ -139,26 +224,73 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
     mm_set_eigentype(mod->rate_matrix, COMPLEX_NUM);
 
   if (mod->estimate_backgd)
-    likelihood_func = tm_likelihood_wrapper;
+    likelihood_func = tm_em_likelihood_wrapper;
   else likelihood_func = tm_partial_ll_wrapper;
 
-  npar=0;
+  st.npar=0;
   for (i=0; i<params->size; i++) 
-    if (mod->param_map[i] >= npar) 
-      npar = mod->param_map[i]+1;
-  opt_params = vec_new(npar);
-  for (i=0; i<npar; i++) 
-    vec_set(opt_params, i, 0);  // in some cases some parameters are not used but need to be initialized
+    if (mod->param_map[i] >= st.npar) 
+      st.npar = mod->param_map[i]+1;
+  st.opt_params = vec_new(st.npar);
+  for (i=0; i<st.npar; i++) 
+    vec_set(st.opt_params, i, 0);  // in some cases some parameters are not used but need to be initialized
   for (i=0; i<params->size; i++) {
     if (mod->param_map[i] >= 0) 
-      vec_set(opt_params, mod->param_map[i], vec_get(params, i));
+      vec_set(st.opt_params, mod->param_map[i], vec_get(params, i));
     vec_set(mod->all_params, i, vec_get(params, i));
   }
 
-  tm_new_boundaries(&lower_bounds, &upper_bounds, npar, mod, 0);
+  tm_new_boundaries(&st.lower_bounds, &st.upper_bounds, st.npar, mod, 0);
 
-  H = mat_new(npar, npar);
-  mat_set_identity(H);
+  /* inverse Hessian (or L-BFGS history), carried over between M
+     steps */
+  st.H = NULL;
+  st.hist = NULL;
+  if (mod->opt_method == OPT_LBFGS)
+    st.hist = opt_lbfgs_history_new(st.npar, OPT_LBFGS_M);
+  else {
+    st.H = mat_new(st.npar, st.npar);
+    mat_set_identity(st.H);
+  }
+
+  /* resume from a checkpoint, if available */
+  if (ckpt_has(mod->ckpt, "EM_ITERATION")) {
+    Vector *saved;
+    if (ckpt_get_int(mod->ckpt, "EM_RATEVAR") && mod->nratecats != nratecats)
+      reintroduce_ratevar(mod, &st, nratecats, alpha, rK0, freqK0, 
+                          opt_ratevar_freqs);
+    saved = ckpt_get_vector(mod->ckpt, "EM_ALL_PARAMS");
+    if (saved->size != params->size)
+      die("ERROR: checkpoint has %i model parameters, expected %i.\n",
+          saved->size, params->size);
+    vec_copy(params, saved);
+    vec_copy(mod->all_params, saved);
+    vec_free(saved);
+    saved = ckpt_get_vector(mod->ckpt, "EM_OPT_PARAMS");
+    if (saved->size != st.npar)
+      die("ERROR: checkpoint has %i parameters, expected %i.\n",
+          saved->size, st.npar);
+    vec_copy(st.opt_params, saved);
+    vec_free(saved);
+    if (st.H != NULL && ckpt_has(mod->ckpt, "EM_INV_HESSIAN")) {
+      Matrix *savedH = ckpt_get_matrix(mod->ckpt, "EM_INV_HESSIAN");
+      if (savedH->nrows != st.npar || savedH->ncols != st.npar)
+        die("ERROR: checkpoint has inverse Hessian of wrong dimension.\n");
+      mat_copy(st.H, savedH);
+      mat_free(savedH);
+    }
+    if (st.hist != NULL)
+      opt_lbfgs_history_restore(st.hist, mod->ckpt, "EM_");
+    if (ckpt_get_int(mod->ckpt, "EM_EXACT_GRAD") && grad_func != NULL)
+      grad_func = compute_grad_em_exact;
+    bfgs_prec = ckpt_get_int(mod->ckpt, "EM_BFGS_PREC");
+    home_stretch = ckpt_get_int(mod->ckpt, "EM_HOME_STRETCH");
+    lastll = ckpt_get_dbl(mod->ckpt, "EM_LASTLL");
+    start_it = ckpt_get_int(mod->ckpt, "EM_ITERATION");
+    ckpt_clear(mod->ckpt);
+    if (logf != NULL) 
+      fprintf(logf, "Resuming from checkpoint at iteration %d.\n", start_it);
+  }
 
   if (mod->estimate_branchlens == TM_BRANCHLENS_NONE ||
       mod->alt_subst_mods != NULL ||
@@ -173,11 +305,27 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
   }
 
 
-  for (it = 1;  ; it++) {
+  for (it = start_it;  ; it++) {
     double tmp;
     checkInterrupt();
 
-    tm_unpack_params(mod, opt_params, -1);
+    if (ckpt_due(mod->ckpt)) {
+      ckpt_begin(mod->ckpt);
+      ckpt_put_int(mod->ckpt, "EM_ITERATION", it);
+      ckpt_put_dbl(mod->ckpt, "EM_LASTLL", lastll);
+      ckpt_put_int(mod->ckpt, "EM_BFGS_PREC", bfgs_prec);
+      ckpt_put_int(mod->ckpt, "EM_HOME_STRETCH", home_stretch);
+      ckpt_put_int(mod->ckpt, "EM_EXACT_GRAD", 
+                   grad_func == compute_grad_em_exact);
+      ckpt_put_int(mod->ckpt, "EM_RATEVAR", mod->nratecats == nratecats);
+      ckpt_put_vector(mod->ckpt, "EM_ALL_PARAMS", mod->all_params);
+      ckpt_put_vector(mod->ckpt, "EM_OPT_PARAMS", st.opt_params);
+      if (st.H != NULL) ckpt_put_matrix(mod->ckpt, "EM_INV_HESSIAN", st.H);
+      else opt_lbfgs_history_save(st.hist, mod->ckpt, "EM_");
+      ckpt_commit(mod->ckpt);
+    }
+
+    tm_unpack_params(mod, st.opt_params, -1);
     
     /* if appropriate, dump intermediate version of model for inspection */
     if (mod->order >= 2) {
@@ -188,8 +336,8 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
     if (logf != NULL) 
       gettimeofday(&post_prob_start, NULL);
 
-    ll = tl_compute_log_likelihood(mod, msa, NULL, NULL, cat, mod->tree_posteriors) 
-      * log(2); 
+    ll = tl_compute_log_likelihood_blocks(mod, msa, cat, block_post, nblocks,
+                                          em.pool) * log(2);
 
     if (logf != NULL) {
       gettimeofday(&post_prob_end, NULL);
@@ -260,34 +408,20 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
 	vec_set(mod->all_params, mod->ratevar_idx+i, vec_get(params, mod->ratevar_idx+i));
     }
 
-    opt_bfgs(likelihood_func, opt_params, (void*)mod, &tmp, lower_bounds,
-             upper_bounds, logf, grad_func, bfgs_prec, H, NULL); 
+    if (mod->opt_method == OPT_LBFGS)
+      opt_lbfgs(likelihood_func, st.opt_params, (void*)&em, &tmp, 
+                st.lower_bounds, st.upper_bounds, logf, grad_func, bfgs_prec,
+                st.hist, NULL, NULL);
+    else
+      opt_bfgs(likelihood_func, st.opt_params, (void*)&em, &tmp, 
+               st.lower_bounds, st.upper_bounds, logf, grad_func, bfgs_prec,
+               st.H, NULL, NULL); 
 
     if (mod->nratecats != nratecats && 
         improvement < TM_EM_CONV(OPT_CRUDE_PREC) && home_stretch) {
-      int nrateparams = tm_get_nratevarparams(mod);
-      int old_npar = npar;
       if (logf != NULL) fprintf(logf, "Introducing rate variation.\n");
-      mod->nratecats = nratecats;
-      mod->alpha  = alpha;
-      mod->rK[0] = rK0;
-      mod->freqK[0] = freqK0;
-      if (opt_ratevar_freqs && !mod->empirical_rates) {
-	npar += nrateparams;
-	vec_realloc(opt_params, npar);
-	for (i=0; i < nrateparams; i++) {
-	  mod->param_map[mod->ratevar_idx+i] = i + old_npar;
-	  vec_set(opt_params, i + old_npar, 
-		  vec_get(mod->all_params, mod->ratevar_idx + i));
-	  
-	}
-	if (lower_bounds != NULL) vec_free(lower_bounds);
-	if (upper_bounds != NULL) vec_free(upper_bounds);
-	tm_new_boundaries(&lower_bounds, &upper_bounds, npar, mod, 0);
-	mat_free(H);
-	H = mat_new(npar, npar);
-	mat_set_identity(H);
-      }
+      reintroduce_ratevar(mod, &st, nratecats, alpha, rK0, freqK0, 
+                          opt_ratevar_freqs);
     }
   }
 
@@ -327,11 +461,16 @@ int tm_fit_em(TreeModel *mod, MSA *msa, Vector *params, int cat,
             (end_time.tv_usec - start_time.tv_usec)/1.0e6);
   }
 
-  vec_free(lower_bounds);
-  tl_free_tree_posteriors(mod, msa, mod->tree_posteriors);
+  vec_free(st.lower_bounds);
+  for (i = 0; i < nblocks; i++)
+    tl_free_tree_posteriors(mod, msa, block_post[i]);
+  sfree(block_post);
   mod->tree_posteriors = NULL;
+  thr_pool_free(em.pool);
 
-  vec_free(opt_params);
+  vec_free(st.opt_params);
+  if (st.H != NULL) mat_free(st.H);
+  if (st.hist != NULL) opt_lbfgs_history_free(st.hist);
   return retval;
 }
 
@@ -352,12 +491,18 @@ void remove_ratevar_from_param_map(TreeModel *mod, Vector *params) {
 
 
 double tm_partial_ll_wrapper(Vector *params, void *data) {
-  TreeModel *mod = (TreeModel*)data;
+  TreeModel *mod = ((EmData*)data)->mod;
   TreePosteriors *post = mod->tree_posteriors;
   tm_unpack_params(mod, params, -1);
   return -tl_compute_partial_ll_suff_stats(mod, post) * log(2);
 }
 
+/* (used when estimating background frequencies) complete likelihood
+   of the model, as for tm_fit */
+double tm_em_likelihood_wrapper(Vector *params, void *data) {
+  return tm_likelihood_wrapper(params, ((EmData*)data)->mod);
+}
+
 /* Print a line to a log file that describes the state of the
    optimization procedure on a given iteration.  The value of the
    function is output, along with the values of all parameters.  If
@@ -412,7 +557,7 @@ void get_neighbors(int *neighbors, int state, int order, int alph_size) {
 void compute_grad_em_approx(Vector *grad, Vector *params, void *data, 
                           Vector *lb, Vector *ub) {
 
-  TreeModel *mod = (TreeModel*)data;
+  TreeModel *mod = ((EmData*)data)->mod;
   MarkovMatrix *P, *Q = mod->rate_matrix;
   int alph_size = (int)strlen(mod->rate_matrix->states);
   int nstates = mod->rate_matrix->size;
@@ -430,11 +575,11 @@ void compute_grad_em_approx(Vector *grad, Vector *params, void *data,
   List *erows = lst_new_int(4), *ecols = lst_new_int(4), 
     *distinct_rows = lst_new_int(2), *distinct_cols = lst_new_int(4);
 
-  static double **q = NULL, **q2 = NULL, **q3 = NULL, 
+  static PHAST_TLS double **q = NULL, **q2 = NULL, **q3 = NULL, 
     **dq = NULL, **dqq = NULL, **qdq = NULL, **dqq2 = NULL, **qdqq = NULL, 
     **q2dq = NULL, **dqq3 = NULL, **qdqq2 = NULL, **q2dqq = NULL, 
     **q3dq = NULL;
-  static Complex *diag = NULL;
+  static PHAST_TLS Complex *diag = NULL;
 
   if  (Q->evals_z == NULL || Q->evec_matrix_z == NULL || Q->evec_matrix_inv_z == NULL)
     die("ERRROR: compute_grad_em_approx got NULL value in eigensystem; error diagonalizing matrix.");
@@ -894,38 +1039,103 @@ void compute_grad_em_approx(Vector *grad, Vector *params, void *data,
   lst_free(distinct_cols);
 }
 
-/* Like above, but using the approach outlined by Schadt and Lange for
-   computing the partial derivatives wrt rate matrix parameters.
-   Slower, but gives exact results */
-void compute_grad_em_exact(Vector *grad, Vector *params, void *data, 
-                           Vector *lb, Vector *ub) {
+/* (used in compute_grad_em_exact) partial derivative of the expected
+   complete-data log likelihood wrt the length of the branch above n,
+   before negation.  Thread safe */
+static double exact_deriv_branch(TreeModel *mod, TreeNode *n) {
+  int nstates = mod->rate_matrix->size;
+  int i, k, l, rcat;
+  MarkovMatrix *P, *Q = mod->rate_matrix;
+  Complex diag[nstates];
+  double t, deriv = 0;
 
-  TreeModel *mod = (TreeModel*)data;
-/*   int alph_size = strlen(mod->rate_matrix->states); */
+  for (rcat = 0; rcat < mod->nratecats; rcat++) {
+    P = mod->P[n->id][rcat];
+    t = n->dparent * mod->rK[rcat]; /* the factor of 1/2 is taken
+                                       care of here, in the def. of
+                                       n->dparent */
+
+    /* main diagonal of matrix of eigenvalues * exponentials of
+       eigenvalues for branch length t*/
+    for (i = 0; i < nstates; i++)
+      diag[i] = z_mul_real(z_mul(z_exp(z_mul_real(zvec_get(Q->evals_z, i), t)), zvec_get(Q->evals_z, i)), mod->rK[rcat]);
+
+    /* save time by only using complex numbers in the inner loop if
+       necessary (each complex mult equivalent to four real mults and
+       two real adds) */
+    if (tm_node_is_reversible(mod, n)) {
+      for (k = 0; k < nstates; k++) {
+        for (l = 0; l < nstates; l++) {
+          double p = mm_get(P, k, l);
+          double dp_dt = 0;
+          double dp_dt_div_p;
+
+          for (i = 0; i < nstates; i++) 
+            dp_dt += (zmat_get(Q->evec_matrix_z, k, i)).x * diag[i].x * 
+              (zmat_get(Q->evec_matrix_inv_z, i, l)).x;
+
+          /* have to handle case of p == 0 carefully -- want contrib
+             to derivative to be zero if dp_dt == 0 or
+             expected_nsubst_tot == 0 (as will normally be the case)
+             and want to avoid a true inf value */
+          if (p == 0) {
+            if (dp_dt == 0) dp_dt_div_p = 0;
+            else if (dp_dt < 0) dp_dt_div_p = NEGINFTY;
+            else dp_dt_div_p = INFTY;
+          }
+          else dp_dt_div_p = dp_dt / p;
+        
+          deriv += dp_dt_div_p *
+            mod->tree_posteriors->expected_nsubst_tot[rcat][k][l][n->id];
+
+        }
+      }
+    }
+    else {                      /* non-reversible model -- need to
+                                   allow for complex numbers */
+      for (k = 0; k < nstates; k++) {
+        for (l = 0; l < nstates; l++) {
+          double p = mm_get(P, k, l);
+          double dp_dt_div_p;
+          Complex dp_dt = z_set(0, 0);
+
+          for (i = 0; i < nstates; i++) 
+            dp_dt = z_add(dp_dt, z_mul(z_mul(zmat_get(Q->evec_matrix_z, k, i), diag[i]), zmat_get(Q->evec_matrix_inv_z, i, l)));
+
+          /* see comments for real case (above) */
+          if (p == 0) {
+            if (dp_dt.x == 0) dp_dt_div_p = 0;
+            else if (dp_dt.x < 0) dp_dt_div_p = NEGINFTY;
+            else dp_dt_div_p = INFTY;
+          }
+          else dp_dt_div_p = dp_dt.x / p;
+
+          if (!(fabs(dp_dt.y) <= TM_IMAG_EPS))
+            die("ERROR compute_grad_exact: fabs(dp_dt.y=%e) should be <= %e\n",
+                dp_dt.y, TM_IMAG_EPS);
+          deriv += dp_dt_div_p *
+            mod->tree_posteriors->expected_nsubst_tot[rcat][k][l][n->id];
+        }
+      }
+    }
+  }
+  return deriv;
+}
+
+/* (used in compute_grad_em_exact) partial derivative of the expected
+   complete-data log likelihood wrt the rate matrix parameter with
+   index params_idx, before negation.  Thread safe */
+static double exact_deriv_ratemat(TreeModel *mod, int params_idx) {
   int nstates = mod->rate_matrix->size;
-  int i, j, k, l, m, rcat, params_idx, node, lidx, orig_size;
-  int idx, grad_idx, numpar;
+  int i, j, k, l, m, rcat, node, lidx, orig_size;
   TreeNode *n;
-  MarkovMatrix *P, *Q;
-  List *traversal;
+  MarkovMatrix *P, *Q = mod->rate_matrix;
   List *erows = lst_new_int(4), *ecols = lst_new_int(4), 
     *distinct_rows = lst_new_int(2);
-  double t;
-  double freqK[mod->nratecats], rK_tweak[mod->nratecats];
+  double t, deriv = 0;
 
-  static double **dq = NULL;
-  static Complex **f = NULL, **tmpmat = NULL, **sinv_dq_s = NULL;
-  static Complex *diag = NULL;
-
-  if (diag == NULL) {
-    diag = (Complex*)smalloc(nstates * sizeof(Complex));
-    set_static_var((void**)&diag);
-  }
-
-  Q = mod->rate_matrix;
-  if (Q->evals_z == NULL || Q->evec_matrix_z == NULL ||
-      Q->evec_matrix_inv_z == NULL)
-    die("ERROR compute_grade_em_exact got NULL value in eigensystem; error diagonalizing rate matrix\n");
+  static PHAST_TLS double **dq = NULL;
+  static PHAST_TLS Complex **f = NULL, **tmpmat = NULL, **sinv_dq_s = NULL;
 
   /* init memory (first time only) */
   if (dq == NULL) {
@@ -942,98 +1152,277 @@ void compute_grad_em_exact(Vector *grad, Vector *params, void *data,
       sinv_dq_s[i] = (Complex*)smalloc(nstates * sizeof(Complex));
     }
   }
-  
-  vec_zero(grad);
 
-  /* compute partial derivs for branch length params */
-  traversal = tr_preorder(mod->tree); /* branch-length parameters
-                                         correspond to pre-order
-                                         traversal of tree */
-  idx = 0;
-  for (j = 0; j < lst_size(traversal); j++) {
+  for (i = 0; i < nstates; i++) {
+    for (j = 0; j < nstates; j++) {
+      dq[i][j] = 0;
+      tmpmat[i][j] = z_set(0, 0);
+      sinv_dq_s[i][j] = z_set(0, 0);
+    }
+  }
 
-    n = lst_get_ptr(traversal, j);
-    if (n == mod->tree) continue;
-    params_idx = mod->bl_idx + idx++;
-    grad_idx = mod->param_map[params_idx];
-    if (grad_idx < 0) continue;
-    if (n->id == mod->root_leaf_id)
-      die("ERROR compute_grad_em_exact: n->id == mod->root_leaf_id = %i\n",
-	  n->id);
+  /* element coords (rows/col pairs) at which current param appears in Q */
+  lst_cpy(erows, mod->rate_matrix_param_row[params_idx]);
+  lst_cpy(ecols, mod->rate_matrix_param_col[params_idx]);
+  if (lst_size(erows) != lst_size(ecols))
+    die("ERROR compute_grad_exact: size of erows (%i) does not match size of ecols (%i)\n", lst_size(erows), lst_size(ecols));
+
+  /* set up dQ, the partial deriv of Q wrt the current param */
+  lst_clear(distinct_rows);
+  for (i = 0, orig_size = lst_size(erows); i < orig_size; i++) {
+    l = lst_get_int(erows, i); 
+    m = lst_get_int(ecols, i);
+
+    if (dq[l][m] != 0)    /* row/col pairs should be unique */
+      die("ERROR compute_grad_exact dq[%i][%i] should be zero but is %e\n",
+          l, m, dq[l][m]);
+
+    dq[l][m] = subst_mod_is_reversible(mod->subst_mod) ? 
+      vec_get(mod->backgd_freqs, m) : 1;
+                              /* FIXME: may need to generalize */
+    
+    if (dq[l][m] == 0) continue; 
+    /* possible if reversible with zero eq freq */
+
+    /* keep track of distinct rows and cols with non-zero entries */
+    /* also add diagonal elements to 'rows' and 'cols' lists, as
+       necessary */
+    if (dq[l][l] == 0) {      /* new row */
+      lst_push_int(distinct_rows, l);
+      lst_push_int(erows, l);
+      lst_push_int(ecols, l);
+    }
 
-    for (rcat = 0; rcat < mod->nratecats; rcat++) {
+    dq[l][l] -= dq[l][m];     /* note that a param can appear
+                                 multiple times in a row */
+  }
+
+  /* compute S^-1 dQ S */
+  for (lidx = 0; lidx < lst_size(erows); lidx++) {
+    i = lst_get_int(erows, lidx);
+    k = lst_get_int(ecols, lidx);
+    for (j = 0; j < nstates; j++)
+      tmpmat[i][j] = z_add(tmpmat[i][j], z_mul_real(zmat_get(Q->evec_matrix_z, k, j), dq[i][k]));
+  }
+
+  for (lidx = 0; lidx < lst_size(distinct_rows); lidx++) {
+    k = lst_get_int(distinct_rows, lidx);
+    for (i = 0; i < nstates; i++) {
+      for (j = 0; j < nstates; j++) {
+        sinv_dq_s[i][j] =
+          z_add(sinv_dq_s[i][j], z_mul(zmat_get(Q->evec_matrix_inv_z, i, k), tmpmat[k][j]));
+      }
+    }
+  }
+
+  for (rcat = 0; rcat < mod->nratecats; rcat++) {
+    for (node = 0; node < mod->tree->nnodes; node++) {
+      if (node == mod->tree->id)
+        continue; 
+
+      n = lst_get_ptr(mod->tree->nodes, node);
+      t = n->dparent * mod->rK[rcat];
+      if (n->id == mod->root_leaf_id) {
+        if (t != 0.0)
+          die("ERROR compute_grad_exact expected t to be zero but was %e\n",
+              t);
+        continue;
+      }
       P = mod->P[n->id][rcat];
-      t = n->dparent * mod->rK[rcat]; /* the factor of 1/2 is taken
-                                         care of here, in the def. of
-                                         n->dparent */
 
-      /* main diagonal of matrix of eigenvalues * exponentials of
-         eigenvalues for branch length t*/
-      for (i = 0; i < nstates; i++)
-        diag[i] = z_mul_real(z_mul(z_exp(z_mul_real(zvec_get(Q->evals_z, i), t)), zvec_get(Q->evals_z, i)), mod->rK[rcat]);
+      /* as above, it's worth it to have separate versions of the
+         computations below for the real and complex cases */
 
-      /* save time by only using complex numbers in the inner loop if
-         necessary (each complex mult equivalent to four real mults and
-         two real adds) */
-      if (tm_node_is_reversible(mod, n)) {
-        for (k = 0; k < nstates; k++) {
-          for (l = 0; l < nstates; l++) {
-            double p = mm_get(P, k, l);
-            double dp_dt = 0;
-            double dp_dt_div_p;
+      if (tm_node_is_reversible(mod, n)) { /* real case */
+        /* build the matrix F */
+        for (i = 0; i < nstates; i++) {
+          for (j = 0; j < nstates; j++) {
+            if ((zvec_get(Q->evals_z, i)).x ==
+                (zvec_get(Q->evals_z, j)).x)
+              f[i][j].x = exp((zvec_get(Q->evals_z, i)).x * t) * t;
+            else
+              f[i][j].x = (exp((zvec_get(Q->evals_z, i)).x * t) 
+                           - exp((zvec_get(Q->evals_z, j)).x * t)) /
+                ((zvec_get(Q->evals_z, i)).x - (zvec_get(Q->evals_z, j)).x);
+          }
+        }
 
-            for (i = 0; i < nstates; i++) 
-              dp_dt += (zmat_get(Q->evec_matrix_z, k, i)).x * diag[i].x * 
-                (zmat_get(Q->evec_matrix_inv_z, i, l)).x;
+        /* compute (F o S^-1 dQ S) S^-1 */
+        for (i = 0; i < nstates; i++) {
+          for (j = 0; j < nstates; j++) {
+            tmpmat[i][j].x = 0;
+            for (k = 0; k < nstates; k++) 
+              tmpmat[i][j].x += f[i][k].x * sinv_dq_s[i][k].x *
+                (zmat_get(Q->evec_matrix_inv_z, k, j)).x;
+          }
+        }
 
-            /* have to handle case of p == 0 carefully -- want contrib
-               to derivative to be zero if dp_dt == 0 or
-               expected_nsubst_tot == 0 (as will normally be the case)
-               and want to avoid a true inf value */
+        /* compute S (F o S^-1 dQ S) S^-1; simultaneously compute
+           gradient elements */
+        for (i = 0; i < nstates; i++) {
+          for (j = 0; j < nstates; j++) {
+            double partial_p = 0;
+            double p = mm_get(P, i, j);
+            double partial_p_div_p;
+
+            for (k = 0; k < nstates; k++) 
+              partial_p += (zmat_get(Q->evec_matrix_z, i, k)).x * 
+                tmpmat[k][j].x;
+
+            /* handle case of p == 0 carefully, as described above */
             if (p == 0) {
-              if (dp_dt == 0) dp_dt_div_p = 0;
-              else if (dp_dt < 0) dp_dt_div_p = NEGINFTY;
-              else dp_dt_div_p = INFTY;
+              if (partial_p == 0) partial_p_div_p = 0;
+              else if (partial_p < 0) partial_p_div_p = NEGINFTY;
+              else partial_p_div_p = INFTY;
             }
-            else dp_dt_div_p = dp_dt / p;
-          
-            vec_set(grad, grad_idx, vec_get(grad, grad_idx) +
-		    dp_dt_div_p *
-		    mod->tree_posteriors->expected_nsubst_tot[rcat][k][l][n->id]);
+            else partial_p_div_p = partial_p / p;
 
+            deriv += partial_p_div_p *
+              mod->tree_posteriors->expected_nsubst_tot[rcat][i][j][node];
           }
         }
       }
-      else {                      /* non-reversible model -- need to
-                                     allow for complex numbers */
-        for (k = 0; k < nstates; k++) {
-          for (l = 0; l < nstates; l++) {
-            double p = mm_get(P, k, l);
-            double dp_dt_div_p;
-            Complex dp_dt = z_set(0, 0);
+      else {                    /* complex case */
+        /* build the matrix F */
+        for (i = 0; i < nstates; i++) {
+          for (j = 0; j < nstates; j++) {
+            if (z_eq(zvec_get(Q->evals_z, i),
+                     zvec_get(Q->evals_z, j)))
+              f[i][j] = z_mul_real(z_exp(z_mul_real(zvec_get(Q->evals_z, i), t)), t);
+            else
+              f[i][j] = z_div(z_sub(z_exp(z_mul_real(zvec_get(Q->evals_z, i), t)), z_exp(z_mul_real(zvec_get(Q->evals_z, j), t))), z_sub(zvec_get(Q->evals_z, i), zvec_get(Q->evals_z, j)));
+            
+          }
+        }
 
-            for (i = 0; i < nstates; i++) 
-              dp_dt = z_add(dp_dt, z_mul(z_mul(zmat_get(Q->evec_matrix_z, k, i), diag[i]), zmat_get(Q->evec_matrix_inv_z, i, l)));
+        /* compute (F o S^-1 dQ S) S^-1 */
+        for (i = 0; i < nstates; i++) {
+          for (j = 0; j < nstates; j++) {
+            tmpmat[i][j] = z_set(0, 0);
+            for (k = 0; k < nstates; k++) 
+              tmpmat[i][j] = z_add(tmpmat[i][j], z_mul(f[i][k], z_mul(sinv_dq_s[i][k], zmat_get(Q->evec_matrix_inv_z, k, j))));
+          }
+        }
 
-            /* see comments for real case (above) */
+        /* compute S (F o S^-1 dQ S) S^-1; simultaneously compute
+           gradient elements */
+        for (i = 0; i < nstates; i++) {
+          for (j = 0; j < nstates; j++) {
+            double p = mm_get(P, i, j);
+            double partial_p_div_p;
+            Complex partial_p = z_set(0, 0);
+
+            for (k = 0; k < nstates; k++) 
+              partial_p = z_add(partial_p, z_mul(zmat_get(Q->evec_matrix_z, i, k), tmpmat[k][j]));
+
+            if (!(fabs(partial_p.y) <= TM_IMAG_EPS))
+              die("ERROR compute_grad_exact: fabs(partial_p.y=%e) should be <= %e\n", partial_p.y, TM_IMAG_EPS);
+
+            /* handle case of p == 0 carefully, as described above */
             if (p == 0) {
-              if (dp_dt.x == 0) dp_dt_div_p = 0;
-              else if (dp_dt.x < 0) dp_dt_div_p = NEGINFTY;
-              else dp_dt_div_p = INFTY;
+              if (partial_p.x == 0) partial_p_div_p = 0;
+              else if (partial_p.x < 0) partial_p_div_p = NEGINFTY;
+              else partial_p_div_p = INFTY;
             }
-            else dp_dt_div_p = dp_dt.x / p;
+            else partial_p_div_p = partial_p.x / p;
 
-            if (!(fabs(dp_dt.y) <= TM_IMAG_EPS))
-	      die("ERROR compute_grad_exact: fabs(dp_dt.y=%e) should be <= %e\n",
-		  dp_dt.y, TM_IMAG_EPS);
-            vec_set(grad, grad_idx, vec_get(grad, grad_idx) +
-                           dp_dt_div_p *
-                           mod->tree_posteriors->expected_nsubst_tot[rcat][k][l][n->id]);
+            deriv += partial_p_div_p *
+              mod->tree_posteriors->expected_nsubst_tot[rcat][i][j][node];
           }
         }
       }
     }
   }
+  lst_free(erows); lst_free(ecols); lst_free(distinct_rows); 
+  return deriv;
+}
+
+/* data shared by the jobs of compute_grad_em_exact; each job computes
+   the derivative wrt one branch length or rate matrix parameter */
+typedef struct {
+  TreeModel *mod;
+  int nbranch;                  /* jobs [0, nbranch) are branches */
+  TreeNode **nodes;             /* node below each branch */
+  int *params_idx;              /* parameter of each job */
+  double *deriv;                /* result of each job */
+} ExactGradData;
+
+static void exact_grad_job(void *data, int job, int thread) {
+  ExactGradData *d = data;
+  if (job < d->nbranch)
+    d->deriv[job] = exact_deriv_branch(d->mod, d->nodes[job]);
+  else
+    d->deriv[job] = exact_deriv_ratemat(d->mod, d->params_idx[job]);
+}
+
+/* Like above, but using the approach outlined by Schadt and Lange for
+   computing the partial derivatives wrt rate matrix parameters.
+   Slower, but gives exact results.  Derivatives wrt different branch
+   lengths and rate matrix parameters are computed concurrently */
+void compute_grad_em_exact(Vector *grad, Vector *params, void *data, 
+                           Vector *lb, Vector *ub) {
+
+  EmData *em = (EmData*)data;
+  TreeModel *mod = em->mod;
+/*   int alph_size = strlen(mod->rate_matrix->states); */
+  int nstates = mod->rate_matrix->size;
+  int i, j, k, l, rcat, params_idx;
+  int idx, grad_idx, numpar, njobs = 0;
+  TreeNode *n;
+  MarkovMatrix *P, *Q;
+  List *traversal;
+  double t;
+  double freqK[mod->nratecats], rK_tweak[mod->nratecats];
+  Complex diag[nstates];
+  ExactGradData d;
+
+  Q = mod->rate_matrix;
+  if (Q->evals_z == NULL || Q->evec_matrix_z == NULL ||
+      Q->evec_matrix_inv_z == NULL)
+    die("ERROR compute_grade_em_exact got NULL value in eigensystem; error diagonalizing rate matrix\n");
+
+  /* FIXME: temporary */
+  if (mod->subst_mod == JC69 || mod->subst_mod == K80 ||
+      mod->subst_mod == UNDEF_MOD)
+    die("ERROR compute_grad_exact: bad subst mod\n");
+
+  /* set up one job per branch length parameter and per rate matrix
+     parameter */
+  traversal = tr_preorder(mod->tree); /* branch-length parameters
+                                         correspond to pre-order
+                                         traversal of tree */
+  numpar = tm_get_nratematparams(mod);
+  d.mod = mod;
+  d.nodes = smalloc(lst_size(traversal) * sizeof(TreeNode*));
+  d.params_idx = smalloc((lst_size(traversal) + numpar) * sizeof(int));
+  d.deriv = smalloc((lst_size(traversal) + numpar) * sizeof(double));
+  idx = 0;
+  for (j = 0; j < lst_size(traversal); j++) {
+    n = lst_get_ptr(traversal, j);
+    if (n == mod->tree) continue;
+    params_idx = mod->bl_idx + idx++;
+    if (mod->param_map[params_idx] < 0) continue;
+    if (n->id == mod->root_leaf_id)
+      die("ERROR compute_grad_em_exact: n->id == mod->root_leaf_id = %i\n",
+	  n->id);
+    d.nodes[njobs] = n;
+    d.params_idx[njobs++] = params_idx;
+  }
+  d.nbranch = njobs;
+  for (idx = 0; idx < numpar; idx++) {
+    params_idx = mod->ratematrix_idx + idx;
+    if (mod->param_map[params_idx] < 0) continue;
+    d.params_idx[njobs++] = params_idx;
+  }
+  thr_foreach(em->pool, njobs, exact_grad_job, &d);
+
+  vec_zero(grad);
+
+  /* partial derivs for branch length params */
+  for (j = 0; j < d.nbranch; j++) {
+    grad_idx = mod->param_map[d.params_idx[j]];
+    vec_set(grad, grad_idx, vec_get(grad, grad_idx) + d.deriv[j]);
+  }
 
   /* compute partial deriv for alpha (if dgamma) */
   if (mod->nratecats > 1 && !mod->empirical_rates) {
@@ -1136,203 +1525,14 @@ void compute_grad_em_exact(Vector *grad, Vector *params, void *data,
       vec_set(grad, grad_idx, 0);
   }
 
-  /* compute partial derivs for rate matrix params */
-
-  /* FIXME: temporary */
-  if (mod->subst_mod == JC69 || mod->subst_mod == K80 ||
-      mod->subst_mod == UNDEF_MOD)
-    die("ERROR compute_grad_exact: bad subst mod\n");
-
-  numpar = tm_get_nratematparams(mod);
-  for (idx=0; idx < numpar; idx++) {
-    params_idx = mod->ratematrix_idx + idx;
-    grad_idx = mod->param_map[params_idx];
-    if (grad_idx < 0) continue;
-
-    for (i = 0; i < nstates; i++) {
-      for (j = 0; j < nstates; j++) {
-        dq[i][j] = 0;
-	tmpmat[i][j] = z_set(0, 0);
-	sinv_dq_s[i][j] = z_set(0, 0);
-      }
-    }
-
-    /* element coords (rows/col pairs) at which current param appears in Q */
-    lst_cpy(erows, mod->rate_matrix_param_row[params_idx]);
-    lst_cpy(ecols, mod->rate_matrix_param_col[params_idx]);
-    if (lst_size(erows) != lst_size(ecols))
-      die("ERROR compute_grad_exact: size of erows (%i) does not match size of ecols (%i)\n", lst_size(erows), lst_size(ecols));
-
-    /* set up dQ, the partial deriv of Q wrt the current param */
-    lst_clear(distinct_rows);
-    for (i = 0, orig_size = lst_size(erows); i < orig_size; i++) {
-      l = lst_get_int(erows, i); 
-      m = lst_get_int(ecols, i);
-
-      if (dq[l][m] != 0)    /* row/col pairs should be unique */
-	die("ERROR compute_grad_exact dq[%i][%i] should be zero but is %e\n",
-	    l, m, dq[l][m]);
-
-      dq[l][m] = subst_mod_is_reversible(mod->subst_mod) ? 
-        vec_get(mod->backgd_freqs, m) : 1;
-                                /* FIXME: may need to generalize */
-      
-      if (dq[l][m] == 0) continue; 
-      /* possible if reversible with zero eq freq */
-
-      /* keep track of distinct rows and cols with non-zero entries */
-      /* also add diagonal elements to 'rows' and 'cols' lists, as
-         necessary */
-      if (dq[l][l] == 0) {      /* new row */
-        lst_push_int(distinct_rows, l);
-        lst_push_int(erows, l);
-        lst_push_int(ecols, l);
-      }
-
-      dq[l][l] -= dq[l][m];     /* note that a param can appear
-                                   multiple times in a row */
-    }
-
-    /* compute S^-1 dQ S */
-    for (lidx = 0; lidx < lst_size(erows); lidx++) {
-      i = lst_get_int(erows, lidx);
-      k = lst_get_int(ecols, lidx);
-      for (j = 0; j < nstates; j++)
-        tmpmat[i][j] = z_add(tmpmat[i][j], z_mul_real(zmat_get(Q->evec_matrix_z, k, j), dq[i][k]));
-    }
-
-    for (lidx = 0; lidx < lst_size(distinct_rows); lidx++) {
-      k = lst_get_int(distinct_rows, lidx);
-      for (i = 0; i < nstates; i++) {
-        for (j = 0; j < nstates; j++) {
-          sinv_dq_s[i][j] =
-            z_add(sinv_dq_s[i][j], z_mul(zmat_get(Q->evec_matrix_inv_z, i, k), tmpmat[k][j]));
-        }
-      }
-    }
-
-    for (rcat = 0; rcat < mod->nratecats; rcat++) {
-      for (node = 0; node < mod->tree->nnodes; node++) {
-        if (node == mod->tree->id)
-          continue; 
-
-        n = lst_get_ptr(mod->tree->nodes, node);
-        t = n->dparent * mod->rK[rcat];
-	if (n->id == mod->root_leaf_id) {
-	  if (t != 0.0)
-	    die("ERROR compute_grad_exact expected t to be zero but was %e\n",
-		t);
-	  continue;
-	}
-        P = mod->P[n->id][rcat];
-
-        /* as above, it's worth it to have separate versions of the
-           computations below for the real and complex cases */
-
-        if (tm_node_is_reversible(mod, n)) { /* real case */
-          /* build the matrix F */
-          for (i = 0; i < nstates; i++) {
-            for (j = 0; j < nstates; j++) {
-              if ((zvec_get(Q->evals_z, i)).x ==
-                  (zvec_get(Q->evals_z, j)).x)
-		f[i][j].x = exp((zvec_get(Q->evals_z, i)).x * t) * t;
-              else
-                f[i][j].x = (exp((zvec_get(Q->evals_z, i)).x * t) 
-			     - exp((zvec_get(Q->evals_z, j)).x * t)) /
-		  ((zvec_get(Q->evals_z, i)).x - (zvec_get(Q->evals_z, j)).x);
-            }
-          }
-
-          /* compute (F o S^-1 dQ S) S^-1 */
-          for (i = 0; i < nstates; i++) {
-            for (j = 0; j < nstates; j++) {
-              tmpmat[i][j].x = 0;
-              for (k = 0; k < nstates; k++) 
-                tmpmat[i][j].x += f[i][k].x * sinv_dq_s[i][k].x *
-		  (zmat_get(Q->evec_matrix_inv_z, k, j)).x;
-            }
-          }
-
-          /* compute S (F o S^-1 dQ S) S^-1; simultaneously compute
-             gradient elements */
-          for (i = 0; i < nstates; i++) {
-            for (j = 0; j < nstates; j++) {
-              double partial_p = 0;
-              double p = mm_get(P, i, j);
-              double partial_p_div_p;
-
-              for (k = 0; k < nstates; k++) 
-                partial_p += (zmat_get(Q->evec_matrix_z, i, k)).x * 
-                  tmpmat[k][j].x;
-
-              /* handle case of p == 0 carefully, as described above */
-              if (p == 0) {
-                if (partial_p == 0) partial_p_div_p = 0;
-                else if (partial_p < 0) partial_p_div_p = NEGINFTY;
-                else partial_p_div_p = INFTY;
-              }
-              else partial_p_div_p = partial_p / p;
-
-              vec_set(grad, grad_idx, vec_get(grad, grad_idx) + 
-		      partial_p_div_p *
-		      mod->tree_posteriors->expected_nsubst_tot[rcat][i][j][node]);
-            }
-          }
-        }
-        else {                    /* complex case */
-          /* build the matrix F */
-          for (i = 0; i < nstates; i++) {
-            for (j = 0; j < nstates; j++) {
-              if (z_eq(zvec_get(Q->evals_z, i),
-		       zvec_get(Q->evals_z, j)))
-                f[i][j] = z_mul_real(z_exp(z_mul_real(zvec_get(Q->evals_z, i), t)), t);
-              else
-                f[i][j] = z_div(z_sub(z_exp(z_mul_real(zvec_get(Q->evals_z, i), t)), z_exp(z_mul_real(zvec_get(Q->evals_z, j), t))), z_sub(zvec_get(Q->evals_z, i), zvec_get(Q->evals_z, j)));
-	      
-            }
-          }
-
-          /* compute (F o S^-1 dQ S) S^-1 */
-          for (i = 0; i < nstates; i++) {
-            for (j = 0; j < nstates; j++) {
-	      tmpmat[i][j] = z_set(0, 0);
-              for (k = 0; k < nstates; k++) 
-                tmpmat[i][j] = z_add(tmpmat[i][j], z_mul(f[i][k], z_mul(sinv_dq_s[i][k], zmat_get(Q->evec_matrix_inv_z, k, j))));
-            }
-          }
-
-          /* compute S (F o S^-1 dQ S) S^-1; simultaneously compute
-             gradient elements */
-          for (i = 0; i < nstates; i++) {
-            for (j = 0; j < nstates; j++) {
-              double p = mm_get(P, i, j);
-              double partial_p_div_p;
-              Complex partial_p = z_set(0, 0);
-
-              for (k = 0; k < nstates; k++) 
-                partial_p = z_add(partial_p, z_mul(zmat_get(Q->evec_matrix_z, i, k), tmpmat[k][j]));
-
-              if (!(fabs(partial_p.y) <= TM_IMAG_EPS))
-		die("ERROR compute_grad_exact: fabs(partial_p.y=%e) should be <= %e\n", partial_p.y, TM_IMAG_EPS);
-
-              /* handle case of p == 0 carefully, as described above */
-              if (p == 0) {
-                if (partial_p.x == 0) partial_p_div_p = 0;
-                else if (partial_p.x < 0) partial_p_div_p = NEGINFTY;
-                else partial_p_div_p = INFTY;
-              }
-              else partial_p_div_p = partial_p.x / p;
-
-              vec_set(grad, grad_idx, vec_get(grad, grad_idx) + 
-		      partial_p_div_p * 
-		      mod->tree_posteriors->expected_nsubst_tot[rcat][i][j][node]);
-            }
-          }
-        }
-      }
-    }
+  /* partial derivs for rate matrix params */
+  for (j = d.nbranch; j < njobs; j++) {
+    grad_idx = mod->param_map[d.params_idx[j]];
+    vec_set(grad, grad_idx, vec_get(grad, grad_idx) + d.deriv[j]);
   }
+
   vec_scale(grad, -1);
-  lst_free(erows); lst_free(ecols); lst_free(distinct_rows); 
+  sfree(d.nodes);
+  sfree(d.params_idx);
+  sfree(d.deriv);
 }
-
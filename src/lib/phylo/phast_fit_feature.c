@@ -19,6 +19,7 @@
 #include <phast/misc.h>
 #include <phast/sufficient_stats.h>
 #include <phast/tree_likelihoods.h>
+#include <phast/thread_pool.h>
 
 #define SIGFIGS 4
 /* number of significant figures to which to estimate scale
@@ -131,6 +132,150 @@ void ff_grad_wrapper(Vector *grad, Vector *params, void *data,
   }
 }
 
+/* shared data for running per-feature tests in parallel.  Arrays
+   indexed by thread hold data private to each thread; everything else
+   is read-only, except that each feature writes only to its own
+   elements of the output arrays */
+typedef struct FeatTestData FeatTestData;
+struct FeatTestData {
+  MSA *msa;
+  GFF_Set *gff;
+  mode_type mode;
+  FILE *logf;
+  FeatFitData **d, **d2;        /* per thread; null and alt models */
+  Vector **grad;                /* per thread */
+  int **has_data;               /* per thread */
+  List *inside, *outside;
+  double fim;
+  FimGrid *grid;
+  double *out[5];               /* per-feature outputs (any may be NULL) */
+  void (*feat_func)(FeatTestData *td, int i, int thread);
+};
+
+static void feat_job(void *data, int job, int thread) {
+  FeatTestData *td = data;
+  checkInterruptN(job, 100);
+  td->feat_func(td, job, thread);
+}
+
+/* apply td->feat_func to every feature, in parallel.  Features are
+   scheduled one at a time, because their cost varies with their
+   length */
+static void run_feat_tests(ThreadPool *pool, FeatTestData *td) {
+  thr_foreach(pool, lst_size(td->gff->features), feat_job, td);
+}
+
+/* create a thread pool for the per-feature tests.  Output to a log
+   file is only meaningful in order, so a single thread is used if logf
+   is non-NULL */
+static ThreadPool *feat_test_pool(int nthreads, FILE *logf) {
+  return thr_pool_new(logf == NULL ? nthreads : 1);
+}
+
+/* create one FeatFitData object per thread.  The first uses mod
+   itself; the others use private copies, because fitting changes the
+   scale and substitution matrices of the model.  The copies are made
+   here, serially, because tree traversals are cached lazily */
+static FeatFitData **thread_feat_data(TreeModel *mod, MSA *msa,
+                                      scale_type stype, mode_type mode,
+                                      int nthreads) {
+  FeatFitData **d = smalloc(nthreads * sizeof(FeatFitData*));
+  int t;
+  d[0] = ff_init_fit_data(mod, msa, stype, mode, FALSE);
+  for (t = 1; t < nthreads; t++) {
+    TreeModel *cpy = tm_create_copy(mod);
+    cpy->lik_cache = NULL;      /* caches are not thread safe */
+    tr_postorder(cpy->tree);
+    tr_preorder(cpy->tree);
+    d[t] = ff_init_fit_data(cpy, msa, stype, mode, FALSE);
+  }
+  return d;
+}
+
+/* free objects created by thread_feat_data, including model copies */
+static void free_thread_feat_data(FeatFitData **d, int nthreads) {
+  int t;
+  for (t = 1; t < nthreads; t++) {
+    TreeModel *cpy = d[t]->cdata->mod;
+    ff_free_fit_data(d[t]);
+    sfree(d[t]);
+    tm_free(cpy);
+  }
+  ff_free_fit_data(d[0]);
+  sfree(d[0]);
+  sfree(d);
+}
+
+/* convert a chi-sq test statistic to a p-value, as appropriate for
+   the mode; acc indicates a departure in the direction of
+   acceleration */
+static double feat_pval(double teststat, mode_type mode, int acc) {
+  double pval;
+  if (mode == NNEUT || mode == CONACC)
+    pval = chisq_cdf(teststat, 1, FALSE);
+  else
+    pval = half_chisq_cdf(teststat, 1, FALSE);
+  /* assumes 50:50 mix of chisq and point mass at zero, due to
+     bounding of param */
+
+  if (pval < 1e-20)
+    pval = 1e-20;
+  /* approx limit of eval of tail prob; pvals of 0 cause problems */
+
+  if (mode == CONACC && acc)
+    pval *= -1;                 /* mark as acceleration */
+  return pval;
+}
+
+/* LRT for a single feature (see ff_lrts) */
+static void lrt_feat(FeatTestData *td, int i, int thread) {
+  FeatFitData *d = td->d[thread];
+  TreeModel *mod = d->cdata->mod;
+  GFF_Feature *f = lst_get_ptr(td->gff->features, i);
+  double null_lnl, alt_lnl, delta_lnl, this_scale = 1;
+
+  /* first check for actual substitution data in feature; if none,
+     don't waste time computing likelihoods */
+  if (!ff_has_data(mod, td->msa, f)) {
+    delta_lnl = 0;
+    this_scale = 1;
+  }
+
+  else {
+    mod->scale = 1;
+    tm_set_subst_matrices(mod);
+
+    /* compute log likelihoods under null and alt hypotheses */
+    null_lnl = ff_compute_log_likelihood(mod, td->msa, f,
+                                         d->cdata->fels_scratch[0]);
+
+    vec_set(d->cdata->params, 0, d->cdata->init_scale);
+    d->feat = f;
+
+    opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d,
+                  &alt_lnl, SIGFIGS, d->cdata->lb->data[0],
+                  d->cdata->ub->data[0], td->logf, NULL, NULL);
+    /* turns out to be faster to use numerical rather than exact
+       derivatives (judging by col case) */
+
+    alt_lnl *= -1;
+    this_scale = d->cdata->params->data[0];
+
+    delta_lnl = alt_lnl - null_lnl;
+    if (delta_lnl <= -0.01)
+      die("ERROR ff_lrts: delta_lnl (%f) <= -0.01\n", delta_lnl);
+    if (delta_lnl < 0) delta_lnl = 0;
+  }
+
+  /* compute p-vals via chi-sq */
+  if (td->out[0] != NULL)
+    td->out[0][i] = feat_pval(2*delta_lnl, td->mode, this_scale > 1);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL) td->out[1][i] = this_scale;
+  if (td->out[2] != NULL) td->out[2][i] = delta_lnl;
+}
+
 /* Perform a likelihood ratio test for each feature in a GFF,
    comparing the given null model with an alternative model that has a
    free scaling parameter for all branches.  Assumes a 0th order
@@ -140,384 +285,394 @@ void ff_grad_wrapper(Vector *grad, Vector *params, void *data,
    optionally store the individual scale factors in feat_scales and
    raw log likelihood ratios in feat_llrs if these variables are
    non-NULL.  Must define mode as CON (for 0 <= scale <= 1), ACC (for
-   1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale) */ 
-void ff_lrts(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode, 
-             double *feat_pvals, double *feat_scales, double *feat_llrs, 
-             FILE *logf) {
-  int i;
-  FeatFitData *d;
-  double null_lnl, alt_lnl, delta_lnl, this_scale = 1;
+   1 <= scale), NNEUT (0 <= scale), or CONACC (0 <= scale).  Features
+   are processed in parallel using nthreads threads */
+void ff_lrts(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode,
+             double *feat_pvals, double *feat_scales, double *feat_llrs,
+             FILE *logf, int nthreads) {
+  ThreadPool *pool = feat_test_pool(nthreads, logf);
+  FeatTestData td;
+
+  td.msa = msa;
+  td.gff = gff;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = feat_pvals;
+  td.out[1] = feat_scales;
+  td.out[2] = feat_llrs;
+  td.feat_func = lrt_feat;
 
   /* init FeatFitData */
-  d = ff_init_fit_data(mod, msa, ALL, mode, FALSE);
+  td.d = thread_feat_data(mod, msa, ALL, mode, thr_pool_size(pool));
 
   /* iterate through features  */
-  for (i = 0; i < lst_size(gff->features); i++) {
-    GFF_Feature *f = lst_get_ptr(gff->features, i);
-    checkInterrupt();
-
-    /* first check for actual substitution data in feature; if none,
-       don't waste time computing likelihoods */
-    if (!ff_has_data(mod, msa, f)) {
-      delta_lnl = 0;
-      this_scale = 1;
-    }
-
-    else {
-      mod->scale = 1;
-      tm_set_subst_matrices(mod);
-
-      /* compute log likelihoods under null and alt hypotheses */
-      null_lnl = ff_compute_log_likelihood(mod, msa, f, 
-                                           d->cdata->fels_scratch[0]);
-
-      vec_set(d->cdata->params, 0, d->cdata->init_scale);
-      d->feat = f;
-
-      opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d, 
-                    &alt_lnl, SIGFIGS, d->cdata->lb->data[0], 
-                    d->cdata->ub->data[0], logf, NULL, NULL);   
-      /* turns out to be faster to use numerical rather than exact
-         derivatives (judging by col case) */
-
-      alt_lnl *= -1;
-      this_scale = d->cdata->params->data[0];
+  run_feat_tests(pool, &td);
 
-      delta_lnl = alt_lnl - null_lnl;
-      if (delta_lnl <= -0.01)
-	die("ERROR ff_lrts: delta_lnl (%f) <= -0.01\n", delta_lnl);
-      if (delta_lnl < 0) delta_lnl = 0;
-    }
+  free_thread_feat_data(td.d, thr_pool_size(pool));
+  thr_pool_free(pool);
+}
 
-    /* compute p-vals via chi-sq */
-    if (feat_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC) 
-        feat_pvals[i] = chisq_cdf(2*delta_lnl, 1, FALSE);
-      else 
-        feat_pvals[i] = half_chisq_cdf(2*delta_lnl, 1, FALSE);
-      /* assumes 50:50 mix of chisq and point mass at zero, due to
-         bounding of param */
+/* subtree LRT for a single feature (see ff_lrts_sub) */
+static void lrt_sub_feat(FeatTestData *td, int i, int thread) {
+  FeatFitData *d = td->d[thread], *d2 = td->d2[thread];
+  GFF_Feature *f = lst_get_ptr(td->gff->features, i);
+  double null_lnl, alt_lnl, delta_lnl;
 
-      if (feat_pvals[i] < 1e-20)
-        feat_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+  /* first check for informative substitution data in feature; if none,
+     don't waste time computing likelihoods */
+  if (!ff_has_data_sub(d2->cdata->mod, td->msa, f, td->inside,
+                       td->outside)) {
+    delta_lnl = 0;
+    d->cdata->params->data[0] = d2->cdata->params->data[0] =
+      d2->cdata->params->data[1] = 1;
+  }
 
-      if (mode == CONACC && this_scale > 1)
-        feat_pvals[i] *= -1; /* mark as acceleration */
+  else {
+    /* compute log likelihoods under null and alt hypotheses */
+    d->feat = f;
+    vec_set(d->cdata->params, 0, d->cdata->init_scale);
+    opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d,
+                  &null_lnl, SIGFIGS, d->cdata->lb->data[0],
+                  d->cdata->ub->data[0], td->logf, NULL, NULL);
+    null_lnl *= -1;
+
+    d2->feat = f;
+    vec_set(d2->cdata->params, 0, d->cdata->params->data[0]);
+                                /* init to previous estimate to save time */
+    vec_set(d2->cdata->params, 1, d2->cdata->init_scale_sub);
+    if (opt_bfgs(ff_likelihood_wrapper, d2->cdata->params, d2, &alt_lnl,
+                 d2->cdata->lb, d2->cdata->ub, td->logf, NULL,
+                 OPT_HIGH_PREC, NULL, NULL, NULL) != 0)
+      ;                         /* do nothing; nonzero exit typically
+                                   occurs when max iterations is
+                                   reached; a warning is printed to
+                                   the log */
+    alt_lnl *= -1;
+
+    delta_lnl = alt_lnl - null_lnl;
+
+    /* This is a hack, it would be better to figure out why the
+       optimization sometimes fails here.
+       If we get a significantly negative lnL, re-initialize params
+       so that they are identical to null model params and re-start */
+    if (delta_lnl <= -0.05) {
+      d2->feat = f;
+      vec_set(d2->cdata->params, 0, d->cdata->params->data[0]);
+      vec_set(d2->cdata->params, 1, 1.0);
+      if (opt_bfgs(ff_likelihood_wrapper, d2->cdata->params, d2, &alt_lnl,
+                   d2->cdata->lb, d2->cdata->ub, td->logf, NULL,
+                   OPT_HIGH_PREC, NULL, NULL, NULL) != 0)
+        if (delta_lnl <= -0.1)
+          die("ERROR ff_lrts_sub: delta_lnl (%f) <= -0.1\n", delta_lnl);
     }
-
-    /* store scales and log likelihood ratios if necessary */
-    if (feat_scales != NULL) feat_scales[i] = this_scale;
-    if (feat_llrs != NULL) feat_llrs[i] = delta_lnl;
+    if (delta_lnl < 0) delta_lnl = 0;
   }
-  
-  ff_free_fit_data(d);
-  sfree(d);  //above function doesn't actually free object
+
+  /* compute p-vals via chi-sq */
+  if (td->out[0] != NULL)
+    td->out[0][i] = feat_pval(2*delta_lnl, td->mode,
+                              d2->cdata->params->data[1] > 1);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL)
+    td->out[1][i] = d->cdata->params->data[0];
+  if (td->out[2] != NULL)
+    td->out[2][i] = d2->cdata->params->data[0];
+  if (td->out[3] != NULL)
+    td->out[3][i] = d2->cdata->params->data[1];
+  if (td->out[4] != NULL)
+    td->out[4][i] = delta_lnl;
 }
 
 /* Subtree version of LRT */
-void ff_lrts_sub(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode, 
-                 double *feat_pvals, double *feat_null_scales, 
-                 double *feat_scales, double *feat_sub_scales, 
-                 double *feat_llrs, FILE *logf) {
-  int i;
-  FeatFitData *d, *d2;
-  double null_lnl, alt_lnl, delta_lnl;
+void ff_lrts_sub(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode,
+                 double *feat_pvals, double *feat_null_scales,
+                 double *feat_scales, double *feat_sub_scales,
+                 double *feat_llrs, FILE *logf, int nthreads) {
+  ThreadPool *pool = feat_test_pool(nthreads, logf);
+  FeatTestData td;
   TreeModel *modcpy;
-  List *inside=NULL, *outside=NULL;
 
   modcpy = tm_create_copy(mod);   /* need separate copy of tree model
                                      with different internal scaling
                                      data for supertree/subtree case */
-
-  /* init ColFitData -- one for null model, one for alt */
   modcpy->subtree_root = NULL;
-  d = ff_init_fit_data(modcpy, msa, ALL, NNEUT, FALSE);
-  d2 = ff_init_fit_data(mod, msa, SUBTREE, mode, FALSE); 
+
+  td.msa = msa;
+  td.gff = gff;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = feat_pvals;
+  td.out[1] = feat_null_scales;
+  td.out[2] = feat_scales;
+  td.out[3] = feat_sub_scales;
+  td.out[4] = feat_llrs;
+  td.feat_func = lrt_sub_feat;
+  td.inside = td.outside = NULL;
+
+  /* init FeatFitData -- one for null model, one for alt */
+  td.d = thread_feat_data(modcpy, msa, ALL, NNEUT, thr_pool_size(pool));
+  td.d2 = thread_feat_data(mod, msa, SUBTREE, mode, thr_pool_size(pool));
                                 /* mod has the subtree info, modcpy
                                    does not */
 
   /* prepare lists of leaves inside and outside root, for use in
      checking for informative substitutions */
   if (mod->subtree_root != NULL) {
-    inside = lst_new_ptr(mod->tree->nnodes);
-    outside = lst_new_ptr(mod->tree->nnodes); 
-    tr_partition_leaves(mod->tree, mod->subtree_root, inside, outside);
+    td.inside = lst_new_ptr(mod->tree->nnodes);
+    td.outside = lst_new_ptr(mod->tree->nnodes);
+    tr_partition_leaves(mod->tree, mod->subtree_root, td.inside,
+                        td.outside);
   }
 
   /* iterate through features  */
-  for (i = 0; i < lst_size(gff->features); i++) {
-    GFF_Feature *f = lst_get_ptr(gff->features, i);
-    checkInterrupt();
-
-    /* first check for informative substitution data in feature; if none,
-       don't waste time computing likelihoods */
-    if (!ff_has_data_sub(mod, msa, f, inside, outside)) {
-      delta_lnl = 0;
-      d->cdata->params->data[0] = d2->cdata->params->data[0] = 
-        d2->cdata->params->data[1] = 1;
-    }
+  run_feat_tests(pool, &td);
 
-    else {
-      /* compute log likelihoods under null and alt hypotheses */
-      d->feat = f;
-      vec_set(d->cdata->params, 0, d->cdata->init_scale);
-      opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d, 
-                    &null_lnl, SIGFIGS, d->cdata->lb->data[0], 
-                    d->cdata->ub->data[0], logf, NULL, NULL);   
-      null_lnl *= -1;
+  free_thread_feat_data(td.d, thr_pool_size(pool));
+  free_thread_feat_data(td.d2, thr_pool_size(pool));
+  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
+                                /* have to revert for tm_free to work
+                                   correctly */
+  tm_free(modcpy);
+  if (td.inside != NULL) lst_free(td.inside);
+  if (td.outside != NULL) lst_free(td.outside);
+  thr_pool_free(pool);
+}
 
-      d2->feat = f;
-      vec_set(d2->cdata->params, 0, d->cdata->params->data[0]); 
-                                /* init to previous estimate to save time */
-      vec_set(d2->cdata->params, 1, d2->cdata->init_scale_sub);
-      //      vec_set(d2->cdata->params, 1, 0.01);
-      if (opt_bfgs(ff_likelihood_wrapper, d2->cdata->params, d2, &alt_lnl, 
-                   d2->cdata->lb, d2->cdata->ub, logf, NULL, 
-                   OPT_HIGH_PREC, NULL, NULL) != 0)
-        ;                         /* do nothing; nonzero exit typically
-                                     occurs when max iterations is
-                                     reached; a warning is printed to
-                                     the log */
-      alt_lnl *= -1;
-
-      delta_lnl = alt_lnl - null_lnl;
-
-      /* This is a hack, it would be better to figure out why the
-	 optimization sometimes fails here.
-	 If we get a significantly negative lnL, re-initialize params
-	 so that they are identical to null model params and re-start */
-      if (delta_lnl <= -0.05) {
-	d2->feat = f;
-	vec_set(d2->cdata->params, 0, d->cdata->params->data[0]); 
-	vec_set(d2->cdata->params, 1, 1.0);
-	if (opt_bfgs(ff_likelihood_wrapper, d2->cdata->params, d2, &alt_lnl, 
-		     d2->cdata->lb, d2->cdata->ub, logf, NULL, 
-		     OPT_HIGH_PREC, NULL, NULL) != 0)
-	  if (delta_lnl <= -0.1)
-	    die("ERROR ff_lrts_sub: delta_lnl (%f) <= -0.1\n", delta_lnl);
-      }
-      if (delta_lnl < 0) delta_lnl = 0;
-    }
+/* score test for a single feature (see ff_score_tests) */
+static void score_feat(FeatTestData *td, int i, int thread) {
+  FeatFitData *d = td->d[thread];
+  double first_deriv, teststat;
 
-    /* compute p-vals via chi-sq */
-    if (feat_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC) 
-        feat_pvals[i] = chisq_cdf(2*delta_lnl, 1, FALSE);
-      else 
-        feat_pvals[i] = half_chisq_cdf(2*delta_lnl, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero, due to
-           bounding of param */
+  d->feat = lst_get_ptr(td->gff->features, i);
 
-      if (feat_pvals[i] < 1e-20)
-        feat_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+  /* first check for actual substitution data in feature; if none,
+     don't waste time computing likelihoods */
+  if (!ff_has_data(d->cdata->mod, td->msa, d->feat)) {
+    teststat = 0;
+    first_deriv = 1;
+  }
 
-      if (mode == CONACC && d2->cdata->params->data[1] > 1)
-        feat_pvals[i] *= -1;    /* mark as acceleration */        
-    }
+  else {
+    ff_scale_derivs(d, &first_deriv, NULL, d->cdata->fels_scratch);
 
-    /* store scales and log likelihood ratios if necessary */
-    if (feat_null_scales != NULL) 
-      feat_null_scales[i] = d->cdata->params->data[0];
-    if (feat_scales != NULL) 
-      feat_scales[i] = d2->cdata->params->data[0];
-    if (feat_sub_scales != NULL) 
-      feat_sub_scales[i] = d2->cdata->params->data[1];
-    if (feat_llrs != NULL) 
-      feat_llrs[i] = delta_lnl;
+    teststat = first_deriv*first_deriv /
+      ((d->feat->end - d->feat->start + 1) * td->fim);
+    /* scale column-by-column FIM by length of feature (expected
+       values are additive) */
+
+    if ((td->mode == ACC && first_deriv < 0) ||
+        (td->mode == CON && first_deriv > 0))
+      teststat = 0;             /* derivative points toward boundary;
+                                   truncate at 0 */
   }
-  
-  ff_free_fit_data(d);
-  ff_free_fit_data(d2);
-  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL; 
-                                /* have to revert for tm_free to work
-                                   correctly */
-  tm_free(modcpy);
-  if (inside != NULL) lst_free(inside);
-  if (outside != NULL) lst_free(outside);
+
+  if (td->out[0] != NULL)
+    td->out[0][i] = feat_pval(teststat, td->mode, first_deriv > 0);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL) td->out[1][i] = first_deriv;
+  if (td->out[2] != NULL) td->out[2][i] = teststat;
 }
 
 /* Score test */
-void ff_score_tests(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode, 
-                    double *feat_pvals, double *feat_derivs, 
-                    double *feat_teststats) {
-  int i;
-  FeatFitData *d;
-  double first_deriv, teststat, fim;
+void ff_score_tests(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode,
+                    double *feat_pvals, double *feat_derivs,
+                    double *feat_teststats, int nthreads) {
+  ThreadPool *pool = thr_pool_new(nthreads);
+  FeatTestData td;
+
+  td.msa = msa;
+  td.gff = gff;
+  td.mode = mode;
+  td.logf = NULL;
+  td.out[0] = feat_pvals;
+  td.out[1] = feat_derivs;
+  td.out[2] = feat_teststats;
+  td.feat_func = score_feat;
+
+  /* precompute FIM (before mod is copied for each thread; see
+     col_score_tests) */
+  td.fim = col_estimate_fim(mod);
+
+  if (td.fim < 0)
+    die("ERROR: negative fisher information in col_score_tests\n");
 
   /* init FeatFitData */
-  d = ff_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
-
-  /* precompute FIM */
-  fim = col_estimate_fim(mod);
-
-  if (fim < 0) 
-    die("ERROR: negative fisher information in col_score_tests\n");
+  td.d = thread_feat_data(mod, msa, ALL, NNEUT, thr_pool_size(pool));
 
   /* iterate through features  */
-  for (i = 0; i < lst_size(gff->features); i++) {
-    checkInterrupt();
-    d->feat = lst_get_ptr(gff->features, i);
+  run_feat_tests(pool, &td);
 
-    /* first check for actual substitution data in feature; if none,
-       don't waste time computing likelihoods */
-    if (!ff_has_data(mod, msa, d->feat)) {
-      teststat = 0;
-      first_deriv = 1;
-    }
+  free_thread_feat_data(td.d, thr_pool_size(pool));
+  thr_pool_free(pool);
+}
 
-    else {
+/* subtree score test for a single feature (see ff_score_tests_sub) */
+static void score_sub_feat(FeatTestData *td, int i, int thread) {
+  FeatFitData *d = td->d[thread], *d2 = td->d2[thread];
+  Vector *grad = td->grad[thread];
+  Matrix *fim;
+  double lnl, teststat;
 
-      ff_scale_derivs(d, &first_deriv, NULL, d->cdata->fels_scratch);
+  d->feat = lst_get_ptr(td->gff->features, i);
 
-      teststat = first_deriv*first_deriv / 
-        ((d->feat->end - d->feat->start + 1) * fim);
-      /* scale column-by-column FIM by length of feature (expected
-         values are additive) */
+  /* first check for informative substitution data in feature; if none,
+     don't waste time computing likelihoods */
+  if (!ff_has_data_sub(d2->cdata->mod, td->msa, d->feat, td->inside,
+                       td->outside)) {
+    teststat = 0;
+    vec_zero(grad);
+    d->cdata->params->data[0] = 1.0;
+  }
 
-      if ((mode == ACC && first_deriv < 0) ||
-          (mode == CON && first_deriv > 0))
-        teststat = 0;             /* derivative points toward boundary;
-                                     truncate at 0 */
+  else {
+    vec_set(d->cdata->params, 0, d->cdata->init_scale);
+    opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d,
+                  &lnl, SIGFIGS, d->cdata->lb->data[0], d->cdata->ub->data[0],
+                  td->logf, NULL, NULL);
+    /* turns out to be faster to use numerical rather than exact
+       derivatives (judging by col case) */
+
+    d2->feat = d->feat;
+    d2->cdata->mod->scale = d->cdata->params->data[0];
+    d2->cdata->mod->scale_sub = 1;
+    tm_set_subst_matrices(d2->cdata->mod);
+    ff_scale_derivs_subtree(d2, grad, NULL, d2->cdata->fels_scratch);
+
+    fim = col_get_fim_sub(td->grid, d2->cdata->mod->scale);
+    mat_scale(fim, d->feat->end - d->feat->start + 1);
+    /* scale column-by-column FIM by length of feature (expected
+       values are additive) */
+
+    teststat = grad->data[1]*grad->data[1] /
+      (fim->data[1][1] - fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
+
+    if (teststat < 0) {
+      fprintf(stderr, "WARNING: teststat < 0 (%f)\n", teststat);
+      teststat = 0;
     }
 
-    if (feat_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        feat_pvals[i] = chisq_cdf(teststat, 1, FALSE);
-      else 
-        feat_pvals[i] = half_chisq_cdf(teststat, 1, FALSE);
-      /* assumes 50:50 mix of chisq and point mass at zero */
-      
-      if (feat_pvals[i] < 1e-20)
-        feat_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
-        
-      if (mode == CONACC && first_deriv > 0)
-        feat_pvals[i] *= -1; /* mark as acceleration */
-    }
+    if ((td->mode == ACC && grad->data[1] < 0) ||
+        (td->mode == CON && grad->data[1] > 0))
+      teststat = 0;             /* derivative points toward boundary;
+                                   truncate at 0 */
 
-    /* store scales and log likelihood ratios if necessary */
-    if (feat_derivs != NULL) feat_derivs[i] = first_deriv;
-    if (feat_teststats != NULL) feat_teststats[i] = teststat;
+    mat_free(fim);
   }
 
-  ff_free_fit_data(d);
+  if (td->out[0] != NULL)
+    td->out[0][i] = feat_pval(teststat, td->mode, grad->data[1] > 0);
+
+  /* store scales and log likelihood ratios if necessary */
+  if (td->out[1] != NULL) td->out[1][i] = d->cdata->params->data[0];
+  if (td->out[2] != NULL) td->out[2][i] = grad->data[0];
+  if (td->out[3] != NULL) td->out[3][i] = grad->data[1];
+  if (td->out[4] != NULL) td->out[4][i] = teststat;
 }
 
 /* Subtree version of score test */
 void ff_score_tests_sub(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode,
-                        double *feat_pvals, double *feat_null_scales, 
-                        double *feat_derivs, double *feat_sub_derivs, 
-                        double *feat_teststats, FILE *logf) {
-  int i;
-  FeatFitData *d, *d2;
-  Vector *grad = vec_new(2);
-  Matrix *fim = mat_new(2, 2);
-  double lnl, teststat;
-  FimGrid *grid;
-  List *inside=NULL, *outside=NULL;
+                        double *feat_pvals, double *feat_null_scales,
+                        double *feat_derivs, double *feat_sub_derivs,
+                        double *feat_teststats, FILE *logf,
+                        const char *fim_grid_fname, int nthreads) {
+  ThreadPool *pool = feat_test_pool(nthreads, logf);
+  FeatTestData td;
+  int t, nthr = thr_pool_size(pool);
   TreeModel *modcpy = tm_create_copy(mod); /* need separate copy of tree model
                                               with different internal scaling
                                               data for supertree/subtree case */
   modcpy->subtree_root = NULL;
 
+  td.msa = msa;
+  td.gff = gff;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = feat_pvals;
+  td.out[1] = feat_null_scales;
+  td.out[2] = feat_derivs;
+  td.out[3] = feat_sub_derivs;
+  td.out[4] = feat_teststats;
+  td.feat_func = score_sub_feat;
+  td.inside = td.outside = NULL;
+  td.grad = smalloc(nthr * sizeof(Vector*));
+  for (t = 0; t < nthr; t++) td.grad[t] = vec_new(2);
+
+  /* precompute Fisher information matrices for a grid of scale
+     values (before mod is copied for each thread; see
+     col_score_tests) */
+  td.grid = col_fim_grid_sub_cached(mod, fim_grid_fname);
+
   /* init FeatFitData -- one for null model, one for alt */
-  d = ff_init_fit_data(modcpy, msa, ALL, NNEUT, FALSE);
-  d2 = ff_init_fit_data(mod, msa, SUBTREE, NNEUT, FALSE); 
+  td.d = thread_feat_data(modcpy, msa, ALL, NNEUT, nthr);
+  td.d2 = thread_feat_data(mod, msa, SUBTREE, NNEUT, nthr);
                                 /* mod has the subtree info, modcpy
                                    does not */
 
-  /* precompute Fisher information matrices for a grid of scale values */
-  grid = col_fim_grid_sub(mod); 
-
   /* prepare lists of leaves inside and outside root, for use in
      checking for informative substitutions */
   if (mod->subtree_root != NULL) {
-    inside = lst_new_ptr(mod->tree->nnodes);
-    outside = lst_new_ptr(mod->tree->nnodes);
-    tr_partition_leaves(mod->tree, mod->subtree_root, inside, outside);
+    td.inside = lst_new_ptr(mod->tree->nnodes);
+    td.outside = lst_new_ptr(mod->tree->nnodes);
+    tr_partition_leaves(mod->tree, mod->subtree_root, td.inside,
+                        td.outside);
   }
 
   /* iterate through features  */
-  for (i = 0; i < lst_size(gff->features); i++) {
-    checkInterrupt();
-    d->feat = lst_get_ptr(gff->features, i);
-
-    /* first check for informative substitution data in feature; if none,
-       don't waste time computing likelihoods */
-    if (!ff_has_data_sub(mod, msa, d->feat, inside, outside)) { 
-      teststat = 0;
-      vec_zero(grad);
-    }
+  run_feat_tests(pool, &td);
 
-    else {
-      vec_set(d->cdata->params, 0, d->cdata->init_scale);
-      opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d, 
-                    &lnl, SIGFIGS, d->cdata->lb->data[0], d->cdata->ub->data[0], 
-                    logf, NULL, NULL);   
-      /* turns out to be faster to use numerical rather than exact
-         derivatives (judging by col case) */
-
-      d2->feat = d->feat;
-      d2->cdata->mod->scale = d->cdata->params->data[0];
-      d2->cdata->mod->scale_sub = 1;
-      tm_set_subst_matrices(d2->cdata->mod);
-      ff_scale_derivs_subtree(d2, grad, NULL, d2->cdata->fels_scratch);
-
-      fim = col_get_fim_sub(grid, d2->cdata->mod->scale); 
-      mat_scale(fim, d->feat->end - d->feat->start + 1);
-      /* scale column-by-column FIM by length of feature (expected
-         values are additive) */
-    
-      teststat = grad->data[1]*grad->data[1] / 
-        (fim->data[1][1] - fim->data[0][1]*fim->data[1][0]/fim->data[0][0]);
-
-      if (teststat < 0) {
-        fprintf(stderr, "WARNING: teststat < 0 (%f)\n", teststat);
-        teststat = 0; 
-      }
-
-      if ((mode == ACC && grad->data[1] < 0) ||
-          (mode == CON && grad->data[1] > 0))
-        teststat = 0;             /* derivative points toward boundary;
-                                     truncate at 0 */
-
-      mat_free(fim);
-    }
-
-    if (feat_pvals != NULL) {
-      if (mode == NNEUT || mode == CONACC)
-        feat_pvals[i] = chisq_cdf(teststat, 1, FALSE);
-      else 
-        feat_pvals[i] = half_chisq_cdf(teststat, 1, FALSE);
-        /* assumes 50:50 mix of chisq and point mass at zero */
+  free_thread_feat_data(td.d, nthr);
+  free_thread_feat_data(td.d2, nthr);
+  for (t = 0; t < nthr; t++) vec_free(td.grad[t]);
+  sfree(td.grad);
+  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL;
+                                /* have to revert for tm_free to work
+                                   correctly */
+  tm_free(modcpy);
+  col_free_fim_grid(td.grid);
+  if (td.inside != NULL) lst_free(td.inside);
+  if (td.outside != NULL) lst_free(td.outside);
+  thr_pool_free(pool);
+}
 
-      if (feat_pvals[i] < 1e-20)
-        feat_pvals[i] = 1e-20;
-      /* approx limit of eval of tail prob; pvals of 0 cause problems */
+/* GERP-like computation for a single feature (see ff_gerp) */
+static void gerp_feat(FeatTestData *td, int i, int thread) {
+  FeatFitData *d = td->d[thread];
+  TreeModel *mod = d->cdata->mod;
+  GFF_Feature *f = lst_get_ptr(td->gff->features, i);
+  int *has_data = td->has_data[thread];
+  int j, nspec = 0;
+  double nneut, scale, lnl;
 
-      if (mode == CONACC && grad->data[1] > 0)
-        feat_pvals[i] *= -1; /* mark as acceleration */
-    }
+  ff_find_missing_branches(mod, td->msa, f, has_data, &nspec);
 
-    /* store scales and log likelihood ratios if necessary */
-    if (feat_null_scales != NULL) feat_null_scales[i] = d->cdata->params->data[0];
-    if (feat_derivs != NULL) feat_derivs[i] = grad->data[0];
-    if (feat_sub_derivs != NULL) feat_sub_derivs[i] = grad->data[1];
-    if (feat_teststats != NULL) feat_teststats[i] = teststat;
+  if (nspec < 3)
+    nneut = scale = 0;
+  else {
+    vec_set(d->cdata->params, 0, d->cdata->init_scale);
+    d->feat = f;
+
+    opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d,
+                  &lnl, SIGFIGS, d->cdata->lb->data[0], d->cdata->ub->data[0],
+                  td->logf, NULL, NULL);
+    /* turns out to be faster to use numerical rather than exact
+       derivatives (judging by col case) */
+
+    scale = d->cdata->params->data[0];
+    for (j = 1, nneut = 0; j < mod->tree->nnodes; j++)  /* node 0 is root */
+      if (has_data[j])
+        nneut += ((TreeNode*)lst_get_ptr(mod->tree->nodes, j))->dparent;
   }
 
-  ff_free_fit_data(d);
-  ff_free_fit_data(d2);
-  vec_free(grad); 
-  modcpy->estimate_branchlens = TM_BRANCHLENS_ALL; 
-                                /* have to revert for tm_free to work
-                                   correctly */
-  tm_free(modcpy);
-  col_free_fim_grid(grid); 
-  if (inside != NULL) lst_free(inside);
-  if (outside != NULL) lst_free(outside);
+  if (td->out[0] != NULL) td->out[0][i] = nneut;
+  if (td->out[1] != NULL) td->out[1][i] = scale * nneut;
+  if (td->out[2] != NULL) {
+    td->out[2][i] = nneut * (1 - scale);
+    if (td->mode == ACC) td->out[2][i] *= -1;
+    else if (td->mode == NNEUT) td->out[2][i] = fabs(td->out[2][i]);
+  }
+  if (td->out[3] != NULL) td->out[3][i] = (double)nspec;
 }
 
 /* Perform a GERP-like computation for each feature.  Computes expected
@@ -526,53 +681,38 @@ void ff_score_tests_sub(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode,
    substitutions (feat_nrejected), and number of species with data
    (feat_nspecies).  If any arrays are NULL, values will not be
    retained.  Gaps and missing data are handled by working with
-   induced subtree.  */
-void ff_gerp(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode, 
-             double *feat_nneut, double *feat_nobs, double *feat_nrejected, 
-             double *feat_nspec, FILE *logf) { 
-  int i, j, nspec = 0;
-  double nneut, scale, lnl;
-  int *has_data = smalloc(mod->tree->nnodes * sizeof(int));
-  FeatFitData *d;
+   induced subtree.  Features are processed in parallel using
+   nthreads threads */
+void ff_gerp(TreeModel *mod, MSA *msa, GFF_Set *gff, mode_type mode,
+             double *feat_nneut, double *feat_nobs, double *feat_nrejected,
+             double *feat_nspec, FILE *logf, int nthreads) {
+  ThreadPool *pool = feat_test_pool(nthreads, logf);
+  FeatTestData td;
+  int t, nthr = thr_pool_size(pool);
+
+  td.msa = msa;
+  td.gff = gff;
+  td.mode = mode;
+  td.logf = logf;
+  td.out[0] = feat_nneut;
+  td.out[1] = feat_nobs;
+  td.out[2] = feat_nrejected;
+  td.out[3] = feat_nspec;
+  td.feat_func = gerp_feat;
+  td.has_data = smalloc(nthr * sizeof(int*));
+  for (t = 0; t < nthr; t++)
+    td.has_data[t] = smalloc(mod->tree->nnodes * sizeof(int));
 
   /* init FeatFitData */
-  d = ff_init_fit_data(mod, msa, ALL, NNEUT, FALSE);
+  td.d = thread_feat_data(mod, msa, ALL, NNEUT, nthr);
 
   /* iterate through features  */
-  for (i = 0; i < lst_size(gff->features); i++) {
-    GFF_Feature *f = lst_get_ptr(gff->features, i);
-    checkInterrupt();
-    ff_find_missing_branches(mod, msa, f, has_data, &nspec);
-
-    if (nspec < 3) 
-      nneut = scale = 0;
-    else {
-      vec_set(d->cdata->params, 0, d->cdata->init_scale);
-      d->feat = f;
-
-      opt_newton_1d(ff_likelihood_wrapper_1d, &d->cdata->params->data[0], d, 
-                    &lnl, SIGFIGS, d->cdata->lb->data[0], d->cdata->ub->data[0], 
-                    logf, NULL, NULL);   
-      /* turns out to be faster to use numerical rather than exact
-         derivatives (judging by col case) */
-      
-      scale = d->cdata->params->data[0];
-      for (j = 1, nneut = 0; j < mod->tree->nnodes; j++)  /* node 0 is root */
-        if (has_data[j]) 
-          nneut += ((TreeNode*)lst_get_ptr(mod->tree->nodes, j))->dparent;
-    }
+  run_feat_tests(pool, &td);
 
-    if (feat_nspec != NULL) feat_nspec[i] = (double)nspec;
-    if (feat_nneut != NULL) feat_nneut[i] = nneut;
-    if (feat_nobs != NULL) feat_nobs[i] = scale * nneut;
-    if (feat_nrejected != NULL) {
-      feat_nrejected[i] = nneut * (1 - scale);
-      if (mode == ACC) feat_nrejected[i] *= -1;
-      else if (mode == NNEUT) feat_nrejected[i] = fabs(feat_nrejected[i]);
-    }
-  }
-  ff_free_fit_data(d);
-  sfree(has_data);
+  free_thread_feat_data(td.d, nthr);
+  for (t = 0; t < nthr; t++) sfree(td.has_data[t]);
+  sfree(td.has_data);
+  thr_pool_free(pool);
 }
 
 /* Create object with metadata and scratch memory for fitting scale
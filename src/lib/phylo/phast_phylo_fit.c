@@ -34,6 +34,9 @@
 #include <phast/stacks.h>
 #include <phast/trees.h>
 #include <phast/misc.h>
+#include <phast/thread_pool.h>
+#include <phast/checkpoint.h>
+#include <phast/tuple_lik_cache.h>
 
 /* initialize phyloFit options to defaults (slightly different
    for rphast).
@@ -97,6 +100,12 @@ struct phyloFit_struct* phyloFit_struct_new(int rphast) {
   pf->use_selection = 0;
   pf->selection = 0.0;
   pf->max_em_its = -1;
+  pf->nthreads = 1;
+  pf->nrestarts = 1;
+  pf->opt_method = OPT_BFGS;
+  pf->checkpoint_fname = NULL;
+  pf->checkpoint_interval = CKPT_DEFAULT_INTERVAL;
+  pf->resume = FALSE;
 
   pf->results = rphast ? lol_new(2) : NULL;
   return pf;
@@ -660,17 +669,238 @@ void print_window_summary(FILE* WINDOWF, List *window_coords, int win,
 }
 
 
+/* A model to be estimated by run_phyloFit, for one category of one
+   window (or one of several restarts for it).  Jobs are set up
+   serially, fitted concurrently, and then written out serially in the
+   order in which they were set up */
+typedef struct {
+  int win, cat;                 /* window (index into window_coords)
+                                   and category */
+  int nrestarts;                /* restarts of the same model are
+                                   consecutive jobs, of which only the
+                                   one with the best likelihood is
+                                   written out */
+  MSA *msa;                     /* alignment for window */
+  TreeModel *mod;
+  Vector *params;               /* starting parameters (NULL if model
+                                   is not to be fitted) */
+  unsigned int ninf_sites;
+  int free_msa;                 /* TRUE if msa is to be freed once the
+                                   job is written out */
+} PhyloFitJob;
+
+/* data shared by the jobs of a batch */
+typedef struct {
+  struct phyloFit_struct *pf;
+  List *jobs;
+  FILE *error_file;
+  int fit_nthreads;             /* threads to use within each fit */
+} PhyloFitBatch;
+
+static void fit_job(void *data, int j, int thread) {
+  PhyloFitBatch *b = data;
+  PhyloFitJob *job = lst_get_ptr(b->jobs, j);
+  struct phyloFit_struct *pf = b->pf;
+  if (job->params == NULL) return;
+  if (pf->use_em)
+    tm_fit_em(job->mod, job->msa, job->params, job->cat, pf->precision,
+              pf->max_em_its, pf->logf, b->error_file, b->fit_nthreads);
+  else
+    tm_fit(job->mod, job->msa, job->params, job->cat, pf->precision,
+           pf->logf, pf->quiet, b->error_file);
+}
+
+static void free_job(struct phyloFit_struct *pf, PhyloFitJob *job) {
+  if (pf->input_mod == NULL) tm_free(job->mod);
+  if (job->params != NULL) vec_free(job->params);
+  if (job->free_msa) msa_free(job->msa);
+  sfree(job);
+}
+
+/* write out the model estimated by a job, along with any requested
+   posterior statistics and window summary, and free the job */
+static void finish_job(struct phyloFit_struct *pf, PhyloFitJob *job,
+                       FILE *WINDOWF, double **gc) {
+  FILE *F;
+  MSA *msa = job->msa;
+  TreeModel *mod = job->mod;
+  int cat = job->cat;
+  String *mod_fname = str_new(STR_MED_LEN);
+
+  if (pf->output_fname_root != NULL)
+    str_cpy_charstr(mod_fname, pf->output_fname_root);
+  if (pf->window_coords != NULL) {
+    if (mod_fname->length != 0)
+      str_append_char(mod_fname, '.');
+    str_append_charstr(mod_fname, "win-");
+    str_append_int(mod_fname, job->win/2 + 1);
+  }
+  if (cat != -1 && pf->nonoverlapping == FALSE) {
+    if (mod_fname->length != 0)
+      str_append_char(mod_fname, '.');
+    if (pf->cm != NULL)
+      str_append(mod_fname, cm_get_feature_unique(pf->cm, cat));
+    else
+      str_append_int(mod_fname, cat);
+  }
+  if (pf->output_fname_root != NULL)
+    str_append_charstr(mod_fname, ".mod");
+
+  if (pf->output_fname_root != NULL) {
+    if (!pf->quiet) fprintf(stderr, "Writing model to %s ...\n",
+                            mod_fname->chars);
+    if (strcmp(pf->output_fname_root, "-") != 0)
+      F = phast_fopen(mod_fname->chars, "w+");
+    else
+      F = stdout;
+    tm_print(F, mod);
+    if (strcmp(pf->output_fname_root, "-") != 0)
+      phast_fclose(F);
+  }
+  if (pf->results != NULL)
+    lol_push_treeModel(pf->results, mod, mod_fname->chars);
+
+  /* output posterior probabilities, if necessary */
+  if (pf->do_bases || pf->do_expected_nsubst ||
+      pf->do_expected_nsubst_tot || pf->do_expected_nsubst_col) {
+    print_post_prob_stats(mod, msa, pf->output_fname_root,
+                          pf->do_bases, pf->do_expected_nsubst,
+                          pf->do_expected_nsubst_tot,
+                          pf->do_expected_nsubst_col, 0,
+                          cat, pf->quiet, NULL);
+  }
+
+  /* print window summary, if window mode */
+  if (pf->window_coords != NULL) {
+    int i, j, total=0;
+    char c;
+    if (*gc == NULL)
+      *gc = smalloc(msa->nseqs*sizeof(double));
+    for (i=0; i < msa->nseqs; i++) {
+      total=0;
+      (*gc)[i]=0;
+      for (j=0; j<msa->length; j++) {
+        c = msa_get_char(msa, i, j);
+        if ((!msa->is_missing[(int)c]) && c != GAP_CHAR) {
+          total++;
+          if (c=='C' || c=='G') (*gc)[i]++;
+        }
+      }
+      (*gc)[i] /= (double)total;
+    }
+    print_window_summary(WINDOWF, pf->window_coords, job->win, cat, mod,
+                         *gc, job->ninf_sites, msa->nseqs, FALSE);
+  }
+
+  str_free(mod_fname);
+  free_job(pf, job);
+}
+
+/* fit the models of a batch of jobs concurrently, then write them out
+   in order */
+static void run_jobs(struct phyloFit_struct *pf, List *jobs, ThreadPool *pool,
+                     int fit_nthreads, FILE *error_file, FILE *WINDOWF,
+                     double **gc) {
+  int j;
+  PhyloFitBatch b;
+  b.pf = pf;
+  b.jobs = jobs;
+  b.error_file = error_file;
+  b.fit_nthreads = fit_nthreads;
+  thr_foreach(pool, lst_size(jobs), fit_job, &b);
+  for (j = 0; j < lst_size(jobs); j++) {
+    PhyloFitJob *job = lst_get_ptr(jobs, j), *best = job;
+    int k, nrestarts = job->nrestarts;
+
+    /* keep the restart with the highest likelihood (the first, in
+       case of ties) */
+    for (k = 0; k < nrestarts; k++) {
+      job = lst_get_ptr(jobs, j+k);
+      if (!pf->quiet && nrestarts > 1)
+        fprintf(stderr, "Restart %d of %d: lnL = %f\n", k+1, nrestarts,
+                job->mod->lnL);
+      if (job->mod->lnL > best->mod->lnL) best = job;
+    }
+    for (k = 0; k < nrestarts; k++) {
+      job = lst_get_ptr(jobs, j+k);
+      if (job == best) continue;
+      if (job->free_msa) best->free_msa = TRUE;
+      job->free_msa = FALSE;
+      free_job(pf, job);
+    }
+    finish_job(pf, best, WINDOWF, gc);
+    j += nrestarts - 1;
+  }
+  lst_clear(jobs);
+}
+
+/* add a list of Strings (possibly NULL) to a fingerprint */
+static tlc_fprint hash_str_list(tlc_fprint h, List *l) {
+  int i, n = (l == NULL ? -1 : lst_size(l));
+  h = tlc_hash(h, &n, sizeof(int));
+  for (i = 0; i < n; i++) {
+    String *str = lst_get_ptr(l, i);
+    h = tlc_hash(h, str->chars, str->length + 1);
+  }
+  return h;
+}
+
+/* compute a fingerprint of the inputs of a single fit, to be stored
+   in its checkpoint: the alignment, the starting model or tree, and
+   the options that affect the course of the fit.  fprint must have
+   room for TLC_FPRINT_LEN + 1 characters */
+static void checkpoint_fingerprint(char *fprint, struct phyloFit_struct *pf,
+                                   MSA *msa, TreeNode *tree, int subst_mod,
+                                   int root_leaf_id, int cat) {
+  int i, settings[] = {subst_mod, root_leaf_id, cat, pf->nratecats,
+                       pf->use_em, pf->opt_method, pf->precision,
+                       pf->likelihood_only, pf->estimate_backgd,
+                       pf->estimate_scale_only, pf->no_freqs, pf->no_rates,
+                       pf->assume_clock, pf->init_parsimony,
+                       pf->init_backgd_from_data, pf->random_init,
+                       pf->symfreq, pf->use_selection, pf->gaps_as_bases,
+                       pf->use_conditionals, pf->no_branchlens,
+                       pf->max_em_its, pf->nonoverlapping};
+  double vals[] = {pf->alpha, pf->selection};
+  tlc_fprint h = tlc_hash_msa(0, msa);
+  char *treestr;
+
+  h = tlc_hash(h, settings, sizeof(settings));
+  h = tlc_hash(h, vals, sizeof(vals));
+  if (pf->input_mod != NULL)
+    h = tlc_hash_model(h, pf->input_mod);
+  if (tree != NULL) {
+    treestr = tr_to_string(tree, TRUE);
+    h = tlc_hash(h, treestr, strlen(treestr));
+    sfree(treestr);
+  }
+  if (pf->subtree_name != NULL)
+    h = tlc_hash(h, pf->subtree_name, strlen(pf->subtree_name) + 1);
+  if (pf->nooptstr != NULL)
+    h = tlc_hash(h, pf->nooptstr->chars, pf->nooptstr->length + 1);
+  h = hash_str_list(h, pf->alt_mod_str);
+  h = hash_str_list(h, pf->bound_arg);
+  h = hash_str_list(h, pf->ignore_branches);
+  if (pf->rate_consts != NULL)
+    for (i = 0; i < lst_size(pf->rate_consts); i++) {
+      double rc = lst_get_dbl(pf->rate_consts, i);
+      h = tlc_hash(h, &rc, sizeof(double));
+    }
+  sprintf(fprint, "%016llx", h);
+}
 
 int run_phyloFit(struct phyloFit_struct *pf) {
   FILE *F, *WINDOWF=NULL;
-  int i, j, win, root_leaf_id = -1;
-  String *mod_fname;
+  int i, j, win, root_leaf_id = -1, batch_size, nfits, fit_nthreads;
   MSA *source_msa;
+  List *jobs, *restart_mods, *restart_params;
+  ThreadPool *pool;
   String *tmpstr = str_new(STR_SHORT_LEN);
   List *cats_to_do=NULL;
   double *gc=NULL;
   char tmpchstr[STR_MED_LEN];
   FILE *parsimony_cost_file = NULL;
+  Checkpoint *ckpt = NULL;
   int free_cm = FALSE, free_cats_to_do_str=FALSE, free_tree=FALSE,
     free_window_coords = FALSE;
 
@@ -700,6 +930,9 @@ int run_phyloFit(struct phyloFit_struct *pf) {
   if (input_mod != NULL && tree != NULL)
     die("ERROR: --tree is not allowed with --init-model.\n");
 
+  if (input_mod != NULL && pf->nrestarts > 1)
+    die("ERROR: --nrestarts is not allowed with --init-model.\n");
+
   if (subst_mod == UNDEF_MOD) {
     if (pf->input_mod != NULL)
       subst_mod = pf->input_mod->subst_mod;
@@ -923,8 +1156,54 @@ int run_phyloFit(struct phyloFit_struct *pf) {
   if (pf->error_fname != NULL)
     error_file = phast_fopen(pf->error_fname, "w");
 
-  /* now estimate models (window by window, if necessary) */
-  mod_fname = str_new(STR_MED_LEN);
+  /* now estimate models (window by window, if necessary).  Models
+     for different windows and categories are independent unless each
+     starts from the result of the last (as with --init-model), so
+     batches of them are fitted concurrently.  This is not done with
+     --log or --error, which all fits share, or if there is only one
+     model to fit; the threads are used within each fit instead (by
+     EM only) */
+  nfits = (pf->window_coords == NULL ? 1 : lst_size(pf->window_coords)/2) *
+    lst_size(cats_to_do) * pf->nrestarts;
+
+  /* checkpointing is supported only for a single fit */
+  if (pf->checkpoint_fname != NULL) {
+    if (nfits > 1)
+      die("ERROR: --checkpoint cannot be used with --windows, --nrestarts, or more than one category.\n");
+    char fprint[TLC_FPRINT_LEN + 1];
+    ckpt = ckpt_new(pf->checkpoint_fname, pf->checkpoint_interval);
+    checkpoint_fingerprint(fprint, pf, msa, tree, subst_mod, root_leaf_id,
+                           lst_get_int(cats_to_do, 0));
+    ckpt_set_fingerprint(ckpt, fprint);
+    if (pf->resume) {
+      if (!ckpt_load(ckpt)) {
+        if (!quiet) 
+          fprintf(stderr, "No checkpoint found in %s; starting from scratch.\n",
+                  pf->checkpoint_fname);
+      }
+      else if (pf->use_em ? ckpt_has(ckpt, "OPT_ITERATION") :
+               ckpt_has(ckpt, "EM_ITERATION"))
+        die("ERROR: checkpoint %s was written by a fit %s --EM.\n",
+            pf->checkpoint_fname, pf->use_em ? "without" : "with");
+      else if (!quiet)
+        fprintf(stderr, "Resuming from checkpoint %s ...\n", 
+                pf->checkpoint_fname);
+    }
+  }
+
+  if (input_mod == NULL && pf->logf == NULL && error_file == NULL &&
+      nfits > 1) {
+    pool = thr_pool_new(pf->nthreads);
+    fit_nthreads = 1;
+  }
+  else {
+    pool = thr_pool_new(1);
+    fit_nthreads = pf->nthreads;
+  }
+  batch_size = thr_pool_size(pool) == 1 ? 1 : 4 * thr_pool_size(pool);
+  jobs = lst_new_ptr(batch_size);
+  restart_mods = lst_new_ptr(pf->nrestarts);
+  restart_params = lst_new_ptr(pf->nrestarts);
   source_msa = msa;
   for (win = 0;
        win < (pf->window_coords == NULL ? 1 : lst_size(pf->window_coords));
@@ -947,6 +1226,7 @@ int run_phyloFit(struct phyloFit_struct *pf) {
       List *pruned_names;
       int old_nnodes, cat = lst_get_int(cats_to_do, i);
       unsigned int ninf_sites;
+      PhyloFitJob *job;
 
       if (input_mod == NULL)
         mod = tm_new(tr_create_copy(tree), NULL, NULL, subst_mod,
@@ -1003,6 +1283,8 @@ int run_phyloFit(struct phyloFit_struct *pf) {
       } else mod->bound_arg = NULL;
 
       mod->use_conditionals = pf->use_conditionals;
+      mod->opt_method = pf->opt_method;
+      mod->ckpt = ckpt;
 
       if (pf->estimate_scale_only ||
 	  pf->estimate_backgd ||
@@ -1157,6 +1439,13 @@ int run_phyloFit(struct phyloFit_struct *pf) {
             msa->seqs = NULL;
           }
         }
+        /* models for additional restarts are copied before parameter
+           setup alters the original; their starting values are drawn
+           here, in order, so that results do not depend on the
+           number of threads */
+        for (j = 1; j < pf->nrestarts; j++)
+          lst_push_ptr(restart_mods, tm_create_copy(mod));
+
         if (pf->random_init)
           params = tm_params_init_random(mod);
         else if (input_mod != NULL)
@@ -1167,6 +1456,16 @@ int run_phyloFit(struct phyloFit_struct *pf) {
 	if (pf->init_parsimony)
 	  tm_params_init_branchlens_parsimony(params, mod, msa, cat);
 
+        for (j = 0; j < lst_size(restart_mods); j++) {
+          Vector *rparams =
+            tm_params_init_random(lst_get_ptr(restart_mods, j));
+          if (pf->init_parsimony)
+            tm_params_init_branchlens_parsimony(rparams,
+                                                lst_get_ptr(restart_mods, j),
+                                                msa, cat);
+          lst_push_ptr(restart_params, rparams);
+        }
+
         if (input_mod != NULL && mod->backgd_freqs != NULL && !pf->no_freqs && pf->init_backgd_from_data) {
           /* in some cases, the eq freqs are needed for
              initialization, but now they should be re-estimated --
@@ -1187,92 +1486,55 @@ int run_phyloFit(struct phyloFit_struct *pf) {
           fprintf(stderr, "Fitting tree model to %s using %s%s ...\n",
                   tmpstr->chars, tm_get_subst_mod_string(subst_mod),
                   mod->nratecats > 1 ? " (with rate variation)" : "");
+          if (pf->nrestarts > 1)
+            fprintf(stderr, "(keeping best of %d restarts)\n",
+                    pf->nrestarts);
         }
-
-        if (pf->use_em)
-          tm_fit_em(mod, msa, params, cat, pf->precision, pf->max_em_its, pf->logf, error_file);
-        else
-          tm_fit(mod, msa, params, cat, pf->precision, pf->logf, pf->quiet, error_file);
-      }
-
-      if (pf->output_fname_root != NULL)
-	str_cpy_charstr(mod_fname, pf->output_fname_root);
-      else str_clear(mod_fname);
-      if (pf->window_coords != NULL) {
-	if (mod_fname->length != 0)
-	  str_append_char(mod_fname, '.');
-        str_append_charstr(mod_fname, "win-");
-        str_append_int(mod_fname, win/2 + 1);
-      }
-      if (cat != -1 && pf->nonoverlapping == FALSE) {
-	if (mod_fname->length != 0)
-	  str_append_char(mod_fname, '.');
-        if (pf->cm != NULL)
-          str_append(mod_fname, cm_get_feature_unique(pf->cm, cat));
-        else
-          str_append_int(mod_fname, cat);
-      }
-      if (pf->output_fname_root != NULL)
-	str_append_charstr(mod_fname, ".mod");
-
-      if (pf->output_fname_root != NULL) {
-	if (!quiet) fprintf(stderr, "Writing model to %s ...\n",
-			    mod_fname->chars);
-	if (strcmp(pf->output_fname_root, "-") != 0)
-          F = phast_fopen(mod_fname->chars, "w+");
-        else
-          F = stdout;
-	tm_print(F, mod);
-	if (strcmp(pf->output_fname_root, "-") != 0)
-	  phast_fclose(F);
-      }
-      if (pf->results != NULL)
-	lol_push_treeModel(pf->results, mod, mod_fname->chars);
-
-      /* output posterior probabilities, if necessary */
-      if (pf->do_bases || pf->do_expected_nsubst ||
-	  pf->do_expected_nsubst_tot || pf->do_expected_nsubst_col) {
-	print_post_prob_stats(mod, msa, pf->output_fname_root,
-			      pf->do_bases, pf->do_expected_nsubst,
-			      pf->do_expected_nsubst_tot,
-			      pf->do_expected_nsubst_col, 0,
-			      cat, quiet, NULL);
       }
 
-      /* print window summary, if window mode */
-      if (pf->window_coords != NULL) {
-	int i, j, total=0;
-	char c;
-	if (gc == NULL)
-	  gc = smalloc(msa->nseqs*sizeof(double));
-	for (i=0; i < msa->nseqs; i++) {
-	  total=0;
-	  gc[i]=0;
-	  for (j=0; j<msa->length; j++) {
-	    c = msa_get_char(msa, i, j);
-	    if ((!msa->is_missing[(int)c]) && c != GAP_CHAR) {
-	      total++;
-	      if (c=='C' || c=='G') gc[i]++;
-	    }
-	  }
-	  gc[i] /= (double)total;
-	}
-        print_window_summary(WINDOWF, pf->window_coords, win, cat, mod, gc,
-                             ninf_sites, msa->nseqs, FALSE);
+      for (j = 0; j <= lst_size(restart_mods); j++) {
+        job = smalloc(sizeof(PhyloFitJob));
+        job->win = win;
+        job->cat = cat;
+        job->nrestarts = lst_size(restart_mods) + 1;
+        job->msa = msa;
+        job->mod = j == 0 ? mod : lst_get_ptr(restart_mods, j-1);
+        job->params = j == 0 ? params : lst_get_ptr(restart_params, j-1);
+        job->ninf_sites = ninf_sites;
+        job->free_msa = FALSE;
+        lst_push_ptr(jobs, job);
       }
+      lst_clear(restart_mods);
+      lst_clear(restart_params);
+      if (lst_size(jobs) >= batch_size)
+        run_jobs(pf, jobs, pool, fit_nthreads, error_file, WINDOWF, &gc);
+    }
 
-      if (input_mod == NULL) tm_free(mod);
-      if (params != NULL) vec_free(params);
+    if (pf->window_coords != NULL) {
+      /* free the window's alignment along with its last job, or now if
+         all of its jobs are done */
+      if (lst_size(jobs) > 0 &&
+          ((PhyloFitJob*)lst_get_ptr(jobs, lst_size(jobs)-1))->msa == msa)
+        ((PhyloFitJob*)lst_get_ptr(jobs, lst_size(jobs)-1))->free_msa = TRUE;
+      else
+        msa_free(msa);
     }
-    if (pf->window_coords != NULL)
-      msa_free(msa);
   }
+  run_jobs(pf, jobs, pool, fit_nthreads, error_file, WINDOWF, &gc);
+  lst_free(jobs);
+  if (ckpt != NULL) {           /* fit is complete and written out */
+    ckpt_remove(ckpt);
+    ckpt_free(ckpt);
+  }
+  lst_free(restart_mods);
+  lst_free(restart_params);
+  thr_pool_free(pool);
+
   if (WINDOWF != NULL && strcmp(pf->output_fname_root, "-") != 0)
     phast_fclose(WINDOWF);
 
   if (error_file != NULL) phast_fclose(error_file);
   if (parsimony_cost_file != NULL) phast_fclose(parsimony_cost_file);
-  str_free(mod_fname);
   str_free(tmpstr);
   if (free_cm) {
     cm_free(pf->cm);
@@ -24,6 +24,7 @@
 #include "phast/fit_column.h"
 #include "phast/fit_feature.h"
 #include "phast/trees.h"
+#include "phast/hashtable.h"
 
 
 /* initialize phyloP options to default (may be different for rphast) */
@@ -47,6 +48,7 @@ struct phyloP_struct *phyloP_struct_new(int rphast) {
   p->epsilon = -1;
   p->subtree_name = NULL;
   p->chrom = NULL;
+  p->binary_track = NULL;
   p->branch_name = NULL;
   p->feats = NULL;
   p->method = SPH;
@@ -60,6 +62,10 @@ struct phyloP_struct *phyloP_struct_new(int rphast) {
   p->mod_fname = NULL;
   p->msa_fname = NULL;
   p->no_prune = FALSE;
+  p->nthreads = 1;
+  p->fim_grid_fname = NULL;
+  p->chunk_size = -1;
+  p->msa_stream = NULL;
 
   p->results = rphast ? lol_new(20) : NULL;
   return p;
@@ -130,9 +136,60 @@ TreeModel* fit_tree_model(TreeModel *source_mod, MSA *msa,
 }
 
 
+/* set subtree or branches of interest for model, if necessary */
+static void set_subtree(TreeModel *mod, char *subtree_name,
+                        List *branch_name, method_type method) {
+  int j;
+  if (subtree_name != NULL && method != SPH) {
+    /* (SPH is a special case -- requires rerooting) */
+    mod->subtree_root = tr_get_node(mod->tree, subtree_name);
+    if (mod->subtree_root == NULL) {
+      tr_name_ancestors(mod->tree);
+      mod->subtree_root = tr_get_node(mod->tree, subtree_name);
+      if (mod->subtree_root == NULL)
+	die("ERROR: no node named '%s'.\n", subtree_name);
+    }
+  }
+  if (branch_name != NULL) {
+    TreeNode *n;
+    char *nodeName;
+    tr_name_ancestors(mod->tree);
+    mod->in_subtree = smalloc(mod->tree->nnodes * sizeof(int));
+    for (j=0; j<mod->tree->nnodes; j++)
+      mod->in_subtree[j] = 0;
+    for (j=0; j<lst_size(branch_name); j++) {
+      nodeName = ((String*)lst_get_ptr(branch_name, j))->chars;
+      n = tr_get_node(mod->tree, nodeName);
+      if (n == NULL) {
+	tr_name_ancestors(mod->tree);
+	n = tr_get_node(mod->tree, nodeName);
+	if (n == NULL) {
+	  die("ERROR: no node named %s\n", nodeName);
+	}
+      }
+      mod->in_subtree[n->id] = 1;
+    }
+    for (j=0; j<mod->tree->nnodes; j++)
+      if (mod->in_subtree[j] == 0) break;
+    if (j == mod->tree->nnodes)
+      die("ERROR: ERROR: cannot name all branches with --branch option\n");
+  }
+}
+
+/* create writer for --binary-track, if requested */
+static BinTrackWriter *binary_track_writer(struct phyloP_struct *p) {
+  btk_encoding enc;
+  double min = -20, max = 20;
+  if (p->binary_track == NULL || p->outfile == NULL) return NULL;
+  if (btk_parse_format(p->binary_track, &enc, &min, &max) != 0)
+    die("ERROR: bad argument to --binary-track (\"%s\").\n",
+        p->binary_track);
+  return btk_writer_new(p->outfile, enc, min, max);
+}
+
 void phyloP(struct phyloP_struct *p) {
   /* variables for options that are passed through p */
-  int nsites, fit_model, base_by_base, refidx;
+  int nsites, fit_model, base_by_base, refidx, nthreads;
   int prior_only, post_only, quantiles_only,
     output_wig, output_gff;
   double ci, epsilon;
@@ -147,6 +204,7 @@ void phyloP(struct phyloP_struct *p) {
   ListOfLists *results;
 
   /* other variables */
+  BinTrackWriter *btk = NULL;
   TreeModel *mod, *mod_fitted = NULL;
   MSA *msa;
   Vector *prior_distrib=NULL, *post_distrib=NULL;
@@ -167,6 +225,7 @@ void phyloP(struct phyloP_struct *p) {
   fit_model = p->fit_model;
   base_by_base = p->base_by_base;
   refidx = p->refidx;
+  nthreads = p->nthreads;
   ci = p->ci;
   epsilon = p->epsilon;
   subtree_name = p->subtree_name;
@@ -218,6 +277,10 @@ void phyloP(struct phyloP_struct *p) {
     die("ERROR: need base-by-base, wig-scores, or features unless method is SPH\n");
   if (prior_only && msa==NULL && nsites < 0)
     die("ERROR: need to specify nsites or msa to get prior");
+  if (p->binary_track != NULL && !output_wig)
+    die("ERROR: --binary-track requires --wig-scores.\n");
+
+  btk = binary_track_writer(p);
   if (!prior_only) {
     if (msa->ss == NULL)
       ss_from_msas(msa, 1, TRUE, NULL, NULL, NULL, -1, 0);
@@ -258,41 +321,7 @@ void phyloP(struct phyloP_struct *p) {
     lst_free(pruned_names);
   }
 
-  /* set subtree if necessary */
-  if (subtree_name != NULL && method != SPH) {
-    /* (SPH is a special case -- requires rerooting) */
-    mod->subtree_root = tr_get_node(mod->tree, subtree_name);
-    if (mod->subtree_root == NULL) {
-      tr_name_ancestors(mod->tree);
-      mod->subtree_root = tr_get_node(mod->tree, subtree_name);
-      if (mod->subtree_root == NULL)
-	die("ERROR: no node named '%s'.\n", subtree_name);
-    }
-  }
-  if (branch_name != NULL) {
-    TreeNode *n;
-    char *nodeName;
-    tr_name_ancestors(mod->tree);
-    mod->in_subtree = smalloc(mod->tree->nnodes * sizeof(int));
-    for (j=0; j<mod->tree->nnodes; j++)
-      mod->in_subtree[j] = 0;
-    for (j=0; j<lst_size(branch_name); j++) {
-      nodeName = ((String*)lst_get_ptr(branch_name, j))->chars;
-      n = tr_get_node(mod->tree, nodeName);
-      if (n == NULL) {
-	tr_name_ancestors(mod->tree);
-	n = tr_get_node(mod->tree, nodeName);
-	if (n == NULL) {
-	  die("ERROR: no node named %s\n", nodeName);
-	}
-      }
-      mod->in_subtree[n->id] = 1;
-    }
-    for (j=0; j<mod->tree->nnodes; j++)
-      if (mod->in_subtree[j] == 0) break;
-    if (j == mod->tree->nnodes)
-      die("ERROR: ERROR: cannot name all branches with --branch option\n");
-  }
+  set_subtree(mod, subtree_name, branch_name, method);
 
   if (feats != NULL) {
     if (msa->idx_offset > 0)
@@ -348,10 +377,10 @@ void phyloP(struct phyloP_struct *p) {
           post_vars = smalloc(msa->ss->ntuples * sizeof(double));
         }
         sub_pval_per_site(jp, msa, mode, fit_model, &prior_mean, &prior_var, 
-                          pvals, post_means, post_vars, logf);
+                          pvals, post_means, post_vars, logf, nthreads);
 
         if (outfile != NULL && output_wig)
-          print_wig(outfile, msa, pvals, chrom, refidx, TRUE, NULL);
+          print_wig(outfile, btk, msa, pvals, chrom, refidx, TRUE, NULL);
 	if ((outfile != NULL && !output_wig) || results!=NULL) {
 	  char str[1000];
 	  sprintf(str, "#neutral mean = %.3f var = %.3f\n#post_mean post_var pval", 
@@ -419,7 +448,7 @@ void phyloP(struct phyloP_struct *p) {
                                   logf);
 
         if (output_wig) 
-          print_wig(outfile, msa, pvals, chrom, refidx, TRUE, results);
+          print_wig(outfile, btk, msa, pvals, chrom, refidx, TRUE, results);
 	if (results != NULL || !output_wig) {
           char str[1000];
           sprintf(str, "#neutral mean_sub = %.3f var_sub = %.3f mean_sup = %.3f  var_sup = %.3f\n#post_mean_sub post_var_sub post_mean_sup post_var_sup pval", 
@@ -490,9 +519,9 @@ void phyloP(struct phyloP_struct *p) {
         scales = smalloc(msa->ss->ntuples * sizeof(double));
       }
       if (subtree_name == NULL && branch_name == NULL) { /* no subtree case */
-        col_lrts(mod, msa, mode, pvals, scales, llrs, logf);
+        col_lrts(mod, msa, mode, pvals, scales, llrs, logf, nthreads);
         if (output_wig) 
-          print_wig(outfile, msa, pvals, chrom, refidx, TRUE, NULL);
+          print_wig(outfile, btk, msa, pvals, chrom, refidx, TRUE, NULL);
 	if (results != NULL || !output_wig)
           print_base_by_base(output_wig ? NULL : outfile, 
 			     "#scale lnlratio pval", 
@@ -505,10 +534,10 @@ void phyloP(struct phyloP_struct *p) {
           null_scales = smalloc(msa->ss->ntuples * sizeof(double));
         }
         col_lrts_sub(mod, msa, mode, pvals, null_scales, scales, sub_scales, 
-                     llrs, logf);
+                     llrs, logf, nthreads);
 
         if (output_wig) 
-          print_wig(outfile, msa, pvals, chrom, refidx, TRUE, NULL);
+          print_wig(outfile, btk, msa, pvals, chrom, refidx, TRUE, NULL);
 	if (results != NULL || !output_wig)
           print_base_by_base(output_wig ? NULL : outfile, 
 			     "#null_scale alt_scale alt_subscale lnlratio pval", 
@@ -525,7 +554,7 @@ void phyloP(struct phyloP_struct *p) {
         llrs = smalloc(lst_size(feats->features) * sizeof(double));
       }
       if (subtree_name == NULL && branch_name == NULL) {  /* no subtree case */
-        ff_lrts(mod, msa, feats, mode, pvals, scales, llrs, logf);
+        ff_lrts(mod, msa, feats, mode, pvals, scales, llrs, logf, nthreads);
         msa_map_gff_coords(msa, feats, 0, p->refidx_feat, 0);
 	if (msa->idx_offset > 0)
 	  gff_add_offset(feats, msa->idx_offset, 0);
@@ -543,7 +572,7 @@ void phyloP(struct phyloP_struct *p) {
           sub_scales = smalloc(lst_size(feats->features) * sizeof(double));
         }
         ff_lrts_sub(mod, msa, feats, mode, pvals, null_scales, scales, 
-                    sub_scales, llrs, logf);
+                    sub_scales, llrs, logf, nthreads);
         msa_map_gff_coords(msa, feats, 0, p->refidx_feat, 0);
 	if (msa->idx_offset > 0)
 	  gff_add_offset(feats, msa->idx_offset, 0);
@@ -571,9 +600,9 @@ void phyloP(struct phyloP_struct *p) {
 
       if (subtree_name == NULL && branch_name == NULL) { /* no subtree case */
         col_score_tests(mod, msa, mode, pvals, derivs, 
-                        teststats);
+                        teststats, nthreads);
         if (output_wig) 
-          print_wig(outfile, msa, pvals, chrom, refidx, TRUE, NULL);
+          print_wig(outfile, btk, msa, pvals, chrom, refidx, TRUE, NULL);
 	if (results != NULL || !output_wig)
           print_base_by_base(output_wig ? NULL : outfile, 
 			     "#deriv teststat pval", 
@@ -588,10 +617,11 @@ void phyloP(struct phyloP_struct *p) {
         }
 
         col_score_tests_sub(mod, msa, mode, pvals, null_scales, derivs, 
-                            sub_derivs, teststats, logf);
+                            sub_derivs, teststats, logf,
+                            p->fim_grid_fname, nthreads);
 
         if (output_wig) 
-          print_wig(outfile, msa, pvals, chrom, refidx, TRUE, NULL);
+          print_wig(outfile, btk, msa, pvals, chrom, refidx, TRUE, NULL);
 	if (results != NULL || !output_wig)
           print_base_by_base(output_wig ? NULL : outfile, 
 			     "#scale deriv subderiv teststat pval", 
@@ -608,7 +638,8 @@ void phyloP(struct phyloP_struct *p) {
         derivs = smalloc(lst_size(feats->features) * sizeof(double));
       }
       if (subtree_name == NULL && branch_name == NULL) { /* no subtree case */
-        ff_score_tests(mod, msa, feats, mode, pvals, derivs, teststats);
+        ff_score_tests(mod, msa, feats, mode, pvals, derivs, teststats,
+                       nthreads);
         msa_map_gff_coords(msa, feats, 0, p->refidx_feat, 0);
 	if (msa->idx_offset > 0)
 	  gff_add_offset(feats, msa->idx_offset, 0);
@@ -627,7 +658,8 @@ void phyloP(struct phyloP_struct *p) {
           sub_derivs = smalloc(lst_size(feats->features) * sizeof(double));
         }
         ff_score_tests_sub(mod, msa, feats, mode, pvals, null_scales, derivs, 
-                           sub_derivs, teststats, logf);
+                           sub_derivs, teststats, logf,
+                           p->fim_grid_fname, nthreads);
         msa_map_gff_coords(msa, feats, 0, p->refidx_feat, 0);
 	if (msa->idx_offset > 0)
 	  gff_add_offset(feats, msa->idx_offset, 0);
@@ -654,9 +686,10 @@ void phyloP(struct phyloP_struct *p) {
         nobs = smalloc(msa->ss->ntuples * sizeof(double));
         nspec = smalloc(msa->ss->ntuples * sizeof(double));
       }
-      col_gerp(mod, msa, mode, nneut, nobs, nrejected, nspec, logf);
+      col_gerp(mod, msa, mode, nneut, nobs, nrejected, nspec, logf,
+               nthreads);
       if (output_wig) 
-        print_wig(outfile, msa, nrejected, chrom, refidx, FALSE, NULL);
+        print_wig(outfile, btk, msa, nrejected, chrom, refidx, FALSE, NULL);
       if (results != NULL || !output_wig) {
         print_base_by_base(output_wig ? NULL : outfile, 
 			   "#nneut nobs nrej nspec", chrom, 
@@ -672,7 +705,8 @@ void phyloP(struct phyloP_struct *p) {
         nobs = smalloc(lst_size(feats->features) * sizeof(double));
         nspec = smalloc(lst_size(feats->features) * sizeof(double));
       }
-      ff_gerp(mod, msa, feats, mode, nneut, nobs, nrejected, nspec, logf);
+      ff_gerp(mod, msa, feats, mode, nneut, nobs, nrejected, nspec, logf,
+              nthreads);
       msa_map_gff_coords(msa, feats, 0, p->refidx_feat, 0);
       if (msa->idx_offset > 0)
 	gff_add_offset(feats, msa->idx_offset, 0);
@@ -686,6 +720,7 @@ void phyloP(struct phyloP_struct *p) {
 			    "nrej", nrejected, "nspec", nspec);
     }
   } /* end GERP */
+  if (btk != NULL) btk_writer_close(btk);
   if (pvals != NULL) sfree(pvals);
   if (post_means != NULL) sfree(post_means);
   if (post_vars != NULL) sfree(post_vars);
@@ -703,3 +738,273 @@ void phyloP(struct phyloP_struct *p) {
 } 
 
 
+
+/* state for scoring an alignment one chunk at a time (see
+   phyloP_stream) */
+typedef struct {
+  struct phyloP_struct *p;
+  char *chrom;                  /* chromosome name for output */
+  JumpProcess *jp;              /* for SPH */
+  double fim;                   /* for SCORE */
+  FimGrid *grid;                /* for SCORE with --subtree or --branch */
+  Hashtable *tuple_hash;        /* maps column tuples already scored to
+                                   indices in scores */
+  List *scores;                 /* scores of those tuples */
+} StreamData;
+
+/* compute the score printed by --wig-scores (p-value or number of
+   rejected substitutions) for every tuple of an alignment */
+static void stream_score_tuples(StreamData *sd, MSA *msa, double *vals) {
+  struct phyloP_struct *p = sd->p;
+  int sub = (p->subtree_name != NULL || p->branch_name != NULL);
+  double mean_sub, var_sub, mean_sup, var_sup;
+
+  if (p->method == SPH && p->subtree_name == NULL)
+    sub_pval_per_site(sd->jp, msa, p->mode, p->fit_model, &mean_sub,
+                      &var_sub, vals, NULL, NULL, p->logf, p->nthreads);
+  else if (p->method == SPH)
+    sub_pval_per_site_subtree(sd->jp, msa, p->mode, p->fit_model,
+                              &mean_sub, &var_sub, &mean_sup, &var_sup,
+                              vals, NULL, NULL, NULL, NULL, p->logf);
+  else if (p->method == LRT && !sub)
+    col_lrts(p->mod, msa, p->mode, vals, NULL, NULL, p->logf, p->nthreads);
+  else if (p->method == LRT)
+    col_lrts_sub(p->mod, msa, p->mode, vals, NULL, NULL, NULL, NULL,
+                 p->logf, p->nthreads);
+  else if (p->method == SCORE && !sub)
+    col_score_tests_fim(p->mod, msa, p->mode, sd->fim, vals, NULL, NULL,
+                        p->nthreads);
+  else if (p->method == SCORE)
+    col_score_tests_sub_grid(p->mod, msa, p->mode, sd->grid, vals, NULL,
+                             NULL, NULL, NULL, p->logf, p->nthreads);
+  else                          /* GERP */
+    col_gerp(p->mod, msa, p->mode, NULL, NULL, vals, NULL, p->logf,
+             p->nthreads);
+}
+
+/* score the tuples of a chunk of the alignment (vals[i] is set to the
+   score of tuple i of chunk).  Tuples scored in previous chunks are
+   looked up; the rest are gathered into a separate alignment with one
+   column per tuple, which is scored in a single pass */
+static void stream_score_chunk(StreamData *sd, MSA *chunk, double *vals) {
+  int i, j, nnew = 0;
+  int *newtup = smalloc(chunk->ss->ntuples * sizeof(int));
+  MSA *newmsa;
+  double *newvals;
+
+  if (lst_size(sd->scores) + chunk->ss->ntuples > STREAM_MAX_TUPLES) {
+    hsh_clear(sd->tuple_hash);
+    lst_clear(sd->scores);
+  }
+
+  for (i = 0; i < chunk->ss->ntuples; i++) {
+    int idx = hsh_get_int(sd->tuple_hash, chunk->ss->col_tuples[i]);
+    if (idx == -1) newtup[nnew++] = i;
+    else vals[i] = lst_get_dbl(sd->scores, idx);
+  }
+
+  if (nnew > 0) {
+    char **seqs = smalloc(chunk->nseqs * sizeof(char*));
+    for (j = 0; j < chunk->nseqs; j++) {
+      seqs[j] = smalloc((nnew + 1) * sizeof(char));
+      for (i = 0; i < nnew; i++)
+        seqs[j][i] = ss_get_char_tuple(chunk, newtup[i], j, 0);
+      seqs[j][nnew] = '\0';
+    }
+    newmsa = msa_new(seqs, chunk->names, chunk->nseqs, nnew,
+                     chunk->alphabet);
+    ss_from_msas(newmsa, 1, TRUE, NULL, NULL, NULL, -1, 0);
+    newvals = smalloc(newmsa->ss->ntuples * sizeof(double));
+    stream_score_tuples(sd, newmsa, newvals);
+
+    for (i = 0; i < nnew; i++) {
+      double val = newvals[newmsa->ss->tuple_idx[i]];
+      vals[newtup[i]] = val;
+      hsh_put_int(sd->tuple_hash, chunk->ss->col_tuples[newtup[i]],
+                  lst_size(sd->scores));
+      lst_push_dbl(sd->scores, val);
+    }
+    sfree(newvals);
+    newmsa->names = NULL;       /* shared with chunk */
+    msa_free(newmsa);
+  }
+  sfree(newtup);
+}
+
+/* score and print the alignment blocks gathered in chunk, then empty
+   it.  Block i starts at column block_cols[i] of chunk and at
+   position block_starts[i] (0-based) of the reference sequence */
+static void stream_flush_chunk(StreamData *sd, MSA *chunk,
+                               List *block_cols, List *block_starts,
+                               BinTrackWriter *btk, long long *last) {
+  struct phyloP_struct *p = sd->p;
+  double *vals;
+  int i, nblocks = lst_size(block_cols);
+
+  if (chunk->length == 0) return;
+  for (i = 0; i < chunk->nseqs; i++)
+    chunk->seqs[i][chunk->length] = '\0';
+
+  ss_from_msas(chunk, 1, TRUE, NULL, NULL, NULL, -1, 0);
+  vals = smalloc(chunk->ss->ntuples * sizeof(double));
+  stream_score_chunk(sd, chunk, vals);
+
+  for (i = 0; i < nblocks; i++)
+    print_wig_piece(p->outfile, btk, chunk, vals, sd->chrom,
+                    lst_get_int(block_cols, i),
+                    i < nblocks - 1 ? lst_get_int(block_cols, i+1) :
+                    chunk->length,
+                    (long long)lst_get_int(block_starts, i) + 1,
+                    p->method != GERP, last);
+  if (btk == NULL && p->outfile != NULL) fflush(p->outfile);
+
+  sfree(vals);
+  ss_free(chunk->ss);
+  chunk->ss = NULL;
+  chunk->length = 0;
+  lst_clear(block_cols);
+  lst_clear(block_starts);
+}
+
+/* Version of phyloP for --wig-scores with a MAF file that is read
+   incrementally from p->msa_stream, p->chunk_size columns at a time,
+   rather than loaded into memory.  The sequences are the leaves of
+   the tree (in the order of the MAF reference sequence first).  Each
+   chunk is scored and printed before the next is read, and scores of
+   distinct columns are kept across chunks so that each is computed
+   only once. */
+void phyloP_stream(struct phyloP_struct *p) {
+  TreeModel *mod = p->mod;
+  StreamData sd;
+  BinTrackWriter *btk;
+  Hashtable *name_hash = hsh_new(100);
+  char **names;
+  MSA *block, *chunk;
+  List *block_cols = lst_new_int(1000), *block_starts = lst_new_int(1000);
+  int nseqs = 0, refseqlen, start_idx, length, do_toupper, i, j,
+    warned = FALSE;
+  long long last_end = -1, last = -1;
+
+  if (!p->base_by_base || !p->output_wig)
+    die("ERROR: --chunk-size requires --wig-scores or --binary-track.\n");
+  if (p->feats != NULL || p->cats_to_do != NULL || p->prior_only ||
+      p->post_only || p->ci != -1 || p->results != NULL)
+    die("ERROR: --chunk-size cannot be used with --features, --do-cats, --null, --posterior, or --confidence-interval.\n");
+  if (p->refidx != 1)
+    die("ERROR: --chunk-size requires the MAF reference sequence as frame of reference (--refidx 1).\n");
+  if (p->method != SPH && (p->fit_model || p->epsilon >= 0))
+    die("ERROR: given arguments only available in SPH mode.  Try '%s'.\n",
+        p->help);
+  if (p->method == GERP && p->subtree_name != NULL)
+    die("ERROR: --subtree not supported with --method GERP.\n");
+  if ((p->method == GERP || p->method == SPH) && p->branch_name != NULL)
+    die("ERROR --branch not supported with --method GERP or --method SPH\n");
+  if (p->branch_name != NULL && p->subtree_name != NULL)
+    die("ERROR: can use only one of --subtree or --branch options\n");
+
+  /* sequence names are the names of the leaves; maf_quick_peek moves
+     the reference sequence to the front */
+  names = smalloc(mod->tree->nnodes * sizeof(char*));
+  for (i = 0; i < mod->tree->nnodes; i++) {
+    TreeNode *n = lst_get_ptr(mod->tree->nodes, i);
+    if (n->lchild == NULL && n->rchild == NULL) {
+      names[nseqs] = copy_charstr(n->name);
+      hsh_put_int(name_hash, names[nseqs], nseqs);
+      nseqs++;
+    }
+  }
+  maf_quick_peek(p->msa_stream, &names, name_hash, NULL, &refseqlen, FALSE);
+  if (refseqlen == -1)
+    die("ERROR: got invalid maf file\n");
+
+  block = msa_new(NULL, names, nseqs, -1, NULL);
+  block->seqs = smalloc(nseqs * sizeof(char*));
+  for (i = 0; i < nseqs; i++) block->seqs[i] = NULL;
+  do_toupper = !msa_alph_has_lowercase(block);
+
+  chunk = msa_new(NULL, names, nseqs, 0, NULL); /* names are shared */
+  chunk->alloc_len = p->chunk_size;
+  chunk->seqs = smalloc(nseqs * sizeof(char*));
+  for (i = 0; i < nseqs; i++)
+    chunk->seqs[i] = smalloc((chunk->alloc_len + 1) * sizeof(char));
+
+  /* set up model and any data that does not depend on the alignment */
+  sd.p = p;
+  sd.chrom = p->chrom != NULL ? p->chrom : names[0];
+  sd.jp = NULL;
+  sd.fim = -1;
+  sd.grid = NULL;
+  sd.tuple_hash = hsh_new(STREAM_MAX_TUPLES / 10);
+  sd.scores = lst_new_dbl(100000);
+
+  set_subtree(mod, p->subtree_name, p->branch_name, p->method);
+  if (p->method == SPH) {
+    if (p->subtree_name != NULL) {
+      if (!tm_is_reversible(mod))
+        die("ERROR: reversible model required with --subtree.\n");
+      tr_name_ancestors(mod->tree);
+      sub_reroot(mod, p->subtree_name);
+      if (p->fit_model)
+        mod->subtree_root = mod->tree->lchild; /* for rescaling */
+    }
+    sd.jp = sub_define_jump_process(mod, p->epsilon >= 0 ? p->epsilon :
+                                    DEFAULT_EPSILON_BASE_BY_BASE,
+                                    tr_total_len(mod->tree));
+  }
+  else if (p->method == SCORE) {
+    if (p->subtree_name == NULL && p->branch_name == NULL) {
+      if ((sd.fim = col_estimate_fim(mod)) < 0)
+        die("ERROR: negative fisher information in col_score_tests\n");
+    }
+    else
+      sd.grid = col_fim_grid_sub_cached(mod, p->fim_grid_fname);
+  }
+  if (mod->msa_seq_idx != NULL) sfree(mod->msa_seq_idx);
+  tm_build_seq_idx(mod, chunk);
+
+  btk = binary_track_writer(p);
+
+  /* gather blocks into chunks of at least chunk_size columns */
+  while (maf_read_block_addseq(p->msa_stream, block, name_hash, &start_idx,
+                               &length, do_toupper, TRUE) != EOF) {
+    checkInterrupt();
+
+    if (start_idx < last_end) {
+      if (!warned)
+        phast_warning("WARNING: ignoring MAF blocks that overlap earlier blocks or are out of order with respect to the reference sequence.\n");
+      warned = TRUE;
+      continue;
+    }
+    last_end = start_idx + length;
+
+    if (chunk->length + block->length > chunk->alloc_len) {
+      chunk->alloc_len = max(2 * chunk->alloc_len,
+                             chunk->length + block->length);
+      for (i = 0; i < nseqs; i++)
+        chunk->seqs[i] = srealloc(chunk->seqs[i], (chunk->alloc_len + 1) *
+                                  sizeof(char));
+    }
+    for (i = 0; i < nseqs; i++)
+      for (j = 0; j < block->length; j++)
+        chunk->seqs[i][chunk->length + j] = block->seqs[i][j];
+    lst_push_int(block_cols, chunk->length);
+    lst_push_int(block_starts, start_idx);
+    chunk->length += block->length;
+
+    if (chunk->length >= p->chunk_size)
+      stream_flush_chunk(&sd, chunk, block_cols, block_starts, btk, &last);
+  }
+  stream_flush_chunk(&sd, chunk, block_cols, block_starts, btk, &last);
+
+  if (btk != NULL) btk_writer_close(btk);
+  if (sd.jp != NULL) sub_free_jump_process(sd.jp);
+  if (sd.grid != NULL) col_free_fim_grid(sd.grid);
+  hsh_free(sd.tuple_hash);
+  lst_free(sd.scores);
+  lst_free(block_cols);
+  lst_free(block_starts);
+  block->names = NULL;          /* shared with chunk */
+  msa_free(block);
+  msa_free(chunk);
+  hsh_free(name_hash);
+}
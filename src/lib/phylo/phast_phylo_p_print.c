@@ -583,8 +583,25 @@ void print_feats_sph_subtree(FILE *outfile, p_value_joint_stats *stats,
 }
 
 
-void print_wig(FILE *outfile, MSA *msa, double *vals, char *chrom,
-	       int refidx, int log_trans, ListOfLists *result) {
+/* write a single value of a wig track, optionally converting a
+   p-value to -log10 scale */
+static double put_wig_val(FILE *outfile, BinTrackWriter *btk, double val,
+                          int log_trans) {
+  if (log_trans) {
+    int sign = 1;
+    if (val < 0) {
+      val = -val;
+      sign = -1;          /* propagate negative sign through */
+    }
+    val = fabs(-log10(val)) * sign; /* fabs prevents -0 for val == 1 */
+  }
+  if (btk != NULL) btk_put(btk, val);
+  else if (outfile != NULL) fprintf(outfile, "%.3f\n", val);
+  return val;
+}
+
+void print_wig(FILE *outfile, BinTrackWriter *btk, MSA *msa, double *vals,
+               char *chrom, int refidx, int log_trans, ListOfLists *result) {
   int last, j, k;
   double val;
   List *posList=NULL, *scoreList=NULL;
@@ -601,19 +618,15 @@ void print_wig(FILE *outfile, MSA *msa, double *vals, char *chrom,
     checkInterruptN(j, 1000);
     if (refidx == 0 || msa_get_char(msa, refidx-1, j) != GAP_CHAR) {
       if (refidx == 0 || !msa_missing_col(msa, refidx, j)) {
-        if (k > last + 1 && outfile != NULL)
-          fprintf(outfile, "fixedStep chrom=%s start=%d step=1\n", chrom,
-		  k + msa->idx_offset + 1);
-        val = vals[msa->ss->tuple_idx[j]];
-        if (log_trans) {
-          int sign = 1;
-          if (val < 0) {
-            val = -val;
-            sign = -1;          /* propagate negative sign through */
-          }
-          val = fabs(-log10(val)) * sign; /* fabs prevents -0 for val == 1 */
+        if (k > last + 1) {
+          if (btk != NULL)
+            btk_start_block(btk, chrom, k + msa->idx_offset + 1);
+          else if (outfile != NULL)
+            fprintf(outfile, "fixedStep chrom=%s start=%d step=1\n", chrom,
+                    k + msa->idx_offset + 1);
         }
-        if (outfile != NULL) fprintf(outfile, "%.3f\n", val);
+        val = put_wig_val(outfile, btk, vals[msa->ss->tuple_idx[j]],
+                          log_trans);
 	if (result != NULL) {
 	  lst_push_int(posList, k + msa->idx_offset + 1);
 	  lst_push_dbl(scoreList, val);
@@ -633,6 +646,37 @@ void print_wig(FILE *outfile, MSA *msa, double *vals, char *chrom,
 }
 
 
+/* Like print_wig, but for a range of columns [start, end) of an
+   alignment that is one piece of a larger one, such as an alignment
+   block in a MAF file.  The reference sequence is the first sequence
+   and its first non-gap character in the range is at coordinate
+   refstart (1-based).  *last is the coordinate of the last value
+   printed by a previous call (or -1), so that a fixedStep section
+   continues across calls when pieces are contiguous; it is updated
+   on return */
+void print_wig_piece(FILE *outfile, BinTrackWriter *btk, MSA *msa,
+                     double *vals, char *chrom, int start, int end,
+                     long long refstart, int log_trans, long long *last) {
+  int j;
+  long long k = refstart;
+  for (j = start; j < end; j++) {
+    checkInterruptN(j, 1000);
+    if (msa_get_char(msa, 0, j) == GAP_CHAR) continue;
+    if (!msa_missing_col(msa, 1, j)) {
+      if (*last < 0 || k > *last + 1) {
+        if (btk != NULL)
+          btk_start_block(btk, chrom, k);
+        else if (outfile != NULL)
+          fprintf(outfile, "fixedStep chrom=%s start=%lld step=1\n", chrom,
+                  k);
+      }
+      put_wig_val(outfile, btk, vals[msa->ss->tuple_idx[j]], log_trans);
+      *last = k;
+    }
+    k++;
+  }
+}
+
 double *log10_pval(double *pval, int len) {
   double *scores = smalloc(len*sizeof(double)), sign;
   int i;
@@ -21,6 +21,7 @@
 #include <phast/prob_vector.h>
 #include <phast/prob_matrix.h>
 #include <phast/fit_column.h>
+#include <phast/thread_pool.h>
 
 /* (used below) compute and return a set of matrices giving p(b, n |
    j), the probability of n substitutions and a final base b given j
@@ -89,6 +90,9 @@ JumpProcess *sub_define_jump_process(TreeModel *mod,
   jp->lambda = 0;
   jp->mod = mod;
   jp->epsilon = epsilon;
+  jp->maxsubst = NULL;
+  jp->post_L = NULL;
+  jp->post_left = jp->post_right = NULL;
 
   /* set lambda to max_a -q_aa */
   for (j = 0; j < size; j++) {
@@ -141,8 +145,74 @@ JumpProcess *sub_define_jump_process(TreeModel *mod,
   return jp;
 }
 
+/* maximum number of doubles held in the per-node cache of posterior
+   distributions (see node_distribs); once it is full, distributions
+   for new leaf patterns are computed but not stored */
+#define POST_CACHE_MAX_DOUBLES (1 << 24)
+
+/* free workspace used by sub_posterior_distrib_site; it will be
+   reallocated on next use */
+static void free_posterior_workspace(JumpProcess *jp) {
+  int i, j;
+  if (jp->post_L == NULL) return;
+  for (i = 0; i < jp->mod->tree->nnodes; i++) {
+    mat_free(jp->post_work[i]);
+    for (j = 0; j < lst_size(jp->post_cache[i]); j++)
+      mat_free(lst_get_ptr(jp->post_cache[i], j));
+    lst_free(jp->post_cache[i]);
+    hsh_free(jp->post_pattern_ids[i]);
+  }
+  sfree(jp->post_L);
+  sfree(jp->post_work);
+  sfree(jp->post_pattern);
+  sfree(jp->post_cache);
+  sfree(jp->post_pattern_ids);
+  mat_free(jp->post_left);
+  mat_free(jp->post_right);
+  sfree(jp->maxsubst);
+  jp->post_L = NULL;
+  jp->post_left = jp->post_right = NULL;
+  jp->maxsubst = NULL;
+}
+
+/* allocate workspace for sub_posterior_distrib_site.  The number of
+   substitutions considered beneath each node depends only on the tree
+   and the branch distributions, not on the data, so the workspace can
+   be sized once and reused for every tuple */
+static void alloc_posterior_workspace(JumpProcess *jp) {
+  List *traversal = tr_postorder(jp->mod->tree);
+  int size = jp->mod->rate_matrix->size, lidx, maxall = 0,
+    nnodes = jp->mod->tree->nnodes;
+
+  jp->maxsubst = smalloc(nnodes * sizeof(int));
+  jp->post_L = smalloc(nnodes * sizeof(void*));
+  jp->post_work = smalloc(nnodes * sizeof(void*));
+  jp->post_pattern = smalloc(nnodes * sizeof(int));
+  jp->post_cache = smalloc(nnodes * sizeof(void*));
+  jp->post_pattern_ids = smalloc(nnodes * sizeof(void*));
+  jp->post_cache_size = 0;
+  for (lidx = 0; lidx < lst_size(traversal); lidx++) {
+    TreeNode *node = lst_get_ptr(traversal, lidx);
+    if (node->lchild == NULL) 
+      jp->maxsubst[node->id] = 0;
+    else 
+      jp->maxsubst[node->id] = 
+        max(jp->maxsubst[node->lchild->id] + 
+            jp->branch_distrib[node->lchild->id][0]->ncols - 1, 
+            jp->maxsubst[node->rchild->id] + 
+            jp->branch_distrib[node->rchild->id][0]->ncols - 1);
+    jp->post_work[node->id] = mat_new(size, jp->maxsubst[node->id] + 1);
+    jp->post_cache[node->id] = lst_new_ptr(100);
+    jp->post_pattern_ids[node->id] = hsh_new(100);
+    if (jp->maxsubst[node->id] > maxall) maxall = jp->maxsubst[node->id];
+  }
+  jp->post_left = mat_new(size, maxall + 1);
+  jp->post_right = mat_new(size, maxall + 1);
+}
+
 void sub_free_jump_process(JumpProcess *jp) {
   int i, j;
+  free_posterior_workspace(jp);
   for (i = 0; i < jp->R->nrows; i++)
     mat_free(jp->A[i]);
   sfree(jp->A);
@@ -167,6 +237,7 @@ void sub_free_jump_process(JumpProcess *jp) {
    branch lengths change).  This version allows for scale factors */
 void sub_recompute_conditionals(JumpProcess *jp) {
   int i, j;
+  free_posterior_workspace(jp); /* sizes may change */
   for (i = 0; i < jp->mod->tree->nnodes; i++) {
     TreeNode *n = lst_get_ptr(jp->mod->tree->nodes, i);
     if (n != jp->mod->tree) {
@@ -260,92 +331,165 @@ Vector *sub_prior_distrib_site(JumpProcess *jp) {
   return sub_distrib_branch(jp, tr_total_len(jp->mod->tree));
 }
 
-/* compute and return a probability vector giving the posterior
-   distribution over the number of substitutions per site given a tree
-   model and alignment column */
-Vector *sub_posterior_distrib_site(JumpProcess *jp, MSA *msa, int tuple_idx) {
-  int lidx, n, i, j, k, a, b, c;
-  Matrix **L = smalloc(jp->mod->tree->nnodes * sizeof(void*));
+/* compute jp->post_L for every node of the tree (or every node but
+   the root, if skip_root == TRUE), for tuple tuple_idx of msa or, if
+   msa is NULL, for missing data at every leaf.
+   jp->post_L[node->id]->data[a][n] is the joint probability of n
+   substitutions and the data beneath node, given that node has label
+   a.  This depends only on the pattern of characters at the leaves
+   beneath node, so, as with site repeats in the pruning algorithm,
+   distributions are cached by pattern and reused for later tuples.
+   Patterns are numbered per node: a leaf's pattern is its state (with
+   missing data and gaps sharing one number) and an internal node's
+   pattern is determined by those of its children.  The root is never
+   cached, since no other distribution depends on it */
+static void node_distribs(JumpProcess *jp, MSA *msa, int tuple_idx,
+                          int skip_root) {
+  int lidx, n, i, j, k, a, b, c, pat;
   List *traversal = tr_postorder(jp->mod->tree);
   int size = jp->mod->rate_matrix->size;
-  Vector *retval;
-  int *maxsubst = smalloc(jp->mod->tree->nnodes * sizeof(int));
-
-  if (jp->mod->order != 0)
-    die("ERROR sub_posterior_distrib_site: jp->mod->order=%i, should be 0\n",
-	jp->mod->order);
-  if (msa->ss == NULL)
-    die("ERROR sub_posterior_distrib_size: msa->ss is NULL\n");
-
-  if (jp->mod->msa_seq_idx == NULL)
-    tm_build_seq_idx(jp->mod, msa);
+  Matrix **L = jp->post_L;
+  int *maxsubst = jp->maxsubst; /* max no. subst. beneath each node */
+  int *pattern = jp->post_pattern;
+  double sum;
+  char key[30];
 
   for (lidx = 0; lidx < lst_size(traversal); lidx++) {
     TreeNode *node = lst_get_ptr(traversal, lidx);
 
-    L[node->id] = mat_new(size, 500);
-    mat_zero(L[node->id]);
-    /* L[node->id]->[a][n] is the joint probability of n substitutions
-       and the data beneath node, given that node has label a */
-
     if (node->lchild == NULL) {    /* leaf -- base case */
-      char c;
+      char c = GAP_CHAR;
 
-      if (jp->mod->msa_seq_idx[node->id] < 0)
-        die("ERROR: no match for leaf '%s' in alignment.\n", node->name);
-
-      c = ss_get_char_tuple(msa, tuple_idx, 
-                                 jp->mod->msa_seq_idx[node->id], 0);
-      if (msa->is_missing[(int)c] || c == GAP_CHAR)
+      if (msa != NULL) {
+        if (jp->mod->msa_seq_idx[node->id] < 0)
+          die("ERROR: no match for leaf '%s' in alignment.\n", node->name);
+        c = ss_get_char_tuple(msa, tuple_idx, 
+                              jp->mod->msa_seq_idx[node->id], 0);
+      }
+      L[node->id] = jp->post_work[node->id];
+      if (msa == NULL || msa->is_missing[(int)c] || c == GAP_CHAR) {
         for (a = 0; a < size; a++)
           L[node->id]->data[a][0] = 1;
+        pattern[node->id] = size;
+      }
       else {
         if (msa->inv_alphabet[(int)c] < 0)
           die("ERROR: bad character in alignment ('%c')\n", c);
+        for (a = 0; a < size; a++)
+          L[node->id]->data[a][0] = 0;
         L[node->id]->data[msa->inv_alphabet[(int)c]][0] = 1;
+        pattern[node->id] = msa->inv_alphabet[(int)c];
       }
-
-      maxsubst[node->id] = 0;	/* max no. subst. beneath node */
     }
     
     else {            /* internal node -- recursive case */
-
       Matrix **d_left = jp->branch_distrib[node->lchild->id];
       Matrix **d_right = jp->branch_distrib[node->rchild->id];
+      Matrix *Ll = L[node->lchild->id], *Lr = L[node->rchild->id], *dest;
+      double **left = jp->post_left->data, **right = jp->post_right->data;
+      int nmax = maxsubst[node->id];
+
+      if (node == jp->mod->tree && skip_root) continue;
+
+      /* look for a cached distribution; failing that, decide where to
+         put the new one */
+      pat = -1;
+      dest = jp->post_work[node->id];
+      if (node != jp->mod->tree && pattern[node->lchild->id] >= 0 &&
+          pattern[node->rchild->id] >= 0) {
+        sprintf(key, "%d,%d", pattern[node->lchild->id],
+                pattern[node->rchild->id]);
+        pat = hsh_get_int(jp->post_pattern_ids[node->id], key);
+        if (pat >= 0) {
+          pattern[node->id] = pat;
+          L[node->id] = lst_get_ptr(jp->post_cache[node->id], pat);
+          continue;
+        }
+        if (jp->post_cache_size + size * (nmax + 1) <=
+            POST_CACHE_MAX_DOUBLES) {
+          pat = lst_size(jp->post_cache[node->id]);
+          dest = mat_new(size, nmax + 1);
+          lst_push_ptr(jp->post_cache[node->id], dest);
+          hsh_put_int(jp->post_pattern_ids[node->id], key, pat);
+          jp->post_cache_size += size * (nmax + 1);
+        }
+      }
+      pattern[node->id] = pat;
+      L[node->id] = dest;
+
+      checkInterrupt();
+
+      /* The number of substitutions on the left (j) and right (n-j)
+         sides are independent given the label a of node, so first
+         compute, for each a, the distribution of j on the left,
+         left[a][j] = sum_b sum_i Ll[b][i] * d_left[a][b][j-i], and
+         likewise for the right, then convolve them.  Each of these
+         depends only on (a, j), so there is no need to recompute it
+         for every total n */
+      for (j = 0; j <= nmax; j++) {
+        int min_i, max_i;
+        /* i goes from 0 to j, but we can trim off extreme vals */
+        min_i = max(0, j - d_left[0]->ncols + 1);
+        max_i = min(j, maxsubst[node->lchild->id]);
+        for (a = 0; a < size; a++) {
+          sum = 0;
+          for (b = 0; b < size; b++) 
+            for (i = min_i; i <= max_i; i++) 
+              sum += Ll->data[b][i] * d_left[a]->data[b][j-i];
+          left[a][j] = sum;
+        }
+      }
 
-      maxsubst[node->id] = max(maxsubst[node->lchild->id] + d_left[0]->ncols - 1, 
-                               maxsubst[node->rchild->id] + d_right[0]->ncols - 1);
-
-      for (n = 0; n <= maxsubst[node->id]; n++) {
-	checkInterruptN(n, 10);
-        for (j = 0; j <= n; j++) {
-          int min_i, max_i, min_k, max_k;
-          min_i = max(0, j - d_left[0]->ncols + 1);
-          max_i = min(j, maxsubst[node->lchild->id]);
-          min_k = max(0, n - j - d_right[0]->ncols + 1);
-          max_k = min(n - j, maxsubst[node->rchild->id]);
-
-          for (a = 0; a < size; a++) {
-            double left = 0, right = 0;
-	    
-            for (b = 0; b < size; b++) 
-              /* i goes from 0 to j, but we can trim off extreme vals */
-              for (i = min_i; i <= max_i; i++) 
-                left += L[node->lchild->id]->data[b][i] * 
-                  d_left[a]->data[b][j-i];
-
-            for (c = 0; c < size; c++) 
-              /* k goes from 0 to n-j, but we can trim off extreme vals */
-              for (k = min_k; k <= max_k; k++) 
-                right += L[node->rchild->id]->data[c][k] * 
-                  d_right[a]->data[c][n-j-k];
-      
-            L[node->id]->data[a][n] += (left * right);
-          }
+      for (j = 0; j <= nmax; j++) {
+        int min_k, max_k;
+        /* k goes from 0 to j, but we can trim off extreme vals */
+        min_k = max(0, j - d_right[0]->ncols + 1);
+        max_k = min(j, maxsubst[node->rchild->id]);
+        for (a = 0; a < size; a++) {
+          sum = 0;
+          for (c = 0; c < size; c++) 
+            for (k = min_k; k <= max_k; k++) 
+              sum += Lr->data[c][k] * d_right[a]->data[c][j-k];
+          right[a][j] = sum;
+        }
+      }
+
+      for (a = 0; a < size; a++) {
+        for (n = 0; n <= nmax; n++) {
+          sum = 0;
+          for (j = 0; j <= n; j++)
+            sum += left[a][j] * right[a][n-j];
+          dest->data[a][n] = sum;
         }
       }
     }
   }
+}
+
+/* compute and return a probability vector giving the posterior
+   distribution over the number of substitutions per site given a tree
+   model and alignment column */
+Vector *sub_posterior_distrib_site(JumpProcess *jp, MSA *msa, int tuple_idx) {
+  int n, a;
+  Matrix **L;
+  int size = jp->mod->rate_matrix->size;
+  Vector *retval;
+  int *maxsubst;
+
+  if (jp->mod->order != 0)
+    die("ERROR sub_posterior_distrib_site: jp->mod->order=%i, should be 0\n",
+	jp->mod->order);
+  if (msa->ss == NULL)
+    die("ERROR sub_posterior_distrib_size: msa->ss is NULL\n");
+
+  if (jp->mod->msa_seq_idx == NULL)
+    tm_build_seq_idx(jp->mod, msa);
+
+  if (jp->post_L == NULL)
+    alloc_posterior_workspace(jp);
+  node_distribs(jp, msa, tuple_idx, FALSE);
+  L = jp->post_L;
+  maxsubst = jp->maxsubst;      /* max no. subst. beneath each node */
 
   retval = vec_new(maxsubst[jp->mod->tree->id] + 1);
   vec_zero(retval);
@@ -360,11 +504,6 @@ Vector *sub_posterior_distrib_site(JumpProcess *jp, MSA *msa, int tuple_idx) {
   for (n = maxsubst[jp->mod->tree->id]; n >= 0 && retval->data[n] < jp->epsilon; n--);
   retval->size = n+1;
 
-  for (lidx = 0; lidx < jp->mod->tree->nnodes; lidx++)
-    mat_free(L[lidx]);
-  sfree(L);
-  sfree(maxsubst);
-
   pv_normalize(retval);
   return retval;
 }
@@ -404,23 +543,104 @@ Vector *sub_posterior_distrib_alignment(JumpProcess *jp, MSA *msa) {
   return retval;
 }
 
+/* number of consecutive tuples handed to a thread at a time by
+   sub_pval_per_site */
+#define TUPLES_PER_JOB 16
+
+/* create a copy of a jump process for use by another thread, sharing
+   the (read-only) jump matrices but with its own branch distributions
+   and workspace, and using the given tree model */
+static JumpProcess *thread_jump_process(JumpProcess *jp, TreeModel *mod) {
+  JumpProcess *cpy = smalloc(sizeof(JumpProcess));
+  int i, j, size = jp->R->nrows;
+  *cpy = *jp;
+  cpy->mod = mod;
+  cpy->maxsubst = NULL;
+  cpy->post_L = NULL;
+  cpy->post_left = cpy->post_right = NULL;
+  cpy->branch_distrib = smalloc(mod->tree->nnodes * sizeof(void*));
+  for (i = 0; i < mod->tree->nnodes; i++) {
+    if (jp->branch_distrib[i] == NULL) {
+      cpy->branch_distrib[i] = NULL;
+      continue;
+    }
+    cpy->branch_distrib[i] = smalloc(size * sizeof(void*));
+    for (j = 0; j < size; j++)
+      cpy->branch_distrib[i][j] = mat_create_copy(jp->branch_distrib[i][j]);
+  }
+  return cpy;
+}
+
+/* free a copy created by thread_jump_process (but not its tree
+   model) */
+static void free_thread_jump_process(JumpProcess *cpy) {
+  int i, j;
+  free_posterior_workspace(cpy);
+  for (i = 0; i < cpy->mod->tree->nnodes; i++) {
+    if (cpy->branch_distrib[i] == NULL) continue;
+    for (j = 0; j < cpy->R->nrows; j++)
+      mat_free(cpy->branch_distrib[i][j]);
+    sfree(cpy->branch_distrib[i]);
+  }
+  sfree(cpy->branch_distrib);
+  sfree(cpy);
+}
+
+/* shared data for computing posterior means and variances in
+   parallel; arrays indexed by thread hold data private to each
+   thread */
+typedef struct {
+  MSA *msa;
+  int fit_model;
+  FILE *logf;
+  JumpProcess **jp;             /* per thread */
+  ColFitData **d;               /* per thread */
+  double *x0, *post_var;
+} PvalSiteData;
+
+static void pval_site_job(void *data, int job, int thread) {
+  PvalSiteData *pd = data;
+  JumpProcess *jp = pd->jp[thread];
+  ColFitData *d = pd->fit_model ? pd->d[thread] : NULL;
+  int tup, end = min(pd->msa->ss->ntuples, (job+1) * TUPLES_PER_JOB);
+  double var, lnl;
+  Vector *post;
+
+  for (tup = job * TUPLES_PER_JOB; tup < end; tup++) {
+    if (pd->fit_model) {        /* estimate scale factor for col */
+      vec_set(d->params, 0, d->init_scale);
+      d->tupleidx = tup;
+      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d, 
+                    &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0], 
+                    pd->logf, NULL, NULL);   
+      jp->mod->scale = d->params->data[0];
+      sub_recompute_conditionals(jp);
+    }
+    post = sub_posterior_distrib_site(jp, pd->msa, tup); 
+    pv_stats(post, &pd->x0[tup], &var);
+    if (pd->post_var != NULL) pd->post_var[tup] = var;
+    vec_free(post);
+  }
+}
+
 /* compute individual site p-values, one per tuple.  If post_mean, and
    post_var are non-NULL, also return tuple-by-tuple mean and variance
    of posterior.  If prior_mean and prior_var are non-NULL, return
    mean and variance of the prior, which will be the same for all
    sites.  Returned array, post_mean, and post_var should have
    dimension msa->ss->ntuples; prior_mean and prior_var should be
-   pointers to individual doubles */
+   pointers to individual doubles.  Posterior distributions are
+   computed in parallel using nthreads threads (one if logf is
+   non-NULL) */
 void sub_pval_per_site(JumpProcess *jp, MSA *msa, mode_type mode,
                        int fit_model, double *prior_mean, double *prior_var, 
                        double *pvals, double *post_mean, double *post_var,
-                       FILE *logf) { 
-  int tup;
-  double var, lnl;
+                       FILE *logf, int nthreads) { 
+  int tup, t, nthr;
   Vector *prior = sub_prior_distrib_site(jp);
-  Vector *post;
   double *x0; /* array of posterior means; used for p-value computation */
-  ColFitData *d=NULL;
+  ThreadPool *pool = thr_pool_new(logf == NULL ? nthreads : 1);
+  PvalSiteData pd;
 
   if (post_mean != NULL)
     x0 = post_mean;             /* just reuse post_mean in this case */
@@ -430,24 +650,47 @@ void sub_pval_per_site(JumpProcess *jp, MSA *msa, mode_type mode,
   if (prior_mean != NULL && prior_var != NULL) 
     pv_stats(prior, prior_mean, prior_var);
 
-  if (fit_model) 
-    d = col_init_fit_data(jp->mod, msa, ALL, NNEUT, FALSE);
-  
-  for (tup = 0; tup < msa->ss->ntuples; tup++) {
-    if (fit_model) {            /* estimate scale factor for col */
-      vec_set(d->params, 0, d->init_scale);
-      d->tupleidx = tup;
-      opt_newton_1d(col_likelihood_wrapper_1d, &d->params->data[0], d, 
-                    &lnl, SIGFIGS, d->lb->data[0], d->ub->data[0], 
-                    logf, NULL, NULL);   
-      jp->mod->scale = d->params->data[0];
-      sub_recompute_conditionals(jp);
+  if (jp->mod->msa_seq_idx == NULL)
+    tm_build_seq_idx(jp->mod, msa);
+
+  /* set up per-thread jump processes (and, if fitting, tree models);
+     done serially because tree traversals are cached lazily */
+  nthr = thr_pool_size(pool);
+  pd.msa = msa;
+  pd.fit_model = fit_model;
+  pd.logf = logf;
+  pd.x0 = x0;
+  pd.post_var = post_var;
+  pd.jp = smalloc(nthr * sizeof(JumpProcess*));
+  pd.d = smalloc(nthr * sizeof(ColFitData*));
+  for (t = 0; t < nthr; t++) {
+    TreeModel *mod = jp->mod;
+    if (t > 0 && fit_model) {
+      mod = tm_create_copy(jp->mod);
+      mod->lik_cache = NULL;    /* caches are not thread safe */
+      tr_postorder(mod->tree);
+      tr_preorder(mod->tree);
     }
-    post = sub_posterior_distrib_site(jp, msa, tup); 
-    pv_stats(post, &x0[tup], &var);
-    if (post_var != NULL) post_var[tup] = var;
-    vec_free(post);
-  }  
+    pd.jp[t] = (t == 0 ? jp : thread_jump_process(jp, mod));
+    pd.d[t] = fit_model ? col_init_fit_data(mod, msa, ALL, NNEUT, FALSE) :
+      NULL;
+  }
+
+  thr_foreach(pool, (msa->ss->ntuples + TUPLES_PER_JOB - 1) / TUPLES_PER_JOB,
+              pval_site_job, &pd);
+
+  for (t = 0; t < nthr; t++) {
+    if (fit_model) col_free_fit_data(pd.d[t]);
+    if (t > 0) {
+      TreeModel *mod = pd.jp[t]->mod;
+      free_thread_jump_process(pd.jp[t]);
+      if (fit_model) tm_free(mod);
+    }
+  }
+  sfree(pd.jp);
+  sfree(pd.d);
+  thr_pool_free(pool);
+
   if (pvals != NULL) {
     if (mode == NNEUT) {
       pv_p_values(prior, x0, msa->ss->ntuples, pvals, TWOTAIL);
@@ -482,7 +725,6 @@ void sub_pval_per_site(JumpProcess *jp, MSA *msa, mode_type mode,
   if (post_mean == NULL) sfree(x0);
   vec_free(prior);
   if (fit_model) {
-    col_free_fit_data(d);
     jp->mod->scale = 1;
     sub_recompute_conditionals(jp); /* in case needed again */
   }
@@ -542,7 +784,7 @@ void sub_pval_per_site_subtree(JumpProcess *jp, MSA *msa, mode_type mode,
       vec_set(d->params, 1, d->init_scale_sub);
       d->tupleidx = tup;
       if (opt_bfgs(col_likelihood_wrapper, d->params, d, &lnl, d->lb, 
-                   d->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL) != 0)
+                   d->ub, logf, NULL, OPT_HIGH_PREC, NULL, NULL, NULL) != 0)
         ;                       /* do nothing; warning will be
                                    produced if problem */
       jp->mod->scale = d->params->data[0];
@@ -644,14 +886,13 @@ void sub_posterior_stats_alignment(JumpProcess *jp, MSA *msa,
    probability of n1 substitutions in the left subtree and n2
    substitutions in the right subtree  */
 Matrix *sub_joint_distrib_site(JumpProcess *jp, MSA *msa, int tuple_idx) {
-  int lidx, n, i, j, k, a, b, c, n1, n2, n1_max = 0, n2_max = 0, done;
-  Matrix **L = smalloc(jp->mod->tree->nnodes * sizeof(void*));
-  List *traversal = tr_postorder(jp->mod->tree);
+  int i, a, b, n1, n2, n1_max, n2_max, done;
+  Matrix **L;
   int size = jp->mod->rate_matrix->size;
-  Matrix *retval;
+  Matrix *retval, *Ll, *Lr;
   Matrix **d_left, **d_right;
   double sum;
-  int *maxsubst = smalloc(jp->mod->tree->nnodes * sizeof(int));
+  int *maxsubst;
 
   if (jp->mod->order != 0)
     die("ERROR sub_joint_distrib_site: jp->mod->Order should be 0, is %i\n",
@@ -660,92 +901,36 @@ Matrix *sub_joint_distrib_site(JumpProcess *jp, MSA *msa, int tuple_idx) {
   if (msa != NULL && jp->mod->msa_seq_idx == NULL)
     tm_build_seq_idx(jp->mod, msa);
 
-  for (lidx = 0; lidx < lst_size(traversal); lidx++) {
-    TreeNode *node = lst_get_ptr(traversal, lidx);
-    checkInterrupt();
-
-    L[node->id] = mat_new(size, 500);
-    mat_zero(L[node->id]);
-    /* L[node->id]->[a][n] is the joint probability of n substitutions
-       and the data beneath node, given that node has label a */
-
-    if (node->lchild == NULL) {    /* leaf -- base case */
-      char c;
-      if (msa != NULL) {
-        if (jp->mod->msa_seq_idx[node->id] < 0)
-          die("ERROR: no match for leaf '%s' in alignment.\n", node->name);
-        c = ss_get_char_tuple(msa, tuple_idx, jp->mod->msa_seq_idx[node->id], 0);
-      }
-      if (msa == NULL || msa->is_missing[(int)c] || c == GAP_CHAR)
-        for (a = 0; a < size; a++)
-          L[node->id]->data[a][0] = 1;
-      else {
-        if (msa->inv_alphabet[(int)c] < 0)
-	  die("ERROR sub_joint_distrib_site: msa->inv_alphabet[%c]=%i\n",
-	      c, msa->inv_alphabet[(int)c]);
-        L[node->id]->data[msa->inv_alphabet[(int)c]][0] = 1;
-      }
-
-      maxsubst[node->id] = 0;	/* max no. subst. beneath node */
-    }
-    
-    else {            /* internal node -- recursive case */
-
-      d_left = jp->branch_distrib[node->lchild->id];
-      d_right = jp->branch_distrib[node->rchild->id];
+  /* distributions beneath the two children of the root, computed
+     exactly as in sub_posterior_distrib_site */
+  if (jp->post_L == NULL)
+    alloc_posterior_workspace(jp);
+  node_distribs(jp, msa, tuple_idx, TRUE);
+  L = jp->post_L;
+  maxsubst = jp->maxsubst;      /* max no. subst. beneath each node */
+  Ll = L[jp->mod->tree->lchild->id];
+  Lr = L[jp->mod->tree->rchild->id];
 
-      maxsubst[node->id] = max(maxsubst[node->lchild->id] + d_left[0]->ncols - 1, 
-                               maxsubst[node->rchild->id] + d_right[0]->ncols - 1);
-      
-      if (node == jp->mod->tree) {
-        /* save these for below */
-        n1_max = maxsubst[jp->mod->tree->lchild->id] + d_left[0]->ncols;
-        n2_max = maxsubst[jp->mod->tree->rchild->id] + d_right[0]->ncols;
-      }
-
-      for (n = 0; n <= maxsubst[node->id]; n++) {
-        for (j = 0; j <= n; j++) {	
-          int min_i, max_i, min_k, max_k;
-          min_i = max(0, j - d_left[0]->ncols + 1);
-          max_i = min(j, maxsubst[node->lchild->id]);
-          min_k = max(0, n - j - d_right[0]->ncols + 1);
-          max_k = min(n - j, maxsubst[node->rchild->id]);
-
-          for (a = 0; a < size; a++) {
-            double left = 0, right = 0;
-
-            for (b = 0; b < size; b++) 
-              for (i = min_i; i <= max_i; i++) 
-                left += L[node->lchild->id]->data[b][i] * 
-                  d_left[a]->data[b][j-i];
-
-            for (c = 0; c < size; c++) 
-              for (k = min_k; k <= max_k; k++) 
-                right += L[node->rchild->id]->data[c][k] * 
-                  d_right[a]->data[c][n-j-k];
-      
-            L[node->id]->data[a][n] += (left * right);
-          }
-        }
-      }
-    }
-  }
+  d_left = jp->branch_distrib[jp->mod->tree->lchild->id];
+  d_right = jp->branch_distrib[jp->mod->tree->rchild->id];
+  n1_max = maxsubst[jp->mod->tree->lchild->id] + d_left[0]->ncols;
+  n2_max = maxsubst[jp->mod->tree->rchild->id] + d_right[0]->ncols;
 
   retval = mat_new(n1_max, n2_max);
   mat_zero(retval);
-  d_left = jp->branch_distrib[jp->mod->tree->lchild->id];
   sum = 0;
   for (n1 = 0; n1 < n1_max; n1++) {
     for (n2 = 0; n2 < n2_max; n2++) {
+      if (n2 > maxsubst[jp->mod->tree->rchild->id]) continue;
       for (a = 0; a < size; a++) {
         double left = 0;
-        int min_i = max(0, n1 - d_left[a]->ncols + 1);
+        int min_i = max(0, n1 - d_left[a]->ncols + 1),
+          max_i = min(n1, maxsubst[jp->mod->tree->lchild->id]);
         for (b = 0; b < size; b++) 
-          for (i = min_i; i <= n1; i++) 
-            left += L[jp->mod->tree->lchild->id]->data[b][i] * 
-              d_left[a]->data[b][n1-i];
+          for (i = min_i; i <= max_i; i++) 
+            left += Ll->data[b][i] * d_left[a]->data[b][n1-i];
         retval->data[n1][n2] += left * jp->mod->backgd_freqs->data[a] * 
-          L[jp->mod->tree->rchild->id]->data[a][n2];
+          Lr->data[a][n2];
       }
       sum += retval->data[n1][n2];
     }
@@ -769,12 +954,6 @@ Matrix *sub_joint_distrib_site(JumpProcess *jp, MSA *msa, int tuple_idx) {
       }
   mat_resize(retval, n1_max, n2_max);
 
-  for (lidx = 0; lidx < jp->mod->tree->nnodes; lidx++)
-    mat_free(L[lidx]);
-  sfree(L);
-
-  sfree(maxsubst);
-
   pm_normalize(retval);
   return retval;
 }
@@ -1483,9 +1483,9 @@ void tm_set_REV_CODON_matrix(TreeModel *mod, Vector *params, int start_idx) {
   int setup_mapping = (mod->rate_matrix_param_row != NULL &&
 		       lst_size(mod->rate_matrix_param_row[start_idx]) == 0);
   double val;
-  static char *states;
-  static int alph_size=-1;
-  static int **revmat = NULL;
+  static PHAST_TLS char *states;
+  static PHAST_TLS int alph_size=-1;
+  static PHAST_TLS int **revmat = NULL;
 
   if (mod->backgd_freqs == NULL)
     die("tm_set_REV_CODON_matrix: mod->backgd_freqs is NULL\n");
@@ -1554,9 +1554,9 @@ void tm_set_SSREV_CODON_matrix(TreeModel *mod, Vector *params, int start_idx) {
   int setup_mapping = (mod->rate_matrix_param_row != NULL &&
 		       lst_size(mod->rate_matrix_param_row[start_idx]) == 0);
   double val;
-  static char *states;
-  static int alph_size=-1;
-  static int **revmat = NULL;
+  static PHAST_TLS char *states;
+  static PHAST_TLS int alph_size=-1;
+  static PHAST_TLS int **revmat = NULL;
 
   if (mod->backgd_freqs == NULL)
     die("tm_set_SSREV_CODON_matrix: mod->backgd_freqs is NULL\n");
@@ -2671,7 +2671,7 @@ void tm_selection_bgc_codon(MarkovMatrix *mm,
   int i, j, k, ni, nj, codi[3], codj[3], whichdif, bgc_idx,
     alph_size = (int)strlen(mm->states), chartype[5];
   double sum, val, sbfactor[2][3], factor;
-  static char *codon_mapping, *alphabet=NULL;
+  static PHAST_TLS char *codon_mapping, *alphabet=NULL;
 
   tm_bgc_assign_chartype(chartype, mm->states);
   if (alphabet != NULL && strcmp(alphabet, mm->states) != 0) {
@@ -15,6 +15,7 @@
 #include <phast/subst_mods.h>
 #include <phast/dgamma.h>
 #include <phast/sufficient_stats.h>
+#include <phast/tuple_lik_cache.h>
 
 /* Computation of likelihoods for columns of a given multiple
    alignment, according to a given tree model.  */
@@ -31,33 +32,85 @@ int tuple_index_missing_data(char *tuple, int *inv_alph, int *is_missing,
 
 
 
-/* Compute the likelihood of a tree model with respect to an
-   alignment.  Optionally retain column-by-column likelihoods,
-   optionally compute posterior probabilities.  If 'post' is NULL, no
-   posterior probabilities (or related quantities) will be computed.
-   If 'post' is non-NULL each of its attributes must either be NULL or
-   previously allocated to the required size. */
-double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
-                                 double *col_scores, double *tuple_scores,
-				 int cat, TreePosteriors *post) {
+/* Set up the sufficient statistics, leaf-to-sequence mapping,
+   substitution matrices, and IUPAC mapping needed to compute the
+   likelihood of mod, if they are not already available, and check
+   arguments */
+static void prepare_likelihood(TreeModel *mod, MSA *msa, double *col_scores,
+                               int cat) {
+  int i, j, defined;
+  int alph_size = (int)strlen(mod->rate_matrix->states);
+
+  /* create IUPAC mapping if needed */
+  if (mod->iupac_inv_map == NULL)
+    mod->iupac_inv_map = build_iupac_inv_map(mod->rate_matrix->inv_states,
+                                             alph_size);
 
+  if (cat > msa->ncats)
+    die("ERROR tl_compute_log_likelihood: cat (%i) > msa->ncats (%i)\n", cat, msa->ncats);
+
+  if (!(cat < 0 || col_scores == NULL || msa->categories != NULL))
+    die("ERROR tl_compute_log_likelihood: cat=%i, col_scores==NULL=%i, msa->categories==NULL=%i\n", cat, col_scores==NULL, msa->categories==NULL);
+  /* if using categories and col-by-col
+     scoring, then must have col-by-col
+     categories */
+
+  /* obtain sufficient statistics, if necessary */
+  if (msa->ss != NULL){
+    if (msa->ss->tuple_size <= mod->order)
+      die("ERROR tl_compute_log_likelihood: tuple_size (%i) must be greater than mod->order (%i)\n",
+	  msa->ss->tuple_size, mod->order);
+  }
+  else
+    ss_from_msas(msa, mod->order+1, col_scores == NULL ? 0 : 1,
+                 NULL, NULL, NULL, -1, subst_mod_is_codon_model(mod->subst_mod));
+
+  /* set up leaf to sequence mapping, if necessary */
+  if (mod->msa_seq_idx == NULL)
+    tm_build_seq_idx(mod, msa);
+
+  /* set up prob matrices, if any are undefined */
+  for (i = 0, defined = TRUE; defined && i < mod->tree->nnodes; i++) {
+    if (((TreeNode*)lst_get_ptr(mod->tree->nodes, i))->parent == NULL)
+      continue;  		/* skip root */
+    for (j = 0; j < mod->nratecats; j++)
+      if (mod->P[i][j] == NULL) defined = FALSE;
+  }
+/*   printf("mod %d\n", mod); */
+  if (!defined) {
+    tm_set_subst_matrices(mod);
+  }
+}
+
+/* Compute the log (base 2) likelihood of the tuples first_tuple,
+   ..., last_tuple-1 (see tl_compute_log_likelihood; assumes
+   prepare_likelihood has been called).  Any expected counts in post
+   are summed over these tuples only; curr_tuple_scores (if non-NULL) is
+   filled in for these tuples only.  Reads but does not alter mod when
+   post is non-NULL, so can be called concurrently for disjoint
+   ranges of tuples with separate expected-count buffers */
+static double compute_log_likelihood(TreeModel *mod, MSA *msa,
+                                     double *curr_tuple_scores, int cat,
+                                     TreePosteriors *post, int first_tuple,
+                                     int last_tuple) {
   int i, j;
   double retval = 0;
   int nstates = mod->rate_matrix->size;
   int alph_size = (int)strlen(mod->rate_matrix->states);
   int npasses = (mod->order > 0 && mod->use_conditionals == 1 ? 2 : 1);
-  int pass, col_offset, k, nodeidx, rcat, /* colidx, */ tupleidx, defined;
+  int pass, col_offset, k, nodeidx, rcat, /* colidx, */ tupleidx;
   TreeNode *n;
   double total_prob, marg_tot;
   List *traversal;
   double **inside_joint = NULL, **inside_marginal = NULL,
     **outside_joint = NULL, **outside_marginal = NULL,
     ****subst_probs = NULL;
-  double *curr_tuple_scores=NULL;
   double rcat_prob[mod->nratecats];
   double tmp[nstates];
-
-  checkInterrupt();
+  double *cached_prob;
+  int use_cache = (mod->lik_cache != NULL && post == NULL && npasses == 1);
+  char cache_key[TLC_FPRINT_LEN + (mod->order+1) * mod->tree->nnodes + 1];
+  tlc_fprint fprint = 0;
 
   /* allocate memory */
   inside_joint = (double**)smalloc(nstates * sizeof(double*));
@@ -93,54 +146,11 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
     }
   }
 
-  /* create IUPAC mapping if needed */
-  if (mod->iupac_inv_map == NULL)
-    mod->iupac_inv_map = build_iupac_inv_map(mod->rate_matrix->inv_states,
-                                             alph_size);
-
-
-  if (cat > msa->ncats)
-    die("ERROR tl_compute_log_likelihood: cat (%i) > msa->ncats (%i)\n", cat, msa->ncats);
-
-  if (!(cat < 0 || col_scores == NULL || msa->categories != NULL))
-    die("ERROR tl_compute_log_likelihood: cat=%i, col_scores==NULL=%i, msa->categories==NULL=%i\n", cat, col_scores==NULL, msa->categories==NULL);
-  /* if using categories and col-by-col
-     scoring, then must have col-by-col
-     categories */
-
-  /* obtain sufficient statistics, if necessary */
-  if (msa->ss != NULL){
-    if (msa->ss->tuple_size <= mod->order)
-      die("ERROR tl_compute_log_likelihood: tuple_size (%i) must be greater than mod->order (%i)\n",
-	  msa->ss->tuple_size, mod->order);
-  }
-  else
-    ss_from_msas(msa, mod->order+1, col_scores == NULL ? 0 : 1,
-                 NULL, NULL, NULL, -1, subst_mod_is_codon_model(mod->subst_mod));
-
-  /* set up leaf to sequence mapping, if necessary */
-  if (mod->msa_seq_idx == NULL)
-    tm_build_seq_idx(mod, msa);
-
-  /* set up prob matrices, if any are undefined */
-  for (i = 0, defined = TRUE; defined && i < mod->tree->nnodes; i++) {
-    if (((TreeNode*)lst_get_ptr(mod->tree->nodes, i))->parent == NULL)
-      continue;  		/* skip root */
-    for (j = 0; j < mod->nratecats; j++)
-      if (mod->P[i][j] == NULL) defined = FALSE;
-  }
-/*   printf("mod %d\n", mod); */
-  if (!defined) {
-    tm_set_subst_matrices(mod);
-  }
-  if (col_scores != NULL && tuple_scores == NULL)
-    curr_tuple_scores = (double*)smalloc(msa->ss->ntuples * sizeof(double));
-  else if (tuple_scores != NULL)
-    curr_tuple_scores = tuple_scores;
-  if (curr_tuple_scores != NULL)
-    for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++)
-      curr_tuple_scores[tupleidx] = 0;
-
+  /* cached values are only used for plain likelihood computations;
+     posteriors and conditional probabilities require the full
+     inside/outside recursions */
+  if (use_cache)
+    fprint = tlc_fingerprint(mod);
   if (post != NULL && post->expected_nsubst_tot != NULL) {
     for (rcat = 0; rcat < mod->nratecats; rcat++)
       for (i = 0; i < nstates; i++)
@@ -152,7 +162,7 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
     for (rcat = 0; rcat < mod->nratecats; rcat++)
       post->rcat_expected_nsites[rcat] = 0;
 
-  for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++) {
+  for (tupleidx = first_tuple; tupleidx < last_tuple; tupleidx++) {
     int skip_fels = FALSE;
 
     if ((cat >= 0 && msa->ss->cat_counts[cat][tupleidx] == 0) ||
@@ -179,7 +189,19 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
       if (ninform < 2) skip_fels = TRUE;
     }
 
-    if (!skip_fels) {
+    cached_prob = NULL;
+    if (use_cache && !skip_fels) {
+      tlc_make_key(cache_key, fprint, mod, msa, tupleidx);
+      cached_prob = tlc_get(mod->lik_cache, cache_key, mod->nratecats);
+    }
+
+    if (cached_prob != NULL) {
+      for (rcat = 0; rcat < mod->nratecats; rcat++) {
+        rcat_prob[rcat] = cached_prob[rcat];
+        total_prob += rcat_prob[rcat];
+      }
+    }
+    else if (!skip_fels) {
       for (pass = 0; pass < npasses; pass++) {
         double **pL = (pass == 0 ? inside_joint : inside_marginal);
         double **pLbar = (pass == 0 ? outside_joint : outside_marginal);
@@ -381,6 +403,8 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
           }
         } /* for rcat */
       } /* for pass */
+      if (use_cache)
+        tlc_put(mod->lik_cache, cache_key, rcat_prob, mod->nratecats);
     } /* if skip_fels */
 
       /* compute posterior prob of each rate cat and related quantities */
@@ -452,6 +476,47 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
   sfree(outside_joint);
   if (mod->order > 0) sfree(inside_marginal);
   if (mod->order > 0 && post != NULL) sfree(outside_marginal);
+  if (post != NULL) {
+    for (rcat = 0; rcat < mod->nratecats; rcat++) {
+      for (j = 0; j < nstates; j++) {
+        for (k = 0; k < nstates; k++)
+          sfree(subst_probs[rcat][j][k]);
+        sfree(subst_probs[rcat][j]);
+      }
+      sfree (subst_probs[rcat]);
+    }
+    sfree(subst_probs);
+  }
+  return(retval);
+}
+
+/* Compute the likelihood of a tree model with respect to an
+   alignment.  Optionally retain column-by-column likelihoods,
+   optionally compute posterior probabilities.  If 'post' is NULL, no
+   posterior probabilities (or related quantities) will be computed.
+   If 'post' is non-NULL each of its attributes must either be NULL or
+   previously allocated to the required size. */
+double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
+                                 double *col_scores, double *tuple_scores,
+				 int cat, TreePosteriors *post) {
+  int i, tupleidx;
+  double retval;
+  double *curr_tuple_scores=NULL;
+
+  checkInterrupt();
+  prepare_likelihood(mod, msa, col_scores, cat);
+
+  if (col_scores != NULL && tuple_scores == NULL)
+    curr_tuple_scores = (double*)smalloc(msa->ss->ntuples * sizeof(double));
+  else if (tuple_scores != NULL)
+    curr_tuple_scores = tuple_scores;
+  if (curr_tuple_scores != NULL)
+    for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++)
+      curr_tuple_scores[tupleidx] = 0;
+
+  retval = compute_log_likelihood(mod, msa, curr_tuple_scores, cat, post,
+                                  0, msa->ss->ntuples);
+
   if (col_scores != NULL) {
     if (cat >= 0)
       for (i = 0; i < msa->length; i++)
@@ -463,18 +528,265 @@ double tl_compute_log_likelihood(TreeModel *mod, MSA *msa,
         col_scores[i] = curr_tuple_scores[msa->ss->tuple_idx[i]];
     if (tuple_scores == NULL) sfree(curr_tuple_scores);
   }
-  if (post != NULL) {
-    for (rcat = 0; rcat < mod->nratecats; rcat++) {
-      for (j = 0; j < nstates; j++) {
-        for (k = 0; k < nstates; k++)
-          sfree(subst_probs[rcat][j][k]);
-        sfree(subst_probs[rcat][j]);
+  return(retval);
+}
+
+
+/* data shared by the jobs of tl_compute_log_likelihood_blocks */
+typedef struct {
+  TreeModel *mod;
+  MSA *msa;
+  int cat, nblocks;
+  TreePosteriors *post;         /* block posteriors (shallow copies) */
+  double *ll;                   /* log likelihood of each block */
+} LikBlockData;
+
+static void lik_block(void *data, int b, int thread) {
+  LikBlockData *d = data;
+  int ntuples = d->msa->ss->ntuples;
+  d->ll[b] = compute_log_likelihood(d->mod, d->msa, NULL, d->cat,
+                                    &d->post[b],
+                                    (int)((long)b * ntuples / d->nblocks),
+                                    (int)((long)(b+1) * ntuples /
+                                          d->nblocks));
+}
+
+double tl_compute_log_likelihood_blocks(TreeModel *mod, MSA *msa, int cat,
+                                        TreePosteriors **posts, int nblocks,
+                                        ThreadPool *pool) {
+  int b, rcat, i, j, k, nstates = mod->rate_matrix->size;
+  double retval = 0;
+  TreePosteriors *post = posts[0];
+  LikBlockData d;
+
+  if (nblocks <= 1 || msa->ss == NULL || msa->ss->ntuples < nblocks)
+    return tl_compute_log_likelihood(mod, msa, NULL, NULL, cat, post);
+
+  checkInterrupt();
+  prepare_likelihood(mod, msa, NULL, cat);
+  tr_postorder(mod->tree);      /* traversals are created lazily */
+  tr_preorder(mod->tree);
+
+  d.mod = mod;
+  d.msa = msa;
+  d.cat = cat;
+  d.nblocks = nblocks;
+  d.post = smalloc(nblocks * sizeof(TreePosteriors));
+  d.ll = smalloc(nblocks * sizeof(double));
+  for (b = 0; b < nblocks; b++) {
+    d.post[b] = *post;
+    d.post[b].expected_nsubst_tot = posts[b]->expected_nsubst_tot;
+    d.post[b].rcat_expected_nsites = posts[b]->rcat_expected_nsites;
+  }
+  thr_foreach(pool, nblocks, lik_block, &d);
+
+  /* sum over blocks, in order */
+  for (b = 0; b < nblocks; b++) {
+    retval += d.ll[b];
+    if (b == 0) continue;
+    if (post->expected_nsubst_tot != NULL)
+      for (rcat = 0; rcat < mod->nratecats; rcat++)
+        for (i = 0; i < nstates; i++)
+          for (j = 0; j < nstates; j++)
+            for (k = 0; k < mod->tree->nnodes; k++)
+              post->expected_nsubst_tot[rcat][i][j][k] +=
+                posts[b]->expected_nsubst_tot[rcat][i][j][k];
+    if (post->rcat_expected_nsites != NULL)
+      for (rcat = 0; rcat < mod->nratecats; rcat++)
+        post->rcat_expected_nsites[rcat] +=
+          posts[b]->rcat_expected_nsites[rcat];
+  }
+  sfree(d.post);
+  sfree(d.ll);
+  return retval;
+}
+
+
+/* returns TRUE if the leaf partial likelihoods computed for mod0 can
+   be used for mod1 (see tl_compute_log_likelihood_pair) */
+static int share_leaves(TreeModel *mod0, TreeModel *mod1) {
+  int i;
+  if (mod0->order != 0 || mod1->order != 0 ||
+      mod0->lik_cache != NULL || mod1->lik_cache != NULL ||
+      mod0->allow_gaps != mod1->allow_gaps ||
+      mod0->inform_reqd != mod1->inform_reqd ||
+      mod0->rate_matrix->size != mod1->rate_matrix->size ||
+      strcmp(mod0->rate_matrix->states, mod1->rate_matrix->states) != 0 ||
+      mod0->tree->nnodes != mod1->tree->nnodes ||
+      mod0->tree->id != mod1->tree->id)
+    return FALSE;
+  for (i = 0; i < mod0->tree->nnodes; i++) {
+    TreeNode *n0 = lst_get_ptr(mod0->tree->nodes, i),
+      *n1 = lst_get_ptr(mod1->tree->nodes, i);
+    if (n0->id != n1->id ||
+        (n0->lchild == NULL) != (n1->lchild == NULL) ||
+        (n0->lchild != NULL && (n0->lchild->id != n1->lchild->id ||
+                                n0->rchild->id != n1->rchild->id)) ||
+        mod0->msa_seq_idx[n0->id] != mod1->msa_seq_idx[n1->id])
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* make sure substitution matrices are defined (as in
+   tl_compute_log_likelihood) */
+static void ensure_subst_matrices(TreeModel *mod) {
+  int i, j;
+  for (i = 0; i < mod->tree->nnodes; i++) {
+    if (((TreeNode*)lst_get_ptr(mod->tree->nodes, i))->parent == NULL)
+      continue;
+    for (j = 0; j < mod->nratecats; j++)
+      if (mod->P[i][j] == NULL) {
+        tm_set_subst_matrices(mod);
+        return;
       }
-      sfree (subst_probs[rcat]);
+  }
+}
+
+void tl_compute_log_likelihood_pair(TreeModel *mod0, TreeModel *mod1,
+                                    MSA *msa, double *col_scores0,
+                                    double *col_scores1) {
+  int i, j, m, rcat, nodeidx, tupleidx, nnodes;
+  int nstates = mod0->rate_matrix->size;
+  int alph_size = (int)strlen(mod0->rate_matrix->states);
+  TreeModel *mods[2];
+  double *tuple_scores[2], *col_scores[2];
+  double *pL, *leaf_vec;
+  int *leaf_state;
+  List *traversal;
+
+  if (msa->ss == NULL)
+    ss_from_msas(msa, 1, 1, NULL, NULL, NULL, -1,
+                 subst_mod_is_codon_model(mod0->subst_mod));
+  if (mod0->msa_seq_idx == NULL) tm_build_seq_idx(mod0, msa);
+  if (mod1->msa_seq_idx == NULL) tm_build_seq_idx(mod1, msa);
+
+  if (!share_leaves(mod0, mod1)) {
+    tl_compute_log_likelihood(mod0, msa, col_scores0, NULL, -1, NULL);
+    tl_compute_log_likelihood(mod1, msa, col_scores1, NULL, -1, NULL);
+    return;
+  }
+
+  checkInterrupt();
+  mods[0] = mod0; mods[1] = mod1;
+  col_scores[0] = col_scores0; col_scores[1] = col_scores1;
+  nnodes = mod0->tree->nnodes;
+
+  if (mod0->iupac_inv_map == NULL)
+    mod0->iupac_inv_map = build_iupac_inv_map(mod0->rate_matrix->inv_states,
+                                              alph_size);
+  ensure_subst_matrices(mod0);
+  ensure_subst_matrices(mod1);
+
+  /* pL[node*nstates + state] holds inside probabilities; leaf_state
+     is the observed state at each leaf, or -1 if ambiguous, in which
+     case leaf_vec holds its partial likelihoods */
+  pL = smalloc(nnodes * nstates * sizeof(double));
+  leaf_vec = smalloc(nnodes * nstates * sizeof(double));
+  leaf_state = smalloc(nnodes * sizeof(int));
+  for (m = 0; m < 2; m++) {
+    tuple_scores[m] = smalloc(msa->ss->ntuples * sizeof(double));
+    for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++)
+      tuple_scores[m][tupleidx] = 0;
+  }
+  traversal = tr_postorder(mod0->tree);
+
+  for (tupleidx = 0; tupleidx < msa->ss->ntuples; tupleidx++) {
+    int skip_fels = FALSE;
+
+    if (msa->ss->counts[tupleidx] == 0) continue;
+    checkInterruptN(tupleidx, 1000);
+
+    /* gap and informativeness checks (shared) */
+    if (!mod0->allow_gaps)
+      for (j = 0; !skip_fels && j < msa->nseqs; j++)
+        if (ss_get_char_tuple(msa, tupleidx, j, 0) == GAP_CHAR)
+          skip_fels = TRUE;
+    if (!skip_fels && mod0->inform_reqd) {
+      int ninform = 0;
+      for (j = 0; j < msa->nseqs; j++) {
+        if (msa->is_informative != NULL && !msa->is_informative[j])
+          continue;
+        else if (!msa->is_missing[(int)ss_get_char_tuple(msa, tupleidx, j, 0)])
+          ninform++;
+      }
+      if (ninform < 2) skip_fels = TRUE;
+    }
+    if (skip_fels) {
+      tuple_scores[0][tupleidx] = tuple_scores[1][tupleidx] = log2(0);
+      continue;
+    }
+
+    /* leaf lookups (shared) */
+    for (nodeidx = 0; nodeidx < nnodes; nodeidx++) {
+      TreeNode *n = lst_get_ptr(mod0->tree->nodes, nodeidx);
+      char thischar;
+      int observed_state;
+      if (n->lchild != NULL) continue;
+      if (mod0->msa_seq_idx[n->id] < 0)
+        die("ERROR tl_compute_log_likelihood_pair: expected a leaf node\n");
+      thischar = ss_get_char_tuple(msa, tupleidx, mod0->msa_seq_idx[n->id], 0);
+      observed_state = mod0->rate_matrix->inv_states[(int)thischar];
+      leaf_state[n->id] = observed_state;
+      if (observed_state < 0) {
+        int *iupac_prob = mod0->iupac_inv_map[(int)thischar];
+        for (i = 0; i < nstates; i++)
+          leaf_vec[n->id * nstates + i] =
+            (iupac_prob != NULL ? iupac_prob[i] : 1);
+      }
+    }
+
+    for (m = 0; m < 2; m++) {
+      TreeModel *mod = mods[m];
+      double total_prob = 0;
+      for (rcat = 0; rcat < mod->nratecats; rcat++) {
+        double rcat_prob = 0;
+        for (nodeidx = 0; nodeidx < lst_size(traversal); nodeidx++) {
+          TreeNode *n = lst_get_ptr(traversal, nodeidx), *child[2];
+          double *tot, totc[2][nstates];
+          int c;
+          if (n->lchild == NULL) continue;
+          child[0] = n->lchild;
+          child[1] = n->rchild;
+          for (c = 0; c < 2; c++) {
+            MarkovMatrix *P = mod->P[child[c]->id][rcat];
+            tot = totc[c];
+            if (child[c]->lchild == NULL && leaf_state[child[c]->id] >= 0) {
+              int s = leaf_state[child[c]->id];
+              for (i = 0; i < nstates; i++)
+                tot[i] = mm_get(P, i, s);
+            }
+            else {
+              double *cL = (child[c]->lchild == NULL ? leaf_vec : pL) +
+                child[c]->id * nstates;
+              for (i = 0; i < nstates; i++) {
+                tot[i] = 0;
+                for (j = 0; j < nstates; j++)
+                  tot[i] += cL[j] * mm_get(P, i, j);
+              }
+            }
+          }
+          for (i = 0; i < nstates; i++)
+            pL[n->id * nstates + i] = totc[0][i] * totc[1][i];
+        }
+        for (i = 0; i < nstates; i++)
+          rcat_prob += vec_get(mod->backgd_freqs, i) *
+            pL[mod->tree->id * nstates + i] * mod->freqK[rcat];
+        total_prob += rcat_prob;
+      }
+      tuple_scores[m][tupleidx] = log2(total_prob);
     }
-    sfree(subst_probs);
   }
-  return(retval);
+
+  for (m = 0; m < 2; m++) {
+    if (col_scores[m] != NULL)
+      for (i = 0; i < msa->length; i++)
+        col_scores[m][i] = tuple_scores[m][msa->ss->tuple_idx[i]];
+    sfree(tuple_scores[m]);
+  }
+  sfree(pL);
+  sfree(leaf_vec);
+  sfree(leaf_state);
 }
 
 /* this is retained for possible use in the future; not using weight
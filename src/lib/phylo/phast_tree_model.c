@@ -17,6 +17,7 @@
 #include <phast/numerical_opt.h>
 #include <phast/markov_matrix.h>
 #include <phast/tree_likelihoods.h>
+#include <phast/thread_pool.h>
 #include <time.h>
 #include <sys/time.h>
 #include <phast/sufficient_stats.h>
@@ -53,6 +54,17 @@
 double tm_likelihood_wrapper(Vector *params, void *data);
 double tm_multi_likelihood_wrapper(Vector *params, void *data);
 
+/* data for tm_multi_likelihood_wrapper */
+typedef struct {
+  int nmod;
+  TreeModel **mods;             /* models to evaluate (private copies
+                                   if the pool has more than one
+                                   thread) */
+  double *ll;                   /* likelihood of each model */
+  Vector *params;               /* parameters being evaluated */
+  ThreadPool *pool;
+} MultiLikData;
+
 
 /* tree == NULL implies weight matrix (most other params ignored in
    this case) */
@@ -163,7 +175,10 @@ TreeModel *tm_new(TreeNode *tree, MarkovMatrix *rate_matrix,
   tm->eqfreq_sym = (tm->subst_mod == SSREV);
   tm->bound_arg = NULL;
   tm->scale_during_opt = 0;
+  tm->opt_method = OPT_BFGS;
   tm->iupac_inv_map = NULL;
+  tm->lik_cache = NULL;
+  tm->ckpt = NULL;
   return tm;
 }
 
@@ -640,10 +655,11 @@ void tm_print(FILE *F, TreeModel *tm) {
  */
 TreeModel *tm_create_copy(TreeModel *src) {
   TreeModel *retval;
-  Vector *freqs = vec_new(src->backgd_freqs->size);
+  Vector *freqs = NULL;         /* may not yet be estimated */
   int i, j, cat;
 
-  vec_copy(freqs, src->backgd_freqs);
+  if (src->backgd_freqs != NULL)
+    freqs = vec_create_copy(src->backgd_freqs);
   retval = tm_new(src->tree != NULL ? tr_create_copy(src->tree) : NULL, 
                   mm_create_copy(src->rate_matrix), freqs, 
                   src->subst_mod, NULL, 
@@ -683,13 +699,15 @@ TreeModel *tm_create_copy(TreeModel *src) {
       retval->ignore_branch[i] = src->ignore_branch[i];
   }
   
-  if (src->empirical_rates) {
+  /* copy rate constants even for discrete gamma models, whose rates
+     are filled out lazily (e.g., by tm_generate_msa) */
+  if (retval->rK != NULL) {
     for (i = 0; i < src->nratecats; i++) {
       retval->rK[i] = src->rK[i];
       retval->freqK[i] = src->freqK[i];
     }
-    retval->empirical_rates = 1;
   }
+  if (src->empirical_rates) retval->empirical_rates = 1;
 
   retval->scale_idx = src->scale_idx;
   retval->bl_idx = src->bl_idx;
@@ -702,6 +720,9 @@ TreeModel *tm_create_copy(TreeModel *src) {
   else retval->noopt_arg = NULL;
   retval->eqfreq_sym = src->eqfreq_sym;
   retval->scale_during_opt = src->scale_during_opt;
+  retval->opt_method = src->opt_method;
+  retval->lik_cache = src->lik_cache;
+  retval->ckpt = NULL;
 
   if (src->all_params != NULL) {
     retval->all_params = vec_create_copy(src->all_params);
@@ -750,9 +771,9 @@ TreeModel *tm_create_copy(TreeModel *src) {
 	}
       }
       else newmod->param_list = NULL;
-      if (newmod->noopt_arg == NULL)
-	currmod->noopt_arg = NULL;
-      else currmod->noopt_arg = str_new_charstr(newmod->noopt_arg->chars);
+      if (currmod->noopt_arg == NULL)
+	newmod->noopt_arg = NULL;
+      else newmod->noopt_arg = str_new_charstr(currmod->noopt_arg->chars);
       lst_push_ptr(retval->alt_subst_mods, (void*)newmod);
     }
   }
@@ -778,9 +799,10 @@ TreeModel *tm_create_copy(TreeModel *src) {
 	}
 	/* Need to find the model for this lineage */
 	for (j = 0; j<lst_size(src->alt_subst_mods); j++) {
-	  if (lst_get_ptr(src->alt_subst_mods, j) == src->alt_subst_mods_ptr[n->id][cat])
+	  if (lst_get_ptr(src->alt_subst_mods, j) == src->alt_subst_mods_ptr[n->id][cat]) {
 	    retval->alt_subst_mods_ptr[n->id][cat] = lst_get_ptr(retval->alt_subst_mods, j);
-	  break;
+	    break;
+	  }
 	}
 	if (j >= lst_size(src->alt_subst_mods))
 	  die("ERROR in tm_create_copy\n");
@@ -1278,11 +1300,91 @@ void tm_mod_freqs(TreeModel *mod, Vector *newfreqs) {
   tm_scale_rate_matrix(mod);
 }
 
+/* number of columns generated together by tm_generate_msa */
+#define SIM_BLOCK_SIZE 4096
+
+/* alias tables (Walker 1977; Vose 1991) for the rows of a
+   probability matrix, allowing a draw from any row in constant time */
+typedef struct {
+  int nrows, size;
+  double *prob;                 /* prob[row*size+i]: probability of
+                                   keeping i */
+  int *alias;                   /* alias[row*size+i]: state taken
+                                   otherwise */
+} AliasTable;
+
+/* build alias tables for the given rows, each of the given size */
+static AliasTable *alias_table_new(double **rows, int nrows, int size) {
+  AliasTable *t = smalloc(sizeof(AliasTable));
+  int *small = smalloc(size * sizeof(int)), *large = smalloc(size * sizeof(int));
+  double *scaled = smalloc(size * sizeof(double));
+  int row, i;
+
+  t->nrows = nrows;
+  t->size = size;
+  t->prob = smalloc(nrows * size * sizeof(double));
+  t->alias = smalloc(nrows * size * sizeof(int));
+  for (row = 0; row < nrows; row++) {
+    double *prob = &t->prob[row*size], sum = 0;
+    int *alias = &t->alias[row*size], nsmall = 0, nlarge = 0;
+
+    for (i = 0; i < size; i++) sum += rows[row][i];
+    if (sum <= 0) {             /* degenerate; behave like pv_draw_idx */
+      for (i = 0; i < size; i++) { prob[i] = 0; alias[i] = size-1; }
+      continue;
+    }
+    for (i = 0; i < size; i++) {
+      scaled[i] = rows[row][i] * size / sum;
+      if (scaled[i] < 1) small[nsmall++] = i;
+      else large[nlarge++] = i;
+    }
+    while (nsmall > 0 && nlarge > 0) {
+      int s = small[--nsmall], l = large[nlarge-1];
+      prob[s] = scaled[s];
+      alias[s] = l;
+      scaled[l] -= 1 - scaled[s];
+      if (scaled[l] < 1) {
+        nlarge--;
+        small[nsmall++] = l;
+      }
+    }
+    /* anything left over is 1 up to rounding error */
+    while (nlarge > 0) { i = large[--nlarge]; prob[i] = 1; alias[i] = i; }
+    while (nsmall > 0) { i = small[--nsmall]; prob[i] = 1; alias[i] = i; }
+  }
+  sfree(small);
+  sfree(large);
+  sfree(scaled);
+  return t;
+}
+
+static void alias_table_free(AliasTable *t) {
+  if (t == NULL) return;
+  sfree(t->prob);
+  sfree(t->alias);
+  sfree(t);
+}
+
+/* draw from the given row using a single uniform, whose integer part
+   selects a column and whose fractional part decides between it and
+   its alias */
+static PHAST_INLINE int alias_draw(AliasTable *t, int row) {
+  double u = rng_unif(NULL) * t->size;
+  int i = (int)u;
+  if (i >= t->size) i = t->size - 1;
+  row *= t->size;
+  return u - i < t->prob[row + i] ? i : t->alias[row + i];
+}
+
 /* Generates an alignment according to set of Tree Models and a
    Markov matrix defing how to transition among them.  TreeModels must
    appear in same order as the states of the Markov matrix. 
    NOTE: call srandom externally.
-   NOTE: only appropriate for order 0 models */
+   NOTE: only appropriate for order 0 models.  Columns are generated
+   in blocks of SIM_BLOCK_SIZE: the classes and rate categories of a
+   block are drawn first, then the states of each node for all columns
+   of the block, visiting nodes in preorder and drawing from alias
+   tables precomputed for every branch and rate category. */
 MSA *tm_generate_msa(int ncolumns, 
                      HMM *hmm,  /* if NULL, single tree model assumed */
                      TreeModel **classmods, 
@@ -1292,10 +1394,13 @@ MSA *tm_generate_msa(int ncolumns,
                                     NULL if hmm is NULL */
                      ) {
 
-  int i, class, nseqs, col, ntreenodes, idx, ratecat;
+  int i, j, k, class, nseqs, ntreenodes, idx, start, nblock, maxcats;
   MSA *msa;
-  int *nodestate;
   char **names, **seqs;
+  int *nodestate, *blockclass, *blockcat;
+  AliasTable **tables, **roottables, *classtable = NULL;
+  char **states;
+  List *traversal;
 
   int nclasses = hmm == NULL ? 1 : hmm->nstates;
   int order=-1;
@@ -1314,6 +1419,7 @@ MSA *tm_generate_msa(int ncolumns,
   ntreenodes = classmods[0]->tree->nnodes; 
 
   nseqs = -1;
+  maxcats = 1;
   for (i = 0; i < nclasses; i++) {
     /* count leaves in tree */
     int num = (classmods[i]->tree->nnodes + 1) / 2;
@@ -1322,6 +1428,8 @@ MSA *tm_generate_msa(int ncolumns,
       DiscreteGamma(classmods[i]->freqK, classmods[i]->rK, 
 		    classmods[i]->alpha, classmods[i]->alpha,
 		    classmods[i]->nratecats, 0);
+    if (classmods[i]->nratecats > maxcats) 
+      maxcats = classmods[i]->nratecats;
 
     if (nseqs == -1) 
       nseqs = num;
@@ -1354,63 +1462,137 @@ MSA *tm_generate_msa(int ncolumns,
     else classmods[0]->msa_seq_idx[i] = -1;
   }
 
-  /* generate sequences, column by column */
+  /* precompute alias tables for the background distribution at the
+     root and for every branch, by class and rate category (indexed
+     [class*maxcats + cat] and [(class*ntreenodes + node)*maxcats +
+     cat], respectively); also record the alphabet used for each */
+  roottables = smalloc(nclasses * maxcats * sizeof(AliasTable*));
+  states = smalloc(nclasses * maxcats * sizeof(char*));
+  tables = smalloc(nclasses * ntreenodes * maxcats * sizeof(AliasTable*));
+  for (i = 0; i < nclasses * ntreenodes * maxcats; i++) tables[i] = NULL;
+  for (class = 0; class < nclasses; class++) {
+    TreeModel *mod = classmods[class];
+    for (k = 0; k < maxcats; k++) {
+      Vector *backgd = NULL;
+      MarkovMatrix *rate_matrix = NULL;
+      AltSubstMod *altmod;
+      roottables[class*maxcats + k] = NULL;
+      if (k >= mod->nratecats) continue;
+      if (mod->alt_subst_mods_ptr != NULL) {
+        altmod = mod->alt_subst_mods_ptr[mod->tree->id][k];
+        if (altmod != NULL) {
+          backgd = altmod->backgd_freqs;
+          rate_matrix = altmod->rate_matrix;
+        }
+      }
+      if (backgd == NULL) {
+        backgd = mod->backgd_freqs;
+        if (backgd == NULL)
+          die("ERROR tm_generate_msa: model's background frequencies are not assigned\n");
+      }
+      if (rate_matrix == NULL)
+        rate_matrix = mod->rate_matrix;
+      roottables[class*maxcats + k] = 
+        alias_table_new(&backgd->data, 1, backgd->size);
+      states[class*maxcats + k] = rate_matrix->states;
+    }
+    for (i = 0; i < mod->tree->nnodes; i++) {
+      TreeNode *n = lst_get_ptr(mod->tree->nodes, i);
+      if (n == mod->tree) continue;
+      for (k = 0; k < mod->nratecats; k++) {
+        MarkovMatrix *P;
+        if (mod->P[n->id][k] == NULL)
+          tm_set_subst_matrices(mod);
+        P = mod->P[n->id][k];
+        tables[(class*ntreenodes + n->id)*maxcats + k] = 
+          alias_table_new(P->matrix->data, P->size, P->size);
+      }
+    }
+  }
+  if (hmm != NULL)
+    classtable = alias_table_new(hmm->transition_matrix->matrix->data,
+                                 hmm->nstates, hmm->nstates);
+
+  /* generate sequences, block by block */
   if (hmm != NULL && hmm->begin_transitions != NULL)
     class = draw_index(hmm->begin_transitions->data, hmm->nstates);
   else
     class = 0;
-  nodestate = (int*)smalloc(ntreenodes * sizeof(int));
-  for (col = 0; col < ncolumns; col++) {
-    List *traversal = tr_preorder(classmods[class]->tree);
-    Vector *backgd=NULL;
-    MarkovMatrix *rate_matrix=NULL;
-    AltSubstMod *altmod=NULL;
-
-    checkInterruptN(col, 1000);
-    if (classmods[class]->nratecats > 1)
-      ratecat = pv_draw_idx_arr(classmods[class]->freqK, classmods[class]->nratecats);
-    else ratecat = 0;
-    if (classmods[class]->alt_subst_mods_ptr != NULL) {
-      altmod = classmods[class]->alt_subst_mods_ptr[classmods[class]->tree->id][ratecat];
-      if (altmod != NULL) {
-	backgd = altmod->backgd_freqs;
-	rate_matrix = altmod->rate_matrix;
-      }
-    }
-    if (backgd == NULL) {
-      backgd = classmods[class]->backgd_freqs;
-      if (backgd == NULL)
-	die("ERROR tm_generate_msa: model's background frequencies are not assigned\n");
+  traversal = tr_preorder(classmods[0]->tree);
+  nodestate = smalloc(ntreenodes * SIM_BLOCK_SIZE * sizeof(int));
+  blockclass = smalloc(SIM_BLOCK_SIZE * sizeof(int));
+  blockcat = smalloc(SIM_BLOCK_SIZE * sizeof(int));
+  for (start = 0; start < ncolumns; start += SIM_BLOCK_SIZE) {
+    int *rootstate = &nodestate[classmods[0]->tree->id * SIM_BLOCK_SIZE];
+    nblock = min(SIM_BLOCK_SIZE, ncolumns - start);
+    checkInterrupt();
+
+    /* classes and rate categories */
+    for (j = 0; j < nblock; j++) {
+      TreeModel *mod = classmods[class];
+      blockclass[j] = class;
+      if (mod->nratecats > 1)
+        blockcat[j] = pv_draw_idx_arr(mod->freqK, mod->nratecats);
+      else blockcat[j] = 0;
+      if (labels != NULL) labels[start + j] = class;
+      if (hmm != NULL)
+        class = alias_draw(classtable, class);
     }
-    if (rate_matrix == NULL)
-      rate_matrix = classmods[class]->rate_matrix;
 
-    nodestate[classmods[class]->tree->id] = pv_draw_idx(backgd);
+    /* root */
+    for (j = 0; j < nblock; j++)
+      rootstate[j] = alias_draw(roottables[blockclass[j]*maxcats +
+                                           blockcat[j]], 0);
+
+    /* remaining nodes, parents before children */
     for (i = 0; i < lst_size(traversal); i++) {
       TreeNode *n = lst_get_ptr(traversal, i);
       TreeNode *l = n->lchild;
       TreeNode *r = n->rchild;
+      int *state = &nodestate[n->id * SIM_BLOCK_SIZE];
       if (!((l == NULL && r == NULL) || (l != NULL && r != NULL)))
 	die("ERROR tm_generate_msa: both children should be NULL or neither\n");
 
-      if (l == NULL) 
-	get_tuple_str(&msa->seqs[classmods[0]->msa_seq_idx[n->id]][col*(order+1)],
-		      nodestate[n->id], order+1, rate_matrix->states);
+      if (l == NULL) {
+        char *seq = msa->seqs[classmods[0]->msa_seq_idx[n->id]];
+        for (j = 0; j < nblock; j++)
+          get_tuple_str(&seq[(start + j)*(order+1)], state[j], order+1,
+                        states[blockclass[j]*maxcats + blockcat[j]]);
+      }
       else {
-        MarkovMatrix *lsubst_mat, *rsubst_mat;
-        if (classmods[class]->P[l->id][ratecat] == NULL)
-          tm_set_subst_matrices(classmods[class]);
-        lsubst_mat = classmods[class]->P[l->id][ratecat];
-        rsubst_mat = classmods[class]->P[r->id][ratecat];
-	nodestate[l->id] = mm_sample_state(lsubst_mat, nodestate[n->id]);
-	nodestate[r->id] = mm_sample_state(rsubst_mat, nodestate[n->id]);
+        TreeNode *child[2];
+        int c;
+        child[0] = l;
+        child[1] = r;
+        for (c = 0; c < 2; c++) {
+          int *childstate = &nodestate[child[c]->id * SIM_BLOCK_SIZE];
+          if (nclasses == 1 && maxcats == 1) {
+            AliasTable *t = tables[child[c]->id];
+            for (j = 0; j < nblock; j++)
+              childstate[j] = alias_draw(t, state[j]);
+          }
+          else {
+            for (j = 0; j < nblock; j++)
+              childstate[j] = 
+                alias_draw(tables[(blockclass[j]*ntreenodes + 
+                                   child[c]->id)*maxcats + blockcat[j]],
+                           state[j]);
+          }
+        }
       }
     }
-    if (labels != NULL) labels[col] = class;
-    if (hmm != NULL)
-      class = mm_sample_state(hmm->transition_matrix, class);
   }
   sfree(nodestate);
+  sfree(blockclass);
+  sfree(blockcat);
+  for (i = 0; i < nclasses * ntreenodes * maxcats; i++)
+    alias_table_free(tables[i]);
+  for (i = 0; i < nclasses * maxcats; i++)
+    alias_table_free(roottables[i]);
+  alias_table_free(classtable);
+  sfree(tables);
+  sfree(roottables);
+  sfree(states);
 
   return msa;
 }
@@ -1932,7 +2114,10 @@ void tm_check_boundaries(Vector *opt_params, Vector *lower_bounds,
 
 
 /* Given an MSA, a tree topology, and a substitution model, fit a tree
-   model using a multidimensional optimization algorithm (BFGS).
+   model using a multidimensional optimization algorithm (BFGS, or
+   L-BFGS if mod->opt_method == OPT_LBFGS).  If mod->ckpt is
+   non-NULL, the state of the optimiser is checkpointed periodically,
+   and a run is resumed from any state loaded into mod->ckpt.
    TreeModel 'mod' must already be allocated, and initialized with
    desired tree topology, substitution model, and (if appropriate)
    background frequencies.  The vector 'params' should define the
@@ -2006,9 +2191,14 @@ int tm_fit(TreeModel *mod, MSA *msa, Vector *params, int cat,
   }
   
   if (!quiet) fprintf(stderr, "numpar = %i\n", opt_params->size);
-  retval = opt_bfgs(tm_likelihood_wrapper, opt_params, (void*)mod, &ll, 
-                    lower_bounds, upper_bounds, logf, NULL, precision, 
-		    NULL, &numeval);
+  if (mod->opt_method == OPT_LBFGS)
+    retval = opt_lbfgs(tm_likelihood_wrapper, opt_params, (void*)mod, &ll, 
+                       lower_bounds, upper_bounds, logf, NULL, precision, 
+                       NULL, mod->ckpt, &numeval);
+  else
+    retval = opt_bfgs(tm_likelihood_wrapper, opt_params, (void*)mod, &ll, 
+                      lower_bounds, upper_bounds, logf, NULL, precision, 
+                      NULL, mod->ckpt, &numeval);
 
   mod->lnL = ll * -1 * log(2);  /* make negative again and convert to
                                    natural log scale */
@@ -2064,7 +2254,8 @@ int tm_fit(TreeModel *mod, MSA *msa, Vector *params, int cat,
     will be used for each mod.
  */
 int tm_fit_multi(TreeModel **mod, int nmod, MSA **msa, int nmsa,
-		 opt_precision_type precision, FILE *logf, int quiet) {
+		 opt_precision_type precision, FILE *logf, int quiet,
+                 int nthreads) {
   /* thoughts: what is params?  Probably the vector of parameters to optimize.  Need
      to also send in lower and upper, in that case.  Is there any way to flexibly
      indicate which parameters we want to share, or should we just assume this has been
@@ -2081,7 +2272,7 @@ int tm_fit_multi(TreeModel **mod, int nmod, MSA **msa, int nmsa,
   double ll;
   Vector *lower_bounds, *upper_bounds, *opt_params;
   int i, j, retval = 0, npar, nstate, numeval;
-  List *modlist;
+  MultiLikData d;
 
   if (nmod != nmsa) {
     if (nmsa != 1) die("tm_fit_multi: expected one msa or one msa for each mod\n");
@@ -2155,12 +2346,41 @@ int tm_fit_multi(TreeModel **mod, int nmod, MSA **msa, int nmsa,
     mod[i]->scale_during_opt = 1;
   
   if (!quiet) fprintf(stderr, "numpar = %i\n", opt_params->size);
-  modlist = lst_new_ptr(nmod);
-  for (i=0; i < nmod; i++) lst_push_ptr(modlist, mod[i]);
-  retval = opt_bfgs(tm_multi_likelihood_wrapper, opt_params, (void*)modlist, 
-		    &ll, lower_bounds, upper_bounds, logf, NULL, precision, 
-		    NULL, &numeval);
-  lst_free(modlist);
+
+  /* the likelihoods of the models are computed concurrently.  With
+     more than one thread, each model is evaluated through a private
+     copy, so that models sharing a tree or other lazily-cached state
+     can be updated independently; the copies are made here, serially,
+     because tree traversals are cached lazily */
+  d.nmod = nmod;
+  d.pool = thr_pool_new(nmod > 1 ? nthreads : 1);
+  d.ll = smalloc(nmod * sizeof(double));
+  d.mods = smalloc(nmod * sizeof(TreeModel*));
+  for (j=0; j < nmod; j++) {
+    if (thr_pool_size(d.pool) == 1)
+      d.mods[j] = mod[j];
+    else {
+      d.mods[j] = tm_create_copy(mod[j]);
+      d.mods[j]->lik_cache = NULL; /* caches are not thread safe */
+      tr_postorder(d.mods[j]->tree);
+      tr_preorder(d.mods[j]->tree);
+    }
+  }
+  if (mod[0]->opt_method == OPT_LBFGS)
+    retval = opt_lbfgs(tm_multi_likelihood_wrapper, opt_params, 
+                       (void*)&d, &ll, lower_bounds, upper_bounds, logf,
+                       NULL, precision, NULL, NULL, &numeval);
+  else
+    retval = opt_bfgs(tm_multi_likelihood_wrapper, opt_params, 
+                      (void*)&d, &ll, lower_bounds, upper_bounds, logf,
+                      NULL, precision, NULL, NULL, &numeval);
+  if (thr_pool_size(d.pool) > 1) {
+    for (j=0; j < nmod; j++)
+      tm_free(d.mods[j]);
+  }
+  thr_pool_free(d.pool);
+  sfree(d.mods);
+  sfree(d.ll);
 
   for (j=0; j < nmod; j++)
     mod[j]->lnL = tm_likelihood_wrapper(opt_params, mod[j]) * -1.0 * log(2);
@@ -2631,12 +2851,21 @@ double tm_likelihood_wrapper(Vector *params, void *data) {
   return ll;
   }*/
 
+static void multi_lik_job(void *data, int job, int thread) {
+  MultiLikData *d = (MultiLikData*)data;
+  d->ll[job] = tm_likelihood_wrapper(d->params, d->mods[job]);
+}
+
+/* the likelihoods are summed in model order, so the result does not
+   depend on the number of threads */
 double tm_multi_likelihood_wrapper(Vector *params, void *data) {
-  List *modlist = (List*)data;
+  MultiLikData *d = (MultiLikData*)data;
   double ll=0;
   int i;
-  for (i=0; i < lst_size(modlist); i++)  
-    ll += tm_likelihood_wrapper(params, lst_get_ptr(modlist, i));
+  d->params = params;
+  thr_foreach(d->pool, d->nmod, multi_lik_job, d);
+  for (i=0; i < d->nmod; i++)  
+    ll += d->ll[i];
   return ll;
 }
 
@@ -2658,7 +2887,7 @@ void tm_unpack_params(TreeModel *mod, Vector *params_in, int idx_offset) {
   MarkovMatrix *temp_mm;
   Vector *temp_backgd;
   double  sum;
-  static Matrix *oldMatrix=NULL;
+  static PHAST_TLS Matrix *oldMatrix=NULL;
 
   if (oldMatrix != NULL && oldMatrix->nrows != mod->rate_matrix->size) {
     mat_free(oldMatrix);
@@ -3136,9 +3365,10 @@ Vector *tm_params_init_random(TreeModel *mod) {
 	for (i=0; i < size; i++) 
 	  vec_set(params, altmod->backgd_idx+i, vec_get(params, mod->backgd_idx+i));
       }
-      if (mod->param_map[altmod->selection_idx] >= 0)
+      if (altmod->selection_idx >= 0 &&
+	  mod->param_map[altmod->selection_idx] >= 0)
 	vec_set(params, altmod->selection_idx, unif_rand()*2-1.0);
-      if (mod->param_map[altmod->bgc_idx] >= 0)
+      if (altmod->bgc_idx >= 0 && mod->param_map[altmod->bgc_idx] >= 0)
 	vec_set(params, altmod->bgc_idx, unif_rand()*2.0-1.0);
     }
     mod->subst_mod = temp_mod;
@@ -0,0 +1,302 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+/* Persistent cache of per-rate-category column likelihoods, keyed by
+   (model fingerprint, column tuple).  See tuple_lik_cache.h. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <phast/tuple_lik_cache.h>
+#include <phast/sufficient_stats.h>
+#include <phast/misc.h>
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* minimum number of hash-table slots, to avoid long bucket chains when
+   the caller has no good estimate of the number of entries */
+#define TLC_MIN_CAPACITY 100000
+
+static tlc_fprint fnv_bytes(tlc_fprint h, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char*)data;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static tlc_fprint fnv_int(tlc_fprint h, int val) {
+  return fnv_bytes(h, &val, sizeof(int));
+}
+
+static tlc_fprint fnv_dbl(tlc_fprint h, double val) {
+  if (val == 0) val = 0;        /* don't distinguish -0 and 0 */
+  return fnv_bytes(h, &val, sizeof(double));
+}
+
+TupleLikCache *tlc_new(int est_capacity) {
+  TupleLikCache *cache = smalloc(sizeof(TupleLikCache));
+  if (est_capacity < TLC_MIN_CAPACITY) est_capacity = TLC_MIN_CAPACITY;
+  cache->entries = hsh_new(est_capacity);
+  cache->keys = lst_new_ptr(est_capacity);
+  cache->nhits = cache->nmisses = 0;
+  return cache;
+}
+
+TupleLikCache *tlc_new_from_file(FILE *F, int est_capacity) {
+  TupleLikCache *cache;
+  char magic[sizeof(TLC_MAGIC)];
+  int version, keylen, nratecats, nentries, i, maxkeylen = 0;
+  char *key = NULL;
+  double *lik = NULL;
+
+  if (fread(magic, sizeof(char), strlen(TLC_MAGIC), F) != strlen(TLC_MAGIC) ||
+      strncmp(magic, TLC_MAGIC, strlen(TLC_MAGIC)) != 0 ||
+      fread(&version, sizeof(int), 1, F) != 1 || version != TLC_VERSION ||
+      fread(&nentries, sizeof(int), 1, F) != 1 || nentries < 0)
+    return NULL;
+
+  cache = tlc_new(nentries + est_capacity);
+  for (i = 0; i < nentries; i++) {
+    if (fread(&keylen, sizeof(int), 1, F) != 1 ||
+        fread(&nratecats, sizeof(int), 1, F) != 1 ||
+        keylen <= TLC_FPRINT_LEN || nratecats <= 0)
+      break;
+    if (keylen > maxkeylen) {
+      key = srealloc(key, (keylen+1) * sizeof(char));
+      maxkeylen = keylen;
+    }
+    lik = srealloc(lik, nratecats * sizeof(double));
+    if (fread(key, sizeof(char), keylen, F) != (size_t)keylen ||
+        fread(lik, sizeof(double), nratecats, F) != (size_t)nratecats)
+      break;
+    key[keylen] = '\0';
+    tlc_put(cache, key, lik, nratecats);
+  }
+  if (key != NULL) sfree(key);
+  if (lik != NULL) sfree(lik);
+  if (i < nentries) {           /* truncated or corrupt */
+    tlc_free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+TupleLikCache *tlc_new_from_fname(const char *fname, int est_capacity) {
+  TupleLikCache *cache;
+  FILE *F = phast_fopen_no_exit(fname, "rb");
+  if (F == NULL)
+    return tlc_new(est_capacity);
+  cache = tlc_new_from_file(F, est_capacity);
+  phast_fclose(F);
+  if (cache == NULL) {
+    phast_warning("WARNING: ignoring invalid likelihood cache %s.\n", fname);
+    cache = tlc_new(est_capacity);
+  }
+  return cache;
+}
+
+void tlc_free(TupleLikCache *cache) {
+  int i;
+  for (i = 0; i < lst_size(cache->keys); i++) {
+    char *key = lst_get_ptr(cache->keys, i);
+    TupleLikEntry *e = hsh_get(cache->entries, key);
+    sfree(e->lik);
+    sfree(e);
+    sfree(key);
+  }
+  lst_free(cache->keys);
+  hsh_free(cache->entries);
+  sfree(cache);
+}
+
+int tlc_write(FILE *F, TupleLikCache *cache) {
+  int i, keylen, version = TLC_VERSION, nentries = lst_size(cache->keys);
+  fwrite(TLC_MAGIC, sizeof(char), strlen(TLC_MAGIC), F);
+  fwrite(&version, sizeof(int), 1, F);
+  fwrite(&nentries, sizeof(int), 1, F);
+  for (i = 0; i < nentries; i++) {
+    char *key = lst_get_ptr(cache->keys, i);
+    TupleLikEntry *e = hsh_get(cache->entries, key);
+    keylen = (int)strlen(key);
+    fwrite(&keylen, sizeof(int), 1, F);
+    fwrite(&e->nratecats, sizeof(int), 1, F);
+    fwrite(key, sizeof(char), keylen, F);
+    fwrite(e->lik, sizeof(double), e->nratecats, F);
+  }
+  return ferror(F) ? 1 : 0;
+}
+
+/* the cache is written to a temporary file that is then renamed, so
+   that an interrupted run never leaves a partially written file */
+int tlc_write_fname(const char *fname, TupleLikCache *cache) {
+  char *tmpname = smalloc((strlen(fname) + 30) * sizeof(char));
+  FILE *F;
+  int err;
+
+  sprintf(tmpname, "%s.%ld.tmp", fname, (long)getpid());
+  if ((F = phast_fopen_no_exit(tmpname, "wb")) == NULL)
+    err = 1;
+  else {
+    err = tlc_write(F, cache);
+    err = (fclose(F) != 0) || err;
+    err = err || rename(tmpname, fname) != 0;
+  }
+  if (err) {
+    phast_warning("WARNING: unable to write likelihood cache %s.\n", fname);
+    remove(tmpname);
+  }
+  sfree(tmpname);
+  return err;
+}
+
+tlc_fprint tlc_fingerprint(TreeModel *mod) {
+  tlc_fprint h = FNV_OFFSET;
+  int i, j, k, rcat, nstates = mod->rate_matrix->size;
+  char *topology = tr_to_string(mod->tree, FALSE);
+
+  h = fnv_int(h, mod->order);
+  h = fnv_int(h, mod->nratecats);
+  h = fnv_bytes(h, mod->rate_matrix->states,
+                strlen(mod->rate_matrix->states));
+  h = fnv_bytes(h, topology, strlen(topology));
+  sfree(topology);
+
+  for (i = 0; i < mod->tree->nnodes; i++) {
+    TreeNode *n = lst_get_ptr(mod->tree->nodes, i);
+    if (n->parent == NULL) continue;
+    for (rcat = 0; rcat < mod->nratecats; rcat++) {
+      MarkovMatrix *P = mod->P[n->id][rcat];
+      h = fnv_int(h, n->id);
+      if (P == NULL) continue;
+      for (j = 0; j < nstates; j++)
+        for (k = 0; k < nstates; k++)
+          h = fnv_dbl(h, mm_get(P, j, k));
+    }
+  }
+  for (i = 0; i < nstates; i++)
+    h = fnv_dbl(h, vec_get(mod->backgd_freqs, i));
+  for (rcat = 0; rcat < mod->nratecats; rcat++)
+    h = fnv_dbl(h, mod->freqK[rcat]);
+  return h;
+}
+
+tlc_fprint tlc_hash(tlc_fprint fprint, const void *data, size_t len) {
+  return fnv_bytes(fprint, data, len);
+}
+
+tlc_fprint tlc_hash_msa(tlc_fprint h, MSA *msa) {
+  int i, j;
+  h = fnv_int(h, msa->nseqs);
+  h = fnv_int(h, msa->length);
+  h = fnv_bytes(h, msa->alphabet, strlen(msa->alphabet));
+  for (i = 0; i < msa->nseqs; i++)
+    h = fnv_bytes(h, msa->names[i], strlen(msa->names[i]) + 1);
+  if (msa->seqs != NULL) {
+    for (i = 0; i < msa->nseqs; i++)
+      h = fnv_bytes(h, msa->seqs[i], msa->length);
+  }
+  else if (msa->ss != NULL) {
+    h = fnv_int(h, msa->ss->tuple_size);
+    h = fnv_int(h, msa->ss->ntuples);
+    for (i = 0; i < msa->ss->ntuples; i++) {
+      h = fnv_bytes(h, msa->ss->col_tuples[i],
+                    msa->nseqs * msa->ss->tuple_size);
+      h = fnv_dbl(h, msa->ss->counts[i]);
+      if (msa->ss->cat_counts != NULL)
+        for (j = 0; j <= msa->ncats; j++)
+          h = fnv_dbl(h, msa->ss->cat_counts[j][i]);
+    }
+    if (msa->ss->tuple_idx != NULL)
+      h = fnv_bytes(h, msa->ss->tuple_idx, msa->length * sizeof(int));
+  }
+  if (msa->categories != NULL)
+    h = fnv_bytes(h, msa->categories, msa->length * sizeof(int));
+  return h;
+}
+
+tlc_fprint tlc_hash_model(tlc_fprint h, TreeModel *mod) {
+  int i, j, nstates = mod->rate_matrix->size;
+  char *tree = tr_to_string(mod->tree, TRUE);
+
+  h = fnv_int(h, mod->subst_mod);
+  h = fnv_int(h, mod->order);
+  h = fnv_int(h, mod->nratecats);
+  h = fnv_int(h, mod->empirical_rates);
+  h = fnv_dbl(h, mod->alpha);
+  h = fnv_dbl(h, mod->selection);
+  h = fnv_dbl(h, mod->scale);
+  h = fnv_bytes(h, mod->rate_matrix->states,
+                strlen(mod->rate_matrix->states));
+  h = fnv_bytes(h, tree, strlen(tree));
+  sfree(tree);
+  for (i = 0; i < nstates; i++)
+    for (j = 0; j < nstates; j++)
+      h = fnv_dbl(h, mm_get(mod->rate_matrix, i, j));
+  if (mod->backgd_freqs != NULL)
+    for (i = 0; i < nstates; i++)
+      h = fnv_dbl(h, vec_get(mod->backgd_freqs, i));
+  if (mod->rK != NULL)
+    for (i = 0; i < mod->nratecats; i++)
+      h = fnv_dbl(h, mod->rK[i]);
+  if (mod->freqK != NULL)
+    for (i = 0; i < mod->nratecats; i++)
+      h = fnv_dbl(h, mod->freqK[i]);
+  h = fnv_int(h, mod->alt_subst_mods == NULL ? 0 :
+              lst_size(mod->alt_subst_mods));
+  return h;
+}
+
+void tlc_make_key(char *key, tlc_fprint fprint, TreeModel *mod, MSA *msa,
+                  int tupleidx) {
+  int i, col_offset, len = TLC_FPRINT_LEN;
+  sprintf(key, "%016llx", fprint);
+  for (i = 0; i < mod->tree->nnodes; i++) {
+    TreeNode *n = lst_get_ptr(mod->tree->nodes, i);
+    if (n->lchild != NULL) continue;
+    for (col_offset = -1*mod->order; col_offset <= 0; col_offset++)
+      key[len++] = ss_get_char_tuple(msa, tupleidx, mod->msa_seq_idx[n->id],
+                                     col_offset);
+  }
+  key[len] = '\0';
+}
+
+double *tlc_get(TupleLikCache *cache, const char *key, int nratecats) {
+  TupleLikEntry *e = hsh_get(cache->entries, key);
+  if (e == (void*)-1 || e->nratecats != nratecats) {
+    cache->nmisses++;
+    return NULL;
+  }
+  cache->nhits++;
+  return e->lik;
+}
+
+void tlc_put(TupleLikCache *cache, const char *key, double *lik,
+             int nratecats) {
+  TupleLikEntry *e = hsh_get(cache->entries, key);
+  int rcat;
+  if (e != (void*)-1) {         /* replace existing entry */
+    if (e->nratecats != nratecats) {
+      e->lik = srealloc(e->lik, nratecats * sizeof(double));
+      e->nratecats = nratecats;
+    }
+  }
+  else {
+    e = smalloc(sizeof(TupleLikEntry));
+    e->nratecats = nratecats;
+    e->lik = smalloc(nratecats * sizeof(double));
+    hsh_put(cache->entries, key, e);
+    lst_push_ptr(cache->keys, copy_charstr(key));
+  }
+  for (rcat = 0; rcat < nratecats; rcat++)
+    e->lik[rcat] = lik[rcat];
+}
@@ -103,6 +103,7 @@ PhyloHmm *phmm_new(HMM *hmm,    /* HMM.  If indel_mode ==
   phmm->gpm = NULL;
   phmm->T = phmm->t = NULL;
   phmm->em_data = NULL;
+  phmm->ckpt = NULL;
   phmm->alpha = NULL;
   phmm->beta = NULL;
   phmm->tau = NULL;
@@ -508,6 +509,8 @@ void phmm_free(PhyloHmm *phmm) {
   if (phmm->em_data != NULL) {
     if (phmm->em_data->H != NULL) 
       mat_free(phmm->em_data->H);
+    if (phmm->em_data->rho_tuple_scores != NULL) 
+      sfree(phmm->em_data->rho_tuple_scores);
     sfree(phmm->em_data);
   }
   hmm_free(phmm->hmm);
@@ -573,6 +576,26 @@ void phmm_compute_emissions(PhyloHmm *phmm,
   for (i = 0; i < phmm->nmods; i++) 
     phmm->state_pos[i] = phmm->state_neg[i] = -1;
 
+  /* in the common two-model case (e.g., the default two-state
+     phastCons HMM), compute both sets of emissions together, sharing
+     leaf lookups; the loop below then reuses them */
+  if (phmm->nmods == 2 && !phmm->reflected) {
+    int s[2] = {-1, -1};
+    for (i = 0; i < phmm->hmm->nstates; i++) 
+      if (s[phmm->state_to_mod[i]] == -1) s[phmm->state_to_mod[i]] = i;
+    if (s[0] != -1 && s[1] != -1) {
+      if (new_alloc) {
+        phmm->emissions[s[0]] = smalloc(msa->length * sizeof(double));
+        phmm->emissions[s[1]] = smalloc(msa->length * sizeof(double));
+      }
+      tl_compute_log_likelihood_pair(phmm->mods[0], phmm->mods[1], msa,
+                                     phmm->emissions[s[0]],
+                                     phmm->emissions[s[1]]);
+      phmm->state_pos[0] = s[0];
+      phmm->state_pos[1] = s[1];
+    }
+  }
+
   for (i = 0; i < phmm->hmm->nstates; i++) {
     if (!quiet) {
       fprintf(stderr, "Computing emission probs (state %d, cat %d, mod %d",
@@ -1147,6 +1170,7 @@ double phmm_fit_em(PhyloHmm *phmm,
   phmm->em_data->fix_functional = fix_functional;
   phmm->em_data->fix_indel = fix_indel;
   phmm->em_data->H = NULL;
+  phmm->em_data->rho_tuple_scores = NULL;
 
   if (msa != NULL)              /* estimating tree models */
     retval = hmm_train_by_em(phmm->hmm, phmm->mods, phmm, 1, 
@@ -1517,7 +1541,7 @@ void phmm_em_estim_indels(PhyloHmm *phmm, IndelEstimData *ied) {
     vec_set(params, 1, phmm->beta[i]);
     vec_set(params, 2, phmm->tau[i]);
     opt_bfgs(indel_max_function, params, ied, &retval, lb, NULL, NULL, 
-             indel_max_gradient, OPT_HIGH_PREC, NULL, NULL); 
+             indel_max_gradient, OPT_HIGH_PREC, NULL, NULL, NULL); 
     phmm->alpha[i] = vec_get(params, 0);
     phmm->beta[i] = vec_get(params, 1);
     phmm->tau[i] = vec_get(params, 2);
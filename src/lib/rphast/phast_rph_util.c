@@ -150,7 +150,7 @@ SEXP rph_opt_bfgs(SEXP likelihoodFunctionP, SEXP paramsP,
     logfile = phast_fopen(CHARACTER_VALUE(logfileP), "a");
 
   opt_bfgs(rph_likelihood_wrapper, params, data, &retval, lower, 
-	   upper, logfile, NULL, precision, NULL, &numeval);
+	   upper, logfile, NULL, precision, NULL, NULL, &numeval);
 
   if (logfile != NULL)
     phast_fclose(logfile);
@@ -163,3 +163,13 @@ endif
 endif
 endif
 
+
+# POSIX threads, used for coarse-grained parallelism in several
+# programs (see include/phast/thread_pool.h).  Not available on
+# Windows builds; add -DSKIP_THREADS to CFLAGS to disable elsewhere
+ifneq ($(TARGETOS), Windows)
+  CFLAGS += -pthread
+  LIBS += -lpthread
+else
+  CFLAGS += -DSKIP_THREADS
+endif
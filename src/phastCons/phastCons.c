@@ -62,6 +62,14 @@ int main(int argc, char *argv[]) {
     {"coding-potential", 0, 0, 'p'},
     {"indels-only", 0, 0, 'J'},
     {"alias", 1, 0, 'A'},
+    {"lik-cache", 1, 0, 'K'},
+    {"binary-track", 1, 0, 0},
+    {"em-window", 1, 0, 'W'},
+    {"em-pooled", 0, 0, 'Q'},
+    {"threads", 1, 0, 'j'},
+    {"checkpoint", 1, 0, 0},
+    {"checkpoint-interval", 1, 0, 0},
+    {"resume", 0, 0, 0},
     {"quiet", 0, 0, 'q'},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
@@ -79,7 +87,7 @@ int main(int argc, char *argv[]) {
   msa_format_type msa_format = UNKNOWN_FORMAT;
 
   while ((c = getopt_long(argc, argv, 
-			  "S:H:V:ni:k:l:C:G:zt:E:R:T:O:r:xL:sN:P:g:U:c:e:IY:D:JM:F:pA:Xqh", 
+			  "S:H:V:ni:k:l:C:G:zt:E:R:T:O:r:xL:sN:P:g:U:c:e:IY:D:JM:F:pA:K:W:Qj:Xqh", 
                           long_opts, &opt_idx)) != -1) {
     switch (c) {
     case 'S':
@@ -243,9 +251,31 @@ int main(int argc, char *argv[]) {
     case 'A':
       p->alias_hash = make_name_hash(optarg);
       break;
+    case 'K':
+      p->lik_cache_fname = optarg;
+      break;
+    case 'W':
+      p->em_window = get_arg_int_bounds(optarg, 1, INFTY);
+      break;
+    case 'Q':
+      p->em_pooled = TRUE;
+      break;
+    case 'j':
+      p->nthreads = get_arg_int_bounds(optarg, 0, INFTY);
+      break;
     case 'q':
       p->results_f = NULL;
       break;
+    case 0:
+      if (strcmp(long_opts[opt_idx].name, "checkpoint") == 0)
+        p->checkpoint_fname = optarg;
+      else if (strcmp(long_opts[opt_idx].name, "checkpoint-interval") == 0)
+        p->checkpoint_interval = get_arg_int_bounds(optarg, 0, INFTY);
+      else if (strcmp(long_opts[opt_idx].name, "resume") == 0)
+        p->resume = TRUE;
+      else if (strcmp(long_opts[opt_idx].name, "binary-track") == 0)
+        p->binary_track = optarg;
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -258,6 +288,9 @@ int main(int argc, char *argv[]) {
       (coding_potential && optind != argc - 2 && optind != argc - 1))
     die("ERROR: extra or missing arguments.  Try '%s -h'.\n", argv[0]);
 
+  if (p->resume && p->checkpoint_fname == NULL)
+    die("ERROR: --resume requires --checkpoint.\n");
+
   set_seed(-1);
 
   if (p->extrapolate_tree_fname != NULL &&
@@ -348,7 +381,8 @@ int main(int argc, char *argv[]) {
     p->msa = msa_new_from_file_define_format(infile, msa_format, NULL);
 
   /* use file name root for default seqname */
-  if (p->viterbi_f != NULL && (p->seqname == NULL || p->idpref == NULL)) {
+  if ((p->viterbi_f != NULL && (p->seqname == NULL || p->idpref == NULL)) ||
+      (p->binary_track != NULL && p->seqname == NULL)) {
     String *tmp = str_new_charstr(msa_fname);
     if (!str_equals_charstr(tmp, "-")) {
       str_remove_path(tmp);
@@ -19,6 +19,7 @@
 #include <phast/gff.h>
 #include <phast/bed.h>
 #include <phast/tree_likelihoods.h>
+#include <phast/tuple_lik_cache.h>
 #include "phastOdds.help"
 
 #define MIN_BLOCK_SIZE 30
@@ -40,8 +41,9 @@ int main(int argc, char *argv[]) {
     *winscore_pos=NULL, *winscore_neg=NULL;
   int *no_alignment=NULL;
   List *pruned_names;
-  char *msa_fname;
+  char *msa_fname, *lik_cache_fname = NULL;
   FILE *infile;
+  TupleLikCache *lik_cache = NULL;
 
   int opt_idx;
   struct option long_opts[] = {
@@ -56,12 +58,13 @@ int main(int argc, char *argv[]) {
     {"msa-format", 1, 0, 'i'},
     {"refidx", 1, 0, 'r'},
     {"output-bed", 0, 0, 'd'},
+    {"lik-cache", 1, 0, 'K'},
     {"verbose", 0, 0, 'v'},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
   };
 
-  while ((c = getopt_long(argc, argv, "B:b:F:f:r:g:w:W:i:ydvh", long_opts, &opt_idx)) != -1) {
+  while ((c = getopt_long(argc, argv, "B:b:F:f:r:g:w:W:i:K:ydvh", long_opts, &opt_idx)) != -1) {
     switch (c) {
     case 'B':
       backgd_hmm = hmm_new_from_file(phast_fopen(optarg, "r"));
@@ -110,6 +113,9 @@ int main(int argc, char *argv[]) {
     case 'd':
       bed_output = 1;
       break;
+    case 'K':
+      lik_cache_fname = optarg;
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -236,6 +242,15 @@ int main(int argc, char *argv[]) {
     msa_reverse_compl(msa_compl);
   }
 
+  if (lik_cache_fname != NULL) {
+    if (verbose) fprintf(stderr, "Reading likelihood cache from %s ...\n", lik_cache_fname);
+    lik_cache = tlc_new_from_fname(lik_cache_fname, 
+                                   (msa->ss != NULL ? msa->ss->ntuples : msa->length) *
+                                   (backgd_nmods + feat_nmods));
+    for (i = 0; i < backgd_nmods; i++) backgd_mods[i]->lik_cache = lik_cache;
+    for (i = 0; i < feat_nmods; i++) feat_mods[i]->lik_cache = lik_cache;
+  }
+
   /* allocate memory for computing scores */
   backgd_emissions = smalloc(backgd_nmods * sizeof(void*));
   for (i = 0; i < backgd_nmods; i++) 
@@ -461,6 +476,11 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (lik_cache != NULL && lik_cache->nmisses > 0) {
+    if (verbose) fprintf(stderr, "Writing likelihood cache to %s ...\n", lik_cache_fname);
+    tlc_write_fname(lik_cache_fname, lik_cache);
+  }
+
   if (verbose) fprintf(stderr, "\nDone.\n");
 
   return 0;
@@ -17,6 +17,7 @@
 #include <phast/numerical_opt.h>
 #include <phast/tree_model.h>
 #include <phast/fit_em.h>
+#include <phast/thread_pool.h>
 #include <time.h>
 #include "phyloBoot.help"
 
@@ -106,6 +107,148 @@ void set_param_descriptions(char **descriptions, TreeModel *mod) {
   free(tempstr);
 }
 
+/* create a nonparametric replicate of msa (which must be represented
+   by sufficient statistics only) with the given tuple counts and
+   length.  The replicate is a view of msa that shares its names and
+   distinct column tuples, so the alignment is never copied; only the
+   counts (which are taken over) are private */
+static MSA *boot_msa_new(MSA *msa, double *counts, int nsites) {
+  MSA *rep = smalloc(sizeof(MSA));
+  *rep = *msa;
+  rep->ss = smalloc(sizeof(MSA_SS));
+  *rep->ss = *msa->ss;
+  rep->ss->counts = counts;
+  rep->ss->msa = rep;
+  rep->length = nsites;
+  return rep;
+}
+
+/* free a replicate created by boot_msa_new, leaving the shared data
+   in place */
+static void boot_msa_free(MSA *rep) {
+  sfree(rep->ss->counts);
+  sfree(rep->ss);
+  sfree(rep);
+}
+
+/* a bootstrap replicate.  Replicates are processed concurrently, in
+   batches */
+typedef struct {
+  MSA *msa;                     /* alignment to fit */
+  TreeModel *mod;               /* model to estimate (NULL if not
+                                   estimating) */
+  Vector *params;               /* initial and then estimated
+                                   parameters */
+} BootRep;
+
+/* data shared by the replicates of a batch */
+typedef struct {
+  BootRep *reps;
+  int start;                    /* number of first replicate in
+                                   batch */
+  int nreps, seed, parametric, nsites, use_em, precision, quiet,
+    random_init, subst_mod, dump_format;
+  MSA *msa;                     /* original alignment (nonparametric
+                                   case) */
+  double *p;                    /* tuple frequencies of msa */
+  TreeModel **models,           /* model to simulate from, and */
+    **subtree_models;           /* subtree model, for each thread
+                                   (parametric case) */
+  char *subtree_name, *dump_msas_root;
+  double subtree_switch_prob, subtree_scale;
+  List *nsites_lst, *scale_lst, *subtree_scale_lst;
+} BootBatch;
+
+/* generate the alignment for a replicate, optionally dump it, and
+   estimate the model.  All random numbers are drawn from a stream
+   determined by the seed and the replicate number, so results do not
+   depend on the number of threads */
+static void run_rep(void *data, int k, int thread) {
+  BootBatch *b = data;
+  BootRep *rep = &b->reps[k];
+  int i = b->start + k, j;
+  char fname[STR_MED_LEN];
+  FILE *F;
+
+  set_rand_stream(b->seed, i);
+
+  /* generate alignment */
+  if (b->parametric) {
+    TreeModel *model = b->models[thread];
+    if (b->scale_lst != NULL)
+      rep->msa = tm_generate_msa_scaleLst(b->nsites_lst, b->scale_lst,
+                                          b->subtree_scale_lst, model,
+                                          b->subtree_name);
+    else if (b->subtree_name != NULL &&
+             (b->subtree_scale != 1.0 || b->subtree_switch_prob != 0.0))
+      rep->msa = tm_generate_msa_random_subtree(b->nsites, model,
+                                                b->subtree_models[thread],
+                                                b->subtree_name,
+                                                b->subtree_switch_prob);
+    else rep->msa = tm_generate_msa(b->nsites, NULL, &model, NULL);
+  }
+  else {
+    int *tmpcounts = smalloc(b->msa->ss->ntuples * sizeof(int));
+    double *counts = smalloc(b->msa->ss->ntuples * sizeof(double));
+    mn_draw(b->nsites, b->p, b->msa->ss->ntuples, tmpcounts);
+                                /* here we simply redraw numbers of
+                                   tuples from multinomial distribution
+                                   defined by orig alignment */
+    for (j = 0; j < b->msa->ss->ntuples; j++) counts[j] = tmpcounts[j];
+                                /* (have to convert from int to double) */
+    sfree(tmpcounts);
+    rep->msa = boot_msa_new(b->msa, counts, b->nsites);
+  }
+
+  if (b->dump_msas_root != NULL) {
+    sprintf(fname, "%s.%d.%s", b->dump_msas_root, i+1, 
+            msa_suffix_for_format(b->dump_format));
+    if (!b->quiet) fprintf(stderr, "Dumping alignment to %s...\n", fname);
+    F = phast_fopen(fname, "w+");
+
+    if (b->dump_format == SS) { /* output ss */
+      if (rep->msa->ss == NULL)   /* (only happens in parametric case) */
+        ss_from_msas(rep->msa, tm_order(b->subst_mod) + 1, FALSE, NULL, NULL,
+                     NULL, -1, subst_mod_is_codon_model(b->subst_mod));
+      ss_write(rep->msa, F, FALSE);
+    }
+    else {                  /* output actual seqs */
+      if (!b->parametric) {   /* only have SS; need to create seqs */
+        ss_to_msa(rep->msa);            
+        msa_permute(rep->msa);
+      }
+      msa_print(F, rep->msa, b->dump_format, FALSE);
+      if (!b->parametric) {   /* need to get rid of seqs because
+                                 tuples are shared with the original
+                                 alignment */
+        for (j = 0; j < rep->msa->nseqs; j++) sfree(rep->msa->seqs[j]);
+        sfree(rep->msa->seqs);
+        rep->msa->seqs = NULL;
+      }
+    }
+    phast_fclose(F);
+  }
+
+  /* now estimate model parameters */
+  if (rep->mod != NULL) {
+    if (b->random_init) 
+      rep->params = tm_params_init_random(rep->mod);
+
+    if (!b->quiet) 
+      fprintf(stderr, "Estimating model for replicate %d of %d...\n", i+1,
+              b->nreps);
+
+    if (b->use_em)
+      tm_fit_em(rep->mod, rep->msa, rep->params, -1, b->precision, -1, NULL,
+                NULL, 1);
+    else
+      tm_fit(rep->mod, rep->msa, rep->params, -1, b->precision, NULL,
+             b->quiet, NULL);
+  }
+
+  unset_rand_stream();
+}
+
 int main(int argc, char *argv[]) {
   
   /* variables for args with default values */
@@ -122,11 +265,11 @@ int main(int argc, char *argv[]) {
   /* other variables */
   FILE *INF, *F;
   signed char c;
-  int i, j, opt_idx, nparams = -1, seed = -1;
+  int i, j, k, opt_idx, nparams = -1, seed = -1, nthreads = 1, start,
+    batch_size;
   String *tmpstr;
   List **estimates=NULL;
   double *p = NULL;
-  int *tmpcounts=NULL;
   char **descriptions = NULL;
   List *tmpl;
   char fname[STR_MED_LEN];
@@ -137,6 +280,9 @@ int main(int argc, char *argv[]) {
   TreeModel *subtreeModel=NULL;
   List *scaleLst=NULL, *subtreeScaleLst=NULL, *nsitesLst=NULL;
   FILE *scaleFile;
+  ThreadPool *pool;
+  BootRep *reps;
+  BootBatch batch;
 
   struct option long_opts[] = {
     {"nsites", 1, 0, 'L'},
@@ -164,10 +310,11 @@ int main(int argc, char *argv[]) {
     {"scale", 1, 0, 'P'},
     {"scale-file", 1, 0, 'F'},
     {"seed", 1, 0, 'D'},
+    {"threads", 1, 0, 'j'},
     {0, 0, 0, 0}
   };
   
-  while ((c = getopt_long(argc, argv, "L:n:i:d:a:m:o:xR:qht:s:k:Ep:M:S:w:l:P:F:D:r", 
+  while ((c = getopt_long(argc, argv, "L:n:i:d:a:m:o:xR:qht:s:k:Ep:M:S:w:l:P:F:D:rj:", 
                           long_opts, &opt_idx)) != -1) {
     switch (c) {
     case 'L':
@@ -272,6 +419,9 @@ int main(int argc, char *argv[]) {
     case 'D':
       seed = get_arg_int_bounds(optarg, 1, INFTY);
       break;
+    case 'j':
+      nthreads = get_arg_int_bounds(optarg, 0, INFTY);
+      break;
     case '?':
       die("Bad argument.  Try '%s -h'.\n", argv[0]);
     }
@@ -353,7 +503,6 @@ int main(int argc, char *argv[]) {
       p = smalloc(msa->ss->ntuples * sizeof(double));
       for (i = 0; i < msa->ss->ntuples; i++) p[i] = msa->ss->counts[i];
       normalize_probs(p, msa->ss->ntuples);
-      tmpcounts = smalloc(msa->ss->ntuples * sizeof(int));
     }
     else {                        /* parametric */
       if (scaleFileName != NULL) {
@@ -381,140 +530,166 @@ int main(int argc, char *argv[]) {
     }
   } /* if input_mods == NULL */
 
-  for (i = 0; i < nreps; i++) {
-    Vector *params=NULL;
-    TreeModel *thismod=NULL;
-
-    /* generate alignment */
-    if (input_mods == NULL) {   /* skip if models given */
-      if (parametric) {
-	if (scaleLst != NULL)
-	  msa = tm_generate_msa_scaleLst(nsitesLst, scaleLst, subtreeScaleLst,
-					 model, subtreeName);
-	else if (subtreeName!=NULL && (subtreeScale!=1.0 || subtreeSwitchProb!=0.0)) 
-	  msa = tm_generate_msa_random_subtree(nsites, model, subtreeModel, 
-					       subtreeName, subtreeSwitchProb);
-	else msa = tm_generate_msa(nsites, NULL, &model, NULL);
-      }
-      else {
-
-        double sum=0;
-        for (j = 0; j < msa->ss->ntuples; j++) sum+=p[j];
-
-        mn_draw(nsites, p, msa->ss->ntuples, tmpcounts);
-                                /* here we simply redraw numbers of
-                                   tuples from multinomial distribution
-                                   defined by orig alignment */
-        for (j = 0; j < msa->ss->ntuples; j++) msa->ss->counts[j] = tmpcounts[j];
-                                /* (have to convert from int to double) */
-        msa->length = nsites;
-      }
-
-      if (dump_msas_root != NULL) {
-        sprintf(fname, "%s.%d.%s", dump_msas_root, i+1, 
-                msa_suffix_for_format(dump_format));
-        if (!quiet) fprintf(stderr, "Dumping alignment to %s...\n", fname);
-        F = phast_fopen(fname, "w+");
+  /* the global generator is used only to choose a base seed, if
+     none was given; each replicate then draws from its own stream */
+  if (seed == -1) seed = 1 + (int)(random() % 2147483646);
+
+  pool = thr_pool_new(input_mods == NULL ? nthreads : 1);
+  batch_size = thr_pool_size(pool) == 1 ? 1 : 4 * thr_pool_size(pool);
+  reps = smalloc(batch_size * sizeof(BootRep));
+  batch.reps = reps;
+  batch.nreps = nreps;
+  batch.seed = seed;
+  batch.parametric = parametric;
+  batch.nsites = nsites;
+  batch.use_em = use_em;
+  batch.precision = precision;
+  batch.quiet = quiet;
+  batch.random_init = random_init;
+  batch.subst_mod = subst_mod;
+  batch.dump_format = dump_format;
+  batch.msa = msa;
+  batch.p = p;
+  batch.subtree_name = subtreeName;
+  batch.dump_msas_root = dump_msas_root;
+  batch.subtree_switch_prob = subtreeSwitchProb;
+  batch.subtree_scale = subtreeScale;
+  batch.nsites_lst = nsitesLst;
+  batch.scale_lst = scaleLst;
+  batch.subtree_scale_lst = subtreeScaleLst;
+
+  /* simulation changes the state of the models (e.g., substitution
+     matrices are computed lazily), so each thread uses its own copy;
+     the copies are made here, serially, because tree traversals are
+     cached lazily */
+  batch.models = smalloc(thr_pool_size(pool) * sizeof(TreeModel*));
+  batch.subtree_models = smalloc(thr_pool_size(pool) * sizeof(TreeModel*));
+  batch.models[0] = model;
+  batch.subtree_models[0] = subtreeModel;
+  for (k = 1; k < thr_pool_size(pool); k++) {
+    batch.models[k] = batch.subtree_models[k] = NULL;
+    if (model != NULL) {
+      batch.models[k] = tm_create_copy(model);
+      tr_postorder(batch.models[k]->tree);
+      tr_preorder(batch.models[k]->tree);
+    }
+    if (subtreeModel != NULL) {
+      batch.subtree_models[k] = tm_create_copy(subtreeModel);
+      tr_postorder(batch.subtree_models[k]->tree);
+      tr_preorder(batch.subtree_models[k]->tree);
+    }
+  }
 
-        if (dump_format == SS) { /* output ss */
-          if (msa->ss == NULL)   /* (only happens in parametric case) */
-            ss_from_msas(msa, tm_order(subst_mod) + 1, FALSE, NULL, NULL, NULL, -1, subst_mod_is_codon_model(subst_mod));
-          ss_write(msa, F, FALSE);
+  for (start = 0; start < nreps; start += batch_size) {
+    int nbatch = min(batch_size, nreps - start);
+
+    /* set up models serially (they are copied from shared objects) */
+    for (k = 0; k < nbatch; k++) {
+      BootRep *rep = &reps[k];
+      rep->msa = NULL;
+      rep->mod = NULL;
+      rep->params = NULL;
+
+      if (input_mods == NULL && do_estimates) {
+        char *alphabet = parametric ? model->rate_matrix->states :
+          msa->alphabet;
+        if (init_mod == NULL) 
+          rep->mod = tm_new(tr_create_copy(tree), NULL, NULL, subst_mod, 
+                            alphabet, nrates, 1, NULL, -1);
+        else {
+          rep->mod = tm_create_copy(init_mod);  
+          tm_reinit(rep->mod, subst_mod, nrates, rep->mod->alpha, NULL, NULL);
         }
-        else {                  /* output actual seqs */
-          if (!parametric) {   /* only have SS; need to create seqs */
-            ss_to_msa(msa);            
-            msa_permute(msa);
-          }
-          msa_print(F, msa, dump_format, FALSE);
-          if (!parametric) {   /* need to get rid of seqs because msa
-                                   object reused */
-            for (j = 0; j < msa->nseqs; j++) sfree(msa->seqs[j]);
-            sfree(msa->seqs);
-            msa->seqs = NULL;
-          }
+        tr_postorder(rep->mod->tree);
+        tr_preorder(rep->mod->tree);
+
+        if (random_init) 
+          rep->params = NULL;   /* drawn by run_rep, from the
+                                   replicate's stream */
+        else if (init_mod != NULL)
+          rep->params = tm_params_new_init_from_model(init_mod);
+        else
+          rep->params = tm_params_init(rep->mod, .1, 5, 1);    
+
+        if (init_mod != NULL && rep->mod->backgd_freqs != NULL) {
+          vec_free(rep->mod->backgd_freqs);
+          rep->mod->backgd_freqs = NULL; /* force re-estimation */
         }
-        phast_fclose(F);
       }
     }
 
-    /* now estimate model parameters */
-    if (input_mods == NULL && do_estimates) {
-      if (init_mod == NULL) 
-        thismod = tm_new(tr_create_copy(tree), NULL, NULL, subst_mod, 
-                         msa->alphabet, nrates, 1, NULL, -1);
-      else {
-        thismod = tm_create_copy(init_mod);  
-        tm_reinit(thismod, subst_mod, nrates, thismod->alpha, NULL, NULL);
+    /* generate alignments and estimate model parameters, concurrently */
+    batch.start = start;
+    if (input_mods == NULL)
+      thr_foreach(pool, nbatch, run_rep, &batch);
+
+    /* write out and collect estimates in order */
+    for (k = 0; k < nbatch; k++) {
+      BootRep *rep = &reps[k];
+      TreeModel *thismod = rep->mod;
+      Vector *params = rep->params;
+      i = start + k;
+
+      if (input_mods == NULL && do_estimates) {
+        if (dump_mods_root != NULL) {
+          sprintf(fname, "%s.%d.mod", dump_mods_root, i+1);
+          if (!quiet) fprintf(stderr, "Dumping model to %s...\n", fname);
+          F = phast_fopen(fname, "w+");
+          tm_print(F, thismod);
+          phast_fclose(F);
+        }
+      } 
+
+      else if (input_mods != NULL) { 
+        /* in this case, we need to set up a parameter vector from
+           the input model */
+        thismod = input_mods[i];
+        params = tm_params_new_init_from_model(thismod);
+        if (nparams > 0 && params->size != nparams)
+          die("ERROR: input models have different numbers of parameters.\n");
+        if (repmod == NULL) repmod = thismod; /* keep around one representative model */
       }
 
-      if (random_init) 
-        params = tm_params_init_random(thismod);
-      else if (init_mod != NULL)
-        params = tm_params_new_init_from_model(init_mod);
-      else
-        params = tm_params_init(thismod, .1, 5, 1);    
+      /* collect parameter estimates */
+      if (do_estimates) {
+        /* set up record of estimates; easiest to init here because number
+           of parameters not always known above */
+        if (nparams <= 0) {
+          nparams = params->size;
+          estimates = smalloc(nparams * sizeof(void*));
+          descriptions = smalloc(nparams * sizeof(char*));
+          for (j = 0; j < nparams; j++) {
+            estimates[j] = lst_new_dbl(nreps);
+            descriptions[j] = smalloc(STR_MED_LEN * sizeof(char));
+            descriptions[j][0] = '\0';
+          }
+          set_param_descriptions(descriptions, thismod);
+        }
 
-      if (init_mod != NULL && thismod->backgd_freqs != NULL) {
-        vec_free(thismod->backgd_freqs);
-        thismod->backgd_freqs = NULL; /* force re-estimation */
+        /* record estimates for this replicate */
+        for (j = 0; j < nparams; j++)
+          lst_push_dbl(estimates[j], vec_get(params, j));
       }
 
-      if (!quiet) 
-        fprintf(stderr, "Estimating model for replicate %d of %d...\n", i+1, nreps);
-
-      if (use_em)
-        tm_fit_em(thismod, msa, params, -1, precision, -1, NULL, NULL);
-      else
-        tm_fit(thismod, msa, params, -1, precision, NULL, quiet, NULL);
-
-      if (dump_mods_root != NULL) {
-        sprintf(fname, "%s.%d.mod", dump_mods_root, i+1);
-        if (!quiet) fprintf(stderr, "Dumping model to %s...\n", fname);
-        F = phast_fopen(fname, "w+");
-        tm_print(F, thismod);
-        phast_fclose(F);
+      if (input_mods == NULL && do_estimates) {
+        if (repmod == NULL) repmod = thismod; /* keep around one representative model */
+        else tm_free(thismod);
       }
-    } 
-
-    else if (input_mods != NULL) { 
-      /* in this case, we need to set up a parameter vector from
-         the input model */
-      thismod = input_mods[i];
-      params = tm_params_new_init_from_model(thismod);
-      if (nparams > 0 && params->size != nparams)
-        die("ERROR: input models have different numbers of parameters.\n");
-      if (repmod == NULL) repmod = thismod; /* keep around one representative model */
-    }
-
-    /* collect parameter estimates */
-    if (do_estimates) {
-      /* set up record of estimates; easiest to init here because number
-         of parameters not always known above */
-      if (nparams <= 0) {
-        nparams = params->size;
-        estimates = smalloc(nparams * sizeof(void*));
-        descriptions = smalloc(nparams * sizeof(char*));
-        for (j = 0; j < nparams; j++) {
-          estimates[j] = lst_new_dbl(nreps);
-          descriptions[j] = smalloc(STR_MED_LEN * sizeof(char));
-	  descriptions[j][0] = '\0';
-        }
-        set_param_descriptions(descriptions, thismod);
+      if (do_estimates) vec_free(params);
+      if (rep->msa != NULL) {
+        if (parametric) msa_free(rep->msa);
+        else boot_msa_free(rep->msa);
       }
-
-      /* record estimates for this replicate */
-      for (j = 0; j < nparams; j++)
-        lst_push_dbl(estimates[j], vec_get(params, j));
     }
-
-    if (input_mods == NULL && do_estimates) {
-      if (repmod == NULL) repmod = thismod; /* keep around one representative model */
-      else tm_free(thismod);
-    }
-    if (do_estimates) vec_free(params);
-    if (parametric) msa_free(msa);
   }
+  for (k = 1; k < thr_pool_size(pool); k++) {
+    if (batch.models[k] != NULL) tm_free(batch.models[k]);
+    if (batch.subtree_models[k] != NULL) tm_free(batch.subtree_models[k]);
+  }
+  sfree(batch.models);
+  sfree(batch.subtree_models);
+  sfree(reps);
+  thr_pool_free(pool);
 
   /* finally, compute and print stats */
   if (do_estimates) {
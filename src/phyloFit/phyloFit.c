@@ -90,16 +90,22 @@ int main(int argc, char *argv[]) {
     {"label-branches", 1, 0, 0},
     {"label-subtree", 1, 0, 0},
     {"selection", 1, 0, 0},
+    {"optimizer", 1, 0, 0},
+    {"checkpoint", 1, 0, 0},
+    {"checkpoint-interval", 1, 0, 0},
+    {"resume", 0, 0, 0},
     {"bound", 1, 0, 'u'},
     {"seed", 1, 0, 'D'},
+    {"threads", 1, 0, 'j'},
+    {"nrestarts", 1, 0, 'x'},
     {0, 0, 0, 0}
   };
 
-  // NOTE: remaining shortcuts left: HjQx
+  // NOTE: remaining shortcuts left: HQ
 
   pf = phyloFit_struct_new(0);
 
-  while ((c = getopt_long(argc, argv, "m:t:s:g:c:C:i:o:k:a:l:w:v:M:p:A:I:K:S:b:d:O:u:Y:e:D:GVENRqLPXZUBFfnrzhWyJ", long_opts, &opt_idx)) != -1) {
+  while ((c = getopt_long(argc, argv, "m:t:s:g:c:C:i:o:k:a:l:w:v:M:p:A:I:K:S:b:d:O:u:Y:e:D:j:x:GVENRqLPXZUBFfnrzhWyJ", long_opts, &opt_idx)) != -1) {
     switch(c) {
     case 'm':
       msa_fname = optarg;
@@ -190,6 +196,9 @@ int main(int argc, char *argv[]) {
     case 'r':
       pf->random_init = TRUE;
       break;
+    case 'x':
+      pf->nrestarts = get_arg_int_bounds(optarg, 1, INFTY);
+      break;
     case 'y':
       pf->init_parsimony = TRUE;
       break;
@@ -294,6 +303,17 @@ int main(int argc, char *argv[]) {
 	pf->selection = get_arg_dbl(optarg);
 	pf->use_selection = TRUE;
       }
+      else if (strcmp(long_opts[opt_idx].name, "optimizer") == 0) {
+	pf->opt_method = get_opt_method(optarg);
+	if (pf->opt_method == OPT_UNKNOWN_METHOD)
+	  die("ERROR: --optimizer must be BFGS or LBFGS.\n");
+      }
+      else if (strcmp(long_opts[opt_idx].name, "checkpoint") == 0) 
+	pf->checkpoint_fname = optarg;
+      else if (strcmp(long_opts[opt_idx].name, "checkpoint-interval") == 0) 
+	pf->checkpoint_interval = get_arg_int_bounds(optarg, 0, INFTY);
+      else if (strcmp(long_opts[opt_idx].name, "resume") == 0) 
+	pf->resume = TRUE;
       else {
 	die("ERROR: unknown option.  Type 'phyloFit -h' for usage.\n");
       }
@@ -307,6 +327,9 @@ int main(int argc, char *argv[]) {
     case 'D':
       seed = get_arg_int_bounds(optarg, 1, INFTY);
       break;
+    case 'j':
+      pf->nthreads = get_arg_int_bounds(optarg, 0, INFTY);
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -315,6 +338,9 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (pf->resume && pf->checkpoint_fname == NULL)
+    die("ERROR: --resume requires --checkpoint.\n");
+
   set_seed(seed);
 
   if (msa_fname == NULL) {
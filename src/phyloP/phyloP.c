@@ -37,6 +37,7 @@ int main(int argc, char *argv[]) {
     {"epsilon", 1, 0, 'e'},
     {"quantiles", 0, 0, 'q'},
     {"wig-scores", 0, 0, 'w'},
+    {"binary-track", 1, 0, 0},
     {"base-by-base", 0, 0, 'b'},
     {"refidx", 1, 0, 'r'},
     {"chrom", 1, 0, 'N'},
@@ -46,6 +47,9 @@ int main(int argc, char *argv[]) {
     {"catmap", 1, 0, 'M'},
     {"no-prune", 0, 0, 'P'},
     {"seed", 1, 0, 'd'},
+    {"fim-grid", 1, 0, 'G'},
+    {"threads", 1, 0, 'j'},
+    {"chunk-size", 1, 0, 'K'},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
   };
@@ -56,7 +60,7 @@ int main(int argc, char *argv[]) {
   srandom((unsigned int)now.tv_usec);
 #endif
 
-  while ((c = getopt_long(argc, argv, "m:o:i:n:pc:s:f:Fe:l:r:B:d:qwgbPN:h", 
+  while ((c = getopt_long(argc, argv, "m:o:i:n:pc:s:f:Fe:l:r:B:d:G:j:K:qwgbPN:h", 
                           long_opts, &opt_idx)) != -1) {
     switch (c) {
     case 'm':
@@ -121,6 +125,13 @@ int main(int argc, char *argv[]) {
       p->base_by_base = TRUE;
       p->output_wig = TRUE;
       break;
+    case 0:
+      if (strcmp(long_opts[opt_idx].name, "binary-track") == 0) {
+        p->base_by_base = TRUE;
+        p->output_wig = TRUE;
+        p->binary_track = optarg;
+      }
+      break;
     case 'b':
       p->base_by_base = TRUE;
       break;
@@ -148,6 +159,15 @@ int main(int argc, char *argv[]) {
     case 'P':
       p->no_prune = TRUE;
       break;
+    case 'G':
+      p->fim_grid_fname = optarg;
+      break;
+    case 'j':
+      p->nthreads = get_arg_int_bounds(optarg, 0, INFTY);
+      break;
+    case 'K':
+      p->chunk_size = get_arg_int_bounds(optarg, 1, INFTY);
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
@@ -175,14 +195,19 @@ int main(int argc, char *argv[]) {
     msa_f = phast_fopen(p->msa_fname, "r");
     if (msa_format == UNKNOWN_FORMAT)
       msa_format = msa_format_for_content(msa_f, 1);
-    if (msa_format == MAF) 
+    if (p->chunk_size > 0) {
+      if (msa_format != MAF)
+        die("ERROR: --chunk-size requires an alignment in MAF format.\n");
+      p->msa_stream = msa_f;   /* read incrementally by phyloP_stream */
+    }
+    else if (msa_format == MAF) 
       p->msa = maf_read_cats(msa_f, NULL, 1, NULL, 
 			     p->cats_to_do==NULL ? NULL : p->feats, p->cm, -1, 
 			     (p->feats == NULL && p->base_by_base==0) ? FALSE : TRUE, /* --features requires order */
 			     NULL, NO_STRIP, FALSE, p->cats_to_do); 
     else 
       p->msa = msa_new_from_file_define_format(msa_f, msa_format, NULL);
-    phast_fclose(msa_f);
+    if (p->msa_stream == NULL) phast_fclose(msa_f);
 
     /* if base_by_base and undefined chrom, use filename root as chrom */
     if (p->base_by_base && p->chrom == NULL) {
@@ -196,7 +221,11 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  phyloP(p);    
+  if (p->msa_stream != NULL) {
+    phyloP_stream(p);
+    phast_fclose(p->msa_stream);
+  }
+  else phyloP(p);
   return 0;
 }
 
@@ -0,0 +1,63 @@
+/***************************************************************************
+ * PHAST: PHylogenetic Analysis with Space/Time models
+ * Copyright (c) 2002-2005 University of California, 2006-2010 Cornell 
+ * University.  All rights reserved.
+ *
+ * This source code is distributed under a BSD-style license.  See the
+ * file LICENSE.txt for details.
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <phast/misc.h>
+#include <phast/bin_track.h>
+#include "btrack2wig.help"
+
+int main(int argc, char *argv[]) {
+  signed char c;
+  int opt_idx, precision = 3, index_only = FALSE, i;
+  FILE *F;
+  BinTrack *t;
+
+  struct option long_opts[] = {
+    {"precision", 1, 0, 'p'},
+    {"index", 0, 0, 'i'},
+    {"help", 0, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((c = getopt_long(argc, argv, "p:ih", long_opts, &opt_idx)) != -1) {
+    switch (c) {
+    case 'p':
+      precision = get_arg_int_bounds(optarg, 0, 20);
+      break;
+    case 'i':
+      index_only = TRUE;
+      break;
+    case 'h':
+      printf("%s", HELP);
+      exit(0);
+    case '?':
+      die("Bad argument.  Try 'btrack2wig -h'.\n");
+    }
+  }
+
+  if (optind != argc - 1) 
+    die("ERROR: Wrong number of arguments.  Try 'btrack2wig -h'.\n");
+
+  F = phast_fopen(argv[optind], "rb");
+  t = btk_open(F);
+
+  if (index_only) {
+    for (i = 0; i < lst_size(t->blocks); i++) {
+      BinTrackBlock *b = lst_get_ptr(t->blocks, i);
+      printf("%s\t%lld\t%lld\n", b->chrom, b->start, b->nvalues);
+    }
+  }
+  else btk_print_wig(t, stdout, precision);
+
+  btk_free(t);
+  phast_fclose(F);
+  return 0;
+}
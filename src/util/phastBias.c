@@ -67,10 +67,11 @@ int main(int argc, char *argv[]) {
     {"output-mods", 1, 0, 'm'},
     {"informative-fn", 1, 0, 'i'},
     {"informative-only", 0, 0, 'o'},
+    {"threads", 1, 0, 'j'},
     {"help", 0, 0, 'h'},
     {0,0,0,0}};
 
-  while ((c = getopt_long(argc, argv, "B:b:L:l:C:c:R:E:T:S:s:f:g:p:m:i:oWh", long_opts, &opt_idx))
+  while ((c = getopt_long(argc, argv, "B:b:L:l:C:c:R:E:T:S:s:f:g:p:m:i:oj:Wh", long_opts, &opt_idx))
 	 != -1) {
     switch (c) {
     case 'B':
@@ -134,6 +135,9 @@ int main(int argc, char *argv[]) {
     case 'o':
       b->informative_only=TRUE;
       break;
+    case 'j':
+      b->nthreads = get_arg_int_bounds(optarg, 0, INFTY);
+      break;
     case 'h':
       printf("%s", HELP);
       exit(0);
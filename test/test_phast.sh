@@ -212,6 +212,12 @@ seed=124
 !phyloFit.mod @phyloFit -D 12345 hpmrc.fa --EM --tree "(((hg16,panTro2),(rn3,mm3)),galGal2)"
 !phyloFit.mod @phyloFit -D 12345 hpmrc.fa --EM --nrates 3 --tree "(((hg16,panTro2),(rn3,mm3)),galGal2)"
 
+# and with the limited-memory optimizer
+!phyloFit.mod @phyloFit -D 12345 hmrc.ss --optimizer LBFGS --subst-mod REV --tree "(human, (mouse,rat), cow)"
+!phyloFit.mod @phyloFit -D 12345 hmrc.ss --optimizer LBFGS --subst-mod UNREST --tree "(human, (mouse,rat), cow)"
+!phyloFit.mod @phyloFit -D 12345 hmrc.ss --optimizer LBFGS --subst-mod REV --tree "(human, (mouse,rat), cow)" -k 4
+!phyloFit.mod @phyloFit hmrc.ss --optimizer LBFGS --EM --subst-mod HKY85 --tree "(human, (mouse,rat), cow)"
+
 # test some of the higher order models (they are slow so use small simulated data set)
 base_evolve --nsites 100 rev.mod > simulated.fa
 # move all these commands to another section so they aren't run automatically with phastCons check